@@ -23,7 +23,9 @@ bool verbose = false;
 
 database read_db_labelsv1(istream &, std::uint32_t);
 database read_db_oldstyle(istream &, std::uint32_t);
+database read_db_binary(istream &);
 void write_db_labelsv1(std::ostream &, const database &);
+void write_db_binary(std::ostream &, const database &);
 
 std::string
 istream_line(const istream &in)
@@ -271,6 +273,10 @@ operator>>(istream &in, database &db)
 
   in.get(c1);
   in.get(c2);
+  if (c1 == '+' && c2 == 'B') {
+    db = read_db_binary(in);
+    return in;
+  }
   if (!(c1 == '+' && c2 == 'V')) {
     throw db_format_exception{"Invalid database format"};
   }
@@ -354,7 +360,8 @@ read_database(const std::string &name, COMP compress_type, bool vrbse)
 }
 
 void
-write_database(const database &db, const std::string &name, COMP compress_type)
+write_database(const database &db, const std::string &name, COMP compress_type,
+               bool binary)
 {
   namespace io = boost::iostreams;
   io::filtering_ostream dbout;
@@ -387,7 +394,11 @@ write_database(const database &db, const std::string &name, COMP compress_type)
     throw std::runtime_error{"Unable to write database!"};
   }
 
-  dbout << db;
+  if (binary) {
+    write_db_binary(dbout, db);
+  } else {
+    dbout << db;
+  }
 }
 
 std::ostream &
@@ -147,7 +147,8 @@ extern bool verbose;
 constexpr int CURRENT_DB_VERSION = 6;
 
 database read_database(const std::string &, COMP = COMP::NONE, bool = false);
-void write_database(const database &, const std::string &, COMP = COMP::NONE);
+void write_database(const database &, const std::string &, COMP = COMP::NONE,
+                    bool binary = false);
 
 istream &operator>>(istream &, database &);
 std::ostream &operator<<(std::ostream &, const database &);
@@ -0,0 +1,576 @@
+// db_binary.cpp
+//
+// Read and write binary Penn databases. See the comments before
+// db_write_binary_header() in src/db.c for the format.
+
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include "database.h"
+#include "io_primitives.h"
+#include "utils.h"
+#include "db_common.h"
+
+using namespace std::literals::string_literals;
+
+namespace {
+
+constexpr long binary_version = 1;
+
+// The huffman tree of src/comp_h.c, which binary databases with
+// huffman compressed attributes are saved with the character counts
+// of. It has to be built exactly the same way to decode them.
+class huffman_tree {
+public:
+  explicit huffman_tree(const std::array<long, 256> &);
+  std::string decode(const std::string &) const;
+
+private:
+  struct cnode {
+    cnode *left = nullptr;
+    cnode *right = nullptr;
+    char c = '\0';
+  };
+  std::deque<cnode> nodes;
+  cnode *top = nullptr;
+
+  static constexpr int code_bits = 25;
+
+  cnode *
+  new_node()
+  {
+    nodes.emplace_back();
+    return &nodes.back();
+  }
+  int fix_tree_depth(cnode *, int, int);
+  void add_ones(cnode *);
+};
+
+huffman_tree::huffman_tree(const std::array<long, 256> &freq)
+{
+  struct entry {
+    long freq;
+    cnode *node;
+  };
+  std::array<entry, 256> table;
+
+  for (int n = 0; n < 256; n += 1) {
+    table[n].freq = freq[n];
+    table[n].node = new_node();
+    table[n].node->c = static_cast<char>(n);
+  }
+
+  table[']'].freq = table['['].freq;
+  if (table[255].freq) {
+    table[255].freq -= 1;
+  }
+  table['\n'].freq /= 16;
+
+  for (int indx = 2; indx < 256; indx += 1) {
+    for (int count = indx;
+         count > 1 && table[count - 1].freq < table[count].freq; count -= 1) {
+      std::swap(table[count], table[count - 1]);
+    }
+  }
+
+  for (int indx = 255; indx > 0; indx -= 1) {
+    cnode *node = new_node();
+    node->left = table[indx].node;
+    node->right = table[indx - 1].node;
+    table[indx - 1].freq += table[indx].freq;
+    table[indx - 1].node = node;
+    for (int count = indx - 1;
+         count > 1 && table[count - 1].freq <= table[count].freq; count -= 1) {
+      std::swap(table[count], table[count - 1]);
+    }
+  }
+
+  fix_tree_depth(table[1].node, 0, 2);
+
+  cnode *node = table[1].node;
+  for (int count = 0; node->left && count < 4; count += 1) {
+    node = node->left;
+  }
+  cnode *one = new_node();
+  *one = *node;
+  node->left = nullptr;
+  node->right = one;
+
+  add_ones(table[1].node);
+
+  node = table[1].node;
+  for (int count = 0; count < 8; count += 1) {
+    if (!node->left) {
+      node->left = new_node();
+    }
+    node = node->left;
+  }
+
+  top = table[1].node;
+}
+
+int
+huffman_tree::fix_tree_depth(cnode *node, int height, int zeros)
+{
+  if (!node) {
+    return height + (zeros > 2);
+  }
+  int a = fix_tree_depth(node->left, height + 1 + (zeros == 7), (zeros + 1) % 8);
+  int b = fix_tree_depth(node->right, height + 1, 0);
+  if (a > code_bits && b < a - 1) {
+    cnode *temp = node->right;
+    node->right = node->left;
+    node->left = node->right->left;
+    node->right->left = node->right->right;
+    node->right->right = temp;
+    a = fix_tree_depth(node->left, height + 1 + (zeros == 7), (zeros + 1) % 8);
+    b = fix_tree_depth(node->right, height + 1, 0);
+  } else if (b > code_bits && a < b - 1) {
+    cnode *temp = node->left;
+    node->left = node->right;
+    node->right = node->left->right;
+    node->left->right = node->left->left;
+    node->left->left = temp;
+    a = fix_tree_depth(node->left, height + 1 + (zeros == 7), (zeros + 1) % 8);
+    b = fix_tree_depth(node->right, height + 1, 0);
+  }
+  return a > b ? a : b;
+}
+
+void
+huffman_tree::add_ones(cnode *node)
+{
+  int count = 0;
+  do {
+    if (node->right) {
+      add_ones(node->right);
+    }
+    if (count >= 7 || (count >= 3 && !node->left && !node->right)) {
+      cnode *one = new_node();
+      *one = *node;
+      node->left = nullptr;
+      node->right = one;
+      node = one;
+      count = 0;
+    }
+    node = node->left;
+    count += 1;
+  } while (node);
+}
+
+std::string
+huffman_tree::decode(const std::string &data) const
+{
+  std::string out;
+  const cnode *node = top;
+
+  for (unsigned char byte : data) {
+    for (int bit = 0; bit < 8; bit += 1) {
+      node = (byte & (1 << bit)) ? node->right : node->left;
+      if (!node) {
+        throw db_format_exception{"Invalid compressed attribute value."};
+      }
+      if (!node->left && !node->right) {
+        if (node->c == '\0') {
+          return out;
+        }
+        out.push_back(node->c);
+        node = top;
+      }
+    }
+  }
+  return out;
+}
+
+std::uint64_t
+get_uint(istream &in)
+{
+  std::uint64_t n = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    char c;
+    if (!in.get(c)) {
+      throw db_format_exception{"Unexpected end of binary database."};
+    }
+    n |= static_cast<std::uint64_t>(c & 0x7F) << shift;
+    if (!(c & 0x80)) {
+      return n;
+    }
+  }
+  throw db_format_exception{"Invalid number in binary database."};
+}
+
+std::int64_t
+get_int(istream &in)
+{
+  std::uint64_t n = get_uint(in);
+  return static_cast<std::int64_t>(n >> 1) ^ -static_cast<std::int64_t>(n & 1);
+}
+
+std::string
+get_string(istream &in)
+{
+  std::string s(get_uint(in), '\0');
+  if (!in.read(&s[0], s.size())) {
+    throw db_format_exception{"Unexpected end of binary database."};
+  }
+  return s;
+}
+
+const std::string &
+get_sref(istream &in, stringvec &strings)
+{
+  std::uint64_t n = get_uint(in);
+  if (n > strings.size()) {
+    throw db_format_exception{"Invalid string table reference."};
+  }
+  if (n == 0) {
+    strings.push_back(get_string(in));
+    return strings.back();
+  }
+  return strings[n - 1];
+}
+
+dbthing
+read_binary_object(istream &in, dbref num, stringvec &strings,
+                   const huffman_tree *huff)
+{
+  dbthing obj;
+  obj.num = num;
+  obj.name = get_string(in);
+  obj.location = get_int(in);
+  obj.contents = get_int(in);
+  obj.exits = get_int(in);
+  obj.next = get_int(in);
+  obj.parent = get_int(in);
+
+  for (auto count = get_uint(in); count > 0; count -= 1) {
+    lock l{};
+    l.type = get_sref(in, strings);
+    l.creator = get_int(in);
+    l.flags = split_words_vec(get_sref(in, strings));
+    l.derefs = get_uint(in);
+    l.key = get_string(in);
+    obj.locks.emplace(l.type, std::move(l));
+  }
+
+  obj.owner = get_int(in);
+  obj.zone = get_int(in);
+  obj.pennies = get_int(in);
+  obj.type = dbtype_from_num(get_uint(in));
+  obj.flags = split_words(get_sref(in, strings));
+  obj.powers = split_words(get_sref(in, strings));
+  obj.warnings = split_words_vec(get_sref(in, strings));
+  obj.created = get_int(in);
+  obj.modified = get_int(in);
+
+  auto count = get_uint(in);
+#ifdef HAVE_BOOST_CONTAINERS
+  obj.attribs.reserve(count);
+#endif
+  for (; count > 0; count -= 1) {
+    attrib a;
+    a.name = get_sref(in, strings);
+    a.creator = get_int(in);
+    a.flags = split_words_vec(get_sref(in, strings));
+    a.derefs = get_uint(in);
+    a.data = get_string(in);
+    if (huff) {
+      a.data = huff->decode(a.data);
+    }
+    obj.attribs.emplace_hint(obj.attribs.end(), a.name, std::move(a));
+  }
+  return obj;
+}
+
+// Writes the binary parts of a database, keeping track of the string
+// table and where each object starts.
+class binary_writer {
+public:
+  explicit binary_writer(std::ostream &o) : out(o) {}
+
+  void
+  put(const char *data, std::size_t len)
+  {
+    out.write(data, len);
+    offset += len;
+  }
+  void
+  put_uint(std::uint64_t n)
+  {
+    char buff[10];
+    std::size_t len = 0;
+    while (n >= 0x80) {
+      buff[len++] = static_cast<char>((n & 0x7F) | 0x80);
+      n >>= 7;
+    }
+    buff[len++] = static_cast<char>(n);
+    put(buff, len);
+  }
+  void
+  put_int(std::int64_t n)
+  {
+    put_uint((static_cast<std::uint64_t>(n) << 1) ^
+             static_cast<std::uint64_t>(n >> 63));
+  }
+  void
+  put_u64le(std::uint64_t n)
+  {
+    char buff[8];
+    for (int b = 0; b < 8; b += 1) {
+      buff[b] = static_cast<char>((n >> (b * 8)) & 0xFF);
+    }
+    put(buff, sizeof buff);
+  }
+  void
+  put_string(const std::string &s)
+  {
+    put_uint(s.size());
+    put(s.data(), s.size());
+  }
+  void
+  put_sref(const std::string &s)
+  {
+    auto ref = strings.find(s);
+    if (ref != strings.end()) {
+      put_uint(ref->second);
+      return;
+    }
+    strtab.push_back(s);
+    strings.emplace(s, strtab.size());
+    put_uint(0);
+    put_string(s);
+  }
+  void write_object(const dbthing &);
+  void write_footer();
+
+  std::uint64_t offset = 0;
+
+private:
+  std::ostream &out;
+  std::unordered_map<std::string, std::uint64_t> strings;
+  stringvec strtab;
+  std::vector<std::pair<dbref, std::uint64_t>> index;
+};
+
+void
+binary_writer::write_object(const dbthing &obj)
+{
+  index.emplace_back(obj.num, offset);
+  put_uint(static_cast<std::uint64_t>(obj.num) + 1);
+  put_string(obj.name);
+  put_int(obj.location);
+  put_int(obj.contents);
+  put_int(obj.exits);
+  put_int(obj.next);
+  put_int(obj.parent);
+  put_uint(obj.locks.size());
+  for (const auto &l : obj.locks) {
+    const auto &lk = l.second;
+    put_sref(lk.type);
+    put_int(lk.creator);
+    put_sref(join_words(lk.flags));
+    put_uint(lk.derefs);
+    put_string(lk.key);
+  }
+  put_int(obj.owner);
+  put_int(obj.zone);
+  put_int(obj.pennies);
+  put_uint(dbtype_to_num(obj.type));
+  put_sref(join_words(obj.flags));
+  put_sref(join_words(obj.powers));
+  put_sref(join_words(obj.warnings));
+  put_int(obj.created);
+  put_int(obj.modified);
+  put_uint(obj.attribs.size());
+  for (const auto &a : obj.attribs) {
+    const auto &attr = a.second;
+    put_sref(attr.name);
+    put_int(attr.creator);
+    put_sref(join_words(attr.flags));
+    put_uint(attr.derefs);
+    put_string(attr.data);
+  }
+}
+
+void
+binary_writer::write_footer()
+{
+  put_uint(0);
+
+  std::uint64_t strtab_start = offset;
+  put_uint(strtab.size());
+  for (const auto &s : strtab) {
+    put_string(s);
+  }
+
+  std::uint64_t index_start = offset;
+  dbref last_ref = 0;
+  std::uint64_t last_offset = 0;
+  put_uint(index.size());
+  for (const auto &i : index) {
+    put_int(i.first - last_ref);
+    put_uint(i.second - last_offset);
+    last_ref = i.first;
+    last_offset = i.second;
+  }
+
+  put_u64le(strtab_start);
+  put_u64le(index_start);
+}
+
+} // namespace
+
+// Read a binary database, after its +B.
+database
+read_db_binary(istream &in)
+{
+  database db;
+
+  long version = db_getref(in);
+  if (version != binary_version) {
+    throw db_format_exception{"Unknown binary database version "s +
+                              std::to_string(version)};
+  }
+  db.dbflags = get_uint(in);
+  db.version = get_uint(in);
+  db.saved_time = get_string(in);
+
+  std::unique_ptr<huffman_tree> huff;
+  auto method = get_string(in);
+  if (method == "huffman") {
+    std::array<long, 256> freq;
+    for (auto &f : freq) {
+      f = get_uint(in);
+    }
+    huff = std::make_unique<huffman_tree>(freq);
+  } else if (method != "none") {
+    throw db_format_exception{"Unknown attribute compression: "s + method};
+  }
+
+  if (verbose) {
+    std::cerr << "Binary database, version " << db.version
+              << ", attribute compression " << method << '\n';
+  }
+
+  char c;
+  std::string line;
+  stringvec strings;
+  while (in.get(c)) {
+    switch (c) {
+    case '+':
+      std::getline(in, line);
+      if (line == "FLAGS LIST") {
+        db.flags = read_flags(in);
+      } else if (line == "POWER LIST") {
+        db.powers = read_flags(in);
+      } else if (line == "ATTRIBUTES LIST") {
+        db.attribs = read_db_attribs(in);
+      } else {
+        throw db_format_exception{"unknown +LIST: "s + line};
+      }
+      break;
+    case '~': {
+      long len = db_getref(in);
+      db.objects.reserve(len);
+    } break;
+    case '!': {
+      std::getline(in, line);
+      std::uint64_t n;
+      std::size_t count = 0;
+      while ((n = get_uint(in))) {
+        dbref d = static_cast<dbref>(n - 1);
+        // Objects destroyed during an incremental dump are saved out
+        // of order.
+        while (static_cast<std::size_t>(d) >= db.objects.size()) {
+          dbthing garbage;
+          garbage.num = static_cast<dbref>(db.objects.size());
+          db.objects.emplace_back(std::move(garbage));
+        }
+        db.objects[d] = read_binary_object(in, d, strings, huff.get());
+        count += 1;
+      }
+      if (get_uint(in) != strings.size()) {
+        throw db_format_exception{"Wrong size of string table."};
+      }
+      for (std::size_t s = 0; s < strings.size(); s += 1) {
+        get_string(in);
+      }
+      if (get_uint(in) != count) {
+        throw db_format_exception{"Wrong size of object index."};
+      }
+      for (std::size_t i = 0; i < count; i += 1) {
+        get_int(in);
+        get_uint(in);
+      }
+      char trailer[16];
+      if (!in.read(trailer, sizeof trailer)) {
+        throw db_format_exception{"Unexpected end of binary database."};
+      }
+    } break;
+    case '*': {
+      std::string eod;
+      std::getline(in, eod);
+      if (eod != "**END OF DUMP***") {
+        throw db_format_exception{"Invalid end string: *"s + eod};
+      }
+    } break;
+    default:
+      throw db_format_exception{"Unexpected character: "s + c};
+    }
+  }
+  if (db.dbflags & DBF_SPIFFY_AF_ANSI) {
+    db.spiffy_af_ansi = true;
+  }
+
+  return db;
+}
+
+void
+write_db_binary(std::ostream &out, const database &db)
+{
+  std::uint32_t dbflag = DBF_NO_CHAT_SYSTEM | DBF_WARNINGS |
+                         DBF_CREATION_TIMES | DBF_SPIFFY_LOCKS |
+                         DBF_NEW_STRINGS | DBF_TYPE_GARBAGE |
+                         DBF_SPLIT_IMMORTAL | DBF_NO_TEMPLE |
+                         DBF_LESS_GARBAGE | DBF_AF_VISUAL |
+                         DBF_VALUE_IS_COST | DBF_LINK_ANYWHERE |
+                         DBF_NO_STARTUP_FLAG | DBF_AF_NODUMP |
+                         DBF_NEW_FLAGS | DBF_NEW_POWERS | DBF_POWERS_LOGGED |
+                         DBF_LABELS | DBF_HEAR_CONNECT | DBF_NEW_VERSIONS;
+  if (db.spiffy_af_ansi) {
+    dbflag |= DBF_SPIFFY_AF_ANSI;
+  }
+
+  binary_writer bin{out};
+
+  out << "+B" << binary_version << '\n';
+  bin.put_uint(dbflag);
+  bin.put_uint(CURRENT_DB_VERSION);
+  bin.put_string(get_time());
+  bin.put_string("none");
+
+  out << "+FLAGS LIST\n";
+  write_flags(out, db.flags);
+  out << "+POWER LIST\n";
+  write_flags(out, db.powers);
+  out << "+ATTRIBUTES LIST\n";
+  write_db_attribs(out, db.attribs);
+  out << '~' << db.objects.size() << '\n';
+  out << "!\n";
+  bin.offset = 0;
+
+  for (const auto &obj : db.objects) {
+    if (obj.type == dbtype::GARBAGE) {
+      continue;
+    }
+    bin.write_object(obj);
+  }
+  bin.write_footer();
+  out << "***END OF DUMP***\n";
+}
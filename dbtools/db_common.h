@@ -1,7 +1,11 @@
 #pragma once
 
 flagmap read_flags(istream &);
+attrmap read_db_attribs(istream &);
 lockmap read_locks(istream &, std::uint32_t);
 
 std::string read_boolexp(istream &);
 std::string read_old_str(istream &);
+
+void write_flags(std::ostream &, const flagmap &);
+void write_db_attribs(std::ostream &, const attrmap &);
@@ -220,6 +220,12 @@ read_db_labelsv1(istream &in, std::uint32_t flags)
     } break;
     case '!': {
       dbref d = db_getref(in);
+      // Objects destroyed during an incremental dump are saved out of
+      // order.
+      if (static_cast<std::size_t>(d) < db.objects.size()) {
+        db.objects[d] = read_object(in, d, db.version, flags);
+        break;
+      }
       while (static_cast<std::size_t>(d) != db.objects.size()) {
         if (!(flags & DBF_LESS_GARBAGE)) {
           std::cerr << "Missing object #" << db.objects.size()
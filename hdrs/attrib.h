@@ -70,6 +70,9 @@ ATTR *atr_sub_branch(ATTR *branch);
 ATTR *atr_sub_branch_prev(ATTR *branch);
 void atr_new_add(dbref thing, char const *RESTRICT atr, char const *RESTRICT s,
                  dbref player, uint32_t flags, uint8_t derefs, bool makeroots);
+void atr_new_add_compressed(dbref thing, char const *RESTRICT atr,
+                            char const *RESTRICT s, char *t, dbref player,
+                            uint32_t flags, uint8_t derefs, bool makeroots);
 atr_err atr_add(dbref thing, char const *RESTRICT atr, char const *RESTRICT s,
                 dbref player, uint32_t flags);
 atr_err atr_clr(dbref thing, char const *atr, dbref player);
@@ -103,6 +106,8 @@ int atr_comm_match(dbref thing, dbref player, int type, int end,
                    MQUE *from_queue, int queue_type, PE_REGS *pe_regs_parent);
 int one_comm_match(dbref thing, dbref player, const char *atr, const char *str,
                    MQUE *from_queue, int queue_type, PE_REGS *pe_regs_parent);
+void cmd_index_invalidate(dbref thing);
+void cmd_index_stats(dbref player);
 int do_set_atr(dbref thing, char const *RESTRICT atr, char const *RESTRICT s,
                dbref player, uint32_t flags);
 void do_atrlock(dbref player, char const *src, char const *action);
@@ -121,7 +126,11 @@ int can_write_attr_internal(dbref player, dbref obj, ATTR *attr, int safe);
 bool can_edit_attr(dbref player, dbref thing, const char *attrname);
 const char *atr_get_compressed_data(ATTR *atr);
 char *atr_value(ATTR *atr);
+char const *atr_value_const(ATTR *atr);
 char *safe_atr_value(ATTR *atr, char *check) __attribute_malloc__;
+void atr_value_forget(chunk_reference_t ref);
+void atr_value_moved(chunk_reference_t from, chunk_reference_t to);
+void atr_value_cache_stats(dbref player);
 
 void unanchored_regexp_attr_check(dbref thing, ATTR *atr, dbref player);
 
@@ -29,6 +29,8 @@ enum chunk_stats_type {
   CSTATS_PAGING
 };
 void chunk_stats(dbref player, enum chunk_stats_type which);
+void WIN32_CDECL STAT_OUT(dbref player, const char *fmt, ...)
+  __attribute__((__format__(__printf__, 2, 3)));
 void chunk_new_period(void);
 
 #ifndef WIN32
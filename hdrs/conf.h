@@ -163,6 +163,8 @@ struct options_table {
   int use_ws;                   /**< True to enable websockets */
   char ws_url[FILE_PATH_LEN];   /**< path to recognize as websocket one in HTTP
                                    requests. */
+  int ws_deflate;          /**< True to offer permessage-deflate */
+  int ws_context_takeover; /**< Keep compression state between messages */
   char input_db[FILE_PATH_LEN]; /**< Name of the input database file */
   char output_db[FILE_PATH_LEN]; /**< Name of the output database file */
   char crash_db[FILE_PATH_LEN];  /**< Name of the panic database file */
@@ -198,6 +200,7 @@ struct options_table {
   int player_queue_limit; /**< Maximum commands a player can queue at once */
   int queue_chunk;   /**< Number of commands run from queue when no input from
                         sockets is waiting */
+  int fair_queue;    /**< Do owners take turns running queued commands? */
   int func_nest_lim; /**< Maximum function recursion depth */
   int func_invk_lim; /**< Maximum number of function invocations */
   int call_lim;      /**< Maximum parser calls allowed in a queue cycle */
@@ -295,6 +298,9 @@ struct options_table {
   int player_name_spaces; /**< Can players have multiword names? */
   int max_aliases;        /**< Maximum allowed aliases per player */
   int forking_dump;       /**< Should we fork to dump? */
+  int incremental_dump;   /**< Save in slices when we can't fork? */
+  int binary_dump;        /**< Save the main database in binary format? */
+  int parallel_db_load;   /**< Use threads to help load the database? */
   int restrict_building;  /**< Is the builder power required to build? */
   int free_objects; /**< If builder power is required, can you create without
                        it? */
@@ -340,6 +346,9 @@ struct options_table {
                                  kibibytes */
   int chunk_cache_memory;     /**< Memory to use for the attribute cache */
   int chunk_migrate_amount;   /**< Number of attrs to migrate each second */
+  int chunk_async_io; /**< Use a thread for attribute swap file I/O? */
+  int attr_value_cache; /**< Memory for decompressed attribute values */
+  int chunk_dedup;      /**< Share chunks with identical contents? */
   char attr_compression[256]; /**< How to compress attribute text in-memory */
   int read_remote_desc; /**< Can players read DESCRIBE attribute remotely? */
   char ssl_private_key_file[FILE_PATH_LEN]; /**< File to load the server's key
@@ -353,12 +362,16 @@ struct options_table {
   int use_quota;                 /**< Are quotas enabled? */
   int empty_attrs;               /**< Are empty attributes preserved? */
   int function_side_effects;     /**< Turn on side effect functions? */
+  int compile_ufuns;       /**< Compile simple attributes for call_ufun()? */
+  int compile_ufuns_check; /**< Check compiled attributes against parser? */
   char error_log[FILE_PATH_LEN]; /**< File to log connections */
   char connect_log[FILE_PATH_LEN]; /**< File to log connections */
   char wizard_log[FILE_PATH_LEN];  /**< File to log wizard commands */
   char command_log[FILE_PATH_LEN]; /**< File to log suspect commands */
   char trace_log[FILE_PATH_LEN];   /**< File to log trace data */
   char checkpt_log[FILE_PATH_LEN]; /**< File to log checkpoint data */
+  int profile_softcode;            /**< Keep softcode profiling data? */
+  char profile_file[FILE_PATH_LEN]; /**< File for @profile/dump */
   char sql_platform[256];          /**< Type of SQL server, or "disabled" */
   char sql_host[256];              /**< Hostname of sql server */
   char sql_username[256];          /**< Username for sql */
@@ -487,6 +500,9 @@ int can_view_config_option(dbref player, PENNCONF *opt);
 #define FREE_OBJECTS (options.free_objects)
 #define RESTRICTED_BUILDING (options.restrict_building)
 #define NO_FORK (!options.forking_dump)
+#define INCREMENTAL_DUMP (options.incremental_dump)
+#define BINARY_DUMP (options.binary_dump)
+#define PARALLEL_DB_LOAD (options.parallel_db_load)
 #define PLAYER_NAME_SPACES (options.player_name_spaces)
 #define MAX_ALIASES (options.max_aliases)
 #define SAFER_UFUN (options.safer_ufun)
@@ -515,6 +531,7 @@ int can_view_config_option(dbref player, PENNCONF *opt);
 #define WALL_PREFIX (options.wall_prefix)
 #define NO_LINK_TO_OBJECT (!options.link_to_object)
 #define QUEUE_PER_OWNER (options.owner_queues)
+#define FAIR_QUEUE (options.fair_queue)
 #define WIZ_NOAENTER (options.wiz_noaenter)
 #define USE_DNS (options.use_dns)
 #define MUSH_IP_ADDR (options.ip_addr)
@@ -530,12 +547,16 @@ int can_view_config_option(dbref player, PENNCONF *opt);
 #define USE_QUOTA (options.use_quota)
 #define EMPTY_ATTRS (options.empty_attrs)
 #define FUNCTION_SIDE_EFFECTS (options.function_side_effects)
+#define COMPILE_UFUNS (options.compile_ufuns)
+#define COMPILE_UFUNS_CHECK (options.compile_ufuns_check)
 #define ERRLOG (options.error_log)
 #define CONNLOG (options.connect_log)
 #define WIZLOG (options.wizard_log)
 #define CMDLOG (options.command_log)
 #define TRACELOG (options.trace_log)
 #define CHECKLOG (options.checkpt_log)
+#define PROFILE_SOFTCODE (options.profile_softcode)
+#define PROFILE_FILE (options.profile_file)
 #define SQL_PLATFORM (options.sql_platform)
 #define SQL_HOST (options.sql_host)
 #define SQL_DB (options.sql_database)
@@ -545,6 +566,8 @@ int can_view_config_option(dbref player, PENNCONF *opt);
 #define CHUNK_SWAP_FILE (options.chunk_swap_file)
 #define CHUNK_CACHE_MEMORY (options.chunk_cache_memory)
 #define CHUNK_MIGRATE_AMOUNT (options.chunk_migrate_amount)
+#define ATTR_VALUE_CACHE (options.attr_value_cache)
+#define CHUNK_DEDUP (options.chunk_dedup)
 
 #define READ_REMOTE_DESC (options.read_remote_desc)
 
@@ -293,6 +293,11 @@ struct db_stat_info {
 
 extern struct object *db;
 extern dbref db_top;
+extern int *db_queue_counts;
+
+/** Number of queued commands charged to an object. With QUEUE_PER_OWNER,
+ * only players' counts are used. */
+#define QueueCount(x) (db_queue_counts[(x)])
 
 void init_sqlite_db();
 
@@ -313,13 +318,15 @@ void clear_objdata(dbref thing);
 typedef uint32_t mail_flag;
 
 /** A mail message.
- * This structure represents a single mail message in the linked list
- * of messages that comprises the mail database. Mail messages are
- * stored in a doubly-linked list sorted by message recipient.
+ * This structure represents a single mail message. Each message is on
+ * two doubly-linked lists: the messages received by its recipient, and
+ * the messages sent by its sender.
  */
 struct mail {
-  struct mail *next;       /**< Pointer to next message */
-  struct mail *prev;       /**< Pointer to previous message */
+  struct mail *next;       /**< Next message to the same recipient */
+  struct mail *prev;       /**< Previous message to the same recipient */
+  struct mail *sent_next;  /**< Next message from the same sender */
+  struct mail *sent_prev;  /**< Previous message from the same sender */
   dbref to;                /**< Recipient dbref */
   dbref from;              /**< Sender's dbref */
   time_t from_ctime;       /**< Sender's creation time */
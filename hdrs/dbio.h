@@ -19,14 +19,27 @@
 
 extern jmp_buf db_err;
 
+struct mapped_file;
+struct bindb;
+
+/** A database file being read or written.
+ * Reads are done a block at a time into buf, or, for uncompressed
+ * files, straight out of a memory mapping of the whole file.
+ */
 typedef struct pennfile {
-  enum { PFT_FILE, PFT_PIPE, PFT_GZFILE } type;
+  enum { PFT_FILE, PFT_PIPE, PFT_GZFILE, PFT_MAPPED } type;
   union {
     FILE *f;
 #ifdef HAVE_LIBZ
     gzFile g;
 #endif
+    struct mapped_file *m;
   } handle;
+  char *buf;  /**< Read buffer, or the contents of a mapped file */
+  size_t pos; /**< Offset of the next character to read in buf */
+  size_t len; /**< Number of characters in buf */
+  bool eof;   /**< Has a read hit the end of the file? */
+  struct bindb *bin; /**< State of a binary database, or NULL for text */
 } PENNFILE;
 
 PENNFILE *penn_fopen(const char *, const char *);
@@ -39,6 +52,8 @@ int penn_fputs(const char *, PENNFILE *);
 int penn_fprintf(PENNFILE *, const char *fmt, ...)
   __attribute__((__format__(__printf__, 2, 3)));
 int penn_ungetc(int, PENNFILE *);
+size_t penn_fread(void *, size_t, PENNFILE *);
+int penn_fwrite(const void *, size_t, PENNFILE *);
 
 int penn_feof(PENNFILE *);
 
@@ -52,6 +67,10 @@ void db_write_labeled_int(PENNFILE *f, char const *label, int value);
 void db_write_labeld_uint32(PENNFILE *, char const *, uint32_t);
 void db_write_labeled_dbref(PENNFILE *f, char const *label, dbref value);
 
+struct object;
+void db_write_header(PENNFILE *f, int flag);
+void db_write_footer(PENNFILE *f);
+int db_write_object_as(PENNFILE *f, dbref i, struct object *o);
 dbref db_write(PENNFILE *f, int flag);
 int db_paranoid_write(PENNFILE *f, int flag);
 
@@ -70,5 +89,6 @@ void db_read_this_labeled_dbref(PENNFILE *f, const char *label, dbref *val);
 void db_read_labeled_dbref(PENNFILE *f, char **label, dbref *val);
 
 dbref db_read(PENNFILE *f);
+bool db_init_compress(PENNFILE *f);
 
 #endif
@@ -83,6 +83,7 @@ char *json_unescape_string(char *input);
 char *json_escape_string(char *input);
 void register_gmcp_handler(char *package, gmcp_handler_func func);
 void send_oob(DESC *d, char *package, cJSON *data);
+void output_stats(dbref player);
 
 /* sql.c */
 void sql_shutdown(void);
@@ -98,9 +99,13 @@ void generic_command_failure(dbref executor, dbref enactor, char *string,
 /* #define COMP_STATS /* */
 
 bool init_compress(PENNFILE *);
+bool init_compress_table(const long freq[256]);
+bool compress_get_table(long freq[256]);
 char *safe_uncompress(char const *) __attribute_malloc__;
 char *text_uncompress(char const *);
 char *text_compress(char const *) __attribute_malloc__;
+bool text_compress_reentrant(void);
+void do_compress_benchmark(dbref player);
 #define compress text_compress
 #define uncompress text_uncompress
 
@@ -234,6 +239,7 @@ int Commer(dbref thing);
 int Listener(dbref thing);
 int parse_chat(dbref player, char *command);
 bool fork_and_dump(int forking);
+void incremental_dump_object(dbref thing);
 void reserve_fd(void);
 void release_fd(void);
 void do_scan(dbref player, char *command, int flag);
@@ -313,9 +319,12 @@ bool is_good_number(NVAL val);
 /* From plyrlist.c */
 void clear_players(void);
 void add_player(dbref player);
-void add_player_alias(dbref player, const char *alias, bool intransaction);
+void add_player_alias(dbref player, const char *alias);
 void delete_player(dbref player);
 void reset_player_list(dbref player, const char *name, const char *alias);
+void add_connected_player(dbref player);
+void delete_connected_player(dbref player);
+dbref match_connected_player(const char *match);
 
 int could_doit(dbref player, dbref thing, NEW_PE_INFO *pe_info);
 int did_it(dbref player, dbref thing, const char *what, const char *def,
@@ -460,6 +469,7 @@ typedef struct _ufun_attrib {
   int pe_flags; /**< Flags to use when evaluating attr (for debug, no_debug) */
   const char *errmess; /**< Error message, if attr couldn't be retrieved */
   int ufun_flags;      /**< UFUN_* flags, for how to parse/eval the attr */
+  chunk_reference_t data; /**< Chunk reference of the attr, for compiling */
 } ufun_attrib;
 
 dbref next_parent(dbref thing, dbref current, int *parent_count,
@@ -542,6 +552,7 @@ bool quick_regexp_match(const char *restrict s, const char *restrict d, bool cs,
                         const char **report_err);
 bool qcomp_regexp_match(const pcre2_code *re, pcre2_match_data *md,
                         const char *s, PCRE2_SIZE);
+void re_cache_stats(dbref player);
 /** Default (case-insensitive) local wildcard match */
 #define local_wild_match(s, d, p) local_wild_match_case(s, d, 0, p)
 
@@ -585,6 +596,8 @@ void do_purge(dbref player);
 
 void dbck(void);
 int undestroy(dbref player, dbref thing);
+dbref new_scratch_object(void);
+void free_scratch_object(dbref thing);
 
 /* From db.c */
 
@@ -80,7 +80,6 @@ typedef int folder_array[MAX_FOLDERS + 1];
 #define MDBF_SENDERCTIME 0x8
 
 /* From extmail.c */
-extern struct mail *maildb;
 extern void set_player_folder(dbref player, int fnum);
 extern void add_folder_name(dbref player, int fld, const char *name);
 extern struct mail *find_exact_starting_point(dbref player);
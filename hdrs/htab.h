@@ -7,7 +7,12 @@
 #ifndef __HTAB_H
 #define __HTAB_H
 
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif /* HAVE_STDINT_H */
+
 typedef struct hashtable HASHTAB;
+typedef struct ihashtable IHASHTAB;
 
 struct hash_bucket;
 
@@ -55,4 +60,30 @@ const char *hash_nextentry_key(HASHTAB *htab);
 void hash_stats(const HASHTAB *htab, struct hashstats *stats);
 unsigned int next_prime_after(unsigned int);
 
+struct ihash_slot;
+
+/** A hash table keyed by 64-bit integers.
+ * More than one entry can have the same key, so a hash of a bigger key
+ * can be used, with the caller checking which entry is the right one.
+ * Entries can't have NULL data.
+ */
+struct ihashtable {
+  struct ihash_slot *slots; /**< Slots, or NULL before the first add */
+  uint32_t size;            /**< Number of slots; a power of 2 */
+  uint32_t entries;         /**< Number of entries stored */
+};
+
+void ihash_init(IHASHTAB *tab, uint32_t size);
+void *ihash_find(const IHASHTAB *tab, uint64_t key);
+void *ihash_match(const IHASHTAB *tab, uint64_t key, uint32_t *pos);
+void ihash_add(IHASHTAB *tab, uint64_t key, void *data);
+void ihash_set(IHASHTAB *tab, uint64_t key, void *data);
+bool ihash_delete(IHASHTAB *tab, uint64_t key, const void *data);
+uint32_t ihash_delete_if(IHASHTAB *tab,
+                         bool (*pred)(uint64_t key, void *data, void *arg),
+                         void *arg);
+void *ihash_next(const IHASHTAB *tab, uint32_t *pos, uint64_t *key);
+void ihash_flush(IHASHTAB *tab);
+size_t ihash_bytes(const IHASHTAB *tab);
+
 #endif /* __HTAB_H_ */
@@ -5,6 +5,8 @@
  * \brief API for working with internal SQLite3 databases.
  */
 
+#include <stdint.h>
+
 #include "sqlite3.h"
 #include "compile.h"
 
@@ -27,6 +29,17 @@ prepare_statement(sqlite3 *db, const char *query, const char *name)
 
 void close_statement(sqlite3_stmt *);
 
+/** Statistics about a cached prepared statement. */
+struct statement_stats {
+  const char *name; /**< Name the statement was cached under */
+  int64_t lookups;  /**< Times it was fetched from the cache */
+  int runs;         /**< Times it was run */
+  int steps;        /**< Virtual machine steps taken */
+  int64_t usecs;    /**< Total time spent running it */
+};
+
+struct statement_stats *statement_cache_stats(sqlite3 *, int *);
+
 char *glob_to_like(const char *orig, char esc, int *len) __attribute_malloc__;
 char *escape_like(const char *orig, char esc, int *len) __attribute_malloc__;
 
@@ -151,6 +151,7 @@ struct new_pe_info {
  **        semaphore, player, object), and for inplace queue entries.
  */
 typedef struct mque MQUE;
+struct run_share;
 struct mque {
   dbref executor; /**< Dbref of the executor, who is running this code (%!) */
   dbref enactor;  /**< Dbref of the enactor, who caused this code to run
@@ -159,8 +160,17 @@ struct mque {
                      (%\@) */
   dbref semaphore_obj; /**< Object this queue was \@wait'd on as a semaphore */
 
-  char
-    *semaphore_attr; /**< Attribute this queue was \@wait'd on as a semaphore */
+  const char *semaphore_attr; /**< Attribute this queue was \@wait'd on as a
+                                 semaphore, from the attribute name tree */
+  MQUE *sem_next;  /**< The next entry waiting on the same semaphore */
+  MQUE *sem_prev;  /**< The previous entry waiting on the same semaphore */
+  uint64_t sem_seq; /**< Order this entry was added to the semaphore queue */
+  int sem_timeout; /**< Position in the semaphore timeout heap, or -1 */
+  struct run_share *share; /**< Share of the command queue this entry is in,
+                              while it's in the command queue */
+  MQUE *share_next;        /**< The next entry in the same share */
+  uint64_t queued_at; /**< When this entry was added to the command queue, in
+                         milliseconds */
 
   NEW_PE_INFO *pe_info; /**< New pe_info struct used for this queue entry */
 
@@ -169,6 +179,8 @@ struct mque {
   MQUE *inplace; /**< Queue entry to run, either via \@include or \@break,
                     \@foo/inplace, etc */
   MQUE *next;    /**< The next queue entry in the linked list */
+  MQUE *prev;    /**< The previous entry, while in the command, wait or
+                    semaphore queue */
 
   char
     *action_list; /**< The action list of commands to run in this queue entry */
@@ -191,6 +203,7 @@ typedef ATTR ALIST;
  */
 struct text_block {
   int nchars;             /**< Number of characters in the block */
+  int size;               /**< Bytes allocated for buf */
   struct text_block *nxt; /**< Pointer to next block in queue */
   char *start;            /**< Start of text */
   char *buf;              /**< Current position in text */
@@ -262,6 +275,8 @@ struct text_queue {
 /* Flag for WebSocket client. */
 #define CONN_WEBSOCKETS_REQUEST 0x10000000
 #define CONN_WEBSOCKETS 0x20000000
+/* Negotiated permessage-deflate for a WebSocket client. */
+#define CONN_WS_DEFLATE 0x40000000
 
 /** Maximum \@doing length */
 #define DOING_LEN 40
@@ -293,7 +308,8 @@ struct squeue {
   void *data;          /** Data to pass to function, or NULL */
   uint64_t when;       /** When to run the function, in milliseconds. */
   char *event;         /** Softcode Event name to trigger, or NULL if none */
-  struct squeue *next; /** Pointer to next squeue event in linked list */
+  uint64_t seq;        /** Order added, to run events due together in order */
+  size_t slot;         /** Position in the system queue's heap */
 };
 
 /**< Have we used too much CPU? */
@@ -322,6 +338,8 @@ struct http_request {
 };
 
 typedef struct descriptor_data DESC;
+struct mccp;
+struct ws_deflate;
 /** A player descriptor's data.
  * This structure associates a connection's socket (file descriptor)
  * with a lot of other relevant information.
@@ -363,6 +381,9 @@ struct descriptor_data {
   const char *close_reason; /**< Why is this socket being closed? */
   dbref closer;             /**< Who closed this socket? */
   struct http_request *http_request;
+  uint32_t poll_state; /**< Cached readiness for the epoll backend */
+  struct mccp *mccp;   /**< MCCP compression state, or NULL */
+  struct ws_deflate *ws_deflate; /**< permessage-deflate state, or NULL */
 };
 
 enum json_type {
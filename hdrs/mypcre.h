@@ -6,10 +6,14 @@
 #define _MYPCRE_H
 
 #define PENN_MATCH_LIMIT 100000
+/** Most memory a match may use, in kilobytes */
+#define PENN_HEAP_LIMIT (10 * 1024)
 
 #define PCRE2_STATIC
 #define PCRE2_CODE_UNIT_WIDTH 8
 
+#include <stdbool.h>
+
 #include "pcre2.h"
 
 extern uint32_t re_compile_flags;
@@ -17,5 +21,23 @@ extern uint32_t re_match_flags;
 extern pcre2_compile_context *re_compile_ctx;
 extern pcre2_match_context *re_match_ctx;
 extern pcre2_convert_context *glob_convert_ctx;
+extern pcre2_jit_stack *re_jit_stack;
+
+struct re_cache_entry;
+
+/** A compiled regular expression borrowed from the regexp cache.
+ * Give it back with re_cache_put() when done matching.
+ */
+struct cached_regexp {
+  pcre2_code *re;               /**< The compiled pattern */
+  pcre2_match_data *md;         /**< Match data sized for the pattern */
+  struct re_cache_entry *entry; /**< The cache entry they belong to */
+};
+
+bool re_cache_get(const char *pattern, uint32_t flags,
+                  struct cached_regexp *cre, int *errcode);
+void re_cache_put(struct cached_regexp *cre);
+int re_match(const pcre2_code *re, PCRE2_SPTR subj, PCRE2_SIZE len,
+             PCRE2_SIZE start, pcre2_match_data *md);
 
 #endif /* End of mypcre.h */
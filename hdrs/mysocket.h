@@ -115,5 +115,7 @@ extern BOOL GetErrorMessage(const DWORD dwError, LPTSTR lpszError,
 #define TN_GMCP                                                                \
   201 /**< Generic MUD Communication Protocol; see                             \
          http://www.gammon.com.au/gmcp */
+#define TN_MCCP2 86 /**< MUD Client Compression Protocol v2, server output */
+#define TN_MCCP3 87 /**< MUD Client Compression Protocol v3, client input */
 
 #endif /* MYSOCKET_H */
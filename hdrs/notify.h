@@ -168,5 +168,6 @@ void notify_format(dbref player, const char *fmt, ...)
   __attribute__((__format__(__printf__, 2, 3)));
 
 int queue_newwrite(DESC *d, const char *b, int n);
+void notify_stats(dbref player);
 
 #endif /* __NOTIFY_H */
@@ -18,6 +18,7 @@
 #include <stdlib.h>
 #include <limits.h>
 #include <math.h>
+#include "chunk.h"
 #include "mushtype.h"
 #include "mypcre.h"
 #include "mushsql.h"
@@ -268,6 +269,10 @@ typedef struct fun FUN;
 int process_expression(char *buff, char **bp, char const **str, dbref executor,
                        dbref caller, dbref enactor, int eflags, int tflags,
                        NEW_PE_INFO *pe_info);
+int process_compiled(char *buff, char **bp, char const *text,
+                     chunk_reference_t data, dbref executor, dbref caller,
+                     dbref enactor, int eflags, NEW_PE_INFO *pe_info);
+void pe_program_stats(dbref player);
 
 void free_pe_info(NEW_PE_INFO *pe_info);
 NEW_PE_INFO *make_pe_info(char *name);
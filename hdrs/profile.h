@@ -0,0 +1,15 @@
+/** \file profile.h
+ *
+ * \brief Interface for the softcode profiler.
+ */
+
+#pragma once
+
+#include "mushtype.h"
+
+void profile_push_function(const char *name);
+void profile_push_attr(dbref thing, const char *attr);
+void profile_push_attrname(const char *attrname);
+void profile_pop(void);
+void profile_stop(void);
+void do_profile(dbref player, const char *arg, bool reset, bool dump);
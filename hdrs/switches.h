@@ -24,174 +24,177 @@
 #define SWITCH_COLNAMES 21
 #define SWITCH_COMBINE 22
 #define SWITCH_COMMANDS 23
-#define SWITCH_CONN 24
-#define SWITCH_CONNECT 25
-#define SWITCH_CONNECTED 26
-#define SWITCH_CONTENTS 27
-#define SWITCH_COUNT 28
-#define SWITCH_CREATE 29
-#define SWITCH_CSTATS 30
-#define SWITCH_DB 31
-#define SWITCH_DEBUG 32
-#define SWITCH_DECOMPILE 33
-#define SWITCH_DELETE 34
-#define SWITCH_DELIMIT 35
-#define SWITCH_DESCRIBE 36
-#define SWITCH_DESTROY 37
-#define SWITCH_DISABLE 38
-#define SWITCH_DOWN 39
-#define SWITCH_DSTATS 40
-#define SWITCH_EMIT 41
-#define SWITCH_ENABLE 42
-#define SWITCH_ENUM 43
-#define SWITCH_EQSPLIT 44
-#define SWITCH_ERR 45
-#define SWITCH_EXITS 46
-#define SWITCH_EXTEND 47
-#define SWITCH_FILE 48
-#define SWITCH_FIRST 49
-#define SWITCH_FLAGS 50
-#define SWITCH_FOLDERS 51
-#define SWITCH_FORWARD 52
-#define SWITCH_FREESPACE 53
-#define SWITCH_FSTATS 54
-#define SWITCH_FULL 55
-#define SWITCH_FUNCTIONS 56
-#define SWITCH_FWD 57
-#define SWITCH_GAG 58
-#define SWITCH_GENERATE 59
-#define SWITCH_GLOBALS 60
-#define SWITCH_HEADER 61
-#define SWITCH_HERE 62
-#define SWITCH_HIDE 63
-#define SWITCH_IFELSE 64
-#define SWITCH_IGNORE 65
-#define SWITCH_IGSWITCH 66
-#define SWITCH_ILIST 67
-#define SWITCH_INLINE 68
-#define SWITCH_INPLACE 69
-#define SWITCH_INSIDE 70
-#define SWITCH_INVENTORY 71
-#define SWITCH_IPRINT 72
-#define SWITCH_JOIN 73
-#define SWITCH_JSON 74
-#define SWITCH_LEAVE 75
-#define SWITCH_LETTER 76
-#define SWITCH_LIMIT 77
-#define SWITCH_LIST 78
-#define SWITCH_LOCAL 79
-#define SWITCH_LOCALIZE 80
-#define SWITCH_LOCKS 81
-#define SWITCH_LOWERCASE 82
-#define SWITCH_LSARGS 83
-#define SWITCH_MATCH 84
-#define SWITCH_ME 85
-#define SWITCH_MEMBERS 86
-#define SWITCH_MOD 87
-#define SWITCH_MOGRIFIER 88
-#define SWITCH_MORTAL 89
-#define SWITCH_MOTD 90
-#define SWITCH_MUTE 91
-#define SWITCH_NAME 92
-#define SWITCH_NO 93
-#define SWITCH_NOBREAK 94
-#define SWITCH_NOCASE 95
-#define SWITCH_NOEVAL 96
-#define SWITCH_NOFLAGCOPY 97
-#define SWITCH_NOFORK 98
-#define SWITCH_NOISY 99
-#define SWITCH_NOPARSE 100
-#define SWITCH_NOSIG 101
-#define SWITCH_NOSPACE 102
-#define SWITCH_NOSPOOF 103
-#define SWITCH_NOTIFY 104
-#define SWITCH_NUKE 105
-#define SWITCH_OEMIT 106
-#define SWITCH_OFF 107
-#define SWITCH_ON 108
-#define SWITCH_OPAQUE 109
-#define SWITCH_OUTSIDE 110
-#define SWITCH_OVERRIDE 111
-#define SWITCH_PAGING 112
-#define SWITCH_PANIC 113
-#define SWITCH_PARANOID 114
-#define SWITCH_PARENT 115
-#define SWITCH_PLAYER 116
-#define SWITCH_PLAYERS 117
-#define SWITCH_PORT 118
-#define SWITCH_POST 119
-#define SWITCH_POWERS 120
-#define SWITCH_PREFIX 121
-#define SWITCH_PRESERVE 122
-#define SWITCH_PRINT 123
-#define SWITCH_PRIVS 124
-#define SWITCH_PURGE 125
-#define SWITCH_PUT 126
-#define SWITCH_QUERY 127
-#define SWITCH_QUEUED 128
-#define SWITCH_QUICK 129
-#define SWITCH_QUIET 130
-#define SWITCH_READ 131
-#define SWITCH_REBOOT 132
-#define SWITCH_RECALL 133
-#define SWITCH_REGEXP 134
-#define SWITCH_REGIONS 135
-#define SWITCH_REGISTER 136
-#define SWITCH_REMIT 137
-#define SWITCH_REMOVE 138
-#define SWITCH_RENAME 139
-#define SWITCH_RESTART 140
-#define SWITCH_RESTORE 141
-#define SWITCH_RESTRICT 142
-#define SWITCH_RETRACT 143
-#define SWITCH_RETROACTIVE 144
-#define SWITCH_REVIEW 145
-#define SWITCH_ROOM 146
-#define SWITCH_ROOMS 147
-#define SWITCH_ROTATE 148
-#define SWITCH_RSARGS 149
-#define SWITCH_RSNOPARSE 150
-#define SWITCH_SAVE 151
-#define SWITCH_SEARCH 152
-#define SWITCH_SEE 153
-#define SWITCH_SEEFLAG 154
-#define SWITCH_SELF 155
-#define SWITCH_SEND 156
-#define SWITCH_SET 157
-#define SWITCH_SETQ 158
-#define SWITCH_SILENT 159
-#define SWITCH_SKIPDEFAULTS 160
-#define SWITCH_SPEAK 161
-#define SWITCH_SPOOF 162
-#define SWITCH_STATS 163
-#define SWITCH_STATUS 164
-#define SWITCH_SUMMARY 165
-#define SWITCH_TABLES 166
-#define SWITCH_TAG 167
-#define SWITCH_TELEPORT 168
-#define SWITCH_TF 169
-#define SWITCH_THINGS 170
-#define SWITCH_TITLE 171
-#define SWITCH_TRACE 172
-#define SWITCH_TRIM 173
-#define SWITCH_TYPE 174
-#define SWITCH_UNCLEAR 175
-#define SWITCH_UNCOMBINE 176
-#define SWITCH_UNFOLDER 177
-#define SWITCH_UNGAG 178
-#define SWITCH_UNHIDE 179
-#define SWITCH_UNMUTE 180
-#define SWITCH_UNREAD 181
-#define SWITCH_UNTAG 182
-#define SWITCH_UNTIL 183
-#define SWITCH_URGENT 184
-#define SWITCH_USEFLAG 185
-#define SWITCH_WHAT 186
-#define SWITCH_WHO 187
-#define SWITCH_WILD 188
-#define SWITCH_WIPE 189
-#define SWITCH_WIZ 190
-#define SWITCH_WIZARD 191
-#define SWITCH_YES 192
-#define SWITCH_ZONE 193
+#define SWITCH_COMPRESSION 24
+#define SWITCH_CONN 25
+#define SWITCH_CONNECT 26
+#define SWITCH_CONNECTED 27
+#define SWITCH_CONTENTS 28
+#define SWITCH_COUNT 29
+#define SWITCH_CREATE 30
+#define SWITCH_CSTATS 31
+#define SWITCH_DB 32
+#define SWITCH_DEBUG 33
+#define SWITCH_DECOMPILE 34
+#define SWITCH_DELETE 35
+#define SWITCH_DELIMIT 36
+#define SWITCH_DESCRIBE 37
+#define SWITCH_DESTROY 38
+#define SWITCH_DISABLE 39
+#define SWITCH_DOWN 40
+#define SWITCH_DSTATS 41
+#define SWITCH_DUMP 42
+#define SWITCH_EMIT 43
+#define SWITCH_ENABLE 44
+#define SWITCH_ENUM 45
+#define SWITCH_EQSPLIT 46
+#define SWITCH_ERR 47
+#define SWITCH_EXITS 48
+#define SWITCH_EXTEND 49
+#define SWITCH_FILE 50
+#define SWITCH_FIRST 51
+#define SWITCH_FLAGS 52
+#define SWITCH_FOLDERS 53
+#define SWITCH_FORWARD 54
+#define SWITCH_FREESPACE 55
+#define SWITCH_FSTATS 56
+#define SWITCH_FULL 57
+#define SWITCH_FUNCTIONS 58
+#define SWITCH_FWD 59
+#define SWITCH_GAG 60
+#define SWITCH_GENERATE 61
+#define SWITCH_GLOBALS 62
+#define SWITCH_HEADER 63
+#define SWITCH_HERE 64
+#define SWITCH_HIDE 65
+#define SWITCH_IFELSE 66
+#define SWITCH_IGNORE 67
+#define SWITCH_IGSWITCH 68
+#define SWITCH_ILIST 69
+#define SWITCH_INLINE 70
+#define SWITCH_INPLACE 71
+#define SWITCH_INSIDE 72
+#define SWITCH_INVENTORY 73
+#define SWITCH_IPRINT 74
+#define SWITCH_JOIN 75
+#define SWITCH_JSON 76
+#define SWITCH_LEAVE 77
+#define SWITCH_LETTER 78
+#define SWITCH_LIMIT 79
+#define SWITCH_LIST 80
+#define SWITCH_LOCAL 81
+#define SWITCH_LOCALIZE 82
+#define SWITCH_LOCKS 83
+#define SWITCH_LOWERCASE 84
+#define SWITCH_LSARGS 85
+#define SWITCH_MATCH 86
+#define SWITCH_ME 87
+#define SWITCH_MEMBERS 88
+#define SWITCH_MOD 89
+#define SWITCH_MOGRIFIER 90
+#define SWITCH_MORTAL 91
+#define SWITCH_MOTD 92
+#define SWITCH_MUTE 93
+#define SWITCH_NAME 94
+#define SWITCH_NO 95
+#define SWITCH_NOBREAK 96
+#define SWITCH_NOCASE 97
+#define SWITCH_NOEVAL 98
+#define SWITCH_NOFLAGCOPY 99
+#define SWITCH_NOFORK 100
+#define SWITCH_NOISY 101
+#define SWITCH_NOPARSE 102
+#define SWITCH_NOSIG 103
+#define SWITCH_NOSPACE 104
+#define SWITCH_NOSPOOF 105
+#define SWITCH_NOTIFY 106
+#define SWITCH_NUKE 107
+#define SWITCH_OEMIT 108
+#define SWITCH_OFF 109
+#define SWITCH_ON 110
+#define SWITCH_OPAQUE 111
+#define SWITCH_OUTSIDE 112
+#define SWITCH_OVERRIDE 113
+#define SWITCH_PAGING 114
+#define SWITCH_PANIC 115
+#define SWITCH_PARANOID 116
+#define SWITCH_PARENT 117
+#define SWITCH_PLAYER 118
+#define SWITCH_PLAYERS 119
+#define SWITCH_PORT 120
+#define SWITCH_POST 121
+#define SWITCH_POWERS 122
+#define SWITCH_PREFIX 123
+#define SWITCH_PRESERVE 124
+#define SWITCH_PRINT 125
+#define SWITCH_PRIVS 126
+#define SWITCH_PURGE 127
+#define SWITCH_PUT 128
+#define SWITCH_QUERY 129
+#define SWITCH_QUEUED 130
+#define SWITCH_QUICK 131
+#define SWITCH_QUIET 132
+#define SWITCH_READ 133
+#define SWITCH_REBOOT 134
+#define SWITCH_RECALL 135
+#define SWITCH_REGEXP 136
+#define SWITCH_REGIONS 137
+#define SWITCH_REGISTER 138
+#define SWITCH_REMIT 139
+#define SWITCH_REMOVE 140
+#define SWITCH_RENAME 141
+#define SWITCH_RESET 142
+#define SWITCH_RESTART 143
+#define SWITCH_RESTORE 144
+#define SWITCH_RESTRICT 145
+#define SWITCH_RETRACT 146
+#define SWITCH_RETROACTIVE 147
+#define SWITCH_REVIEW 148
+#define SWITCH_ROOM 149
+#define SWITCH_ROOMS 150
+#define SWITCH_ROTATE 151
+#define SWITCH_RSARGS 152
+#define SWITCH_RSNOPARSE 153
+#define SWITCH_SAVE 154
+#define SWITCH_SEARCH 155
+#define SWITCH_SEE 156
+#define SWITCH_SEEFLAG 157
+#define SWITCH_SELF 158
+#define SWITCH_SEND 159
+#define SWITCH_SET 160
+#define SWITCH_SETQ 161
+#define SWITCH_SILENT 162
+#define SWITCH_SKIPDEFAULTS 163
+#define SWITCH_SPEAK 164
+#define SWITCH_SPOOF 165
+#define SWITCH_STATS 166
+#define SWITCH_STATUS 167
+#define SWITCH_SUMMARY 168
+#define SWITCH_TABLES 169
+#define SWITCH_TAG 170
+#define SWITCH_TELEPORT 171
+#define SWITCH_TF 172
+#define SWITCH_THINGS 173
+#define SWITCH_TITLE 174
+#define SWITCH_TRACE 175
+#define SWITCH_TRIM 176
+#define SWITCH_TYPE 177
+#define SWITCH_UNCLEAR 178
+#define SWITCH_UNCOMBINE 179
+#define SWITCH_UNFOLDER 180
+#define SWITCH_UNGAG 181
+#define SWITCH_UNHIDE 182
+#define SWITCH_UNMUTE 183
+#define SWITCH_UNREAD 184
+#define SWITCH_UNTAG 185
+#define SWITCH_UNTIL 186
+#define SWITCH_URGENT 187
+#define SWITCH_USEFLAG 188
+#define SWITCH_WHAT 189
+#define SWITCH_WHO 190
+#define SWITCH_WILD 191
+#define SWITCH_WIPE 192
+#define SWITCH_WIZ 193
+#define SWITCH_WIZARD 194
+#define SWITCH_YES 195
+#define SWITCH_ZONE 196
 #endif /* SWITCHES_H */
@@ -24,8 +24,12 @@ int process_output(DESC *d);
 /* websock.c */
 int is_websocket(const char *command);
 int process_websocket_request(DESC *d, const char *command);
-int process_websocket_frame(DESC *d, char *tbuf1, int got);
-void to_websocket_frame(const char **bp, int *np, char channel);
+int process_websocket_frame(DESC *d, char *tbuf1, int got, char *out,
+                            int outlen);
+void to_websocket_frame(DESC *d, const char **bp, int *np, char channel);
+void free_websocket_deflate(DESC *d);
+bool websocket_deflate_takeover(DESC *d);
+void websocket_stats(dbref player);
 
 int markup_websocket(char *buff, char **bp, char *data, int datalen, char *alt,
                      int altlen, char channel);
@@ -821,6 +821,7 @@ do_attribute_access(dbref player, char *name, char *perms, int retroactive)
         else
           AL_FLAGS(ap2) = flags;
         AL_CREATOR(ap2) = player;
+        cmd_index_invalidate(i);
       }
     }
   }
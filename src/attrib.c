@@ -11,7 +11,10 @@
 
 #include <string.h>
 #include <ctype.h>
+#include <inttypes.h>
 
+#include "ansi.h"
+#include "case.h"
 #include "chunk.h"
 #include "conf.h"
 #include "dbdefs.h"
@@ -24,12 +27,14 @@
 #include "memcheck.h"
 #include "mushdb.h"
 #include "mymalloc.h"
+#include "mypcre.h"
 #include "notify.h"
 #include "parse.h"
 #include "privtab.h"
 #include "sort.h"
 #include "strtree.h"
 #include "strutil.h"
+#include "tests.h"
 
 #ifdef WIN32
 #pragma warning(disable : 4761) /* disable warning re conversion */
@@ -755,18 +760,46 @@ create_atr(dbref thing, char const *atr_name)
 void
 atr_new_add(dbref thing, const char *RESTRICT atr, const char *RESTRICT s,
             dbref player, uint32_t flags, uint8_t derefs, bool makeroots)
+{
+  atr_new_add_compressed(thing, atr, s, NULL, player, flags, derefs,
+                         makeroots);
+}
+
+/** Add an attribute to an object, dangerously, with a value that
+ * may already be compressed.
+ * This is atr_new_add() for the database loader, which can compress
+ * attribute values ahead of time.
+ * \param thing object to set the attribute on.
+ * \param atr name of the attribute to set.
+ * \param s value of the attribute to set, or NULL if only t is known.
+ * \param t s as compressed by compress(), or NULL to compress it here.
+ *          It's freed either way.
+ * \param player the attribute creator.
+ * \param flags bitmask of attribute flags for this attribute.
+ * \param derefs the initial deref count to use for the attribute value.
+ * \param makeroots if creating a branch (FOO`BAR) attr, and the root (FOO)
+ *                  doesn't exist, should we create it instead of aborting?
+ */
+void
+atr_new_add_compressed(dbref thing, const char *RESTRICT atr,
+                       const char *RESTRICT s, char *t, dbref player,
+                       uint32_t flags, uint8_t derefs, bool makeroots)
 {
   ATTR *ptr;
   char *p, root_name[ATTRIBUTE_NAME_LIMIT + 1];
+  bool empty = s ? !*s : (!t || !*t);
 
-  if (!EMPTY_ATTRS && !*s && !(flags & AF_ROOT))
+  if (!EMPTY_ATTRS && empty && !(flags & AF_ROOT)) {
+    free(t);
     return;
+  }
 
   /* Don't fail on a bad name, but do log it */
   if (!good_atr_name(atr))
     do_rawlog(LT_ERR, "Bad attribute name %s on object %s", atr,
               unparse_dbref(thing));
 
+  cmd_index_invalidate(thing);
   ptr = find_atr_in_list(thing, atr);
   if (ptr) {
     /* Duplicate, probably because of an added root attribute.  This
@@ -782,10 +815,11 @@ atr_new_add(dbref thing, const char *RESTRICT atr, const char *RESTRICT s,
     }
 
     /* replace string with new string */
-    if (!s || !*s) {
-      /* nothing */
+    if (empty) {
+      free(t);
     } else {
-      char *t = compress(s);
+      if (!t)
+        t = compress(s);
       if (!t)
         return;
 
@@ -802,8 +836,10 @@ atr_new_add(dbref thing, const char *RESTRICT atr, const char *RESTRICT s,
     *p = '\0';
     root = find_atr_in_list(thing, root_name);
     if (!root) {
-      if (!makeroots)
+      if (!makeroots) {
+        free(t);
         return;
+      }
       do_rawlog(LT_ERR, "Missing root attribute '%s' on object #%d!\n",
                 root_name, thing);
       atr_new_add(thing, root_name, EMPTY_ATTRS ? "" : " ", player, AF_ROOT, 0,
@@ -815,18 +851,21 @@ atr_new_add(dbref thing, const char *RESTRICT atr, const char *RESTRICT s,
   }
 
   ptr = create_atr(thing, atr);
-  if (!ptr)
+  if (!ptr) {
+    free(t);
     return;
+  }
 
   AL_FLAGS(ptr) = flags;
   AL_FLAGS(ptr) &= ~AF_COMMAND & ~AF_LISTEN;
   AL_CREATOR(ptr) = player;
 
   /* replace string with new string */
-  if (!s || !*s) {
-    /* nothing */
+  if (empty) {
+    free(t);
   } else {
-    char *t = compress(s);
+    if (!t)
+      t = compress(s);
     if (!t)
       return;
 
@@ -941,6 +980,8 @@ atr_add(dbref thing, const char *RESTRICT atr, const char *RESTRICT s,
   if (ptr && !Can_Write_Attr(player, thing, ptr))
     return AE_ERROR;
 
+  cmd_index_invalidate(thing);
+
   /* make a new atr, if needed */
   if (!ptr) {
     atr_err res = can_create_attr(player, thing, atr, flags);
@@ -1662,6 +1703,8 @@ atr_free_all(dbref thing)
 {
   ATTR *ptr;
 
+  cmd_index_invalidate(thing);
+
   if (AttrCap(thing) == 0) {
     return;
   }
@@ -1740,6 +1783,395 @@ can_debug(dbref player, dbref victim)
   return success;
 }
 
+/** Copy the pattern of a $-command or ^-listen attribute value.
+ * Converts \:s into :, but leaves all other \s alone, and makes sure
+ * we don't trip over foo\\:, which isn't escaping :.
+ * \param atrval the attribute value.
+ * \param end character that ends the pattern (usually ':').
+ * \param buff BUFFER_LEN buffer to copy the pattern into.
+ * \return offset of the action list in atrval, or -1 if not a pattern.
+ */
+static int
+cmd_pattern(const char *atrval, int end, char *buff)
+{
+  int i, j;
+
+  if (atrval[0] != '^' && atrval[0] != '$') {
+    return -1;
+  }
+  for (i = 1, j = 0; atrval[i] && atrval[i] != end; i++) {
+    if (atrval[i] == '\\' && atrval[i + 1]) {
+      if (atrval[i + 1] == end) {
+        i++;
+      } else {
+        buff[j++] = atrval[i++];
+      }
+    }
+    buff[j++] = atrval[i];
+  }
+  buff[j] = '\0';
+
+  /* at this point, atrval[i] should be the separating ':'.
+   * If it's not, this ain't an $ or ^-pattern.
+   */
+  if (!atrval[i]) {
+    return -1;
+  }
+  return i + 1;
+}
+
+/* $-command index.
+ *
+ * Most calls to atr_comm_match() are for objects that have no $-command
+ * matching the input, and proving that used to mean uncompressing and
+ * matching every $-command on the object and its parents. Instead, the
+ * first time an object is checked, its $-commands are summarized by
+ * what the input must start with: the upper-cased literal first word of
+ * the pattern (kept sorted for a binary search), the literal text before
+ * the first wildcard, or, for regexp commands, the compiled pattern.
+ * Objects whose whole parent chain can't match are skipped without
+ * looking at their attributes; anything that might match goes through
+ * the normal matching code, so the index only has to be conservative.
+ * An object's index is thrown away whenever one of its attributes is
+ * added, changed, removed or has its flags altered.
+ */
+
+/** One summarized $-command pattern. */
+struct cmd_pattern {
+  char *text;     /**< Upper-cased literal prefix */
+  size_t len;     /**< Length of text */
+  pcre2_code *re; /**< Compiled pattern of a regexp command, or NULL */
+};
+
+/** The summarized $-commands of one object. */
+struct cmd_index {
+  int nwords; /**< Patterns whose first word is literal, sorted, at the front */
+  int count;  /**< Total number of patterns */
+  bool always; /**< Some pattern starts with a wildcard */
+  struct cmd_pattern *patterns; /**< Array of patterns */
+};
+
+static struct cmd_index **cmd_indexes = NULL;
+static dbref cmd_indexes_size = 0;
+/** Shared index for objects without any $-commands */
+static struct cmd_index no_cmds = {0, 0, 0, NULL};
+static pcre2_match_data *cmd_index_md = NULL;
+static struct {
+  uint64_t hits;   /**< Commands rejected by the index */
+  uint64_t misses; /**< Commands passed on to full matching */
+  uint64_t builds; /**< Indexes built */
+  uint64_t drops;  /**< Indexes thrown away */
+} cmd_index_counts;
+
+/** Summarize a wildcard pattern by its literal prefix.
+ * \param pat the pattern, with markup removed.
+ * \param buff BUFFER_LEN buffer to store the upper-cased prefix in.
+ * \param word set to true if the prefix is the pattern's complete first
+ *   word, and false if it ends at a wildcard.
+ * \return length of the prefix.
+ */
+static size_t
+cmd_pattern_prefix(const char *pat, char *buff, bool *word)
+{
+  size_t n;
+
+  for (n = 0; pat[n] && n < BUFFER_LEN - 1; n++) {
+    if (pat[n] == '*' || pat[n] == '?' || pat[n] == '\\') {
+      *word = 0;
+      buff[n] = '\0';
+      return n;
+    }
+    if (pat[n] == ' ') {
+      break;
+    }
+    buff[n] = UPCASE(pat[n]);
+  }
+  *word = 1;
+  buff[n] = '\0';
+  return n;
+}
+
+static int
+cmd_word_cmp(const void *a, const void *b)
+{
+  const struct cmd_pattern *pa = a, *pb = b;
+
+  if (pa->len != pb->len) {
+    return pa->len < pb->len ? -1 : 1;
+  }
+  return memcmp(pa->text, pb->text, pa->len);
+}
+
+static void
+cmd_index_free(struct cmd_index *ci)
+{
+  int n;
+
+  if (ci == &no_cmds) {
+    return;
+  }
+  for (n = 0; n < ci->count; n++) {
+    if (ci->patterns[n].text) {
+      mush_free(ci->patterns[n].text, "cmd_index.pattern");
+    }
+    if (ci->patterns[n].re) {
+      pcre2_code_free(ci->patterns[n].re);
+      DEL_CHECK("pcre");
+    }
+  }
+  mush_free(ci->patterns, "cmd_index.patterns");
+  mush_free(ci, "cmd_index");
+}
+
+/** Summarize the $-commands set directly on an object. */
+static struct cmd_index *
+cmd_index_build(dbref thing)
+{
+  struct cmd_index *ci;
+  ATTR *ptr;
+  char pattern[BUFFER_LEN], prefix[BUFFER_LEN];
+  int max = 0, back;
+
+  cmd_index_counts.builds++;
+
+  ATTR_FOR_EACH (thing, ptr) {
+    if (AL_FLAGS(ptr) & AF_COMMAND) {
+      max++;
+    }
+  }
+  if (!max) {
+    return &no_cmds;
+  }
+
+  ci = mush_malloc(sizeof *ci, "cmd_index");
+  ci->patterns = mush_calloc(max, sizeof *ci->patterns, "cmd_index.patterns");
+  ci->nwords = 0;
+  ci->count = 0;
+  ci->always = 0;
+  back = max;
+
+  ATTR_FOR_EACH (thing, ptr) {
+    char *atrval;
+    struct cmd_pattern *cp;
+    bool word;
+    size_t len;
+
+    if (!(AL_FLAGS(ptr) & AF_COMMAND)) {
+      continue;
+    }
+    atrval = atr_value(ptr);
+    if (!atrval[0] || !atrval[1] || cmd_pattern(atrval, ':', pattern) < 0) {
+      continue;
+    }
+
+    if (AF_Regexp(ptr)) {
+      int errcode;
+      PCRE2_SIZE erroffset;
+      pcre2_code *re;
+
+      re = pcre2_compile((const PCRE2_UCHAR *) pattern, PCRE2_ZERO_TERMINATED,
+                         (AF_Case(ptr) ? 0 : PCRE2_CASELESS) | re_compile_flags,
+                         &errcode, &erroffset, re_compile_ctx);
+      if (!re) {
+        /* Can never match */
+        continue;
+      }
+      ADD_CHECK("pcre");
+      cp = &ci->patterns[--back];
+      cp->re = re;
+      ci->count++;
+      continue;
+    }
+
+    len = cmd_pattern_prefix(remove_markup(pattern, NULL), prefix, &word);
+    if (!len && !word) {
+      ci->always = 1;
+      continue;
+    }
+    cp = word ? &ci->patterns[ci->nwords++] : &ci->patterns[--back];
+    cp->text = mush_strdup(prefix, "cmd_index.pattern");
+    cp->len = len;
+    ci->count++;
+  }
+
+  if (back > ci->nwords) {
+    /* Close the gap between the words and everything else */
+    memmove(ci->patterns + ci->nwords, ci->patterns + back,
+            (max - back) * sizeof *ci->patterns);
+  }
+  if (ci->nwords > 1) {
+    qsort(ci->patterns, ci->nwords, sizeof *ci->patterns, cmd_word_cmp);
+  }
+  if (!ci->count && !ci->always) {
+    cmd_index_free(ci);
+    return &no_cmds;
+  }
+  return ci;
+}
+
+/** Return an object's $-command index, building it if needed. */
+static struct cmd_index *
+cmd_index_get(dbref thing)
+{
+  if (thing >= cmd_indexes_size) {
+    dbref newsize = db_top > thing ? db_top : thing + 1;
+
+    cmd_indexes = mush_realloc(cmd_indexes, newsize * sizeof *cmd_indexes,
+                               "cmd_index.array");
+    memset(cmd_indexes + cmd_indexes_size, 0,
+           (newsize - cmd_indexes_size) * sizeof *cmd_indexes);
+    cmd_indexes_size = newsize;
+  }
+  if (!cmd_indexes[thing]) {
+    cmd_indexes[thing] = cmd_index_build(thing);
+  }
+  return cmd_indexes[thing];
+}
+
+/** Forget an object's $-command index.
+ * Must be called whenever any attribute on the object is added, changed,
+ * removed, or has its flags altered.
+ * \param thing dbref of the object.
+ */
+void
+cmd_index_invalidate(dbref thing)
+{
+  if (thing < 0 || thing >= cmd_indexes_size || !cmd_indexes[thing]) {
+    return;
+  }
+  cmd_index_free(cmd_indexes[thing]);
+  cmd_indexes[thing] = NULL;
+  cmd_index_counts.drops++;
+}
+
+/** Could any pattern in an index match the input?
+ * \param ci the index to check.
+ * \param plain the input with markup removed.
+ * \param plainlen length of plain.
+ * \param upper the input with markup removed, upper-cased.
+ * \param wordlen length of the first word of upper.
+ * \return true if some pattern might match.
+ */
+static bool
+cmd_index_candidate(struct cmd_index *ci, const char *plain, size_t plainlen,
+                    const char *upper, size_t wordlen)
+{
+  int lo, hi, n;
+
+  if (ci->always) {
+    return 1;
+  }
+
+  lo = 0;
+  hi = ci->nwords - 1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2, cmp;
+    struct cmd_pattern *cp = &ci->patterns[mid];
+
+    if (cp->len != wordlen) {
+      cmp = cp->len < wordlen ? -1 : 1;
+    } else {
+      cmp = memcmp(cp->text, upper, wordlen);
+    }
+    if (cmp == 0) {
+      return 1;
+    } else if (cmp < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid - 1;
+    }
+  }
+
+  for (n = ci->nwords; n < ci->count; n++) {
+    struct cmd_pattern *cp = &ci->patterns[n];
+
+    if (cp->re) {
+      if (!cmd_index_md) {
+        cmd_index_md = pcre2_match_data_create(1, NULL);
+      }
+      if (pcre2_match(cp->re, (const PCRE2_UCHAR *) plain, plainlen, 0,
+                      re_match_flags, cmd_index_md, re_match_ctx) >= 0) {
+        return 1;
+      }
+    } else if (strncmp(upper, cp->text, cp->len) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/** Could an object or its parents have a $-command matching the input?
+ * \param thing the object to check.
+ * \param parent_depth true to check thing's parents as well.
+ * \param str the input.
+ * \return false if no $-command on thing or its parents can match str.
+ */
+static bool
+cmd_index_may_match(dbref thing, int parent_depth, const char *str)
+{
+  char plain[BUFFER_LEN], upper[BUFFER_LEN];
+  size_t plainlen, wordlen, n;
+  dbref current = thing, next;
+  int parent_count = 0;
+
+  if (strlen(str) >= BUFFER_LEN) {
+    return 1;
+  }
+  mush_strncpy(plain, remove_markup(str, NULL), BUFFER_LEN);
+  plainlen = strlen(plain);
+  for (n = 0; n <= plainlen; n++) {
+    upper[n] = UPCASE(plain[n]);
+  }
+  for (wordlen = 0; upper[wordlen] && upper[wordlen] != ' '; wordlen++)
+    ;
+
+  do {
+    next =
+      parent_depth ? next_parent(thing, current, &parent_count, NULL) : NOTHING;
+    if (cmd_index_candidate(cmd_index_get(current), plain, plainlen, upper,
+                            wordlen)) {
+      return 1;
+    }
+  } while ((current = next) != NOTHING);
+  return 0;
+}
+
+/** Report $-command index statistics.
+ * \param player the enactor.
+ */
+void
+cmd_index_stats(dbref player)
+{
+  dbref n;
+  int objects = 0, patterns = 0;
+  size_t bytes = cmd_indexes_size * sizeof *cmd_indexes;
+
+  for (n = 0; n < cmd_indexes_size; n++) {
+    if (cmd_indexes[n] && cmd_indexes[n] != &no_cmds) {
+      int i;
+
+      objects++;
+      patterns += cmd_indexes[n]->count;
+      bytes += sizeof(struct cmd_index) +
+               cmd_indexes[n]->count * sizeof(struct cmd_pattern);
+      for (i = 0; i < cmd_indexes[n]->count; i++) {
+        if (cmd_indexes[n]->patterns[i].text) {
+          bytes += cmd_indexes[n]->patterns[i].len + 1;
+        }
+      }
+    }
+  }
+  notify_format(player,
+                " %d objects with %d indexed patterns, ~%lu bytes (not "
+                "counting regexps).",
+                objects, patterns, (unsigned long) bytes);
+  notify_format(player,
+                " %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64
+                " builds, %" PRIu64 " invalidations.",
+                cmd_index_counts.hits, cmd_index_counts.misses,
+                cmd_index_counts.builds, cmd_index_counts.drops);
+}
+
 /** Match input against a $command or ^listen attribute.
  * This function attempts to match a string against either an $-command
  * or ^listens on an object. Matches may be glob or regex matches,
@@ -1759,7 +2191,7 @@ atr_single_match_r(ATTR *ptr, int flag_mask, int end, const char *input,
 {
   char buff[BUFFER_LEN];
   char *atrval;
-  int i, j;
+  int i;
   int match_found = 0;
 
   if (!ptr) {
@@ -1779,32 +2211,9 @@ atr_single_match_r(ATTR *ptr, int flag_mask, int end, const char *input,
     return 0;
   }
 
-  if (atrval[0] != '^' && atrval[0] != '$') {
+  if ((i = cmd_pattern(atrval, end, buff)) < 0) {
     return 0;
   }
-  /* Find and copy the pattern (regexp or wild) to buff.
-   * Convert \:s into :, but leave all other \s alone. And
-   * make sure we don't trip over foo\\:, which isn't escaping :.
-   */
-  for (i = 1, j = 0; atrval[i] && atrval[i] != end; i++) {
-    if (atrval[i] == '\\' && atrval[i + 1]) {
-      if (atrval[i + 1] == end) {
-        i++;
-      } else {
-        buff[j++] = atrval[i++];
-      }
-    }
-    buff[j++] = atrval[i];
-  }
-  buff[j] = '\0';
-
-  /* at this point, atrval[i] should be the separating ':'.
-   * If it's not, this ain't an $ or ^-pattern.
-   */
-  if (!atrval[i]) {
-    return 0;
-  }
-  i++;
 
   if (cmd_buff) {
     strncpy(cmd_buff, atrval + i, BUFFER_LEN);
@@ -1884,6 +2293,13 @@ atr_comm_match(dbref thing, dbref player, int type, int end, char const *str,
   if (type == '$') {
     flag_mask = AF_COMMAND;
     parent_depth = GoodObject(Parent(thing));
+    if (end == ':' && GoodObject(thing)) {
+      if (!cmd_index_may_match(thing, parent_depth, str)) {
+        cmd_index_counts.hits++;
+        return 0;
+      }
+      cmd_index_counts.misses++;
+    }
   } else {
     flag_mask = AF_LISTEN;
     if (has_flag_by_name(thing, "LISTEN_PARENT",
@@ -2634,6 +3050,7 @@ atr_free_one(dbref thing, ATTR *a)
 
   if (!a)
     return;
+  cmd_index_invalidate(thing);
   st_delete(AL_NAME(a), &atr_names);
   if (a->data)
     chunk_delete(a->data);
@@ -2643,6 +3060,201 @@ atr_free_one(dbref thing, ATTR *a)
   AttrCount(thing) -= 1;
 }
 
+/** A decompressed attribute value in the value cache.
+ * Attribute text is immutable once stored in a chunk, so values can be
+ * cached by chunk reference. Entries are dropped when their chunk is
+ * deleted and follow it when migration moves it, and the least recently
+ * used ones are dropped to stay under attr_value_cache bytes. The text
+ * is stored right after the entry.
+ */
+struct atr_cache_entry {
+  chunk_reference_t ref;        /**< Chunk holding the compressed value */
+  size_t len;                   /**< Length of the text */
+  struct atr_cache_entry *prev; /**< More recently used entry */
+  struct atr_cache_entry *next; /**< Less recently used entry */
+  char *value;                  /**< The decompressed text */
+};
+
+/** Number of entries to size the value cache's hash table for */
+#define ATR_CACHE_INITIAL_SIZE 768
+
+static IHASHTAB atr_cache; /**< Cached values, by chunk reference */
+static struct atr_cache_entry *atr_cache_mru = NULL, *atr_cache_lru = NULL;
+static size_t atr_cache_bytes = 0;
+
+/** Value cache statistics */
+static struct {
+  uint64_t hits;    /**< Reads served from the cache */
+  uint64_t misses;  /**< Reads that decompressed the value */
+  uint64_t drops;   /**< Entries dropped for chunk deletion */
+  uint64_t evicted; /**< Entries pushed out to stay in budget */
+} atr_cache_counts;
+
+static void
+atr_cache_unlink(struct atr_cache_entry *e)
+{
+  if (e->prev) {
+    e->prev->next = e->next;
+  } else {
+    atr_cache_mru = e->next;
+  }
+  if (e->next) {
+    e->next->prev = e->prev;
+  } else {
+    atr_cache_lru = e->prev;
+  }
+}
+
+static void
+atr_cache_push(struct atr_cache_entry *e)
+{
+  e->prev = NULL;
+  e->next = atr_cache_mru;
+  if (atr_cache_mru) {
+    atr_cache_mru->prev = e;
+  } else {
+    atr_cache_lru = e;
+  }
+  atr_cache_mru = e;
+}
+
+/* Bytes charged against the budget for an entry with len bytes of text,
+ * counting its hash table slot */
+static inline size_t
+atr_cache_cost(size_t len)
+{
+  return sizeof(struct atr_cache_entry) + len + 1 +
+         sizeof(chunk_reference_t) + sizeof(struct atr_cache_entry *);
+}
+
+/* Remove an entry from the cache and free it */
+static void
+atr_cache_remove(struct atr_cache_entry *e)
+{
+  ihash_delete(&atr_cache, e->ref, e);
+  atr_cache_unlink(e);
+  atr_cache_bytes -= atr_cache_cost(e->len);
+  mush_free(e, "atr_cache.entry");
+}
+
+/* Drop least recently used entries until there's room for need more
+ * bytes */
+static void
+atr_cache_trim(size_t need)
+{
+  while (atr_cache_lru &&
+         atr_cache_bytes + need > (size_t) ATTR_VALUE_CACHE) {
+    atr_cache_remove(atr_cache_lru);
+    atr_cache_counts.evicted++;
+  }
+}
+
+/** Forget the cached value of a chunk, because it's being deleted.
+ * \param ref the chunk reference.
+ */
+void
+atr_value_forget(chunk_reference_t ref)
+{
+  struct atr_cache_entry *e = ihash_find(&atr_cache, ref);
+
+  if (e) {
+    atr_cache_remove(e);
+    atr_cache_counts.drops++;
+  }
+}
+
+/** Keep the cached value of a chunk that migration has moved.
+ * Hits on the cache don't touch the chunk, so often-read values look
+ * cold to migration and are the ones it moves; dropping them then
+ * would push the hottest values out of the cache. The contents of a
+ * chunk don't change when it moves, so the entry is just re-keyed.
+ * \param from where the chunk was.
+ * \param to where it is now.
+ */
+void
+atr_value_moved(chunk_reference_t from, chunk_reference_t to)
+{
+  struct atr_cache_entry *e = ihash_find(&atr_cache, from);
+
+  if (e) {
+    ihash_delete(&atr_cache, from, e);
+    e->ref = to;
+    ihash_add(&atr_cache, to, e);
+  }
+}
+
+/** Report on the attribute value cache, for \@stats/chunks.
+ * \param player the player to tell, or NOTHING to log it.
+ */
+void
+atr_value_cache_stats(dbref player)
+{
+  uint64_t reads = atr_cache_counts.hits + atr_cache_counts.misses;
+
+  STAT_OUT(player, "Values:    %10u cached (%10lu bytes of %10d allowed)",
+           (unsigned int) atr_cache.entries, (unsigned long) atr_cache_bytes,
+           ATTR_VALUE_CACHE);
+  STAT_OUT(player,
+           "             %10" PRIu64 " hits (%3.0f%%) %10" PRIu64
+           " misses",
+           atr_cache_counts.hits,
+           reads ? 100.0 * atr_cache_counts.hits / reads : 0.0,
+           atr_cache_counts.misses);
+  STAT_OUT(player,
+           "             %10" PRIu64 " dropped  %10" PRIu64 " evicted",
+           atr_cache_counts.drops, atr_cache_counts.evicted);
+}
+
+/** Return the uncompressed text of an attribute, using the value cache.
+ * \param atr the attribute.
+ * \return the text. It must not be modified, and is only good until the
+ * next attribute is read or changed.
+ */
+char const *
+atr_value_const(ATTR *atr)
+{
+  struct atr_cache_entry *e;
+  char *text;
+  size_t len;
+
+  if (!atr->data) {
+    return "";
+  }
+  if (atr_cache_bytes > (size_t) ATTR_VALUE_CACHE) {
+    /* attr_value_cache was lowered */
+    atr_cache_trim(0);
+  }
+  if ((e = ihash_find(&atr_cache, atr->data))) {
+    atr_cache_counts.hits++;
+    if (e != atr_cache_mru) {
+      atr_cache_unlink(e);
+      atr_cache_push(e);
+    }
+    return e->value;
+  }
+
+  atr_cache_counts.misses++;
+  text = uncompress(atr_get_compressed_data(atr));
+  len = strlen(text);
+  if (atr_cache_cost(len) > (size_t) ATTR_VALUE_CACHE) {
+    return text;
+  }
+
+  e = mush_malloc(sizeof *e + len + 1, "atr_cache.entry");
+  e->ref = atr->data;
+  e->len = len;
+  e->value = (char *) (e + 1);
+  memcpy(e->value, text, len + 1);
+  atr_cache_trim(atr_cache_cost(len));
+  if (!atr_cache.slots) {
+    ihash_init(&atr_cache, ATR_CACHE_INITIAL_SIZE);
+  }
+  ihash_add(&atr_cache, e->ref, e);
+  atr_cache_push(e);
+  atr_cache_bytes += atr_cache_cost(len);
+  return e->value;
+}
+
 /** Return the compressed data for an attribute.
  * This is a chokepoint function for accessing the chunk data.
  * \param atr the attribute struct from which to get the data reference.
@@ -2672,7 +3284,10 @@ atr_get_compressed_data(ATTR *atr)
 char *
 atr_value(ATTR *atr)
 {
-  return uncompress(atr_get_compressed_data(atr));
+  static char buff[BUFFER_LEN];
+
+  mush_strncpy(buff, atr_value_const(atr), BUFFER_LEN);
+  return buff;
 }
 
 /** Return the uncompressed data for an attribute in a dynamic buffer.
@@ -2686,5 +3301,77 @@ char *
 safe_atr_value(ATTR *atr, char *check)
 {
   add_check(check);
-  return safe_uncompress(atr_get_compressed_data(atr));
+  return strdup(atr_value_const(atr));
+}
+
+TEST_GROUP(cmd_index)
+{
+  char buff[BUFFER_LEN];
+  bool word;
+  dbref thing;
+
+  TEST("cmd_pattern_prefix.1", cmd_pattern_prefix("foo *", buff, &word) == 3 &&
+                                 word && strcmp(buff, "FOO") == 0);
+  TEST("cmd_pattern_prefix.2",
+       cmd_pattern_prefix("+who", buff, &word) == 4 && word);
+  TEST("cmd_pattern_prefix.3", cmd_pattern_prefix("ab*c d", buff, &word) == 2 &&
+                                 !word && strcmp(buff, "AB") == 0);
+  TEST("cmd_pattern_prefix.4",
+       cmd_pattern_prefix("*", buff, &word) == 0 && !word);
+  TEST("cmd_pattern_prefix.5",
+       cmd_pattern_prefix("x\\*", buff, &word) == 1 && !word);
+
+  thing = new_scratch_object();
+  atr_add(thing, "TEST`CMDINDEX", "$tEst cmdindex *:think 1", GOD, 0);
+  TEST("cmd_index.1", cmd_index_may_match(thing, 0, "test cmdindex foo"));
+  TEST("cmd_index.2", !cmd_index_may_match(thing, 0, "testx cmdindex foo"));
+  atr_add(thing, "TEST`CMDINDEX2", "$zz?t:think 1", GOD, 0);
+  TEST("cmd_index.3", cmd_index_may_match(thing, 0, "zZxt"));
+  TEST("cmd_index.4", !cmd_index_may_match(thing, 0, "zxzt"));
+  atr_add(thing, "TEST`CMDINDEX3", "$^r[0-9]+$:think 1", GOD, AF_REGEXP);
+  TEST("cmd_index.5", cmd_index_may_match(thing, 0, "R42"));
+  TEST("cmd_index.6", !cmd_index_may_match(thing, 0, "r42x"));
+  atr_clr(thing, "TEST`CMDINDEX", GOD);
+  TEST("cmd_index.7", !cmd_index_may_match(thing, 0, "test cmdindex foo"));
+  atr_clr(thing, "TEST`CMDINDEX2", GOD);
+  atr_clr(thing, "TEST`CMDINDEX3", GOD);
+  atr_clr(thing, "TEST", GOD);
+  TEST("cmd_index.8", !cmd_index_may_match(thing, 0, "R42"));
+  free_scratch_object(thing);
+}
+
+TEST_GROUP(atr_value_cache)
+{
+  ATTR *a;
+  char const *v;
+  uint64_t hits;
+  uint32_t count;
+  chunk_reference_t ref;
+  dbref thing;
+
+  thing = new_scratch_object();
+  atr_add(thing, "VALCACHE", "cached value", GOD, 0);
+  a = atr_get_noparent(thing, "VALCACHE");
+  v = atr_value_const(a);
+  TEST("atr_value_cache.1", a && strcmp(v, "cached value") == 0);
+  hits = atr_cache_counts.hits;
+  TEST("atr_value_cache.2", atr_value_const(a) == v &&
+                              atr_cache_counts.hits == hits + 1);
+  TEST("atr_value_cache.3", strcmp(atr_value(a), "cached value") == 0);
+  atr_add(thing, "VALCACHE", "new value", GOD, 0);
+  TEST("atr_value_cache.4", strcmp(atr_value_const(a), "new value") == 0);
+  /* Migration keeps the value cached under the new reference */
+  ref = a->data;
+  atr_value_moved(ref, ref + 1);
+  TEST("atr_value_cache.moved.1",
+       !ihash_find(&atr_cache, ref) && ihash_find(&atr_cache, ref + 1));
+  atr_value_moved(ref + 1, ref);
+  hits = atr_cache_counts.hits;
+  TEST("atr_value_cache.moved.2",
+       strcmp(atr_value_const(a), "new value") == 0 &&
+         atr_cache_counts.hits == hits + 1);
+  count = atr_cache.entries;
+  atr_clr(thing, "VALCACHE", GOD);
+  TEST("atr_value_cache.5", atr_cache.entries == count - 1);
+  free_scratch_object(thing);
 }
@@ -73,6 +73,9 @@
 #ifdef HAVE_POLL_H
 #include <poll.h>
 #endif
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 #ifdef HAVE_LIBCURL
 #include <curl/curl.h>
 #endif
@@ -117,6 +120,7 @@
 #include "map_file.h"
 #include "tests.h"
 #include "websock.h"
+#include "profile.h"
 #include "log.h"
 
 #ifndef WIN32
@@ -171,6 +175,34 @@ static int under_limit = 1;
 
 static bool disable_socket_quota = false;
 
+#ifdef HAVE_EPOLL_CREATE1
+/* Edge-triggered epoll backend for player descriptors. Sockets are
+ * registered once when the descriptor is created, and the last readiness
+ * the kernel reported is cached in d->poll_state until a read or write
+ * would block. Only descriptors with outstanding readiness are kept on
+ * poll_pending and walked by check_sockets(); the listening sockets and
+ * other odds and ends still go through poll(), along with epoll_fd itself.
+ */
+#define DESC_POLL_WATCHED 0x1 /**< Registered with epoll_fd */
+#define DESC_POLL_READ 0x2    /**< Readable since the last blocking read */
+#define DESC_POLL_WRITE 0x4   /**< Writable since the last blocking write */
+#define DESC_POLL_HUP 0x8     /**< Peer hung up */
+#define DESC_POLL_PENDING 0x10 /**< On the poll_pending list */
+/** A read on the descriptor would block; wait for the next edge. */
+#define DESC_POLL_DRAINED(d) ((d)->poll_state &= ~DESC_POLL_READ)
+
+static int epoll_fd = -1;           /**< epoll instance, or -1 to use poll() */
+static bool epoll_disabled = false; /**< Set by --no-epoll */
+static DESC **poll_pending = NULL;  /**< Descriptors with cached readiness */
+static int poll_pending_count = 0, poll_pending_size = 0;
+/** throttle_msecs when no descriptor is waiting for command quota */
+#define NOT_THROTTLED UINT64_MAX
+/** Time till a throttled desc can run, or NOT_THROTTLED */
+static uint64_t throttle_msecs = NOT_THROTTLED;
+#else
+#define DESC_POLL_DRAINED(d) ((void) 0)
+#endif
+
 char cf_motd_msg[BUFFER_LEN] = {'\0'};     /**< The message of the day */
 char cf_wizmotd_msg[BUFFER_LEN] = {'\0'};  /**< The wizard motd */
 char cf_downmotd_msg[BUFFER_LEN] = {'\0'}; /**< The down message */
@@ -200,6 +232,9 @@ const char *default_ttype = "unknown";
 
 #define QUOTA_MAX (COMMAND_BURST_SIZE * MS_PER_SEC)
 
+/** Longest the main loop waits when nothing is due sooner */
+#define MAX_WAIT_MSECS SECS_TO_MSECS(500)
+
 /* When the mush gets a new connection, it tries sending a telnet
  * option negotiation code for setting client-side line-editing mode
  * to it. If it gets a reply, a flag in the descriptor struct is
@@ -253,6 +288,57 @@ int starting_telnet_neg_len = 0;
 
 struct gmcp_handler *gmcp_handlers = NULL;
 
+#ifdef HAVE_LIBZ
+/* MCCP2 output streams use a 4K window and a small hash table, about
+ * 40K of zlib state per connection instead of the usual 256K. MCCP3
+ * input has to use whatever window the client picked, so its inflate
+ * stream is only made once the client starts compressing. */
+#define MCCP_WINDOW_BITS 12
+#define MCCP_MEM_LEVEL 5
+#define MCCP_BUFFER_LEN 8192 /**< Size of the compressed output buffer */
+#define MCCP_END_TRIES 10    /**< Times to wait for a stream's end to go out */
+#define MCCP_END_WAIT 100    /**< Milliseconds to wait each time */
+
+/** MCCP compression state for a descriptor */
+struct mccp {
+  z_stream out;     /**< MCCP2 deflate stream */
+  z_stream in;      /**< MCCP3 inflate stream */
+  bool deflating;   /**< Is output being compressed? */
+  bool inflating;   /**< Is input being decompressed? */
+  bool unflushed;   /**< Has output gone into out since the last flush? */
+  bool finishing;   /**< End the output stream once the queue is empty */
+  bool finished;    /**< The output stream has ended */
+  char *zbuf;       /**< Compressed output waiting to be sent */
+  int zlen;         /**< Bytes in zbuf */
+  int zsent;        /**< Bytes of zbuf already sent */
+};
+
+/** Totals for all MCCP streams, for @stats/tables */
+static struct {
+  uint64_t plain_out;  /**< Bytes of output compressed */
+  uint64_t zipped_out; /**< Compressed bytes they made */
+  uint64_t usecs_out;  /**< Time spent compressing */
+  uint64_t plain_in;   /**< Bytes of input after decompression */
+  uint64_t zipped_in;  /**< Compressed bytes received */
+} mccp_counts;
+
+static int mccp_send(DESC *d);
+static void mccp_inflate(DESC *d, char *buf, int len);
+static bool mccp_end(DESC *d);
+static void mccp_free(DESC *d);
+#endif
+
+/** Does a descriptor have output waiting to be sent? */
+static inline bool
+desc_has_output(DESC *d)
+{
+#ifdef HAVE_LIBZ
+  if (d->mccp && d->mccp->zsent < d->mccp->zlen)
+    return 1;
+#endif
+  return d->output.head != NULL;
+}
+
 /** Iterate through a list of descriptors, and do something with those
  * that are connected.
  */
@@ -355,6 +441,11 @@ static void open_ports(Port_t port, Port_t sslport);
 static void gameloop();
 static void ext_startup();
 static void ext_shutdown();
+static void desc_poll_add(DESC *d);
+static void desc_poll_remove(DESC *d);
+static void poll_add_descs(uint32_t *msec_timeout);
+static void poll_check_descs(int found);
+void desc_output_pending(DESC *d);
 
 #ifndef WIN32
 typedef int SOCKET;
@@ -587,6 +678,10 @@ main(int argc, char **argv)
           }
         } else if (strcmp(argv[n], "--no-pcre-jit") == 0) {
           re_match_flags = PCRE2_NO_JIT;
+        } else if (strcmp(argv[n], "--no-epoll") == 0) {
+#ifdef HAVE_EPOLL_CREATE1
+          epoll_disabled = 1;
+#endif
         } else if (strcmp(argv[n], "--tests") == 0) {
           enable_tests = 1;
         } else if (strcmp(argv[n], "--only-tests") == 0) {
@@ -763,7 +858,12 @@ main(int argc, char **argv)
   glob_convert_ctx = pcre2_convert_context_create(NULL);
   pcre2_set_character_tables(re_compile_ctx, pcre2_maketables(NULL));
   pcre2_set_match_limit(re_match_ctx, PENN_MATCH_LIMIT);
-  pcre2_set_heap_limit(re_match_ctx, 10 * 1024); // 10MB max heap memory
+  pcre2_set_heap_limit(re_match_ctx, PENN_HEAP_LIMIT);
+  /* JIT code doesn't use the heap limit, and PCRE2's default JIT stack
+   * is only 32K, so give it the same room the interpreter gets. */
+  re_jit_stack =
+    pcre2_jit_stack_create(32 * 1024, PENN_HEAP_LIMIT * 1024, NULL);
+  pcre2_jit_stack_assign(re_match_ctx, NULL, re_jit_stack);
   pcre2_set_glob_escape(glob_convert_ctx, '\\');
   pcre2_set_glob_separator(glob_convert_ctx, '`');
 
@@ -993,6 +1093,9 @@ update_quotas(struct timeval current)
   msecs = msec_diff(current, last);
   last = current;
 
+#ifdef HAVE_EPOLL_CREATE1
+  throttle_msecs = NOT_THROTTLED;
+#endif
   DESC_ITER (d) {
     if (d->conn_flags & CONN_NOQUOTA)
       d->quota = QUOTA_MAX;
@@ -1000,6 +1103,15 @@ update_quotas(struct timeval current)
       d->quota += COMMANDS_PER_SECOND * msecs;
     if (d->quota > QUOTA_MAX)
       d->quota = QUOTA_MAX;
+#ifdef HAVE_EPOLL_CREATE1
+    /* The epoll backend doesn't walk every descriptor in check_sockets(),
+     * so work out here when the next throttled one can run again. */
+    if (d->input.head) {
+      uint64_t wait = d->quota >= MS_PER_SEC ? 0 : MS_PER_SEC - d->quota;
+      if (wait < throttle_msecs)
+        throttle_msecs = wait;
+    }
+#endif
   }
 
   /* And the HTTP quota */
@@ -1017,11 +1129,11 @@ http_msecs_till_next()
      * command again. */
     return ((MS_PER_SEC - http_quota) / HTTP_SECOND_LIMIT) + HTTP_SECOND_LIMIT;
   }
-  /* Arbitarily high */
-  return SECS_TO_MSECS(500);
+  return MAX_WAIT_MSECS;
 }
 
 extern slab *text_block_slab;
+extern int text_blocks_pooled, text_blocks_used;
 
 /* Is source one an IP connection? */
 static inline bool
@@ -1315,6 +1427,7 @@ shutdownsock(DESC *d, const char *reason, dbref executor, int flags)
   d->conn_flags |= CONN_SHUTDOWN | flags;
   d->close_reason = reason;
   d->closer = executor;
+  desc_poll_remove(d);
 }
 
 #define CONN_CLOSABLES                                                         \
@@ -1382,6 +1495,195 @@ static nfds_t fd_size = 0, fds_used = 0;
 #define PENN_POLLOUT POLLOUT
 #endif
 
+#ifdef HAVE_EPOLL_CREATE1
+/** Create the epoll instance used to watch player descriptors, if it
+ * doesn't already exist.
+ * \return true if descriptors should be watched with epoll.
+ */
+static bool
+epoll_setup(void)
+{
+  if (epoll_fd >= 0)
+    return 1;
+  if (epoll_disabled)
+    return 0;
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0) {
+    penn_perror("epoll_create1");
+    /* Don't keep trying; poll() will do. */
+    epoll_disabled = 1;
+    return 0;
+  }
+  return 1;
+}
+
+/** Put a descriptor on the list of those with cached readiness.
+ * \param d the descriptor.
+ */
+static void
+desc_poll_pend(DESC *d)
+{
+  if (d->poll_state & DESC_POLL_PENDING)
+    return;
+  if (poll_pending_count >= poll_pending_size) {
+    poll_pending_size = poll_pending_size ? poll_pending_size * 2 : 32;
+    poll_pending = mush_realloc(poll_pending,
+                                sizeof *poll_pending * poll_pending_size,
+                                "poll_pending");
+  }
+  poll_pending[poll_pending_count++] = d;
+  d->poll_state |= DESC_POLL_PENDING;
+}
+
+/** Does a pending descriptor have i/o that can be done right now? */
+static inline bool
+desc_poll_ready(DESC *d)
+{
+  return ((d->poll_state & DESC_POLL_READ) && !d->input.head) ||
+         ((d->poll_state & DESC_POLL_WRITE) && desc_has_output(d)) ||
+         (d->poll_state & DESC_POLL_HUP);
+}
+
+/** Collect readiness events from the kernel and do i/o on every descriptor
+ * that has something to do. Descriptors stay on the pending list until
+ * a read or write reports it would block.
+ * \param events true if epoll_fd was reported readable.
+ */
+static void
+epoll_check_descs(bool events)
+{
+  struct epoll_event evs[256];
+  int n, i, j;
+  DESC *d;
+
+  while (events) {
+    n = epoll_wait(epoll_fd, evs, sizeof evs / sizeof evs[0], 0);
+    if (n < 0) {
+      if (errno != EINTR)
+        penn_perror("epoll_wait");
+      break;
+    }
+    for (i = 0; i < n; i += 1) {
+      d = im_find(descs_by_fd, evs[i].data.fd);
+      if (!d || !(d->poll_state & DESC_POLL_WATCHED))
+        continue;
+      if (evs[i].events & EPOLLERR) {
+        /* Socket error; kill this connection. */
+        shutdownsock(d, "socket error", d->player >= 0 ? d->player : GOD,
+                     CONN_NOWRITE);
+        continue;
+      }
+      if (evs[i].events & (EPOLLIN | EPOLLHUP))
+        d->poll_state |= DESC_POLL_READ;
+      if (evs[i].events & EPOLLOUT)
+        d->poll_state |= DESC_POLL_WRITE;
+      if (evs[i].events & EPOLLHUP)
+        d->poll_state |= DESC_POLL_HUP;
+      desc_poll_pend(d);
+    }
+    if (n < (int) (sizeof evs / sizeof evs[0]))
+      break;
+  }
+
+  /* process_input() can queue output and add more descriptors to the
+   * list, so don't cache poll_pending_count. */
+  for (i = 0; i < poll_pending_count; i += 1) {
+    d = poll_pending[i];
+    if (!d || !(d->poll_state & DESC_POLL_WATCHED))
+      continue;
+    if ((d->poll_state & DESC_POLL_READ) && !d->input.head) {
+      if (!process_input(d, d->poll_state & DESC_POLL_WRITE)) {
+        shutdownsock(d, "disconnect", d->player, CONN_NOWRITE);
+        continue;
+      }
+    }
+    if ((d->poll_state & DESC_POLL_WRITE) && desc_has_output(d)) {
+      if (!process_output(d)) {
+        shutdownsock(d, "disconnect", d->player, CONN_NOWRITE);
+        continue;
+      }
+      /* Anything left over has to wait for the next EPOLLOUT edge. */
+      if (desc_has_output(d))
+        d->poll_state &= ~DESC_POLL_WRITE;
+    }
+    if (d->poll_state & DESC_POLL_HUP) {
+      d->poll_state &= ~DESC_POLL_HUP;
+      http_command_ready(d);
+    }
+  }
+
+  /* Keep only the descriptors that still have unread input or
+   * writable output waiting. */
+  for (i = j = 0; i < poll_pending_count; i += 1) {
+    d = poll_pending[i];
+    if (!d)
+      continue;
+    if ((d->poll_state & DESC_POLL_READ) ||
+        ((d->poll_state & DESC_POLL_WRITE) && desc_has_output(d))) {
+      poll_pending[j++] = d;
+    } else {
+      d->poll_state &= ~DESC_POLL_PENDING;
+    }
+  }
+  poll_pending_count = j;
+}
+#endif
+
+/** Start watching a new descriptor's socket for i/o.
+ * \param d the descriptor.
+ */
+static void
+desc_poll_add(DESC *d)
+{
+  d->poll_state = 0;
+#ifdef HAVE_EPOLL_CREATE1
+  if (epoll_setup()) {
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof ev);
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.fd = d->descriptor;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, d->descriptor, &ev) < 0) {
+      penn_perror("epoll_ctl");
+      shutdownsock(d, "socket error", NOTHING, CONN_NOWRITE);
+      return;
+    }
+    /* If the socket is already readable or writable, the kernel queues an
+     * event for it right away. */
+    d->poll_state = DESC_POLL_WATCHED;
+  }
+#endif
+}
+
+/** Stop watching a descriptor's socket. Called when it's being shut down.
+ * \param d the descriptor.
+ */
+static void
+desc_poll_remove(DESC *d)
+{
+#ifdef HAVE_EPOLL_CREATE1
+  if (d->poll_state & DESC_POLL_WATCHED)
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, d->descriptor, NULL);
+  /* Leave DESC_POLL_PENDING alone; cleanup_desc() takes it off the list. */
+  d->poll_state &= DESC_POLL_PENDING;
+#else
+  d->poll_state = 0;
+#endif
+}
+
+/** Note that output has been queued for a descriptor. If its socket was
+ * last seen writable, the next check_sockets() will try to flush it.
+ * \param d the descriptor.
+ */
+void
+desc_output_pending(DESC *d)
+{
+#ifdef HAVE_EPOLL_CREATE1
+  if (d->poll_state & DESC_POLL_WRITE)
+    desc_poll_pend(d);
+#endif
+}
+
 void
 ext_startup()
 {
@@ -1400,6 +1702,11 @@ ext_startup()
   avail_descriptors -= 2; /* reserve some more for setting up the slave */
 #endif
 
+#ifdef HAVE_EPOLL_CREATE1
+  if (epoll_setup())
+    do_rawlog(LT_ERR, "Using epoll for descriptor i/o.");
+#endif
+
   /* done. print message to the log */
   do_rawlog(LT_ERR, "%d file descriptors available.", avail_descriptors);
   do_rawlog(LT_ERR, "RESTART FINISHED.");
@@ -1413,6 +1720,17 @@ ext_shutdown()
   if (fds)
     mush_free(fds, "pollfds");
 
+#ifdef HAVE_EPOLL_CREATE1
+  if (epoll_fd >= 0) {
+    close(epoll_fd);
+    epoll_fd = -1;
+  }
+  if (poll_pending)
+    mush_free(poll_pending, "poll_pending");
+  poll_pending = NULL;
+  poll_pending_count = poll_pending_size = 0;
+#endif
+
 #ifdef HAVE_LIBCURL
   curl_multi_cleanup(curl_handle);
 #endif
@@ -1436,10 +1754,17 @@ check_sockets(uint32_t msec_timeout)
   time_t now;
 #endif
   int found;
-  DESC *d;
+  int ndescs = im_count(descs_by_fd);
+#ifdef HAVE_EPOLL_CREATE1
+  int epoll_slot = -1;
+
+  /* Only epoll_fd itself goes in the poll() set */
+  if (epoll_fd >= 0)
+    ndescs = 1;
+#endif
 
-  if (((int) fd_size) < ((int) im_count(descs_by_fd) + 6)) {
-    fd_size = im_count(descs_by_fd) + 16;
+  if (((int) fd_size) < ndescs + 6) {
+    fd_size = ndescs + 16;
     fds = mush_realloc(fds, sizeof *fds * fd_size, "pollfds");
   }
   fds_used = 0;
@@ -1485,33 +1810,25 @@ check_sockets(uint32_t msec_timeout)
   }
 #endif
 
-  /** Now add all the active descriptors */
-  DESC_ITER (d) {
-    /* If d->input.head is non-null, the descriptor is being throttled.
-     * If d->output.head is non-null, the descriptor is choked on send,
-     * we want to watch for POLLOUT event to write some more.
-     * */
-    int events = 0;
-
-    if (d->input.head) {
-      /* They're throttled, be nice and reduce timeout to when we think
-       * they'll be unthrottled. */
-      uint64_t curr = MS_PER_SEC - d->quota;
-      if (msec_timeout > curr)
-        msec_timeout = curr;
-    } else {
-      events |= PENN_POLLIN;
-    }
-
-    if (d->output.head) {
-      events |= PENN_POLLOUT;
-    }
-
-    if (events) {
-      fds[fds_used].events = events;
-      fds[fds_used++].fd = d->descriptor;
+#ifdef HAVE_EPOLL_CREATE1
+  if (epoll_fd >= 0) {
+    /* Don't sleep if a descriptor still has i/o we can do, and wake up
+     * when a throttled one can run again. */
+    for (int i = 0; i < poll_pending_count; i += 1) {
+      if (poll_pending[i] && desc_poll_ready(poll_pending[i])) {
+        msec_timeout = 0;
+        break;
+      }
     }
-  }
+    if (throttle_msecs != NOT_THROTTLED && msec_timeout > throttle_msecs)
+      msec_timeout = throttle_msecs;
+    epoll_slot = fds_used;
+    fds[fds_used].fd = epoll_fd;
+    fds[fds_used].revents = 0;
+    fds[fds_used++].events = PENN_POLLIN;
+  } else
+#endif
+    poll_add_descs(&msec_timeout);
 
 #ifdef HAVE_LIBCURL
   curl_status =
@@ -1632,47 +1949,104 @@ check_sockets(uint32_t msec_timeout)
 #endif
 
     /* Check all the users for input */
-    DESC_ITER (d) {
-      unsigned int input_ready, output_ready, errors, full_events;
-      if (found <= 0)
-        break;
+#ifdef HAVE_EPOLL_CREATE1
+    if (epoll_fd < 0)
+#endif
+      poll_check_descs(found);
+  }
 
-      if ((SOCKET) d->descriptor != fds[fds_used].fd)
-        continue;
+#ifdef HAVE_EPOLL_CREATE1
+  if (epoll_fd >= 0)
+    epoll_check_descs(epoll_slot >= 0 &&
+                      (fds[epoll_slot].revents & PENN_POLLIN));
+#endif
+  return 1;
+}
 
-      input_ready = fds[fds_used].revents & PENN_POLLIN;
-      full_events = fds[fds_used].revents;
+/** Add every descriptor that can do i/o to the poll() set.
+ * \param msec_timeout pointer to the poll timeout, which is reduced if a
+ * throttled descriptor will be able to run sooner.
+ */
+static void
+poll_add_descs(uint32_t *msec_timeout)
+{
+  DESC *d;
+
+  DESC_ITER (d) {
+    /* If d->input.head is non-null, the descriptor is being throttled.
+     * If d->output.head is non-null, the descriptor is choked on send,
+     * we want to watch for POLLOUT event to write some more.
+     * */
+    int events = 0;
+
+    if (d->input.head) {
+      /* They're throttled, be nice and reduce timeout to when we think
+       * they'll be unthrottled. */
+      uint64_t curr = MS_PER_SEC - d->quota;
+      if (*msec_timeout > curr)
+        *msec_timeout = curr;
+    } else {
+      events |= PENN_POLLIN;
+    }
+
+    if (desc_has_output(d)) {
+      events |= PENN_POLLOUT;
+    }
+
+    if (events) {
+      fds[fds_used].events = events;
+      fds[fds_used++].fd = d->descriptor;
+    }
+  }
+}
+
+/** Do i/o on every descriptor poll() reported as ready.
+ * \param found number of ready fds left to handle.
+ */
+static void
+poll_check_descs(int found)
+{
+  DESC *d;
+
+  DESC_ITER (d) {
+    unsigned int input_ready, output_ready, errors, full_events;
+    if (found <= 0)
+      break;
+
+    if ((SOCKET) d->descriptor != fds[fds_used].fd)
+      continue;
+
+    input_ready = fds[fds_used].revents & PENN_POLLIN;
+    full_events = fds[fds_used].revents;
 #ifdef HAVE_LIBCURL
-      errors = 0;
+    errors = 0;
 #else
-      errors = fds[fds_used].revents & (POLLERR | POLLNVAL);
+    errors = fds[fds_used].revents & (POLLERR | POLLNVAL);
 #endif
-      output_ready = fds[fds_used++].revents & PENN_POLLOUT;
-      if (input_ready || errors || output_ready)
-        found -= 1;
-      if (errors) {
-        /* Socket error; kill this connection. */
-        shutdownsock(d, "socket error", d->player >= 0 ? d->player : GOD,
-                     CONN_NOWRITE);
-      } else {
-        if (input_ready) {
-          if (!process_input(d, output_ready)) {
-            shutdownsock(d, "disconnect", d->player, CONN_NOWRITE);
-            continue;
-          }
-        }
-        if (output_ready) {
-          if (!process_output(d)) {
-            shutdownsock(d, "disconnect", d->player, CONN_NOWRITE);
-          }
+    output_ready = fds[fds_used++].revents & PENN_POLLOUT;
+    if (input_ready || errors || output_ready)
+      found -= 1;
+    if (errors) {
+      /* Socket error; kill this connection. */
+      shutdownsock(d, "socket error", d->player >= 0 ? d->player : GOD,
+                   CONN_NOWRITE);
+    } else {
+      if (input_ready) {
+        if (!process_input(d, output_ready)) {
+          shutdownsock(d, "disconnect", d->player, CONN_NOWRITE);
+          continue;
         }
       }
-      if (full_events & POLLHUP) {
-        http_command_ready(d);
+      if (output_ready) {
+        if (!process_output(d)) {
+          shutdownsock(d, "disconnect", d->player, CONN_NOWRITE);
+        }
       }
     }
+    if (full_events & POLLHUP) {
+      http_command_ready(d);
+    }
   }
-  return 1;
 }
 
 static void
@@ -1689,7 +2063,7 @@ gameloop()
   store = timeout_check
 
     /* any queued commands or events waiting? */
-    msec_timeout = SECS_TO_MSECS(500);
+    msec_timeout = MAX_WAIT_MSECS;
     min_timeout(msec_timeout, queue_msecs_till_next());
     min_timeout(msec_timeout, sq_msecs_till_next());
     min_timeout(msec_timeout, http_msecs_till_next());
@@ -2296,6 +2670,17 @@ cleanup_desc(DESC *d)
 
   im_delete(descs_by_fd, d->descriptor);
 
+#ifdef HAVE_EPOLL_CREATE1
+  if (d->poll_state & DESC_POLL_PENDING) {
+    for (int i = 0; i < poll_pending_count; i += 1) {
+      if (poll_pending[i] == d) {
+        poll_pending[i] = NULL;
+        break;
+      }
+    }
+  }
+#endif
+
   if (sslsock && d->ssl) {
     ssl_close_connection(d->ssl);
     d->ssl = NULL;
@@ -2305,6 +2690,11 @@ cleanup_desc(DESC *d)
     mush_free(d->http_request, "http_request");
   }
 
+#ifdef HAVE_LIBZ
+  mccp_free(d);
+#endif
+  free_websocket_deflate(d);
+
   {
     freeqs(d);
     if (d->ttype && d->ttype != default_ttype)
@@ -2357,6 +2747,8 @@ initializesock(int s, char *addr, char *ip, conn_source source)
   d->checksum[0] = '\0';
   d->ssl = NULL;
   d->ssl_state = 0;
+  d->mccp = NULL;
+  d->ws_deflate = NULL;
   d->source = source;
   d->next = descriptor_list;
   descriptor_list = d;
@@ -2370,12 +2762,16 @@ initializesock(int s, char *addr, char *ip, conn_source source)
     }
   }
   im_insert(descs_by_fd, d->descriptor, d);
+  desc_poll_add(d);
   d->connlog_id = connlog_connection(ip, addr, is_ssl_desc(d));
   d->conn_timer = sq_register_in(1, test_telnet_wrapper, (void *) d, NULL);
   queue_event(SYSEVENT, "SOCKET`CONNECT", "%d,%s", d->descriptor, d->ip);
   return d;
 }
 
+static uint64_t output_writes = 0; /**< Calls made to send output */
+static uint64_t output_bytes = 0;  /**< Bytes of output sent */
+
 static int
 network_send_ssl(DESC *d)
 {
@@ -2455,6 +2851,7 @@ network_send_ssl(DESC *d)
       need_write = 1;
       break; /* Need to retry */
     }
+    output_writes += 1;
     written += cnt;
     if (cnt == cur->nchars) {
       /* Wrote a complete block */
@@ -2471,11 +2868,19 @@ network_send_ssl(DESC *d)
     d->output.tail = NULL;
   d->output_size -= written;
   d->output_chars += written;
+  output_bytes += written;
 
   return written + need_write;
 }
 
 #ifdef HAVE_WRITEV
+/* Most blocks of output to send with one writev() */
+#if defined(IOV_MAX) && IOV_MAX < 64
+#define OUTPUT_IOVECS IOV_MAX
+#else
+#define OUTPUT_IOVECS 64
+#endif
+
 static int
 network_send_writev(DESC *d)
 {
@@ -2483,10 +2888,10 @@ network_send_writev(DESC *d)
 
   while (d->output.head) {
     int cnt, n;
-    struct iovec lines[10];
+    struct iovec lines[OUTPUT_IOVECS];
     struct text_block *cur = d->output.head;
 
-    for (n = 0; cur && n < 10; cur = cur->nxt) {
+    for (n = 0; cur && n < OUTPUT_IOVECS; cur = cur->nxt) {
       lines[n].iov_base = cur->start;
       lines[n].iov_len = cur->nchars;
       n += 1;
@@ -2501,6 +2906,7 @@ network_send_writev(DESC *d)
         return 0;
       }
     }
+    output_writes += 1;
     written += cnt;
     while (cnt > 0) {
       cur = d->output.head;
@@ -2523,17 +2929,136 @@ output_done:
     d->output.tail = NULL;
   d->output_size -= written;
   d->output_chars += written;
+  output_bytes += written;
 
   return written;
 }
 #endif
 
+#ifdef HAVE_LIBZ
+/** Compress queued output into a descriptor's MCCP buffer.
+ * Whole blocks are fed to zlib until the buffer fills up. Once the queue
+ * is empty the stream is flushed, so everything queued so far can be
+ * decompressed by the client as soon as it arrives.
+ * \param d the descriptor.
+ */
+static void
+mccp_deflate(DESC *d)
+{
+  struct mccp *m = d->mccp;
+  z_stream *z = &m->out;
+  struct text_block *cur;
+  struct timeval start, end;
+  int flush, before;
+
+  penn_gettimeofday(&start);
+  z->next_out = (Bytef *) m->zbuf + m->zlen;
+  z->avail_out = MCCP_BUFFER_LEN - m->zlen;
+  while (z->avail_out > 0 && !m->finished) {
+    cur = d->output.head;
+    if (cur) {
+      z->next_in = (Bytef *) cur->start;
+      z->avail_in = cur->nchars;
+      flush = Z_NO_FLUSH;
+    } else if (m->finishing) {
+      z->avail_in = 0;
+      flush = Z_FINISH;
+    } else if (m->unflushed) {
+      z->avail_in = 0;
+      flush = Z_SYNC_FLUSH;
+    } else {
+      break;
+    }
+    before = z->avail_out;
+    if (deflate(z, flush) == Z_STREAM_END)
+      m->finished = 1;
+    mccp_counts.zipped_out += before - z->avail_out;
+    if (cur) {
+      int used = cur->nchars - z->avail_in;
+
+      cur->start += used;
+      cur->nchars -= used;
+      d->output_size -= used;
+      d->output_chars += used;
+      mccp_counts.plain_out += used;
+      m->unflushed = 1;
+      if (!cur->nchars) {
+        d->output.head = cur->nxt;
+        free_text_block(cur);
+      }
+    } else if (z->avail_out > 0) {
+      /* zlib only stops short of a complete flush when out of room */
+      m->unflushed = 0;
+    }
+  }
+  if (!d->output.head)
+    d->output.tail = NULL;
+  m->zlen = MCCP_BUFFER_LEN - z->avail_out;
+  penn_gettimeofday(&end);
+  mccp_counts.usecs_out +=
+    (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec);
+}
+
+/** Send output to a descriptor that's using MCCP2 compression.
+ * \param d the descriptor.
+ * \return number of bytes of compressed output sent, 1 if the socket is
+ * full, or 0 on errors.
+ */
+static int
+mccp_send(DESC *d)
+{
+  struct mccp *m = d->mccp;
+  int written = 0;
+
+  while (1) {
+    if (m->zsent < m->zlen) {
+      int cnt = send(d->descriptor, m->zbuf + m->zsent, m->zlen - m->zsent, 0);
+
+      if (cnt < 0) {
+        if (is_blocking_err(errno))
+          break;
+        shutdownsock(d, "socket error", NOTHING, CONN_NOWRITE);
+        return 0;
+      }
+      output_writes += 1;
+      output_bytes += cnt;
+      written += cnt;
+      m->zsent += cnt;
+      if (m->zsent < m->zlen)
+        break;
+    }
+    m->zsent = m->zlen = 0;
+    if (m->finished) {
+      /* The client has everything up to the end of the stream, so anything
+       * else can go out uncompressed. */
+      deflateEnd(&m->out);
+      m->deflating = m->finishing = m->finished = 0;
+      break;
+    }
+    mccp_deflate(d);
+    if (!m->zlen)
+      break;
+  }
+  return written ? written : 1;
+}
+#endif
+
 static int
 network_send(DESC *d)
 {
   int written = 0;
   struct text_block *cur;
 
+#ifdef HAVE_LIBZ
+  if (d && d->mccp && d->mccp->deflating) {
+    written = mccp_send(d);
+    if (!written || d->mccp->deflating)
+      return written;
+    /* The compressed stream ended; send the rest as plain text */
+    written = 0;
+  }
+#endif
+
   if (!d || !d->output.head)
     return 1;
 
@@ -2555,6 +3080,7 @@ network_send(DESC *d)
         return 0;
       }
     }
+    output_writes += 1;
     written += cnt;
 
     if (cnt == cur->nchars) {
@@ -2573,6 +3099,7 @@ network_send(DESC *d)
     d->output.tail = NULL;
   d->output_size -= written;
   d->output_chars += written;
+  output_bytes += written;
   return written;
 }
 
@@ -2592,6 +3119,51 @@ process_output(DESC *d)
     return network_send(d);
 }
 
+/** Show statistics on queued and sent output, for @stats/tables.
+ * \param player the enactor.
+ */
+void
+output_stats(dbref player)
+{
+  notify_format(player, " %d blocks of queued text, %d free blocks pooled.",
+                text_blocks_used, text_blocks_pooled);
+  notify_format(player,
+                " %" PRIu64 " bytes sent in %" PRIu64
+                " writes, %.1f bytes per write.",
+                output_bytes, output_writes,
+                output_writes ? (double) output_bytes / output_writes : 0.0);
+#ifdef HAVE_LIBZ
+  {
+    DESC *d;
+    int zout = 0, zin = 0;
+
+    DESC_ITER (d) {
+      if (d->mccp) {
+        zout += d->mccp->deflating;
+        zin += d->mccp->inflating;
+      }
+    }
+    notify_format(player,
+                  " MCCP: %d connections compressing output, %d compressing "
+                  "input.",
+                  zout, zin);
+    if (mccp_counts.plain_out)
+      notify_format(player,
+                    " %" PRIu64 " bytes of output compressed to %" PRIu64
+                    " (%.1f%%), %.1f usecs per KB.",
+                    mccp_counts.plain_out, mccp_counts.zipped_out,
+                    100.0 * mccp_counts.zipped_out / mccp_counts.plain_out,
+                    1024.0 * mccp_counts.usecs_out / mccp_counts.plain_out);
+    if (mccp_counts.zipped_in)
+      notify_format(player,
+                    " %" PRIu64 " bytes of input decompressed from %" PRIu64
+                    ".",
+                    mccp_counts.plain_in, mccp_counts.zipped_in);
+  }
+#endif
+  websocket_stats(player);
+}
+
 /** A wrapper around test_telnet(), which is called via the
  * squeue system in timers.c
  * \param data a descriptor, cast as a void pointer
@@ -2992,6 +3564,209 @@ TELNET_HANDLER(telnet_gmcp_sb)
   cJSON_Delete(json);
 }
 
+#ifdef HAVE_LIBZ
+static voidpf
+mccp_zalloc(voidpf opaque __attribute__((__unused__)), uInt items, uInt size)
+{
+  return mush_calloc(items, size, "mccp.zlib");
+}
+
+static void
+mccp_zfree(voidpf opaque __attribute__((__unused__)), voidpf address)
+{
+  mush_free(address, "mccp.zlib");
+}
+
+/** Get a descriptor's MCCP state, making it if needed. */
+static struct mccp *
+mccp_state(DESC *d)
+{
+  if (!d->mccp)
+    d->mccp = mush_calloc(1, sizeof *d->mccp, "mccp");
+  return d->mccp;
+}
+
+/* Start compressing output on IAC DO MCCP2 */
+TELNET_HANDLER(telnet_mccp2)
+{
+  static const char start[5] = {IAC, SB, TN_MCCP2, IAC, SE};
+  struct mccp *m;
+
+  if (*cmd != DO)
+    return;
+  if (d->ssl) {
+    /* SSL output doesn't go through network_send() */
+    static const char wont[3] = {IAC, WONT, TN_MCCP2};
+    queue_newwrite(d, wont, 3);
+    process_output(d);
+    return;
+  }
+  m = mccp_state(d);
+  if (m->deflating)
+    return;
+  m->out.zalloc = mccp_zalloc;
+  m->out.zfree = mccp_zfree;
+  m->out.opaque = NULL;
+  if (deflateInit2(&m->out, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                   MCCP_WINDOW_BITS, MCCP_MEM_LEVEL,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    do_rawlog(LT_ERR, "Unable to start MCCP2 for descriptor %d: %s",
+              d->descriptor, m->out.msg ? m->out.msg : "unknown error");
+    return;
+  }
+  if (!m->zbuf)
+    m->zbuf = mush_malloc(MCCP_BUFFER_LEN, "mccp.buffer");
+  /* The start sequence goes out uncompressed, ahead of anything that's
+   * still queued. */
+  memcpy(m->zbuf, start, sizeof start);
+  m->zlen = sizeof start;
+  m->zsent = 0;
+  m->deflating = 1;
+  m->unflushed = m->finishing = m->finished = 0;
+  do_rawlog_lvl(LT_CONN, MLOG_DEBUG, "Descriptor %d using MCCP2.",
+                d->descriptor);
+  process_output(d);
+}
+
+/* IAC SB MCCP3 IAC SE: everything the client sends after this is
+ * compressed. */
+TELNET_HANDLER(telnet_mccp3_sb)
+{
+  struct mccp *m = mccp_state(d);
+
+  if (m->inflating)
+    return;
+  m->in.zalloc = mccp_zalloc;
+  m->in.zfree = mccp_zfree;
+  m->in.opaque = NULL;
+  m->in.next_in = Z_NULL;
+  m->in.avail_in = 0;
+  if (inflateInit(&m->in) != Z_OK) {
+    do_rawlog(LT_ERR, "Unable to start MCCP3 for descriptor %d: %s",
+              d->descriptor, m->in.msg ? m->in.msg : "unknown error");
+    return;
+  }
+  m->inflating = 1;
+  do_rawlog_lvl(LT_CONN, MLOG_DEBUG, "Descriptor %d using MCCP3.",
+                d->descriptor);
+}
+
+/** Decompress MCCP3 input from a descriptor and process it.
+ * \param d the descriptor.
+ * \param buf the compressed input.
+ * \param len the length of buf.
+ */
+static void
+mccp_inflate(DESC *d, char *buf, int len)
+{
+  z_stream *z = &d->mccp->in;
+  char out[BUFFER_LEN];
+
+  mccp_counts.zipped_in += len;
+  z->next_in = (Bytef *) buf;
+  z->avail_in = len;
+  /* A full out buffer can leave more output inside zlib even after the
+   * last input byte is used, so keep going until it stops short. */
+  do {
+    int r, got;
+
+    z->next_out = (Bytef *) out;
+    z->avail_out = sizeof out;
+    r = inflate(z, Z_SYNC_FLUSH);
+    got = sizeof out - z->avail_out;
+    mccp_counts.plain_in += got;
+    if (r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR) {
+      do_rawlog_lvl(LT_CONN, MLOG_INFO,
+                    "[%d/%s/%s] Invalid MCCP3 data: %s", d->descriptor,
+                    d->addr, d->ip, z->msg ? z->msg : "unknown error");
+      inflateEnd(z);
+      d->mccp->inflating = 0;
+      shutdownsock(d, "compression error", NOTHING, 0);
+      return;
+    }
+    if (got)
+      process_input_helper(d, out, got);
+    if (r == Z_STREAM_END) {
+      /* The client stopped compressing; the rest is plain text. */
+      char *rest = (char *) z->next_in;
+      int left = z->avail_in;
+
+      inflateEnd(z);
+      d->mccp->inflating = 0;
+      mccp_counts.zipped_in -= left;
+      if (left)
+        process_input_helper(d, rest, left);
+      return;
+    }
+    if (!got)
+      break;
+  } while (z->avail_in > 0 || z->avail_out == 0);
+}
+
+/** Stop all MCCP compression for a descriptor that's being closed or
+ * handed over to a new process on reboot.
+ * The end of the compressed stream has to reach the client before anything
+ * else can be sent, so this waits a little while for a full socket to drain.
+ * \param d the descriptor.
+ * \return true if the stream was ended, false if the rest of it couldn't
+ * be sent and the connection is unusable.
+ */
+static bool
+mccp_end(DESC *d)
+{
+  struct mccp *m = d->mccp;
+  int tries;
+  bool ended;
+
+  if (!m)
+    return 1;
+  if (m->inflating) {
+    static const char wont[3] = {IAC, WONT, TN_MCCP3};
+    queue_newwrite(d, wont, 3);
+  }
+  if (m->deflating) {
+    m->finishing = 1;
+    for (tries = 0; tries < MCCP_END_TRIES; tries++) {
+      struct pollfd p;
+
+      if (!mccp_send(d) || !m->deflating)
+        break;
+      p.fd = d->descriptor;
+      p.events = POLLOUT;
+      p.revents = 0;
+#ifdef WIN32
+      WSAPoll(&p, 1, MCCP_END_WAIT);
+#else
+      poll(&p, 1, MCCP_END_WAIT);
+#endif
+    }
+  }
+  ended = !m->deflating;
+  mccp_free(d);
+  return ended;
+}
+
+/** Free a descriptor's MCCP state.
+ * \param d the descriptor.
+ */
+static void
+mccp_free(DESC *d)
+{
+  struct mccp *m = d->mccp;
+
+  if (!m)
+    return;
+  if (m->deflating)
+    deflateEnd(&m->out);
+  if (m->inflating)
+    inflateEnd(&m->in);
+  if (m->zbuf)
+    mush_free(m->zbuf, "mccp.buffer");
+  mush_free(m, "mccp");
+  d->mccp = NULL;
+}
+#endif /* HAVE_LIBZ */
+
 /** Escape a string so it can be sent as a telnet SB (IAC -> IAC IAC). Returns
  * a STATIC buffer. */
 char *
@@ -3265,6 +4040,22 @@ init_telnet_opts(void)
   telopt->sb = telnet_gmcp_sb;
   telnet_options[i] = telopt;
 
+#ifdef HAVE_LIBZ
+  telopt = mush_malloc(sizeof(struct telnet_opt), "telopt");
+  telopt->optcode = i = TN_MCCP2;
+  telopt->offer = WILL;
+  telopt->handler = telnet_mccp2;
+  telopt->sb = NULL;
+  telnet_options[i] = telopt;
+
+  telopt = mush_malloc(sizeof(struct telnet_opt), "telopt");
+  telopt->optcode = i = TN_MCCP3;
+  telopt->offer = WILL;
+  telopt->handler = NULL;
+  telopt->sb = telnet_mccp3_sb;
+  telnet_options[i] = telopt;
+#endif
+
   /* Store the telnet options we negotiate for new connections,
    * to avoid looking them up every time someone connects */
   len = 0;
@@ -3327,6 +4118,14 @@ handle_telnet(DESC *d, char **q, char *qend)
   case WONT:
     setup_telnet(d);
     (*q)++; /* Skip DONT/WONT */
+#ifdef HAVE_LIBZ
+    if (*q < qend && **q == TN_MCCP2 &&
+        (unsigned char) *(*q - 1) == DONT && d->mccp && d->mccp->deflating) {
+      /* End the compressed stream after what's already queued */
+      d->mccp->finishing = 1;
+      process_output(d);
+    }
+#endif
     return 1;
   case DO:
   case WILL:
@@ -3393,6 +4192,11 @@ process_input_helper(DESC *d, char *tbuf1, int got)
 {
   char *p, *pend, *q, *qend;
   int is_first;
+  char wsbuf[BUFFER_LEN * 2];
+#ifdef HAVE_LIBZ
+  char *zipped = NULL;
+  bool inflating = d->mccp && d->mccp->inflating;
+#endif
 
   is_first = d->conn_flags & CONN_AWAITING_FIRST_DATA;
 
@@ -3403,8 +4207,14 @@ process_input_helper(DESC *d, char *tbuf1, int got)
   }
 
   if ((d->conn_flags & CONN_WEBSOCKETS)) {
-    /* Process using WebSockets framing. */
-    got = process_websocket_frame(d, tbuf1, got);
+    /* Process using WebSockets framing. Decompressed messages can be
+     * longer than what was read, so they go into a separate buffer. */
+    if (d->conn_flags & CONN_WS_DEFLATE) {
+      got = process_websocket_frame(d, tbuf1, got, wsbuf, sizeof wsbuf);
+      tbuf1 = wsbuf;
+    } else {
+      got = process_websocket_frame(d, tbuf1, got, tbuf1, got);
+    }
   }
 
   if (!d->raw_input) {
@@ -3456,6 +4266,13 @@ process_input_helper(DESC *d, char *tbuf1, int got)
         if (p < pend)
           *p++ = *q;
       }
+#ifdef HAVE_LIBZ
+      else if (!inflating && d->mccp && d->mccp->inflating) {
+        /* MCCP3 started; the rest of the buffer is compressed. */
+        zipped = q + 1;
+        break;
+      }
+#endif
     } else if (p < pend) {
       *p++ = *q;
     }
@@ -3469,6 +4286,11 @@ process_input_helper(DESC *d, char *tbuf1, int got)
   }
 
   d->conn_flags &= ~CONN_AWAITING_FIRST_DATA;
+
+#ifdef HAVE_LIBZ
+  if (zipped && zipped < qend)
+    mccp_inflate(d, zipped, qend - zipped);
+#endif
 }
 
 /* ARGSUSED */
@@ -3492,6 +4314,7 @@ process_input(DESC *d, int output_ready __attribute__((__unused__)))
         return 0;
       } else if (ssl_need_handshake(d->ssl_state)) {
         /* We're still not ready to send to this connection. Alas. */
+        DESC_POLL_DRAINED(d);
         return 1;
       }
     }
@@ -3506,6 +4329,7 @@ process_input(DESC *d, int output_ready __attribute__((__unused__)))
         return 0;
       } else if (ssl_need_accept(d->ssl_state)) {
         /* We're still not ready to send to this connection. Alas. */
+        DESC_POLL_DRAINED(d);
         return 1;
       }
     }
@@ -3519,6 +4343,8 @@ process_input(DESC *d, int output_ready __attribute__((__unused__)))
       d->ssl_state = 0;
       return 0;
     }
+    if (got <= 0)
+      DESC_POLL_DRAINED(d);
   } else {
     got = recv(d->descriptor, tbuf1, sizeof tbuf1, 0);
     if (got <= 0) {
@@ -3526,14 +4352,25 @@ process_input(DESC *d, int output_ready __attribute__((__unused__)))
        * the socket, but we shouldn't assume that read() will actually get it
        * and blindly act like a got of -1 is a disconnect-worthy error.
        */
-      if (is_blocking_err(errno))
+      if (is_blocking_err(errno)) {
+        DESC_POLL_DRAINED(d);
         return 1;
-      else {
+      } else {
         shutdownsock(d, "socket error", NOTHING, CONN_NOWRITE);
         return 0;
       }
     }
+    /* A short read means the socket buffer is empty. */
+    if (got < (int) sizeof tbuf1)
+      DESC_POLL_DRAINED(d);
+  }
+
+#ifdef HAVE_LIBZ
+  if (d->mccp && d->mccp->inflating) {
+    mccp_inflate(d, tbuf1, got);
+    return 1;
   }
+#endif
 
   process_input_helper(d, tbuf1, got);
 
@@ -4669,6 +5506,15 @@ close_sockets(void)
 
   for (d = descriptor_list; d; d = dnext) {
     dnext = d->next;
+#ifdef HAVE_LIBZ
+    /* Finish any compressed stream so the message below is readable */
+    if (!mccp_end(d)) {
+      closesocket(d->descriptor);
+      continue;
+    }
+#endif
+    /* Send anything still queued before the shutdown message */
+    process_output(d);
     if (!d->ssl) {
 #ifdef HAVE_WRITEV
       struct iovec byebye[2];
@@ -5904,6 +6750,7 @@ announce_connect(DESC *d, int isnew, int num)
   dbref player = d->player;
 
   set_flag_internal(player, "CONNECTED");
+  add_connected_player(player);
 
   if (isnew) {
     /* A brand new player created. */
@@ -6147,6 +6994,7 @@ announce_disconnect(DESC *saved, const char *reason, dbref executor)
 
   if (!numleft) {
     clear_flag_internal(player, "CONNECTED");
+    delete_connected_player(player);
     (void) atr_add(player, "LASTLOGOUT", show_time(mudtime, 0), GOD, 0);
   }
 
@@ -6363,35 +7211,10 @@ do_poll(dbref player, const char *message, int clear)
 dbref
 short_page(const char *match)
 {
-  DESC *d;
-  dbref who1 = NOTHING;
-  int count = 0;
-
   if (!(match && *match))
     return NOTHING;
 
-  for (d = descriptor_list; d; d = d->next) {
-    if (d->connected) {
-      if (!string_prefix(Name(d->player), match))
-        continue;
-      if (!strcasecmp(Name(d->player), match)) {
-        count = 1;
-        who1 = d->player;
-        break;
-      }
-      if (who1 == NOTHING || d->player != who1) {
-        who1 = d->player;
-        count++;
-      }
-    }
-  }
-
-  if (count > 1)
-    return AMBIGUOUS;
-  else if (count == 0)
-    return NOTHING;
-
-  return who1;
+  return match_connected_player(match);
 }
 
 /** Match the partial name of a connected player the enactor can see.
@@ -7392,6 +8215,15 @@ dump_reboot_db(void)
 #endif
     putref(f, maxd);
     DESC_ITER (d) {
+#ifdef HAVE_LIBZ
+      /* The new process starts with plain telnet streams. A client that
+       * can't be given the end of its compressed stream would only get
+       * garbage from here on, so it's dropped instead of handed over. */
+      if (!mccp_end(d)) {
+        closesocket(d->descriptor);
+        continue;
+      }
+#endif
       putref(f, d->descriptor);
       putref(f, d->connected_at);
       putref(f, d->hide);
@@ -7525,6 +8357,8 @@ load_reboot_db(void)
         d->height = 24;
       }
       d->ttype = NULL;
+      d->mccp = NULL;
+      d->ws_deflate = NULL;
       if (flags & RDBF_TTYPE) {
         temp = getstring_noalloc(f);
         if (!strcmp(temp, REBOOT_DB_NOVALUE) || !strcmp(temp, default_ttype))
@@ -7562,6 +8396,8 @@ load_reboot_db(void)
       d->ssl_state = 0;
       d->next = NULL;
 
+      d->poll_state = 0;
+
       if (d->conn_flags & CONN_CLOSE_READY) {
         d->close_reason = "ssl shutdown";
         d->next = closed;
@@ -7575,9 +8411,12 @@ load_reboot_db(void)
         }
       }
       im_insert(descs_by_fd, d->descriptor, d);
-      if (d->connected && GoodObject(d->player) && IsPlayer(d->player))
+      if (!(d->conn_flags & CONN_CLOSE_READY))
+        desc_poll_add(d);
+      if (d->connected && GoodObject(d->player) && IsPlayer(d->player)) {
         set_flag_internal(d->player, "CONNECTED");
-      else if ((!d->player || !GoodObject(d->player)) && d->connected) {
+        add_connected_player(d->player);
+      } else if ((!d->player || !GoodObject(d->player)) && d->connected) {
         d->connected = CONN_SCREEN;
         d->player = NOTHING;
       }
@@ -7697,6 +8536,7 @@ do_reboot(dbref player, int flag)
 #endif /* __CYGWIN__ */
 #endif /* WIN32 */
 #endif /* PROFILING */
+  profile_stop();
   dump_reboot_db();
 #ifdef INFO_SLAVE
   kill_info_slave();
@@ -125,6 +125,8 @@
  * fragmented)
  * Regions:          147 total,       16 cached
  * Paging:        158686 out,     158554 in
+ * Swap-in:         1204 buffered,       31 waited,     157319 read
+ * Latency:     101833 <10us  51992 <100us   4637 <1ms     91 <10ms      1 more
  * Storage:      9628500 total (86% saturation)
  *
  * Period:             1 (   5791834 accesses so far,       1085 chunks at max)
@@ -156,6 +158,15 @@
  * number of times a region has been moved out of or into memory
  * cache.
  *
+ * Where threads are available, page-outs are handed to a background
+ * I/O thread instead of blocking the game, and the hottest paged-out
+ * regions (by dereference count) are read ahead into spare buffers.
+ * The Swap-in line breaks page-ins down by whether the region was
+ * still sitting in one of those buffers, had to be waited for while
+ * the I/O thread finished with it, or was read by the game itself;
+ * the Latency line is a histogram of how long each page-in stalled
+ * the game.
+ *
  * Finally comes statistics on migration and the migration period.
  * The period number is listed, along with the total number of
  * dereferences in the period and how many chunks have the maximum
@@ -235,19 +246,30 @@
 #include <unistd.h>
 #endif
 #include <errno.h>
+#include <signal.h>
 #ifdef HAVE_SYS_STAT_H
 #include <sys/stat.h>
 #endif
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
+#include "attrib.h"
 #include "command.h"
 #include "conf.h"
 #include "dbdefs.h"
 #include "externs.h"
+#include "hash_function.h"
+#include "htab.h"
 #include "intrface.h"
 #include "log.h"
 #include "mymalloc.h"
 #include "notify.h"
 #include "strutil.h"
+#include "tests.h"
 
 #ifdef WIN32
 #pragma warning(disable : 4761) /* disable warning re conversion */
@@ -302,6 +324,12 @@ acm_chunk_fetch(chunk_reference_t reference, char *buffer, uint16_t buffer_len)
   return len;
 }
 
+static uint16_t
+acm_chunk_peek(chunk_reference_t reference, char *buffer, uint16_t buffer_len)
+{
+  return acm_chunk_fetch(reference, buffer, buffer_len);
+}
+
 static uint16_t
 acm_chunk_len(chunk_reference_t reference)
 {
@@ -390,6 +418,15 @@ acm_chunk_fork_done(void)
 /** Log all mallocs. */
 #undef DEBUG_CHUNK_MALLOC
 
+/** Hand swap file reads and writes to a background thread.
+ * This needs positional I/O, so the game and the I/O thread can share
+ * the swap file descriptor, and pthread_atfork(), so a forked child
+ * knows it has no I/O thread. */
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_PTHREAD_ATFORK) &&                 \
+  defined(HAVE_PREAD) && defined(HAVE_PWRITE) && !defined(WIN32)
+#define CHUNK_ASYNC_IO
+#endif
+
 /** For debugging, we keep a rolling log of debug messages.
  * These get dumped to disk if we're about to panic.
  */
@@ -809,6 +846,56 @@ static int stat_migrate_move;  /**< Number of move migrations */
 static int stat_migrate_away;  /**< Number of chunk evictions */
 static int stat_create;        /**< Number of chunk creations */
 static int stat_delete;        /**< Number of chunk deletions */
+static int stat_read_buffered; /**< Page-ins copied from a swap buffer */
+static int stat_read_waited;   /**< Page-ins that waited on the I/O thread */
+static int stat_read_direct;   /**< Page-ins read by the game itself */
+/** Number of swap-in latency buckets, each ten times wider than the last */
+#define SWAPIN_LATENCY_BUCKETS 5
+/** histogram of how long page-ins stalled the game */
+static int stat_swapin_latency[SWAPIN_LATENCY_BUCKETS];
+
+#ifdef CHUNK_ASYNC_IO
+/*
+ * Background swap I/O.
+ *
+ * The I/O thread only ever moves whole regions between the swap file
+ * and the job buffers below; every other piece of allocator state is
+ * touched by the main thread alone.  Each job describes one region,
+ * and a region has at most one live job, which only exists while the
+ * region is paged out.
+ */
+/** Number of swap jobs (and spare region buffers) */
+#define SWAP_JOBS 8
+/** How many of the jobs may be read-aheads */
+#define SWAP_READ_AHEAD_MAX (SWAP_JOBS / 2)
+
+/** Life cycle of a swap job */
+enum swap_job_state {
+  SWAP_JOB_FREE,   /**< Unused */
+  SWAP_JOB_QUEUED, /**< Waiting for the I/O thread */
+  SWAP_JOB_BUSY,   /**< Being read or written by the I/O thread */
+  SWAP_JOB_DONE    /**< Finished; buffer holds the region */
+};
+
+/** A region transfer handled by the I/O thread. */
+struct swap_job {
+  enum swap_job_state state; /**< Where the job is in its life */
+  bool write;                /**< Page-out rather than read-ahead */
+  uint16_t region;           /**< Region being transferred */
+  int error;                 /**< errno of a failed transfer, or 0 */
+  uint32_t seq;              /**< Queue order */
+  RegionHeader *buf;         /**< Copy of the region */
+};
+
+static struct swap_job swap_jobs[SWAP_JOBS];
+static uint32_t swap_seq;          /**< Sequence number of the next job */
+static bool swap_thread_running;   /**< Is the I/O thread up? */
+static pthread_t swap_thread;      /**< The I/O thread */
+static pthread_mutex_t swap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t swap_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t swap_done = PTHREAD_COND_INITIALIZER;
+static int stat_write_behind; /**< Page-outs handed to the I/O thread */
+#endif
 
 /*
  * migration globals that are used for holding relevant data...
@@ -1587,6 +1674,427 @@ write_cache_region(fd_type fd, RegionHeader *rhp, uint16_t region)
 #endif
 }
 
+/** Record how long a page-in kept the game waiting.
+ * \param start when the page-in began.
+ */
+static void
+note_swapin_latency(struct timeval *start)
+{
+  struct timeval now;
+  long usec, limit;
+  int bucket;
+
+  penn_gettimeofday(&now);
+  usec = (now.tv_sec - start->tv_sec) * 1000000L +
+         (now.tv_usec - start->tv_usec);
+  for (bucket = 0, limit = 10;
+       bucket < SWAPIN_LATENCY_BUCKETS - 1 && usec >= limit;
+       bucket++, limit *= 10)
+    ;
+  stat_swapin_latency[bucket]++;
+}
+
+#ifdef CHUNK_ASYNC_IO
+/** Move a job's region between the swap file and its buffer.
+ * This runs in the I/O thread, so it reports failure rather than
+ * panicking; the main thread panics when it collects the job.
+ * \param job the job to perform.
+ * \return 0 on success, or an errno value.
+ */
+static int
+swap_job_transfer(struct swap_job *job)
+{
+  off_t file_offset = (off_t) job->region * REGION_SIZE;
+  char *pos = (char *) job->buf;
+  size_t remaining = REGION_SIZE;
+  ssize_t done;
+  int j, err = EIO;
+
+  for (j = 0; j < 10; j++) {
+    if (job->write)
+      done = pwrite(swap_fd, pos, remaining, file_offset);
+    else
+      done = pread(swap_fd, pos, remaining, file_offset);
+    if (done >= 0) {
+      remaining -= done;
+      pos += done;
+      file_offset += done;
+      if (!remaining)
+        return 0;
+    } else
+      err = errno;
+  }
+  return err;
+}
+
+/** Find the oldest queued swap job.
+ * Called with swap_lock held.
+ * \return the job, or NULL if nothing is queued.
+ */
+static struct swap_job *
+next_swap_job(void)
+{
+  struct swap_job *job = NULL;
+  int j;
+
+  for (j = 0; j < SWAP_JOBS; j++) {
+    if (swap_jobs[j].state == SWAP_JOB_QUEUED &&
+        (!job || (int32_t) (swap_jobs[j].seq - job->seq) < 0))
+      job = swap_jobs + j;
+  }
+  return job;
+}
+
+/** The swap I/O thread. */
+static void *
+swap_io_thread(void *arg __attribute__((__unused__)))
+{
+  struct swap_job *job;
+  int err;
+
+  pthread_mutex_lock(&swap_lock);
+  for (;;) {
+    while (!(job = next_swap_job()))
+      pthread_cond_wait(&swap_work, &swap_lock);
+    job->state = SWAP_JOB_BUSY;
+    pthread_mutex_unlock(&swap_lock);
+    err = swap_job_transfer(job);
+    pthread_mutex_lock(&swap_lock);
+    job->error = err;
+    job->state = SWAP_JOB_DONE;
+    pthread_cond_broadcast(&swap_done);
+  }
+  return NULL;
+}
+
+/** Wait for the I/O thread to finish with a job.
+ * Called with swap_lock held.
+ * \param job the job to wait for.
+ */
+static void
+swap_job_wait(struct swap_job *job)
+{
+  while (job->state == SWAP_JOB_QUEUED || job->state == SWAP_JOB_BUSY)
+    pthread_cond_wait(&swap_done, &swap_lock);
+}
+
+/** Free a finished job, panicking if it was a write that failed.
+ * Called with swap_lock held.
+ * \param job the job to free.
+ */
+static void
+swap_job_release(struct swap_job *job)
+{
+  if (job->write && job->error)
+    mush_panicf("chunk swap file write of region %04x, errno %d: %s",
+                job->region, job->error, strerror(job->error));
+  job->state = SWAP_JOB_FREE;
+}
+
+/** Find the live swap job for a region.
+ * Called with swap_lock held.
+ * \param region the region to look for.
+ * \return the job, or NULL if the region has none.
+ */
+static struct swap_job *
+swap_job_for(uint16_t region)
+{
+  int j;
+
+  for (j = 0; j < SWAP_JOBS; j++) {
+    if (swap_jobs[j].state != SWAP_JOB_FREE && swap_jobs[j].region == region)
+      return swap_jobs + j;
+  }
+  return NULL;
+}
+
+/** Get a job slot for a new transfer.
+ * Free slots are used first, then finished write-behinds (the data is
+ * already on disk), and, for writes only, finished read-aheads.
+ * Called with swap_lock held.
+ * \param write true if the slot is wanted for a page-out.
+ * \return the job, or NULL if every slot is in use.
+ */
+static struct swap_job *
+swap_job_claim(bool write)
+{
+  struct swap_job *job = NULL;
+  int j;
+
+  for (j = 0; j < SWAP_JOBS && !job; j++) {
+    if (swap_jobs[j].state == SWAP_JOB_FREE)
+      job = swap_jobs + j;
+  }
+  for (j = 0; j < SWAP_JOBS && !job; j++) {
+    if (swap_jobs[j].state == SWAP_JOB_DONE && swap_jobs[j].write)
+      job = swap_jobs + j;
+  }
+  for (j = 0; j < SWAP_JOBS && !job && write; j++) {
+    if (swap_jobs[j].state == SWAP_JOB_DONE)
+      job = swap_jobs + j;
+  }
+  if (!job)
+    return NULL;
+  if (job->state == SWAP_JOB_DONE)
+    swap_job_release(job);
+  if (!job->buf) {
+    job->buf = mush_malloc(REGION_SIZE, "chunk swap buffer");
+    if (!job->buf)
+      mush_panic("chunk swap buffer allocation failure");
+  }
+  return job;
+}
+
+/** Queue a transfer for the I/O thread.
+ * Called with swap_lock held.
+ * \param job the claimed job.
+ * \param region the region to transfer.
+ * \param write true for a page-out, false for a read-ahead.
+ */
+static void
+swap_job_queue(struct swap_job *job, uint16_t region, bool write)
+{
+  job->write = write;
+  job->region = region;
+  job->error = 0;
+  job->seq = swap_seq++;
+  job->state = SWAP_JOB_QUEUED;
+  pthread_cond_signal(&swap_work);
+}
+
+/** Put one buffer in another's place in the cache list.
+ * Swap jobs trade buffers with the cache rather than copying regions.
+ * \param old the buffer leaving the cache.
+ * \param rhp the buffer taking its place.
+ */
+static void
+replace_cache_region(RegionHeader *old, RegionHeader *rhp)
+{
+  rhp->prev = old->prev;
+  rhp->next = old->next;
+  if (rhp->prev)
+    rhp->prev->next = rhp;
+  if (rhp->next)
+    rhp->next->prev = rhp;
+  if (cache_head == old)
+    cache_head = rhp;
+  if (cache_tail == old)
+    cache_tail = rhp;
+}
+
+/** Hand a region being paged out to the I/O thread.
+ * The job takes the cache buffer itself, and its spare buffer goes
+ * into the cache in exchange.
+ * \param rhp the cache buffer holding the region.
+ * \return the buffer now standing in for rhp, or NULL if no job was
+ * free and the caller must write the region itself.
+ */
+static RegionHeader *
+swap_write_behind(RegionHeader *rhp)
+{
+  struct swap_job *job;
+  RegionHeader *spare = NULL;
+
+  if (!swap_thread_running)
+    return NULL;
+  pthread_mutex_lock(&swap_lock);
+  job = swap_job_claim(true);
+  if (job) {
+    spare = job->buf;
+    job->buf = rhp;
+    replace_cache_region(rhp, spare);
+    swap_job_queue(job, rhp->region_id, true);
+    stat_write_behind++;
+  }
+  pthread_mutex_unlock(&swap_lock);
+  return spare;
+}
+
+/** Take a region from its swap job, if it has one.
+ * The job's buffer goes into the cache in place of rhp, which becomes
+ * the job's spare.  A read-ahead that hasn't started yet is dropped,
+ * since reading the region directly is no slower than waiting for it.
+ * \param region the region being paged in.
+ * \param rhp the cache buffer meant to receive the region.
+ * \return the buffer holding the region, or NULL if the caller must
+ * read it into rhp itself.
+ */
+static RegionHeader *
+swap_job_take(uint16_t region, RegionHeader *rhp)
+{
+  struct swap_job *job;
+  RegionHeader *filled = NULL;
+
+  pthread_mutex_lock(&swap_lock);
+  job = swap_job_for(region);
+  if (job && !job->write && job->state == SWAP_JOB_QUEUED) {
+    job->state = SWAP_JOB_FREE;
+    job = NULL;
+  }
+  if (job) {
+    if (job->state == SWAP_JOB_BUSY) {
+      stat_read_waited++;
+      swap_job_wait(job);
+    } else
+      stat_read_buffered++;
+    if (!job->write && job->error) {
+      /* Let the direct read report the problem. */
+      stat_read_buffered--;
+      job->state = SWAP_JOB_FREE;
+    } else {
+      /* A write-behind still queued is simply cancelled; the region
+       * is about to be in memory again. */
+      filled = job->buf;
+      job->buf = rhp;
+      replace_cache_region(rhp, filled);
+      job->state = SWAP_JOB_DONE;
+      swap_job_release(job);
+    }
+  }
+  pthread_mutex_unlock(&swap_lock);
+  return filled;
+}
+
+/** Drop any swap job for a region whose contents are being discarded.
+ * \param region the region being recycled.
+ */
+static void
+swap_job_forget(uint16_t region)
+{
+  struct swap_job *job;
+
+  pthread_mutex_lock(&swap_lock);
+  job = swap_job_for(region);
+  if (job) {
+    if (job->state == SWAP_JOB_QUEUED)
+      job->state = SWAP_JOB_FREE;
+    else {
+      swap_job_wait(job);
+      swap_job_release(job);
+    }
+  }
+  pthread_mutex_unlock(&swap_lock);
+}
+
+/** Wait for the I/O thread to go idle.
+ * Called with swap_lock held.
+ */
+static void
+swap_jobs_wait_all(void)
+{
+  int j;
+
+  for (j = 0; j < SWAP_JOBS; j++)
+    swap_job_wait(swap_jobs + j);
+}
+
+/** Make sure every write-behind has reached the swap file. */
+static void
+swap_jobs_drain(void)
+{
+  pthread_mutex_lock(&swap_lock);
+  swap_jobs_wait_all();
+  pthread_mutex_unlock(&swap_lock);
+}
+
+/** Queue read-aheads of the hottest paged-out regions.
+ * Regions are ranked by their dereference counts, so the ones most
+ * likely to be wanted again are waiting in a buffer when they are.
+ */
+static void
+swap_read_ahead(void)
+{
+  uint16_t best[SWAP_READ_AHEAD_MAX];
+  uint8_t best_derefs[SWAP_READ_AHEAD_MAX];
+  struct swap_job *job;
+  uint16_t region;
+  uint8_t derefs;
+  int j, want, nbest = 0;
+
+  if (!swap_thread_running)
+    return;
+
+  pthread_mutex_lock(&swap_lock);
+  want = SWAP_READ_AHEAD_MAX;
+  for (j = 0; j < SWAP_JOBS; j++) {
+    if (swap_jobs[j].state != SWAP_JOB_FREE && !swap_jobs[j].write)
+      want--;
+  }
+  for (region = 0; want > 0 && region < region_count; region++) {
+    if (regions[region].in_memory || !regions[region].used_count)
+      continue;
+    derefs = RegionDerefs(region);
+    if (!derefs || (nbest == want && derefs <= best_derefs[nbest - 1]))
+      continue;
+    if (swap_job_for(region))
+      continue;
+    /* Insertion sort into the short list, hottest first */
+    if (nbest < want)
+      nbest++;
+    for (j = nbest - 1; j > 0 && best_derefs[j - 1] < derefs; j--) {
+      best[j] = best[j - 1];
+      best_derefs[j] = best_derefs[j - 1];
+    }
+    best[j] = region;
+    best_derefs[j] = derefs;
+  }
+  for (j = 0; j < nbest; j++) {
+    job = swap_job_claim(false);
+    if (!job)
+      break;
+    swap_job_queue(job, best[j], false);
+  }
+  pthread_mutex_unlock(&swap_lock);
+}
+
+/** Quiesce the I/O thread before a fork.
+ * The lock is held across the fork, so the child's copy of the job
+ * table is consistent. */
+static void
+swap_prefork(void)
+{
+  pthread_mutex_lock(&swap_lock);
+  swap_jobs_wait_all();
+}
+
+/** Resume swap I/O in the parent after a fork. */
+static void
+swap_postfork_parent(void)
+{
+  pthread_mutex_unlock(&swap_lock);
+}
+
+/** The child of a fork has no I/O thread; do all swapping directly. */
+static void
+swap_postfork_child(void)
+{
+  swap_thread_running = false;
+  pthread_mutex_unlock(&swap_lock);
+}
+
+/** Start the swap I/O thread. */
+static void
+swap_thread_start(void)
+{
+  sigset_t all, old;
+  int err;
+
+  /* Signals belong to the main thread. */
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  err = pthread_create(&swap_thread, NULL, swap_io_thread, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (err) {
+    do_rawlog(LT_ERR, "CHUNK: Unable to start swap I/O thread: %s",
+              strerror(err));
+    return;
+  }
+  pthread_detach(swap_thread);
+  pthread_atfork(swap_prefork, swap_postfork_parent, swap_postfork_child);
+  swap_thread_running = true;
+}
+#endif /* CHUNK_ASYNC_IO */
+
 /** Update cache position to stave off recycling.
  * \param rhp the cached region to keep around.
  */
@@ -1621,6 +2129,10 @@ static RegionHeader *
 find_available_cache_region(void)
 {
   RegionHeader *rhp;
+  uint16_t region;
+#ifdef CHUNK_ASYNC_IO
+  RegionHeader *spare;
+#endif
 
   debug_log("find_available_cache_region");
 
@@ -1644,19 +2156,25 @@ find_available_cache_region(void)
     return cache_tail;
 
   rhp = cache_tail;
+  region = rhp->region_id;
   /* page the current occupant out */
-  find_oddballs(rhp->region_id);
+  find_oddballs(region);
 #ifdef DEBUG_CHUNK_PAGING
-  do_rawlog(LT_TRACE, "CHUNK: Paging out region %04x (offset %08x)",
-            rhp->region_id, (unsigned) file_offset);
+  do_rawlog(LT_TRACE, "CHUNK: Paging out region %04x (offset %08x)", region,
+            (unsigned) file_offset);
 #endif
-  write_cache_region(swap_fd, rhp, rhp->region_id);
+#ifdef CHUNK_ASYNC_IO
+  if ((spare = swap_write_behind(rhp)))
+    rhp = spare;
+  else
+#endif
+    write_cache_region(swap_fd, rhp, region);
   /* keep statistics */
-  stat_paging_histogram[RegionDerefs(rhp->region_id)]++;
+  stat_paging_histogram[RegionDerefs(region)]++;
   stat_page_out++;
 
   /* mark the paged out region as not in memory */
-  regions[rhp->region_id].in_memory = NULL;
+  regions[region].in_memory = NULL;
   /* mark it not in use for sanity check reasons */
   rhp->region_id = INVALID_REGION_ID;
 
@@ -1674,12 +2192,15 @@ bring_in_region(uint16_t region)
   RegionHeader *rhp, *prev, *next;
   uint32_t offset;
   unsigned int shift;
+  struct timeval start;
+  RegionHeader *filled = NULL;
 
   debug_log("bring_in_region %04x", region);
 
   ASSERT(region < region_count);
   if (rp->in_memory)
     return;
+  penn_gettimeofday(&start);
   rhp = find_available_cache_region();
   ASSERT(rhp->region_id == INVALID_REGION_ID);
 
@@ -1692,7 +2213,18 @@ bring_in_region(uint16_t region)
   do_rawlog(LT_TRACE, "CHUNK: Paging in region %04x (offset %08x)", region,
             (unsigned) file_offset);
 #endif
-  read_cache_region(swap_fd, rhp, region);
+#ifdef CHUNK_ASYNC_IO
+  filled = swap_job_take(region, rhp);
+#endif
+  if (filled) {
+    rhp = filled;
+    prev = rhp->prev;
+    next = rhp->next;
+  } else {
+    read_cache_region(swap_fd, rhp, region);
+    stat_read_direct++;
+  }
+  note_swapin_latency(&start);
   /* link the region to its cache entry */
   rp->in_memory = rhp;
 
@@ -1765,8 +2297,12 @@ create_region(void)
   regions[region].largest_free_chunk = regions[region].free_bytes;
   regions[region].total_derefs = 0;
   regions[region].period_last_touched = curr_period;
-  if (!regions[region].in_memory)
+  if (!regions[region].in_memory) {
+#ifdef CHUNK_ASYNC_IO
+    swap_job_forget(region);
+#endif
     regions[region].in_memory = find_available_cache_region();
+  }
   regions[region].in_memory->region_id = region;
   regions[region].in_memory->first_free = FIRST_CHUNK_OFFSET_IN_REGION;
   write_free_chunk(region, FIRST_CHUNK_OFFSET_IN_REGION,
@@ -2023,6 +2559,17 @@ chunk_statistics(dbref player)
   STAT_OUT(player, "Regions:   %10d total, %8d cached", (int) region_count,
            (int) cached_region_count);
   STAT_OUT(player, "Paging:    %10d out, %10d in", stat_page_out, stat_page_in);
+  STAT_OUT(player, "Swap-in:   %10d buffered, %8d waited, %10d read",
+           stat_read_buffered, stat_read_waited, stat_read_direct);
+  STAT_OUT(player,
+           "Latency:   %8d <10us %6d <100us %6d <1ms %6d <10ms %6d more",
+           stat_swapin_latency[0], stat_swapin_latency[1],
+           stat_swapin_latency[2], stat_swapin_latency[3],
+           stat_swapin_latency[4]);
+#ifdef CHUNK_ASYNC_IO
+  if (swap_thread_running)
+    STAT_OUT(player, "Swap-out:  %10d written behind", stat_write_behind);
+#endif
   STAT_OUT(player, " ");
   STAT_OUT(player, "Period:    %10d (%10d accesses so far, %10d chunks at max)",
            (int) curr_period, stat_deref_count, stat_deref_maxxed);
@@ -2417,6 +2964,24 @@ acc_chunk_fetch(chunk_reference_t reference, char *buffer, uint16_t buffer_len)
   return len;
 }
 
+static uint16_t
+acc_chunk_peek(chunk_reference_t reference, char *buffer, uint16_t buffer_len)
+{
+  uint16_t region, offset, len;
+  region = ChunkReferenceToRegion(reference);
+  offset = ChunkReferenceToOffset(reference);
+  ASSERT(region < region_count);
+  bring_in_region(region);
+#ifdef CHUNK_PARANOID
+  verify_used_chunk(region, offset);
+#endif
+  len = ChunkLen(region, offset);
+  if (len <= buffer_len)
+    memcpy(buffer, ChunkDataPtr(region, offset), len);
+  touch_cache_region(regions[region].in_memory);
+  return len;
+}
+
 static uint16_t
 acc_chunk_len(chunk_reference_t reference)
 {
@@ -2493,6 +3058,10 @@ acc_chunk_migration(int count, chunk_reference_t **references)
   m_references = NULL;
   m_count = 0;
 
+#ifdef CHUNK_ASYNC_IO
+  swap_read_ahead();
+#endif
+
   debug_log("*** chunk_migration ends", count);
 }
 
@@ -2545,6 +3114,11 @@ acc_chunk_init(void)
   if (!regions)
     mush_panic("cannot malloc space for chunk region list");
 
+#ifdef CHUNK_ASYNC_IO
+  if (options.chunk_async_io)
+    swap_thread_start();
+#endif
+
   /*
     command_add("@DEBUGCHUNK", CMD_T_ANY | CMD_T_GOD, 0, 0, 0,
                 switchmask("ALL BRIEF FULL"), cmd_debugchunk);
@@ -2671,6 +3245,9 @@ acc_chunk_fork_file(void)
   rhp = find_available_cache_region();
   prev = rhp->prev;
   next = rhp->next;
+#ifdef CHUNK_ASYNC_IO
+  swap_jobs_drain();
+#endif
   for (j = 0; j < region_count; j++) {
     if (regions[j].in_memory)
       continue;
@@ -2759,6 +3336,7 @@ struct ac_funcs {
   chunk_reference_t (*chunk_create)(char const *, uint16_t, uint8_t);
   void (*chunk_delete)(chunk_reference_t);
   uint16_t (*fetch)(chunk_reference_t, char *, uint16_t);
+  uint16_t (*peek)(chunk_reference_t, char *, uint16_t);
   uint16_t (*len)(chunk_reference_t);
   uint8_t (*derefs)(chunk_reference_t);
   void (*migration)(int, chunk_reference_t **);
@@ -2773,20 +3351,185 @@ struct ac_funcs {
 };
 
 static struct ac_funcs malloc_interface = {
-  acm_chunk_create,      acm_chunk_delete,    acm_chunk_fetch,
-  acm_chunk_len,         acm_chunk_derefs,    acm_chunk_migration,
-  acm_chunk_num_swapped, acm_chunk_init,      acm_chunk_stats,
-  acm_chunk_new_period,  acm_chunk_fork_file, acm_chunk_fork_parent,
-  acm_chunk_fork_child,  acm_chunk_fork_done};
+  acm_chunk_create,     acm_chunk_delete,      acm_chunk_fetch,
+  acm_chunk_peek,       acm_chunk_len,         acm_chunk_derefs,
+  acm_chunk_migration,  acm_chunk_num_swapped, acm_chunk_init,
+  acm_chunk_stats,      acm_chunk_new_period,  acm_chunk_fork_file,
+  acm_chunk_fork_parent, acm_chunk_fork_child, acm_chunk_fork_done};
 
 static struct ac_funcs chunk_interface = {
-  acc_chunk_create,      acc_chunk_delete,    acc_chunk_fetch,
-  acc_chunk_len,         acc_chunk_derefs,    acc_chunk_migration,
-  acc_chunk_num_swapped, acc_chunk_init,      acc_chunk_stats,
-  acc_chunk_new_period,  acc_chunk_fork_file, acc_chunk_fork_parent,
-  acc_chunk_fork_child,  acc_chunk_fork_done};
+  acc_chunk_create,     acc_chunk_delete,      acc_chunk_fetch,
+  acc_chunk_peek,       acc_chunk_len,         acc_chunk_derefs,
+  acc_chunk_migration,  acc_chunk_num_swapped, acc_chunk_init,
+  acc_chunk_stats,      acc_chunk_new_period,  acc_chunk_fork_file,
+  acc_chunk_fork_parent, acc_chunk_fork_child, acc_chunk_fork_done};
 
 static struct ac_funcs *chunker = NULL;
+
+/*
+ * Deduplication
+ */
+/* When chunk_dedup is on, every chunk created is indexed by a hash of
+ * its contents in dedup_by_hash, and creating another chunk with the
+ * same contents hands back the existing reference instead. Each indexed
+ * chunk's entry counts its holders and remembers its hash, so
+ * chunk_delete() only frees the chunk when the last holder lets go, and
+ * can drop it from the index without reading it back.
+ *
+ * Migration can only update the one holder of a reference it's given,
+ * and holders can't be tracked down (attribute lists get reallocated),
+ * so shared chunks are left where they are until they're back down to
+ * one holder.
+ */
+
+/** A chunk in the dedup index. */
+struct dedup_chunk {
+  chunk_reference_t ref; /**< The chunk */
+  uint32_t hash;         /**< Hash of its contents */
+  uint32_t holders;      /**< Number of holders */
+  uint16_t len;          /**< Length of the chunk */
+};
+
+static IHASHTAB dedup_by_hash; /**< struct dedup_chunks, by content hash */
+static IHASHTAB dedup_by_ref;  /**< The same, by reference */
+static uint32_t share_count = 0; /**< Chunks with more than one holder */
+static uint64_t dedup_extra = 0; /**< Holders beyond the first, in all */
+static uint64_t dedup_saved = 0; /**< Bytes not stored because of sharing */
+static char dedup_buff[UINT16_MAX]; /**< For reading chunks back */
+
+static uint32_t
+dedup_content_hash(char const *data, uint16_t len)
+{
+  return city_hash(data, len, 0);
+}
+
+/** Look for an indexed chunk with the given contents.
+ * \param data the contents.
+ * \param len the length of the contents.
+ * \param hash dedup_content_hash(data, len).
+ * \return the chunk's entry, or NULL if there isn't one.
+ */
+static struct dedup_chunk *
+dedup_find(char const *data, uint16_t len, uint32_t hash)
+{
+  struct dedup_chunk *dc;
+  uint32_t pos = 0;
+
+  while ((dc = ihash_match(&dedup_by_hash, hash, &pos))) {
+    if (dc->len == len &&
+        chunker->peek(dc->ref, dedup_buff, sizeof dedup_buff) == len &&
+        memcmp(dedup_buff, data, len) == 0) {
+      break;
+    }
+  }
+  return dc;
+}
+
+/** Index a newly created chunk.
+ * \param ref the chunk.
+ * \param hash the hash of its contents.
+ * \param len its length.
+ */
+static void
+dedup_add(chunk_reference_t ref, uint32_t hash, uint16_t len)
+{
+  struct dedup_chunk *dc = mush_malloc(sizeof *dc, "chunk.dedup");
+
+  dc->ref = ref;
+  dc->hash = hash;
+  dc->holders = 1;
+  dc->len = len;
+  ihash_add(&dedup_by_hash, hash, dc);
+  ihash_add(&dedup_by_ref, ref, dc);
+}
+
+/** Update the index after migration moves a chunk.
+ * \param from where the chunk was.
+ * \param to where it is now.
+ */
+static void
+dedup_moved(chunk_reference_t from, chunk_reference_t to)
+{
+  struct dedup_chunk *dc = ihash_find(&dedup_by_ref, from);
+
+  if (dc) {
+    ihash_delete(&dedup_by_ref, from, dc);
+    dc->ref = to;
+    ihash_add(&dedup_by_ref, to, dc);
+  }
+}
+
+/** Record that a chunk has been handed out again.
+ * \param dc the chunk's entry.
+ */
+static void
+share_add(struct dedup_chunk *dc)
+{
+  if (dc->holders++ == 1) {
+    share_count += 1;
+  }
+  dedup_extra += 1;
+  dedup_saved += dc->len;
+}
+
+/** Is a chunk held by more than one reference? */
+static bool
+share_held(chunk_reference_t ref)
+{
+  struct dedup_chunk *dc;
+
+  return share_count && (dc = ihash_find(&dedup_by_ref, ref)) &&
+         dc->holders > 1;
+}
+
+/** Let go of one holder of a chunk, and stop indexing it if that was
+ * the last one.
+ * \param ref the chunk.
+ * \retval true the chunk has other holders, and must not be freed.
+ * \retval false this was the only holder.
+ */
+static bool
+share_drop(chunk_reference_t ref)
+{
+  struct dedup_chunk *dc = ihash_find(&dedup_by_ref, ref);
+
+  if (!dc) {
+    return false; /* Created while chunk_dedup was off */
+  }
+  if (dc->holders > 1) {
+    if (--dc->holders == 1) {
+      share_count -= 1;
+    }
+    dedup_extra -= 1;
+    dedup_saved -= dc->len;
+    return true;
+  }
+  ihash_delete(&dedup_by_hash, dc->hash, dc);
+  ihash_delete(&dedup_by_ref, ref, dc);
+  mush_free(dc, "chunk.dedup");
+  return false;
+}
+
+/** Report how much deduplication is saving.
+ * \param player the player to display it to, or NOTHING to log it.
+ */
+static void
+dedup_stats(dbref player)
+{
+  if (!CHUNK_DEDUP && !dedup_by_ref.entries) {
+    return;
+  }
+  STAT_OUT(player,
+           "Dedup:     %10u shared (%10" PRIu64 " extra refs, %10" PRIu64
+           " bytes saved)",
+           (unsigned int) share_count, dedup_extra, dedup_saved);
+  STAT_OUT(player, "             %10u indexed (%10lu bytes of index)",
+           (unsigned int) dedup_by_ref.entries,
+           (unsigned long) (dedup_by_ref.entries * sizeof(struct dedup_chunk) +
+                            ihash_bytes(&dedup_by_hash) +
+                            ihash_bytes(&dedup_by_ref)));
+}
+
 /*
  * Interface routines
  */
@@ -2799,15 +3542,34 @@ static struct ac_funcs *chunker = NULL;
 chunk_reference_t
 chunk_create(char const *data, uint16_t len, uint8_t derefs)
 {
-  return chunker->chunk_create(data, len, derefs);
+  struct dedup_chunk *dc;
+  chunk_reference_t ref;
+  uint32_t hash;
+
+  if (!CHUNK_DEDUP) {
+    return chunker->chunk_create(data, len, derefs);
+  }
+  hash = dedup_content_hash(data, len);
+  if ((dc = dedup_find(data, len, hash))) {
+    share_add(dc);
+    return dc->ref;
+  }
+  ref = chunker->chunk_create(data, len, derefs);
+  dedup_add(ref, hash, len);
+  return ref;
 }
 
 /** Deallocate a chunk of storage.
+ * If the chunk is shared with other references, it's kept for them.
  * \param reference the reference to the chunk to be freed.
  */
 void
 chunk_delete(chunk_reference_t reference)
 {
+  if (share_drop(reference)) {
+    return;
+  }
+  atr_value_forget(reference);
   chunker->chunk_delete(reference);
 }
 
@@ -2861,7 +3623,38 @@ chunk_derefs(chunk_reference_t reference)
 void
 chunk_migration(int count, chunk_reference_t **references)
 {
-  chunker->migration(count, references);
+  chunk_reference_t *old;
+  chunk_reference_t **movable = references;
+  int k, n = count;
+
+  /* Shared chunks stay put; only one of their holders could be told. */
+  if (share_count) {
+    movable = mush_calloc(count ? count : 1, sizeof *movable,
+                          "chunk.migration");
+    for (k = 0, n = 0; k < count; k++) {
+      if (!share_held(*references[k])) {
+        movable[n++] = references[k];
+      }
+    }
+  }
+
+  /* Cached attribute values and the dedup index are keyed by reference,
+   * so update them for the ones that move. */
+  old = mush_calloc(n ? n : 1, sizeof *old, "chunk.migration");
+  for (k = 0; k < n; k++) {
+    old[k] = *movable[k];
+  }
+  chunker->migration(n, movable);
+  for (k = 0; k < n; k++) {
+    if (*movable[k] != old[k]) {
+      atr_value_moved(old[k], *movable[k]);
+      dedup_moved(old[k], *movable[k]);
+    }
+  }
+  mush_free(old, "chunk.migration");
+  if (movable != references) {
+    mush_free(movable, "chunk.migration");
+  }
 }
 
 /** Get the number of paged regions.
@@ -2900,6 +3693,10 @@ void
 chunk_stats(dbref player, enum chunk_stats_type which)
 {
   chunker->stats(player, which);
+  if (which == CSTATS_SUMMARY) {
+    dedup_stats(player);
+    atr_value_cache_stats(player);
+  }
 }
 
 /** Start a new migration period.
@@ -2949,3 +3746,38 @@ chunk_fork_done(void)
 }
 
 #endif /* !WIN32 */
+
+TEST_GROUP(chunk_dedup)
+{
+  int dedup = options.chunk_dedup;
+  uint32_t shared = share_count, indexed = dedup_by_ref.entries;
+  chunk_reference_t a, b, c;
+  chunk_reference_t *refs[2];
+  char buff[16];
+
+  options.chunk_dedup = 1;
+  a = chunk_create("dedup test", 10, 0);
+  b = chunk_create("dedup test", 10, 0);
+  c = chunk_create("dedup tesT", 10, 0);
+  TEST("chunk_dedup.1", a == b && a != c && share_count == shared + 1);
+  refs[0] = &a;
+  refs[1] = &b;
+  chunk_migration(2, refs);
+  TEST("chunk_dedup.2", a == b && share_held(a));
+  chunk_delete(a);
+  TEST("chunk_dedup.3", chunk_fetch(b, buff, sizeof buff) == 10 &&
+                          memcmp(buff, "dedup test", 10) == 0 &&
+                          share_count == shared);
+  chunk_delete(b);
+  a = chunk_create("dedup test", 10, 0);
+  TEST("chunk_dedup.4", !share_held(a));
+  options.chunk_dedup = 0;
+  b = chunk_create("dedup test", 10, 0);
+  TEST("chunk_dedup.5", a != b);
+  chunk_delete(a);
+  chunk_delete(b);
+  chunk_delete(c);
+  TEST("chunk_dedup.6", dedup_by_ref.entries == indexed &&
+                          dedup_by_hash.entries == indexed);
+  options.chunk_dedup = dedup;
+}
@@ -50,6 +50,7 @@
 #include "mymalloc.h"
 #include "mysocket.h"
 #include "parse.h"
+#include "profile.h"
 #include "ssl_slave.h"
 #include "strutil.h"
 #include "version.h"
@@ -1266,6 +1267,12 @@ COMMAND(cmd_pemit)
            queue_entry->pe_info);
 }
 
+COMMAND(cmd_profile)
+{
+  do_profile(executor, arg_left, SW_ISSET(sw, SWITCH_RESET),
+             SW_ISSET(sw, SWITCH_DUMP));
+}
+
 COMMAND(cmd_prompt)
 {
   int flags = SILENT_OR_NOISY(sw, SILENT_PEMIT) | PEMIT_PROMPT | PEMIT_LIST;
@@ -1486,6 +1493,8 @@ COMMAND(cmd_stats)
     chunk_stats(executor, CSTATS_FREESPACEG);
   else if (SW_ISSET(sw, SWITCH_FLAGS))
     flag_stats(executor);
+  else if (SW_ISSET(sw, SWITCH_COMPRESSION))
+    do_compress_benchmark(executor);
   else
     do_stats(executor, arg_left);
 }
@@ -24,6 +24,9 @@
 #define CHAR_BITS       8       /**< number of bits in char */
 #define CHAR_MASK       255     /**< mask for just one char */
 #define CODE_BITS       25      /**< max number of bits in code */
+#define LOOKUP_BITS     11      /**< bits of input decoded per table lookup */
+#define LOOKUP_MASK     ((1 << LOOKUP_BITS) - 1)
+#define LOOKUP_SYMS     6       /**< most chars one table lookup can decode */
 #ifndef SAMPLE_SIZE
 #define SAMPLE_SIZE     0       /**< sample entire database */
 #endif
@@ -41,15 +44,28 @@ typedef struct cnode {
   char c;               /**< character at this node. */
 } CNode;
 
+/** An entry in the decoding table. It holds the chars whose codes fit,
+ * one after the other, in the LOOKUP_BITS bits used to index it.
+ */
+typedef struct dentry {
+  unsigned char bits;   /**< Number of bits the chars use up. */
+  unsigned char count;  /**< Number of chars, 0 if the first code is longer. */
+  char c[LOOKUP_SYMS];  /**< The chars. An EOS is always the last one. */
+} DEntry;
+
 static CNode *ctop;
 static CType ctable[TABLE_SIZE];
 static char ltable[TABLE_SIZE];
+static DEntry dtable[1 << LOOKUP_BITS];
+static long huff_freq[TABLE_SIZE];  /**< Counts the tree was built from */
 
 slab *huffman_slab = NULL;
 
 static int fix_tree_depth(CNode *node, int height, int zeros);
 static void add_ones(CNode *node);
 static void build_ctable(CNode *root, CType code, int numbits);
+static void build_dtable(void);
+static bool huff_build_tree(void);
 
 /** Huffman-compress a string.
  * Compress a string: this is pretty easy. For each char in the string,
@@ -57,6 +73,10 @@ static void build_ctable(CNode *root, CType code, int numbits);
  * build, keeping careful track of the number of bits we add.
  * Then stick the EOS character at the end.
  *
+ * Codes are staged in a 64-bit word and written out 32 bits at a time;
+ * the longest code (CODE_BITS) always fits behind the 31 bits that can
+ * be left over.
+ *
  * Important notes:
  *   This function mallocs memory that should be freed by the caller!
  *   The caller is also currently responsible for adding mem checks
@@ -69,33 +89,37 @@ static void build_ctable(CNode *root, CType code, int numbits);
 static char *
 huff_text_compress(const char *s)
 {
-  CType stage;
+  uint64_t stage;
   int bits = 0;
-  const char *p;
+  const unsigned char *p;
   char *b, *buf;
   int needed_length;
 
   /* Part 1 - how long will the compressed string be? */
-  for (p = s; p && *p; p++)
+  for (p = (const unsigned char *) s; p && *p; p++)
     bits += ltable[*p];
   bits += CHAR_BITS * 2 - 1;    /* add space for the ending \0 */
   needed_length = bits / CHAR_BITS;
 
   /* Part 2 - Actually get around to compressing the data... */
-  p = s;
+  p = (const unsigned char *) s;
   b = buf = malloc(needed_length);
   stage = 0;
   bits = 0;
 
   while (p && *p) {
     /* Put code on stage */
-    stage |= ctable[*p] << bits;
+    stage |= (uint64_t) ctable[*p] << bits;
     bits += ltable[*p];
-    /* Put any full bytes of stage into the compressed string */
-    while (bits >= CHAR_BITS) {
-      *b++ = stage & CHAR_MASK;
-      stage = stage >> CHAR_BITS;
-      bits -= CHAR_BITS;
+    /* Put a full word of stage into the compressed string */
+    if (bits >= 32) {
+      b[0] = stage & CHAR_MASK;
+      b[1] = (stage >> 8) & CHAR_MASK;
+      b[2] = (stage >> 16) & CHAR_MASK;
+      b[3] = (stage >> 24) & CHAR_MASK;
+      b += 4;
+      stage >>= 32;
+      bits -= 32;
     }
     p++;
   }
@@ -134,26 +158,19 @@ do { \
   } \
 } while (0)
 
-/** Huffman uncompress a string.
- * Uncompression is a snap, too. Go bit by bit, using the
- * bits to traverse the binary tree (0=left, 1=right) until reaching
- * a leaf node, which is the uncompressed character.
- * Stop when the leaf node turns out to be EOS.
+/** Huffman uncompress a string one bit at a time.
+ * Go bit by bit, using the bits to traverse the binary tree (0=left,
+ * 1=right) until reaching a leaf node, which is the uncompressed
+ * character. Stop when the leaf node turns out to be EOS.
  *
- * To avoid generating memory problems, this function should be
- * used with something of the format
- * \verbatim
- * char tbuf1[BUFFER_LEN];
- * strcpy(tbuf1, text_uncompress(a->value));
- * \endverbatim
- * if you are using something of type char *buff, use the
- * safe_uncompress function instead.
+ * This is the original decoder. huff_text_uncompress() is the one
+ * that gets used; this one is kept to check and time it against.
  *
  * \param s a compressed string.
  * \return a pointer to a static buffer containing the uncompressed string.
  */
 static char *
-huff_text_uncompress(const char *s)
+huff_tree_uncompress(const char *s)
 {
 
   static char buf[BUFFER_LEN];
@@ -181,6 +198,81 @@ huff_text_uncompress(const char *s)
   }
 }
 
+/** Huffman uncompress a string.
+ * Instead of walking the tree a bit at a time, look the next
+ * LOOKUP_BITS bits of input up in dtable, which gives every character
+ * whose code fits entirely in them. Codes too long for the table are
+ * finished off by walking the tree from the top. Stop after EOS.
+ *
+ * Input is read a byte at a time into a 64-bit stage, never past the
+ * null byte that every compressed string ends with. After that the
+ * stage fills with 0 bits, which decode as EOS.
+ *
+ * To avoid generating memory problems, this function should be
+ * used with something of the format
+ * \verbatim
+ * char tbuf1[BUFFER_LEN];
+ * strcpy(tbuf1, text_uncompress(a->value));
+ * \endverbatim
+ * if you are using something of type char *buff, use the
+ * safe_uncompress function instead.
+ *
+ * \param s a compressed string.
+ * \return a pointer to a static buffer containing the uncompressed string.
+ */
+static char *
+huff_text_uncompress(const char *s)
+{
+  /* Room for a whole table entry past the last character kept */
+  static char buf[BUFFER_LEN + LOOKUP_SYMS];
+  char *const end = buf + BUFFER_LEN - 1;
+  const unsigned char *p;
+  char *b;
+  uint64_t stage = 0;
+  int bits = 0;
+
+  buf[0] = '\0';
+  if (!s || !*s)
+    return buf;
+  p = (const unsigned char *) s;
+  b = buf;
+  for (;;) {
+    const DEntry *e;
+
+    while (bits <= 56 && *p) {
+      stage |= (uint64_t) *p++ << bits;
+      bits += CHAR_BITS;
+    }
+    e = &dtable[stage & LOOKUP_MASK];
+    if (e->count) {
+      memcpy(b, e->c, LOOKUP_SYMS);
+      b += e->count;
+      stage >>= e->bits;
+      bits -= e->bits;
+    } else {
+      CNode *node = ctop;
+
+      do {
+        node = (stage & 1) ? node->right : node->left;
+        stage >>= 1;
+        bits -= 1;
+      } while (node && (node->left || node->right));
+      if (!node) {
+        /* Not something huff_text_compress() made */
+        *b = EOS;
+        return buf;
+      }
+      *b++ = node->c;
+    }
+    if (b >= end) {
+      *end = EOS;
+      return buf;
+    }
+    if (b[-1] == EOS)
+      return buf;
+  }
+}
+
 static int
 fix_tree_depth(CNode *node, int height, int zeros)
 {
@@ -256,8 +348,8 @@ build_ctable(CNode *root, CType code, int numbits)
 #endif
 
   if (!root->left && !root->right) {
-    ctable[root->c] = code;
-    ltable[root->c] = numbits;
+    ctable[(unsigned char) root->c] = code;
+    ltable[(unsigned char) root->c] = numbits;
 #ifdef STANDALONE
     printf(isprint(root->c) ? "Code for '%c':\t" : "Code for %d:\t", root->c);
     for (i = 0; i < numbits; i++)
@@ -277,6 +369,34 @@ build_ctable(CNode *root, CType code, int numbits)
   }
 }
 
+/* Build dtable from the tree */
+static void
+build_dtable(void)
+{
+  int i;
+
+  for (i = 0; i <= LOOKUP_MASK; i++) {
+    DEntry *e = &dtable[i];
+    int used = 0;
+
+    e->count = 0;
+    while (e->count < LOOKUP_SYMS) {
+      CNode *node = ctop;
+      int n = used;
+
+      while (node && (node->left || node->right) && n < LOOKUP_BITS)
+        node = ((i >> n++) & 1) ? node->right : node->left;
+      if (!node || node->left || node->right)
+        break;                  /* The code doesn't fit in what's left */
+      e->c[e->count++] = node->c;
+      used = n;
+      if (node->c == EOS)
+        break;
+    }
+    e->bits = used;
+  }
+}
+
 /** Initialize huffman compression.
  * Initialize the compression tree and table in 5 steps:
  * 1. Initialize arrays and things
@@ -292,7 +412,51 @@ static bool
 huff_init_compress(PENNFILE *f)
 {
   int total;
-  char c;
+  int c;
+
+#ifdef STANDALONE
+  printf("init_compress: Part 2\n");
+#endif
+
+  /* Part 2: count frequencies */
+  memset(huff_freq, 0, sizeof huff_freq);
+  if (f) {
+    total = 0;
+    while (!penn_feof(f) && (!SAMPLE_SIZE || (total++ < SAMPLE_SIZE))) {
+      c = penn_fgetc(f);
+      huff_freq[(unsigned char) c]++;
+    }
+  }
+#ifdef STANDALONE
+  for (c = 0; c < TABLE_SIZE; c++) {
+    printf(isprint(c) ? "Frequency for '%c': %d\n"
+           : "Frequency for %d: %d\n", c, huff_freq[c]);
+  }
+#endif
+
+  return huff_build_tree();
+}
+
+/** Initialize huffman compression from saved character counts.
+ * A binary database stores attribute values compressed, along with the
+ * counts their tree was built from, so the same tree has to be built
+ * again to read them.
+ * \param freq the frequency of every character.
+ */
+static bool
+huff_init_table(const long freq[TABLE_SIZE])
+{
+  memcpy(huff_freq, freq, sizeof huff_freq);
+  return huff_build_tree();
+}
+
+/** Build the compression tree and table from huff_freq.
+ * This is every step of huff_init_compress() but the counting.
+ */
+static bool
+huff_build_tree(void)
+{
+  int total;
   struct {
     long freq;
     CNode *node;
@@ -305,12 +469,14 @@ huff_init_compress(PENNFILE *f)
   printf("init_compress: Part 1\n");
 #endif
 
+  if (huffman_slab)
+    slab_destroy(huffman_slab);
   huffman_slab = slab_create("huffman attribute compression", sizeof(CNode));
   slab_set_opt(huffman_slab, SLAB_ALLOC_BEST_FIT, 1);
 
   /* Part 1: initialize */
   for (total = 0; total < TABLE_SIZE; total++) {
-    table[total].freq = 0;
+    table[total].freq = huff_freq[total];
     table[total].node = slab_malloc(huffman_slab, NULL);
     if (!table[total].node) {
       do_rawlog(LT_ERR,
@@ -322,25 +488,6 @@ huff_init_compress(PENNFILE *f)
     table[total].node->right = (CNode *) NULL;
   }
 
-#ifdef STANDALONE
-  printf("init_compress: Part 2\n");
-#endif
-
-  /* Part 2: count frequencies */
-  if (f) {
-    total = 0;
-    while (!penn_feof(f) && (!SAMPLE_SIZE || (total++ < SAMPLE_SIZE))) {
-      c = penn_fgetc(f);
-      table[c].freq++;
-    }
-  }
-#ifdef STANDALONE
-  for (indx = 0; indx < TABLE_SIZE; indx++) {
-    printf(isprint(indx) ? "Frequency for '%c': %d\n"
-           : "Frequency for %d: %d\n", indx, table[indx].freq);
-  }
-#endif
-
 #ifdef STANDALONE
   printf("init_compress: Part 3\n");
 #endif
@@ -499,11 +646,12 @@ huff_init_compress(PENNFILE *f)
 #endif
 
   /* Part 5: Now traverse the tree, depth-first, and construct
-   * the compression table.
+   * the compression and decoding tables.
    */
 
   ctop = table[1].node;
   build_ctable(ctop, 0, 0);
+  build_dtable();
 
 #ifdef STANDALONE
   printf("init_compress: Done\n");
@@ -516,7 +664,8 @@ huff_init_compress(PENNFILE *f)
 struct compression_ops huffman_ops = {
   huff_init_compress,
   huff_text_compress,
-  huff_text_uncompress
+  huff_text_uncompress,
+  1
 };
 
 #ifdef STANDALONE
@@ -369,4 +369,4 @@ hash_fn(const char *s, int hashtab_mask)
 }
 
 struct compression_ops word_ops = {word_init_compress, word_text_compress,
-                                   word_text_uncompress};
+                                   word_text_uncompress, 0};
@@ -17,12 +17,16 @@
 
 #include "log.h"
 #include "mushtype.h"
+#include "attrib.h"
+#include "dbdefs.h"
 #include "dbio.h"
 #include "conf.h"
 #include "externs.h"
 #include "mushdb.h"
 #include "mymalloc.h"
+#include "notify.h"
 #include "strutil.h"
+#include "tests.h"
 
 typedef bool (*init_fn)(PENNFILE *);
 typedef char *(*comp_fn)(char const *);
@@ -31,6 +35,7 @@ struct compression_ops {
   init_fn init;
   comp_fn comp;
   comp_fn decomp;
+  bool reentrant; /**< Can comp be called from other threads? */
 };
 
 #include "comp_h.c"
@@ -58,7 +63,7 @@ dummy_decompress(char const *s)
 }
 
 struct compression_ops nocompression_ops = {dummy_init, dummy_compress,
-                                            dummy_decompress};
+                                            dummy_decompress, 1};
 
 struct compression_ops *comp_ops = NULL;
 
@@ -84,12 +89,58 @@ init_compress(PENNFILE *f)
   return comp_ops->init(f);
 }
 
+/** Initialize huffman compression from a binary database's table.
+ * Attribute values in the database are stored huffman-compressed with
+ * the tree built from freq, so that's the compression the game has to
+ * use, whatever attr_compression says.
+ * \param freq the character counts saved by compress_get_table().
+ * \return true on success.
+ */
+bool
+init_compress_table(const long freq[256])
+{
+  if (strcmp(options.attr_compression, "huffman") != 0) {
+    do_rawlog(LT_ERR,
+              "Database attributes are huffman compressed. Using huffman "
+              "instead of '%s' compression.",
+              options.attr_compression);
+    strcpy(options.attr_compression, "huffman");
+  }
+  comp_ops = &huffman_ops;
+  return huff_init_table(freq);
+}
+
+/** Get what a binary database needs to read compressed attribute
+ * values back in.
+ * \param freq filled in with the character counts the huffman tree
+ * was built from.
+ * \return true if values are huffman compressed and can be saved
+ * as-is, false if they have to be saved uncompressed.
+ */
+bool
+compress_get_table(long freq[256])
+{
+  if (comp_ops != &huffman_ops)
+    return false;
+  memcpy(freq, huff_freq, sizeof huff_freq);
+  return true;
+}
+
 __attribute_malloc__ char *
 text_compress(char const *s)
 {
   return comp_ops->comp(s);
 }
 
+/** Is it safe to call text_compress() from threads other than the main
+ * one? Only valid once init_compress() has been called.
+ */
+bool
+text_compress_reentrant(void)
+{
+  return comp_ops && comp_ops->reentrant;
+}
+
 char *
 text_uncompress(char const *s)
 {
@@ -101,3 +152,185 @@ safe_uncompress(char const *s)
 {
   return strdup(comp_ops->decomp(s));
 }
+
+#define BENCH_CORPUS (4 * 1024 * 1024) /**< Most attribute text to time */
+#define BENCH_USECS 100000 /**< Shortest time to spend on each timing */
+
+static int64_t
+bench_usecs(const struct timeval *start)
+{
+  struct timeval now;
+
+  penn_gettimeofday(&now);
+  return (now.tv_sec - start->tv_sec) * INT64_C(1000000) +
+         (now.tv_usec - start->tv_usec);
+}
+
+/** Time compressing a corpus of strings.
+ * \param text the strings.
+ * \param n the number of strings.
+ * \param bytes their total length.
+ * \return uncompressed bytes handled per second, in MB.
+ */
+static double
+bench_comp(char **text, int n, size_t bytes)
+{
+  struct timeval start;
+  int64_t usecs;
+  int i, rounds = 0;
+
+  penn_gettimeofday(&start);
+  do {
+    for (i = 0; i < n; i++)
+      free(comp_ops->comp(text[i]));
+    rounds += 1;
+  } while ((usecs = bench_usecs(&start)) < BENCH_USECS);
+  return (double) bytes * rounds / usecs;
+}
+
+/** Time uncompressing a corpus of strings.
+ * \param decomp the uncompression function.
+ * \param comp the compressed strings.
+ * \param n the number of strings.
+ * \param bytes their total uncompressed length.
+ * \return uncompressed bytes produced per second, in MB.
+ */
+static double
+bench_decomp(comp_fn decomp, char **comp, int n, size_t bytes)
+{
+  struct timeval start;
+  int64_t usecs;
+  int i, rounds = 0;
+
+  penn_gettimeofday(&start);
+  do {
+    for (i = 0; i < n; i++)
+      decomp(comp[i]);
+    rounds += 1;
+  } while ((usecs = bench_usecs(&start)) < BENCH_USECS);
+  return (double) bytes * rounds / usecs;
+}
+
+/** Time attribute compression with the database's own attributes.
+ * Up to BENCH_CORPUS bytes of attribute values are compressed and
+ * uncompressed over and over, and the throughput of each reported,
+ * along with how well they compress and whether they all come back
+ * unchanged. With huffman compression, the old bit-at-a-time decoder
+ * is timed too.
+ * \param player the enactor.
+ */
+void
+do_compress_benchmark(dbref player)
+{
+  char **text = NULL, **comp;
+  int n = 0, cap = 0, bad = 0, i;
+  size_t bytes = 0, cbytes = 0;
+  dbref thing;
+  ATTR *a;
+
+  if (!Wizard(player)) {
+    notify(player, T("Permission denied."));
+    return;
+  }
+
+  for (thing = 0; thing < db_top && bytes < BENCH_CORPUS; thing++) {
+    if (IsGarbage(thing))
+      continue;
+    ATTR_FOR_EACH (thing, a) {
+      char const *v = uncompress(atr_get_compressed_data(a));
+
+      if (!*v)
+        continue;
+      if (n == cap) {
+        cap = cap ? cap * 2 : 1024;
+        text = mush_realloc(text, cap * sizeof *text, "compress.bench");
+      }
+      text[n++] = mush_strdup(v, "compress.bench.text");
+      bytes += strlen(v);
+    }
+  }
+  if (!n) {
+    notify(player, T("There are no attribute values to time."));
+    return;
+  }
+
+  comp = mush_calloc(n, sizeof *comp, "compress.bench");
+  for (i = 0; i < n; i++) {
+    comp[i] = comp_ops->comp(text[i]);
+    cbytes += strlen(comp[i]);
+    if (strcmp(comp_ops->decomp(comp[i]), text[i]) != 0 ||
+        (comp_ops == &huffman_ops &&
+         strcmp(huff_tree_uncompress(comp[i]), text[i]) != 0))
+      bad += 1;
+  }
+
+  notify_format(player, T("Compression: %s"), options.attr_compression);
+  notify_format(player,
+                T("Corpus:      %d attributes, %zu bytes, %zu compressed "
+                  "(%.1f%%)"),
+                n, bytes, cbytes, 100.0 * cbytes / (bytes ? bytes : 1));
+  notify_format(player, T("Compress:    %8.1f MB/s"),
+                bench_comp(text, n, bytes));
+  notify_format(player, T("Uncompress:  %8.1f MB/s"),
+                bench_decomp(comp_ops->decomp, comp, n, bytes));
+  if (comp_ops == &huffman_ops)
+    notify_format(player, T("Tree walk:   %8.1f MB/s"),
+                  bench_decomp(huff_tree_uncompress, comp, n, bytes));
+  if (bad)
+    notify_format(player, T("%d attribute values did not survive compression!"),
+                  bad);
+
+  for (i = 0; i < n; i++) {
+    free(comp[i]);
+    mush_free(text[i], "compress.bench.text");
+  }
+  mush_free(comp, "compress.bench");
+  mush_free(text, "compress.bench");
+}
+
+TEST_GROUP(huffman)
+{
+  long freq[TABLE_SIZE], saved[TABLE_SIZE];
+  bool active = comp_ops == &huffman_ops;
+  char text[BUFFER_LEN + 100], *c;
+  int i;
+  static const char *const samples[] = {
+    "",
+    "a",
+    "The quick brown fox jumps over the lazy dog.",
+    "[setq(0,u(me/fn,%0))][iter(%q0,[ansi(h,##)]%r)]",
+    "\xc3\xa9t\xc3\xa9 \xe2\x82\xac 100 \x7f\x01\x1b[1m",
+  };
+
+  if (active)
+    memcpy(saved, huff_freq, sizeof saved);
+  for (i = 0; i < TABLE_SIZE; i++)
+    freq[i] = (i >= 'a' && i <= 'z') ? 1000 : (i < 128 ? 10 : 0);
+  freq[' '] = 5000;
+  huff_init_table(freq);
+
+  for (i = 0; i < (int) (sizeof samples / sizeof samples[0]); i++) {
+    c = huff_text_compress(samples[i]);
+    TEST("huffman.1", strcmp(huff_text_uncompress(c), samples[i]) == 0);
+    TEST("huffman.2", strcmp(huff_tree_uncompress(c), samples[i]) == 0);
+    free(c);
+  }
+  /* Every byte value, and long codes the table can't decode */
+  for (i = 0; i < 255; i++)
+    text[i] = 255 - i;
+  text[255] = '\0';
+  c = huff_text_compress(text);
+  TEST("huffman.3", strcmp(huff_text_uncompress(c), text) == 0);
+  free(c);
+  /* Too long to uncompress whole */
+  memset(text, 'x', sizeof text - 1);
+  text[sizeof text - 1] = '\0';
+  c = huff_text_compress(text);
+  TEST("huffman.4", strlen(huff_text_uncompress(c)) == BUFFER_LEN - 1 &&
+                      strcmp(huff_text_uncompress(c),
+                             huff_tree_uncompress(c)) == 0);
+  free(c);
+
+  if (active)
+    huff_init_table(saved);
+}
@@ -145,6 +145,8 @@ PENNCONF conftable[] = {
    "net"},
   {"use_ws", cf_bool, &options.use_ws, sizeof options.use_ws, 0, "net"},
   {"ws_url", cf_str, options.ws_url, sizeof options.ws_url, 0, "net"},
+  {"ws_deflate", cf_bool, &options.ws_deflate, 2, 0, "net"},
+  {"ws_context_takeover", cf_bool, &options.ws_context_takeover, 2, 0, "net"},
   {"use_dns", cf_bool, &options.use_dns, 2, 0, "net"},
   {"logins", cf_bool, &options.login_allow, 2, 0, "net"},
   {"player_creation", cf_bool, &options.create_allow, 2, 0, "net"},
@@ -160,6 +162,9 @@ PENNCONF conftable[] = {
   {"sql_database", cf_str, options.sql_database, sizeof options.sql_database,
    CP_GODONLY, "net"},
   {"forking_dump", cf_bool, &options.forking_dump, 2, 0, "dump"},
+  {"incremental_dump", cf_bool, &options.incremental_dump, 2, 0, "dump"},
+  {"binary_dump", cf_bool, &options.binary_dump, 2, 0, "dump"},
+  {"parallel_db_load", cf_bool, &options.parallel_db_load, 2, 0, "dump"},
   {"dump_message", cf_str, options.dump_message, sizeof options.dump_message,
    CP_OPTIONAL, "dump"},
   {"dump_complete", cf_str, options.dump_complete, sizeof options.dump_complete,
@@ -228,6 +233,7 @@ PENNCONF conftable[] = {
    "limits"},
   {"queue_loss", cf_int, &options.queue_loss, 10000, 0, "limits"},
   {"queue_chunk", cf_int, &options.queue_chunk, 100000, 0, "limits"},
+  {"fair_queue", cf_bool, &options.fair_queue, 2, 0, "limits"},
   {"function_recursion_limit", cf_int, &options.func_nest_lim, 100000, 0,
    "limits"},
   {"function_invocation_limit", cf_int, &options.func_invk_lim, 100000, 0,
@@ -246,6 +252,9 @@ PENNCONF conftable[] = {
   {"use_syslog", cf_bool, &options.use_syslog, 2, 0, "log"},
   {"log_commands", cf_bool, &options.log_commands, 2, 0, "log"},
   {"log_forces", cf_bool, &options.log_forces, 2, 0, "log"},
+  {"profile_softcode", cf_bool, &options.profile_softcode, 2, 0, "log"},
+  {"profile_file", cf_str, options.profile_file, sizeof options.profile_file,
+   0, "log"},
   {"error_log", cf_str, options.error_log, sizeof options.error_log, 0, "log"},
   {"command_log", cf_str, options.command_log, sizeof options.command_log, 0,
    "log"},
@@ -271,6 +280,9 @@ PENNCONF conftable[] = {
   {"safer_ufun", cf_bool, &options.safer_ufun, 2, 0, "funcs"},
   {"function_side_effects", cf_bool, &options.function_side_effects, 2, 0,
    "funcs"},
+  {"compile_ufuns", cf_bool, &options.compile_ufuns, 2, 0, "funcs"},
+  {"compile_ufuns_check", cf_bool, &options.compile_ufuns_check, 2, 0,
+   "funcs"},
 
   {"noisy_whisper", cf_bool, &options.noisy_whisper, 2, 0, "cmds"},
   {"possessive_get", cf_bool, &options.possessive_get, 2, 0, "cmds"},
@@ -318,6 +330,10 @@ PENNCONF conftable[] = {
   {"chunk_cache_memory", cf_int, &options.chunk_cache_memory, 1000000000, 0,
    "files"},
   {"chunk_migrate", cf_int, &options.chunk_migrate_amount, 100000, 0, "limits"},
+  {"attr_value_cache", cf_int, &options.attr_value_cache, 1000000000, 0,
+   "limits"},
+  {"chunk_async_io", cf_bool, &options.chunk_async_io, 2, 0, "files"},
+  {"chunk_dedup", cf_bool, &options.chunk_dedup, 2, 0, "limits"},
 
   {"attr_compression", cf_str, options.attr_compression,
    sizeof options.attr_compression, 0, NULL},
@@ -1170,6 +1186,8 @@ conf_default_set(void)
   strcpy(options.socket_file, "data/netmush.sock");
   options.use_ws = 1;
   strcpy(options.ws_url, "/wsclient");
+  options.ws_deflate = 1;
+  options.ws_context_takeover = 1;
   strcpy(options.input_db, "data/indb");
   strcpy(options.output_db, "data/outdb");
   strcpy(options.crash_db, "data/PANIC.db");
@@ -1211,11 +1229,14 @@ conf_default_set(void)
   options.starting_quota = 20;
   options.player_queue_limit = 100;
   options.queue_chunk = 3;
+  options.fair_queue = 0;
   options.func_nest_lim = 50;
   options.func_invk_lim = 2500;
   options.call_lim = 0;
   options.use_quota = 1;
   options.function_side_effects = 1;
+  options.compile_ufuns = 0;
+  options.compile_ufuns_check = 0;
   options.empty_attrs = 1;
   set_string_option(options.money_singular, T("Penny"));
   set_string_option(options.money_plural, T("Pennies"));
@@ -1247,6 +1268,8 @@ conf_default_set(void)
   options.use_syslog = 0;
   options.log_commands = 0;
   options.log_forces = 1;
+  options.profile_softcode = 0;
+  strcpy(options.profile_file, "log/profile.folded");
   options.support_pueblo = 0;
   options.login_allow = 1;
   options.guest_allow = 1;
@@ -1295,6 +1318,9 @@ conf_default_set(void)
   options.player_name_spaces = 0;
   options.max_aliases = 3;
   options.forking_dump = 1;
+  options.incremental_dump = 1;
+  options.binary_dump = 0;
+  options.parallel_db_load = 1;
   options.restrict_building = 0;
   options.free_objects = 1;
   options.flags_on_examine = 1;
@@ -1336,6 +1362,9 @@ conf_default_set(void)
   options.chunk_swap_initial = 2048;
   options.chunk_cache_memory = 1000000;
   options.chunk_migrate_amount = 50;
+  options.chunk_async_io = 0;
+  options.attr_value_cache = 1000000;
+  options.chunk_dedup = 0;
   strcpy(options.attr_compression, "none");
   options.read_remote_desc = 0;
 #ifdef HAVE_SSL
@@ -50,18 +50,105 @@
 #include "mushdb.h"
 #include "mymalloc.h"
 #include "parse.h"
+#include "profile.h"
 #include "ptab.h"
 #include "strtree.h"
 #include "strutil.h"
+#include "tests.h"
 #include "mushsql.h"
 
 intmap *queue_map = NULL; /**< Intmap for looking up queue entries by pid */
 static uint32_t top_pid = 1;
 #define MAX_PID (1U << 15)
 
-static MQUE *qfirst = NULL, *qlast = NULL, *qwait = NULL;
+static MQUE *qfirst = NULL, *qlast = NULL;
+
+/* qfirst has every entry in the command queue in the order they were added,
+ * and that's the order they run in normally. Entries are also kept in a
+ * share for their owner, one for entries caused by players and one for
+ * entries caused by objects, in the same order. With fair_queue on, player
+ * shares run before object shares, and within each class owners take turns
+ * using deficit round robin: each turn allows RUN_SHARE_QUANTUM
+ * microseconds, and an entry that runs over is paid for out of the owner's
+ * later turns. So one owner queueing lots of commands only slows down their
+ * own. */
+#define RUN_PLAYER 0 /**< Share class for entries caused by players */
+#define RUN_OBJECT 1 /**< Share class for entries caused by objects */
+#define RUN_SHARE_QUANTUM 1000
+#define RUN_SHARE_MAX_DEBT (RUN_SHARE_QUANTUM * 1000)
+
+/** One owner's entries in one class of the command queue */
+struct run_share {
+  im_key key;      /**< Key in run_shares */
+  MQUE *head;      /**< First entry */
+  MQUE *tail;      /**< Last entry */
+  int64_t deficit; /**< Microseconds left in the current turn */
+  struct run_share *ring_next; /**< Next share in the class's rotation */
+  struct run_share *ring_prev; /**< Previous share in the class's rotation */
+};
+
+static intmap *run_shares = NULL; /**< Shares by owner and class */
+static struct run_share *run_ring[2] = {NULL, NULL}; /**< Current shares */
+
+/* How long entries wait in the command queue, by class, in buckets for
+ * under 1, 2, 4, ... milliseconds, with the last for anything longer. */
+#define QUEUE_DELAY_BUCKETS 16
+static uint64_t queue_delays[2][QUEUE_DELAY_BUCKETS];
 static MQUE *qsemfirst = NULL, *qsemlast = NULL;
 
+/* Timed @waits are kept in a hierarchical timing wheel, so adding or
+ * removing one costs the same however many others there are. Level 0 has
+ * a slot for each second of the current 256-second block, level 1 a slot
+ * for each 256-second block of the current 65536-second one, and so on.
+ * An entry is in the slot for the highest 8-bit group where its time
+ * differs from the wheel's, and moves down a level when the wheel reaches
+ * the block it's in. Entries due in the same second are always in the same
+ * slot, in the order they were added. Entries that are already due are
+ * kept in wait_due, and ones too far off for the wheel in wait_far; both
+ * are sorted by time. */
+#define WAIT_WHEEL_BITS 8
+#define WAIT_WHEEL_SLOTS (1 << WAIT_WHEEL_BITS)
+#define WAIT_WHEEL_LEVELS 4
+#define WAIT_SLOT_COUNT (WAIT_WHEEL_LEVELS * WAIT_WHEEL_SLOTS + 2)
+/* If the clock jumps ahead more than this, rebuild the wheel instead of
+ * stepping through every second. */
+#define WAIT_WHEEL_MAX_STEP (1 << 16)
+
+/** A list of wait queue entries */
+struct wait_slot {
+  MQUE *head; /**< First entry */
+  MQUE *tail; /**< Last entry */
+};
+
+static struct wait_slot wait_slots[WAIT_SLOT_COUNT];
+#define WAIT_SLOT(level, n) (wait_slots[(level) * WAIT_WHEEL_SLOTS + (n)])
+#define wait_due (wait_slots[WAIT_SLOT_COUNT - 2])
+#define wait_far (wait_slots[WAIT_SLOT_COUNT - 1])
+static time_t wait_time = 0; /**< The next second the wheel will reach */
+static int wait_count = 0;   /**< Number of entries in the wait queue */
+
+/* Semaphore waits are in qsemfirst in the order they were added, for @ps
+ * and @halt. They're also indexed by object, with a list for each
+ * attribute that has waiters, so @notify only looks at the entries it
+ * releases. The ones with a timeout are also in a heap ordered by when
+ * they time out. */
+
+/** The entries waiting on one semaphore attribute of an object */
+struct sem_bucket {
+  const char *attr;        /**< Attribute name, from atr_names */
+  MQUE *head;              /**< First entry waiting */
+  MQUE *tail;              /**< Last entry waiting */
+  struct sem_bucket *next; /**< Next attribute of the same object */
+};
+
+intmap *sem_map = NULL; /**< Map of dbrefs to their sem_buckets */
+static MQUE **sem_timeouts = NULL; /**< Heap of entries with timeouts */
+static int sem_timeout_count = 0;  /**< Number of entries in sem_timeouts */
+static int sem_timeout_size = 0;   /**< Space allocated in sem_timeouts */
+static uint64_t sem_seq = 0;       /**< Counter for MQUE.sem_seq */
+
+extern StrTree atr_names;
+
 static int add_to_generic(dbref player, int am, const char *name,
                           uint32_t flags);
 static int add_to(dbref player, int am);
@@ -80,6 +167,8 @@ static void show_queue_env(dbref player, MQUE *q);
 static void do_raw_restart(dbref victim);
 static int waitable_attr(dbref thing, const char *atr);
 static void shutdown_a_queue(MQUE **head, MQUE **tail);
+static void run_queue_add(MQUE *q);
+static void run_queue_remove(MQUE *q);
 static int do_entry(MQUE *entry, int include_recurses);
 static MQUE *new_queue_entry(NEW_PE_INFO *pe_info);
 void init_queue(void);
@@ -101,13 +190,791 @@ extern dbref report_dbref;
  */
 #define SEMAPHORE_FLAGS (AF_LOCKED | AF_PRIVATE | AF_NOCOPY | AF_NODUMP)
 
-/** Queue initializtion function. Must be called before anything
- * is added to the queue.
+/** Find the slot a wait queue entry belongs in.
+ * \param when the time the entry is due.
+ * \return the slot.
+ */
+static struct wait_slot *
+wait_slot_for(time_t when)
+{
+  uint64_t diff;
+  int level;
+
+  if (when < wait_time)
+    return &wait_due;
+  diff = (uint64_t) when ^ (uint64_t) wait_time;
+  for (level = 0; level < WAIT_WHEEL_LEVELS; level++) {
+    int shift = WAIT_WHEEL_BITS * level;
+
+    if (!(diff >> (shift + WAIT_WHEEL_BITS)))
+      return &WAIT_SLOT(level,
+                        ((uint64_t) when >> shift) & (WAIT_WHEEL_SLOTS - 1));
+  }
+  return &wait_far;
+}
+
+/** Add an entry to the wait queue, after any others due at the same time.
+ * \param q the entry.
+ */
+static void
+wait_add(MQUE *q)
+{
+  struct wait_slot *s = wait_slot_for(q->wait_until);
+  MQUE *after = s->tail;
+
+  if (s == &wait_due || s == &wait_far) {
+    /* Sorted; new entries almost always go at the end */
+    while (after && after->wait_until > q->wait_until)
+      after = after->prev;
+  }
+  q->prev = after;
+  if (after) {
+    q->next = after->next;
+    after->next = q;
+  } else {
+    q->next = s->head;
+    s->head = q;
+  }
+  if (q->next)
+    q->next->prev = q;
+  else
+    s->tail = q;
+  wait_count += 1;
+}
+
+/** Take an entry out of the wait queue.
+ * \param q the entry, which must not have changed its time since it was
+ * added.
+ */
+static void
+wait_remove(MQUE *q)
+{
+  struct wait_slot *s = wait_slot_for(q->wait_until);
+
+  if (q->prev)
+    q->prev->next = q->next;
+  else
+    s->head = q->next;
+  if (q->next)
+    q->next->prev = q->prev;
+  else
+    s->tail = q->prev;
+  q->next = q->prev = NULL;
+  wait_count -= 1;
+}
+
+/** Is an entry in the wait queue? */
+static bool
+wait_queued(MQUE *q)
+{
+  if (q->semaphore_obj != NOTHING || q->share)
+    return false;
+  return q->prev || wait_slot_for(q->wait_until)->head == q;
+}
+
+/** Move all the entries in a slot to where they belong now. */
+static void
+wait_cascade(struct wait_slot *s)
+{
+  MQUE *q = s->head, *next;
+
+  s->head = s->tail = NULL;
+  for (; q; q = next) {
+    next = q->next;
+    wait_count -= 1;
+    wait_add(q);
+  }
+}
+
+/** Advance the wheel by one second, moving entries in any block it
+ * enters down a level. */
+static void
+wait_tick(void)
+{
+  int level;
+
+  wait_time += 1;
+  if (!((uint64_t) wait_time & UINT64_C(0xFFFFFFFF))) {
+    /* Entering a new 2^32 second span; bring its entries onto the wheel */
+    while (wait_far.head &&
+           !(((uint64_t) wait_far.head->wait_until ^ (uint64_t) wait_time) >>
+             (WAIT_WHEEL_BITS * WAIT_WHEEL_LEVELS))) {
+      MQUE *q = wait_far.head;
+
+      if ((wait_far.head = q->next))
+        wait_far.head->prev = NULL;
+      else
+        wait_far.tail = NULL;
+      q->next = NULL;
+      wait_count -= 1;
+      wait_add(q);
+    }
+  }
+  for (level = WAIT_WHEEL_LEVELS - 1; level > 0; level--) {
+    int shift = WAIT_WHEEL_BITS * level;
+
+    if (!((uint64_t) wait_time & ((UINT64_C(1) << shift) - 1)))
+      wait_cascade(&WAIT_SLOT(
+        level, ((uint64_t) wait_time >> shift) & (WAIT_WHEEL_SLOTS - 1)));
+  }
+}
+
+/** A wait queue entry and where it was found, for sorting. */
+struct wait_sort {
+  MQUE *q; /**< The entry */
+  int n;   /**< Position found in */
+};
+
+static int
+wait_sort_cmp(const void *a, const void *b)
+{
+  const struct wait_sort *wa = a, *wb = b;
+
+  if (wa->q->wait_until != wb->q->wait_until)
+    return wa->q->wait_until < wb->q->wait_until ? -1 : 1;
+  /* Same time means same slot; keep the order they were found in. */
+  return wa->n - wb->n;
+}
+
+/** Get the entries of the wait queue, in the order they'll run.
+ * \param count set to the number of entries.
+ * \return a mush_malloc'ed array of entries, or NULL if there are none.
+ * Free with "mque.wait_list".
+ */
+static MQUE **
+wait_queue_list(int *count)
+{
+  struct wait_sort *sorted;
+  MQUE **list, *q;
+  int i, n = 0;
+
+  *count = 0;
+  if (!wait_count)
+    return NULL;
+  sorted = mush_calloc(wait_count, sizeof *sorted, "mque.wait_list");
+  for (i = 0; i < WAIT_SLOT_COUNT; i++) {
+    for (q = wait_slots[i].head; q; q = q->next) {
+      sorted[n].q = q;
+      sorted[n].n = n;
+      n++;
+    }
+  }
+  qsort(sorted, n, sizeof *sorted, wait_sort_cmp);
+  /* Reuse the space for the result */
+  list = (MQUE **) sorted;
+  for (i = 0; i < n; i++)
+    list[i] = sorted[i].q;
+  *count = n;
+  return list;
+}
+
+/** Move the entries in a wait queue slot to the end of the run queue. */
+static void
+wait_run_slot(struct wait_slot *s)
+{
+  MQUE *point, *next;
+
+  for (point = s->head; point; point = next) {
+    next = point->next;
+    point->next = point->prev = NULL;
+    point->wait_until = 0;
+    wait_count -= 1;
+    run_queue_add(point);
+  }
+  s->head = s->tail = NULL;
+}
+
+/** Catch the wheel up with the clock before adding to it. If the clock has
+ * gone backwards or jumped far ahead, rebuild the wheel around the new time.
+ */
+static void
+wait_sync(void)
+{
+  MQUE **list;
+  int i, n;
+
+  if (!wait_count) {
+    wait_time = mudtime;
+    return;
+  }
+  if (wait_time <= mudtime + 1 && mudtime - wait_time <= WAIT_WHEEL_MAX_STEP)
+    return;
+  list = wait_queue_list(&n);
+  memset(wait_slots, 0, sizeof wait_slots);
+  wait_count = 0;
+  wait_time = mudtime;
+  for (i = 0; i < n; i++) {
+    list[i]->next = list[i]->prev = NULL;
+    wait_add(list[i]);
+  }
+  mush_free(list, "mque.wait_list");
+}
+
+TEST_GROUP(wait_wheel)
+{
+  /* Entries due at these offsets from the wheel's time, which is set to
+     cross block boundaries at every level as it's stepped. */
+  static const int offsets[] = {5, 299, -10, 300, 5, 70000, 0, 301, 256, 300};
+  enum { N = sizeof offsets / sizeof offsets[0] };
+  struct wait_slot saved[WAIT_SLOT_COUNT];
+  time_t saved_time = wait_time, base = ((time_t) 1 << 24) - 300;
+  int saved_count = wait_count;
+  MQUE entries[N], **list;
+  int i, n, ran = 0;
+  bool ok = true;
+
+  memcpy(saved, wait_slots, sizeof saved);
+  memset(wait_slots, 0, sizeof wait_slots);
+  memset(entries, 0, sizeof entries);
+  wait_count = 0;
+  wait_time = base;
+  for (i = 0; i < N; i++) {
+    entries[i].wait_until = base + offsets[i];
+    wait_add(&entries[i]);
+  }
+  list = wait_queue_list(&n);
+  TEST("wait_wheel.1", n == N);
+  /* Sorted by time, then by when they were added */
+  for (i = 1; i < n; i++) {
+    if (list[i - 1]->wait_until > list[i]->wait_until ||
+        (list[i - 1]->wait_until == list[i]->wait_until &&
+         list[i - 1] > list[i]))
+      ok = false;
+  }
+  TEST("wait_wheel.2", ok);
+  /* Stepping the wheel hands them out in the same order */
+  while (wait_due.head) {
+    ok = ok && wait_due.head == list[ran++];
+    wait_remove(wait_due.head);
+  }
+  while (wait_count && ran < n && wait_time <= base + 70000) {
+    struct wait_slot *s =
+      &WAIT_SLOT(0, (uint64_t) wait_time & (WAIT_WHEEL_SLOTS - 1));
+
+    while (s->head) {
+      ok = ok && s->head == list[ran++] && s->head->wait_until == wait_time;
+      wait_remove(s->head);
+    }
+    wait_tick();
+  }
+  TEST("wait_wheel.3", ok && ran == N && !wait_count);
+  mush_free(list, "mque.wait_list");
+  memcpy(wait_slots, saved, sizeof saved);
+  wait_time = saved_time;
+  wait_count = saved_count;
+}
+
+/** Does a time out before b? Entries with the same timeout go in the
+ * order they started waiting. */
+static inline bool
+sem_timeout_before(const MQUE *a, const MQUE *b)
+{
+  return a->wait_until < b->wait_until ||
+         (a->wait_until == b->wait_until && a->sem_seq < b->sem_seq);
+}
+
+static inline void
+sem_timeout_place(MQUE *q, int n)
+{
+  sem_timeouts[n] = q;
+  q->sem_timeout = n;
+}
+
+/** Move an entry up or down the timeout heap until it's in order. */
+static void
+sem_timeout_sift(int n)
+{
+  MQUE *q = sem_timeouts[n];
+
+  while (n > 0 && sem_timeout_before(q, sem_timeouts[(n - 1) / 2])) {
+    sem_timeout_place(sem_timeouts[(n - 1) / 2], n);
+    n = (n - 1) / 2;
+  }
+  while (1) {
+    int child = n * 2 + 1;
+
+    if (child >= sem_timeout_count)
+      break;
+    if (child + 1 < sem_timeout_count &&
+        sem_timeout_before(sem_timeouts[child + 1], sem_timeouts[child]))
+      child += 1;
+    if (!sem_timeout_before(sem_timeouts[child], q))
+      break;
+    sem_timeout_place(sem_timeouts[child], n);
+    n = child;
+  }
+  sem_timeout_place(q, n);
+}
+
+static void
+sem_timeout_add(MQUE *q)
+{
+  if (sem_timeout_count == sem_timeout_size) {
+    sem_timeout_size = sem_timeout_size ? sem_timeout_size * 2 : 64;
+    sem_timeouts = mush_realloc(sem_timeouts,
+                                sem_timeout_size * sizeof *sem_timeouts,
+                                "mque.sem_timeouts");
+  }
+  sem_timeout_place(q, sem_timeout_count++);
+  sem_timeout_sift(q->sem_timeout);
+}
+
+static void
+sem_timeout_remove(MQUE *q)
+{
+  int n = q->sem_timeout;
+
+  q->sem_timeout = -1;
+  sem_timeout_count -= 1;
+  if (n == sem_timeout_count)
+    return;
+  sem_timeout_place(sem_timeouts[sem_timeout_count], n);
+  sem_timeout_sift(n);
+}
+
+/** Find the list of entries waiting on an object's semaphore attribute.
+ * \param thing the semaphore object.
+ * \param attr the attribute name, from atr_names.
+ * \param create true to add an empty list if there isn't one.
+ * \return the list, or NULL.
+ */
+static struct sem_bucket *
+sem_bucket_find(dbref thing, const char *attr, bool create)
+{
+  struct sem_bucket *first = im_find(sem_map, thing), *b;
+
+  for (b = first; b; b = b->next) {
+    if (b->attr == attr)
+      return b;
+  }
+  if (!create)
+    return NULL;
+  b = mush_malloc(sizeof *b, "mque.sem_bucket");
+  b->attr = attr;
+  b->head = b->tail = NULL;
+  if (first) {
+    b->next = first->next;
+    first->next = b;
+  } else {
+    b->next = NULL;
+    im_insert(sem_map, thing, b);
+  }
+  return b;
+}
+
+/** Free an empty list of semaphore waiters. */
+static void
+sem_bucket_free(dbref thing, struct sem_bucket *b)
+{
+  struct sem_bucket *first = im_find(sem_map, thing), **bp;
+
+  if (first == b) {
+    im_delete(sem_map, thing);
+    if (b->next)
+      im_insert(sem_map, thing, b->next);
+  } else {
+    for (bp = &first->next; *bp != b; bp = &(*bp)->next)
+      ;
+    *bp = b->next;
+  }
+  mush_free(b, "mque.sem_bucket");
+}
+
+/** Add an entry to the end of the semaphore queue. Its semaphore_obj,
+ * semaphore_attr and wait_until must already be set.
+ * \param q the entry.
  */
+static void
+sem_add(MQUE *q)
+{
+  struct sem_bucket *b =
+    sem_bucket_find(q->semaphore_obj, q->semaphore_attr, true);
+
+  q->sem_seq = sem_seq++;
+  q->next = NULL;
+  q->prev = qsemlast;
+  if (qsemlast)
+    qsemlast->next = q;
+  else
+    qsemfirst = q;
+  qsemlast = q;
+  q->sem_next = NULL;
+  q->sem_prev = b->tail;
+  if (b->tail)
+    b->tail->sem_next = q;
+  else
+    b->head = q;
+  b->tail = q;
+  if (q->wait_until)
+    sem_timeout_add(q);
+}
+
+/** Take an entry out of the semaphore queue. This doesn't change the
+ * semaphore's count.
+ * \param q the entry.
+ */
+static void
+sem_remove(MQUE *q)
+{
+  struct sem_bucket *b =
+    sem_bucket_find(q->semaphore_obj, q->semaphore_attr, false);
+
+  if (q->prev)
+    q->prev->next = q->next;
+  else
+    qsemfirst = q->next;
+  if (q->next)
+    q->next->prev = q->prev;
+  else
+    qsemlast = q->prev;
+  q->next = q->prev = NULL;
+  if (q->sem_prev)
+    q->sem_prev->sem_next = q->sem_next;
+  else
+    b->head = q->sem_next;
+  if (q->sem_next)
+    q->sem_next->sem_prev = q->sem_prev;
+  else
+    b->tail = q->sem_prev;
+  q->sem_next = q->sem_prev = NULL;
+  if (!b->head)
+    sem_bucket_free(q->semaphore_obj, b);
+  if (q->sem_timeout >= 0)
+    sem_timeout_remove(q);
+  q->semaphore_obj = NOTHING;
+}
+
+/** Find the first entry waiting on a semaphore.
+ * \param thing the semaphore object.
+ * \param attr the attribute name, from atr_names, or NULL for any.
+ * \return the entry that's been waiting longest, or NULL.
+ */
+static MQUE *
+sem_first(dbref thing, const char *attr)
+{
+  struct sem_bucket *b;
+  MQUE *first = NULL;
+
+  for (b = im_find(sem_map, thing); b; b = b->next) {
+    if (attr && b->attr != attr)
+      continue;
+    if (!first || b->head->sem_seq < first->sem_seq)
+      first = b->head;
+  }
+  return first;
+}
+
+TEST_GROUP(sem_index)
+{
+  /* Entries waiting on two attributes of one object, some released one at a
+     time and the rest by @notify/all. */
+  intmap *saved_sem = sem_map, *saved_shares = run_shares;
+  struct run_share *saved_ring[2] = {run_ring[0], run_ring[1]};
+  MQUE *saved_first = qfirst, *saved_last = qlast;
+  MQUE *saved_semfirst = qsemfirst, *saved_semlast = qsemlast;
+  const char *attr[2];
+  MQUE entries[5], *q;
+  static const int released[] = {0, 1, 3, 4};
+  dbref thing = new_scratch_object();
+  int i;
+  bool ok = true;
+
+  sem_map = im_new();
+  run_shares = im_new();
+  run_ring[RUN_PLAYER] = run_ring[RUN_OBJECT] = NULL;
+  qfirst = qlast = qsemfirst = qsemlast = NULL;
+  attr[0] = st_insert("TEST_SEM_A", &atr_names);
+  attr[1] = st_insert("TEST_SEM_B", &atr_names);
+  memset(entries, 0, sizeof entries);
+  for (i = 0; i < 5; i++) {
+    entries[i].executor = NOTHING;
+    entries[i].semaphore_obj = thing;
+    entries[i].semaphore_attr = attr[i & 1];
+    entries[i].sem_timeout = -1;
+    sem_add(&entries[i]);
+  }
+  TEST("sem_index.1", im_count(sem_map) == 1 &&
+                        sem_first(thing, attr[0]) == &entries[0] &&
+                        sem_first(thing, attr[1]) == &entries[1] &&
+                        sem_first(thing, NULL) == &entries[0] &&
+                        !sem_first(thing + 1, NULL));
+  /* Taking one out of the middle */
+  sem_remove(&entries[2]);
+  TEST("sem_index.2", entries[2].semaphore_obj == NOTHING &&
+                        entries[0].sem_next == &entries[4] &&
+                        entries[4].sem_prev == &entries[0] &&
+                        entries[1].next == &entries[3]);
+  /* @notify releases the first entry on the attribute */
+  TEST("sem_index.3", execute_one_semaphore(thing, "TEST_SEM_A", NULL) &&
+                        entries[0].semaphore_obj == NOTHING &&
+                        qfirst == &entries[0] &&
+                        sem_first(thing, attr[0]) == &entries[4] &&
+                        qsemfirst == &entries[1]);
+  /* @notify/all releases the rest in the order they started waiting */
+  dequeue_semaphores(thing, NULL, 0, 1, 0);
+  for (i = 0, q = qfirst; i < 4; i++, q = q ? q->next : NULL) {
+    ok = ok && q == &entries[released[i]] && q->semaphore_obj == NOTHING;
+  }
+  TEST("sem_index.4", ok && !q && !qsemfirst && !qsemlast &&
+                        im_count(sem_map) == 0);
+  while (qfirst)
+    run_queue_remove(qfirst);
+  st_delete(attr[0], &atr_names);
+  st_delete(attr[1], &atr_names);
+  free_scratch_object(thing);
+  im_destroy(sem_map);
+  im_destroy(run_shares);
+  sem_map = saved_sem;
+  run_shares = saved_shares;
+  run_ring[0] = saved_ring[0];
+  run_ring[1] = saved_ring[1];
+  qfirst = saved_first;
+  qlast = saved_last;
+  qsemfirst = saved_semfirst;
+  qsemlast = saved_semlast;
+}
+
+/** Add an entry to the end of the command queue.
+ * \param q the entry.
+ */
+static void
+run_queue_add(MQUE *q)
+{
+  int cls = (q->queue_type & QUEUE_PLAYER) ? RUN_PLAYER : RUN_OBJECT;
+  dbref owner = GoodObject(q->executor) ? Owner(q->executor) : NOTHING;
+  im_key key = ((im_key) (owner + 1) << 1) | cls;
+  struct run_share *s = im_find(run_shares, key);
+
+  if (!s) {
+    /* New shares wait for their turn at the end of the rotation */
+    s = mush_malloc(sizeof *s, "mque.share");
+    s->key = key;
+    s->head = s->tail = NULL;
+    s->deficit = 0;
+    if (run_ring[cls]) {
+      s->ring_next = run_ring[cls];
+      s->ring_prev = run_ring[cls]->ring_prev;
+      s->ring_prev->ring_next = s;
+      s->ring_next->ring_prev = s;
+    } else {
+      s->ring_next = s->ring_prev = s;
+      run_ring[cls] = s;
+    }
+    im_insert(run_shares, key, s);
+  }
+  q->share = s;
+  q->share_next = NULL;
+  if (s->tail)
+    s->tail->share_next = q;
+  else
+    s->head = q;
+  s->tail = q;
+
+  q->next = NULL;
+  q->prev = qlast;
+  if (qlast)
+    qlast->next = q;
+  else
+    qfirst = q;
+  qlast = q;
+  q->queued_at = now_msecs();
+}
+
+/** Take an entry off the command queue. It must be the first in its share.
+ * \param q the entry.
+ */
+static void
+run_queue_remove(MQUE *q)
+{
+  struct run_share *s = q->share;
+
+  if (q->prev)
+    q->prev->next = q->next;
+  else
+    qfirst = q->next;
+  if (q->next)
+    q->next->prev = q->prev;
+  else
+    qlast = q->prev;
+  q->next = q->prev = NULL;
+
+  if (!(s->head = q->share_next)) {
+    int cls = s->key & 1;
+
+    s->tail = NULL;
+    if (s->ring_next == s) {
+      run_ring[cls] = NULL;
+    } else {
+      s->ring_prev->ring_next = s->ring_next;
+      s->ring_next->ring_prev = s->ring_prev;
+      if (run_ring[cls] == s) {
+        /* The next share's turn starts now */
+        run_ring[cls] = s->ring_next;
+        run_ring[cls]->deficit += RUN_SHARE_QUANTUM;
+      }
+    }
+    im_delete(run_shares, s->key);
+    mush_free(s, "mque.share");
+  }
+  q->share = NULL;
+  q->share_next = NULL;
+}
+
+/** Pick the next entry to run with the fair scheduler. */
+static MQUE *
+run_queue_next(void)
+{
+  int cls = run_ring[RUN_PLAYER] ? RUN_PLAYER : RUN_OBJECT;
+  struct run_share *s = run_ring[cls];
+
+  while (s->deficit <= 0) {
+    s = s->ring_next;
+    s->deficit += RUN_SHARE_QUANTUM;
+  }
+  run_ring[cls] = s;
+  return s->head;
+}
+
+/** Charge an owner's share for the time an entry took to run.
+ * \param key the share's key.
+ * \param usecs how long the entry took.
+ */
+static void
+run_queue_charge(im_key key, int64_t usecs)
+{
+  struct run_share *s = im_find(run_shares, key);
+
+  /* If the share was emptied, its turn is over anyway */
+  if (s) {
+    s->deficit -= usecs;
+    if (s->deficit < -RUN_SHARE_MAX_DEBT)
+      s->deficit = -RUN_SHARE_MAX_DEBT;
+  }
+}
+
+TEST_GROUP(run_queue)
+{
+  /* Two owners take turns, one's entries costing six times the other's.
+     The cheap owner gets more turns, and each owner's entries still run in
+     the order they were added. */
+  static const char expected[] = "BBABAA";
+  intmap *saved_shares = run_shares;
+  struct run_share *saved_ring[2] = {run_ring[0], run_ring[1]};
+  MQUE *saved_first = qfirst, *saved_last = qlast;
+  MQUE entries[6], *q;
+  int last[2] = {-1, -1};
+  char order[sizeof expected];
+  int i, n = 0;
+  bool ok = true;
+
+  run_shares = im_new();
+  run_ring[RUN_PLAYER] = run_ring[RUN_OBJECT] = NULL;
+  qfirst = qlast = NULL;
+  memset(entries, 0, sizeof entries);
+  for (i = 0; i < 6; i++) {
+    entries[i].executor = (i & 1) ? GOD : NOTHING;
+    run_queue_add(&entries[i]);
+  }
+  TEST("run_queue.1", im_count(run_shares) == 2 && qfirst == &entries[0]);
+  while (qfirst && n < 6) {
+    im_key key;
+    int who;
+
+    q = run_queue_next();
+    who = q->executor == GOD;
+    ok = ok && q - entries > last[who];
+    last[who] = q - entries;
+    order[n++] = who ? 'B' : 'A';
+    key = q->share->key;
+    run_queue_remove(q);
+    run_queue_charge(key, who ? 500 : 3000);
+  }
+  order[n] = '\0';
+  TEST("run_queue.2", ok && !qfirst && strcmp(order, expected) == 0);
+  TEST("run_queue.3", im_count(run_shares) == 0 && !run_ring[RUN_OBJECT]);
+  /* Debt is capped */
+  run_queue_add(&entries[0]);
+  run_queue_charge(entries[0].share->key, INT64_C(1) << 40);
+  TEST("run_queue.4", entries[0].share->deficit == -RUN_SHARE_MAX_DEBT);
+  run_queue_remove(&entries[0]);
+  im_destroy(run_shares);
+  run_shares = saved_shares;
+  run_ring[0] = saved_ring[0];
+  run_ring[1] = saved_ring[1];
+  qfirst = saved_first;
+  qlast = saved_last;
+}
+
+/** Record how long an entry waited in the command queue. */
+static void
+queue_delay_add(MQUE *q, int cls)
+{
+  uint64_t delay = now_msecs() - q->queued_at;
+  int b = 0;
+
+  while (b < QUEUE_DELAY_BUCKETS - 1 && delay >= (UINT64_C(1) << b))
+    b++;
+  queue_delays[cls][b] += 1;
+}
+
+/** Estimate a percentile of command queue delays.
+ * \param cls RUN_PLAYER or RUN_OBJECT.
+ * \param pct the percentile.
+ * \return the upper bound in milliseconds of the bucket holding it, 0 if
+ * it's the last bucket, or -1 if no entries have run.
+ */
+static int
+queue_delay_percentile(int cls, int pct)
+{
+  uint64_t total = 0, seen = 0;
+  int b;
+
+  for (b = 0; b < QUEUE_DELAY_BUCKETS; b++)
+    total += queue_delays[cls][b];
+  if (!total)
+    return -1;
+  for (b = 0; b < QUEUE_DELAY_BUCKETS - 1; b++) {
+    seen += queue_delays[cls][b];
+    if (seen * 100 >= total * pct)
+      return 1 << b;
+  }
+  return 0;
+}
+
+/** Describe command queue delays for @ps.
+ * \param cls RUN_PLAYER or RUN_OBJECT.
+ * \return a static buffer with the 50th, 95th and 99th percentiles.
+ */
+static const char *
+queue_delay_summary(int cls)
+{
+  static char buff[2][64];
+  static const int pcts[3] = {50, 95, 99};
+  char part[3][20];
+  int i;
+
+  for (i = 0; i < 3; i++) {
+    int ms = queue_delay_percentile(cls, pcts[i]);
+
+    if (ms < 0)
+      strcpy(part[i], "-");
+    else if (ms == 0)
+      snprintf(part[i], sizeof part[i], ">%dms",
+               1 << (QUEUE_DELAY_BUCKETS - 2));
+    else
+      snprintf(part[i], sizeof part[i], "<%dms", ms);
+  }
+  snprintf(buff[cls], sizeof buff[cls], "%s/%s/%s", part[0], part[1],
+           part[2]);
+  return buff[cls];
+}
+
 void
 init_queue(void)
 {
   queue_map = im_new();
+  sem_map = im_new();
+  run_shares = im_new();
 }
 
 /** Returns true if the attribute on thing can be used as a semaphore.
@@ -168,41 +1035,24 @@ add_to_generic(dbref player, int am, const char *name, uint32_t flags)
   return num;
 }
 
-/** Wrapper for add_to_generic() to incremement a player's QUEUE attribute.
- * \param player object whose QUEUE should be incremented
- * \param am amount to increment the QUEUE by
- * \retval new value of QUEUE
+/** Adjust the count of commands an object has queued.
+ * \param player object whose queue count should be incremented
+ * \param am amount to increment the count by
+ * \retval new queue count
  */
 static int
 add_to(dbref player, int am)
 {
-  sqlite3 *sqldb;
-  sqlite3_stmt *adder;
-  int status;
-  sqlite3_int64 newam;
-
   if (QUEUE_PER_OWNER) {
     player = Owner(player);
   }
 
-  sqldb = get_shared_db();
-  adder = prepare_statement(
-    sqldb, "UPDATE objects SET queue = remember(queue + ?, ?) WHERE dbref = ?",
-    "queue.add");
-  sqlite3_bind_int(adder, 1, am);
-  sqlite3_bind_pointer(adder, 2, &newam, "carray", NULL);
-  sqlite3_bind_int(adder, 3, player);
-
-  do {
-    status = sqlite3_step(adder);
-  } while (is_busy_status(status));
-  if (status != SQLITE_DONE) {
-    do_rawlog(LT_ERR, "Unable to update queue for #%d: %s", player,
-              sqlite3_errstr(status));
-    newam = -1;
+  if (!GoodObject(player)) {
+    return -1;
   }
-  sqlite3_reset(adder);
-  return newam;
+
+  QueueCount(player) += am;
+  return QueueCount(player);
 }
 
 /** Wrapper for add_to_generic() to incrememnt an attribute when a
@@ -262,7 +1112,7 @@ free_qentry(MQUE *entry)
   }
 
   if (entry->semaphore_attr) {
-    mush_free(entry->semaphore_attr, "mque.semaphore_attr");
+    st_delete(entry->semaphore_attr, &atr_names);
     entry->semaphore_attr = NULL;
   }
 
@@ -362,9 +1212,17 @@ new_queue_entry(NEW_PE_INFO *pe_info)
 
   entry->inplace = NULL;
   entry->next = NULL;
+  entry->prev = NULL;
 
   entry->semaphore_obj = NOTHING;
   entry->semaphore_attr = NULL;
+  entry->sem_next = NULL;
+  entry->sem_prev = NULL;
+  entry->sem_seq = 0;
+  entry->sem_timeout = -1;
+  entry->share = NULL;
+  entry->share_next = NULL;
+  entry->queued_at = 0;
   entry->wait_until = 0;
   entry->pid = 0;
   entry->action_list = NULL;
@@ -505,12 +1363,7 @@ queue_event(dbref enactor, const char *event, const char *fmt, ...)
   /* Hmm, should events queue ahead of anything else?
    * For now, yes, but leaving code here anyway.
    */
-  if (qlast) {
-    qlast->next = tmp;
-    qlast = tmp;
-  } else {
-    qlast = qfirst = tmp;
-  }
+  run_queue_add(tmp);
 
   /* All good! */
   im_insert(queue_map, tmp->pid, tmp);
@@ -563,12 +1416,7 @@ insert_que(MQUE *queue_entry, MQUE *parent_queue)
     (queue_entry->queue_type & (QUEUE_PLAYER | QUEUE_OBJECT | QUEUE_INPLACE))) {
   case QUEUE_PLAYER:
   case QUEUE_OBJECT:
-    if (qlast) {
-      qlast->next = queue_entry;
-      qlast = queue_entry;
-    } else {
-      qlast = qfirst = queue_entry;
-    }
+    run_queue_add(queue_entry);
     break;
   case QUEUE_INPLACE:
     if (parent_queue->inplace) {
@@ -841,7 +1689,7 @@ queue_attribute_useatr(dbref executor, ATTR *a, dbref enactor, PE_REGS *pe_regs,
       return 1;
     }
   } else {
-    strncpy(cmd_buff, atr_value(a), BUFFER_LEN);
+    strncpy(cmd_buff, atr_value_const(a), BUFFER_LEN);
     command = cmd_buff;
     /* Trim off $-command or ^-command prefix */
     if (*command == '$' || *command == '^') {
@@ -932,29 +1780,15 @@ wait_que(dbref executor, int waittill, char *command, dbref enactor, dbref sem,
   }
   tmp->semaphore_obj = sem;
   if (sem == NOTHING) {
-    /* No semaphore, put on normal wait queue, sorted by time */
-    MQUE *point, *trail = NULL;
-
-    for (point = qwait; point && (point->wait_until <= tmp->wait_until);
-         point = point->next)
-      trail = point;
-
-    tmp->next = point;
-    if (trail != NULL)
-      trail->next = tmp;
-    else
-      qwait = tmp;
+    /* No semaphore, put on normal wait queue */
+    wait_sync();
+    wait_add(tmp);
   } else {
 
     /* Put it on the end of the semaphore queue */
     tmp->semaphore_attr =
-      mush_strdup(semattr ? semattr : "SEMAPHORE", "mque.semaphore_attr");
-    if (qsemlast != NULL) {
-      qsemlast->next = tmp;
-      qsemlast = tmp;
-    } else {
-      qsemfirst = qsemlast = tmp;
-    }
+      st_insert(semattr ? semattr : "SEMAPHORE", &atr_names);
+    sem_add(tmp);
   }
   im_insert(queue_map, tmp->pid, tmp);
 }
@@ -1000,7 +1834,7 @@ void
 queue_update(void)
 {
   static time_t last_mudtime = 0;
-  MQUE *trail = NULL, *point, *next;
+  MQUE *point;
 
   if (mudtime == last_mudtime) {
     /* Only run once per second at most. */
@@ -1009,46 +1843,25 @@ queue_update(void)
   last_mudtime = mudtime;
 
   /* check regular @wait queue */
-  while (qwait && qwait->wait_until <= mudtime) {
-    point = qwait;
-    qwait = point->next;
-    point->next = NULL;
-    point->wait_until = 0;
-    if (qlast) {
-      qlast->next = point;
-      qlast = point;
-    } else {
-      qlast = qfirst = point;
-    }
+  wait_sync();
+  wait_run_slot(&wait_due);
+  while (wait_time <= mudtime) {
+    wait_run_slot(&WAIT_SLOT(0, (uint64_t) wait_time & (WAIT_WHEEL_SLOTS - 1)));
+    wait_tick();
   }
 
-  /* check for semaphore Zwait timeouts */
-  for (point = qsemfirst, trail = NULL; point; point = next) {
-    if (point->wait_until == 0 || point->wait_until > mudtime) {
-      next = (trail = point)->next;
-      continue; /* skip non-timed and those that haven't gone off yet */
-    }
-    if (trail != NULL)
-      trail->next = next = point->next;
-    else
-      qsemfirst = next = point->next;
-    if (point == qsemlast)
-      qsemlast = trail;
+  /* check for semaphore @wait timeouts */
+  while (sem_timeout_count && sem_timeouts[0]->wait_until <= mudtime) {
+    point = sem_timeouts[0];
     add_to_sem(point->semaphore_obj, -1, point->semaphore_attr);
-    point->semaphore_obj = NOTHING;
-    point->next = NULL;
-    if (qlast) {
-      qlast->next = point;
-      qlast = point;
-    } else {
-      qlast = qfirst = point;
-    }
+    sem_remove(point);
+    run_queue_add(point);
   }
 }
 
 /** Execute some commands from the top of the queue.
- * This function dequeues and executes commands on the normal
- * priority (player) queue.
+ * This function dequeues and executes commands on the command queue,
+ * oldest first, or picked by the fair scheduler if fair_queue is on.
  * \param ncom number of commands to execute.
  * \return number of commands executed.
  */
@@ -1057,6 +1870,8 @@ do_top(int ncom)
 {
   int i;
   MQUE *entry;
+  im_key key;
+  struct timeval start, end;
 
   for (i = 0; i < ncom; i++) {
     if (!qfirst)
@@ -1065,10 +1880,18 @@ do_top(int ncom)
     /* We must dequeue before execution, so that things like
      * queued @kick or @ps get a sane queue image.
      */
-    entry = qfirst;
-    if (!(qfirst = entry->next))
-      qlast = NULL;
-    do_entry(entry, 0);
+    entry = FAIR_QUEUE ? run_queue_next() : qfirst;
+    key = entry->share->key;
+    queue_delay_add(entry, key & 1);
+    run_queue_remove(entry);
+    if (FAIR_QUEUE) {
+      penn_gettimeofday(&start);
+      do_entry(entry, 0);
+      penn_gettimeofday(&end);
+      run_queue_charge(key, (end.tv_sec - start.tv_sec) * INT64_C(1000000) +
+                              (end.tv_usec - start.tv_usec));
+    } else
+      do_entry(entry, 0);
     free_qentry(entry);
   }
   return i;
@@ -1122,6 +1945,7 @@ do_entry(MQUE *entry, int include_recurses)
   MQUE *tmp;
   int pt_flag = PT_SEMI;
   PE_REGS *pe_regs;
+  bool profiled;
 
   if (entry->queue_type & QUEUE_NOLIST)
     pt_flag = PT_NOTHING;
@@ -1140,6 +1964,11 @@ do_entry(MQUE *entry, int include_recurses)
 
   queue_load_record[0] += 1;
 
+  profiled = PROFILE_SOFTCODE;
+  if (profiled) {
+    profile_push_attrname(entry->pe_info->attrname);
+  }
+
   s = entry->action_list;
   if (!include_recurses) {
     start_cpu_timer();
@@ -1247,6 +2076,10 @@ do_entry(MQUE *entry, int include_recurses)
     }
   }
 
+  if (profiled) {
+    profile_pop();
+  }
+
   if (!include_recurses)
     reset_cpu_timer();
 
@@ -1265,7 +2098,6 @@ uint64_t
 queue_msecs_till_next(void)
 {
   uint64_t min, curr;
-  MQUE *point;
   /* If there are commands in the player queue, they should be run
    * immediately.
    */
@@ -1280,21 +2112,35 @@ queue_msecs_till_next(void)
    * queue when they have one second to go.
    */
 
-  /* Wait queue is in sorted order so we only have to look at the first
-     item on it. Anything else is wasted time. */
-  if (qwait) {
-    curr = SECS_TO_MSECS(difftime(qwait->wait_until, mudtime));
+  /* The soonest @wait is the first overdue one, or in the first used
+     second of the wheel's current block. If that block is empty, wake up
+     when the wheel gets to the next one. */
+  if (wait_count) {
+    time_t when;
+
+    if (wait_due.head) {
+      when = wait_due.head->wait_until;
+    } else {
+      int n;
+
+      when = wait_time;
+      for (n = (uint64_t) when & (WAIT_WHEEL_SLOTS - 1); n < WAIT_WHEEL_SLOTS;
+           n++, when++) {
+        if (WAIT_SLOT(0, n).head)
+          break;
+      }
+    }
+    curr = when > mudtime ? SECS_TO_MSECS(difftime(when, mudtime)) : 0;
     if (curr < min)
       min = curr;
   }
 
-  for (point = qsemfirst; point; point = point->next) {
-    if (point->wait_until == 0) /* no timeout */
-      continue;
-    curr = SECS_TO_MSECS(difftime(point->wait_until, mudtime));
-    if (curr < min) {
+  if (sem_timeout_count) {
+    curr = sem_timeouts[0]->wait_until > mudtime
+             ? SECS_TO_MSECS(difftime(sem_timeouts[0]->wait_until, mudtime))
+             : 0;
+    if (curr < min)
       min = curr;
-    }
   }
 
   return min;
@@ -1323,31 +2169,19 @@ drain_helper(dbref player __attribute__((__unused__)), dbref thing,
 int
 execute_one_semaphore(dbref thing, char const *aname, PE_REGS *pe_regs)
 {
-  MQUE **point;
   MQUE *entry;
+  const char *attr = NULL;
 
-  /* Go through the semaphore queue and do it */
-  point = &qsemfirst;
-  while (*point) {
-    entry = *point;
-    if (entry->semaphore_obj != thing ||
-        (aname && strcmp(entry->semaphore_attr, aname))) {
-      point = &(entry->next);
-      continue;
-    }
-
-    /* Remove the queue entry from the semaphore list */
-    *point = entry->next;
-    entry->next = NULL;
-    if (qsemlast == entry) {
-      qsemlast = qsemfirst;
-      if (qsemlast)
-        while (qsemlast->next)
-          qsemlast = qsemlast->next;
-    }
+  /* Attribute names of waiting entries are all in atr_names */
+  if (aname && !(attr = st_find(aname, &atr_names)))
+    return 0;
 
-    /* Update bookkeeping */
+  /* Find the first entry waiting on the semaphore and do it */
+  entry = sem_first(thing, attr);
+  if (entry) {
+    /* Update bookkeeping, and remove it from the semaphore queue */
     add_to_sem(entry->semaphore_obj, -1, entry->semaphore_attr);
+    sem_remove(entry);
 
     if (pe_regs) {
       if (entry->pe_info == NULL) {
@@ -1357,12 +2191,7 @@ execute_one_semaphore(dbref thing, char const *aname, PE_REGS *pe_regs)
     }
 
     /* And enqueue */
-    if (qlast) {
-      qlast->next = entry;
-      qlast = entry;
-    } else {
-      qlast = qfirst = entry;
-    }
+    run_queue_add(entry);
     return 1;
   }
   return 0;
@@ -1382,35 +2211,23 @@ dequeue_semaphores(dbref thing, char const *aname, int count, int all,
                    int drain)
 {
 
-  MQUE **point;
   MQUE *entry;
+  const char *attr = NULL;
 
   if (all)
     count = INT_MAX;
 
-  /* Go through the semaphore queue and do it */
-  point = &qsemfirst;
-  while (*point && count > 0) {
-    entry = *point;
-    if (entry->semaphore_obj != thing ||
-        (aname && strcmp(entry->semaphore_attr, aname))) {
-      point = &(entry->next);
-      continue;
-    }
-
-    /* Remove the queue entry from the semaphore list */
-    *point = entry->next;
-    entry->next = NULL;
-    if (qsemlast == entry) {
-      qsemlast = qsemfirst;
-      if (qsemlast)
-        while (qsemlast->next)
-          qsemlast = qsemlast->next;
-    }
-
-    /* Update bookkeeping */
+  /* Go through the entries waiting on the semaphore and do them. Attribute
+     names of waiting entries are all in atr_names. */
+  if (aname && !(attr = st_find(aname, &atr_names)))
+    entry = NULL;
+  else
+    entry = sem_first(thing, attr);
+  for (; entry && count > 0; entry = sem_first(thing, attr)) {
+    /* Update bookkeeping, and remove it from the semaphore queue */
     count--;
     add_to_sem(entry->semaphore_obj, -1, entry->semaphore_attr);
+    sem_remove(entry);
 
     /* Dispose of the entry as appropriate: discard if @drain, or put
      * into either the player or the object queue. */
@@ -1419,12 +2236,7 @@ dequeue_semaphores(dbref thing, char const *aname, int count, int all,
       add_to(entry->executor, -1);
       free_qentry(entry);
     } else {
-      if (qlast) {
-        qlast->next = entry;
-        qlast = entry;
-      } else {
-        qlast = qfirst = entry;
-      }
+      run_queue_add(entry);
     }
   }
 
@@ -1639,8 +2451,8 @@ void
 do_waitpid(dbref player, const char *pidstr, const char *timestr, bool until)
 {
   uint32_t pid;
-  MQUE *q, *tmp, *last;
-  bool found;
+  MQUE *q;
+  bool waiting;
 
   if (!is_strict_uinteger(pidstr)) {
     notify(player, T("That is not a valid pid!"));
@@ -1671,6 +2483,12 @@ do_waitpid(dbref player, const char *pidstr, const char *timestr, bool until)
     return;
   }
 
+  waiting = wait_queued(q);
+  if (waiting)
+    wait_remove(q);
+  else if (q->sem_timeout >= 0)
+    sem_timeout_remove(q);
+
   if (until) {
     int when;
 
@@ -1696,42 +2514,13 @@ do_waitpid(dbref player, const char *pidstr, const char *timestr, bool until)
       q->wait_until = 0;
   }
 
-  /* Now adjust it in the wait queue. Not a clever approach, but I
-     wrote it at 3 am and clever was not an option. */
-  found = false;
-  for (tmp = qwait, last = NULL; tmp; last = tmp, tmp = tmp->next) {
-    if (tmp == q) {
-      if (last)
-        last->next = q->next;
-      else
-        qwait = qwait->next;
-      found = true;
-      break;
-    }
-  }
-  if (found) {
-    found = false;
-    for (tmp = qwait, last = NULL; tmp; last = tmp, tmp = tmp->next) {
-      if (tmp->wait_until > q->wait_until) {
-        if (last) {
-          last->next = q;
-          q->next = tmp;
-        } else {
-          q->next = qwait;
-          qwait = q;
-        }
-        found = true;
-        break;
-      }
-    }
-    if (!found) {
-      if (last)
-        last->next = q;
-      else
-        qwait = q;
-      q->next = NULL;
-    }
-  }
+  /* Now put it where it belongs in the wait queue or semaphore timeouts. A
+     semaphore timeout of 0 means it waits forever. */
+  if (waiting) {
+    wait_sync();
+    wait_add(q);
+  } else if (q->semaphore_obj != NOTHING && q->wait_until)
+    sem_timeout_add(q);
 
   notify_format(player, T("Queue entry with pid %u updated."),
                 (unsigned int) pid);
@@ -1894,7 +2683,12 @@ FUNCTION(fun_lpids)
     }
   }
   if (qmask & LPIDS_WAIT) {
-    for (tmp = qwait; tmp; tmp = tmp->next) {
+    MQUE **waits;
+    int i, count;
+
+    waits = wait_queue_list(&count);
+    for (i = 0; i < count; i++) {
+      tmp = waits[i];
       if (GoodObject(player) && GoodObject(tmp->executor) &&
           ((qmask & LPIDS_INDEPENDENT) ? (tmp->executor != player)
                                        : !Owns(tmp->executor, player))) {
@@ -1905,6 +2699,8 @@ FUNCTION(fun_lpids)
       safe_integer(tmp->pid, buff, bp);
       first = false;
     }
+    if (waits)
+      mush_free(waits, "mque.wait_list");
   }
   if (qmask & LPIDS_SEMAPHORE) {
     for (tmp = qsemfirst; tmp; tmp = tmp->next) {
@@ -1924,23 +2720,31 @@ FUNCTION(fun_lpids)
   }
 }
 
+/* Count, and maybe show, one entry of a queue for @ps */
+static void
+show_queue_entry(dbref player, dbref victim, int q_type, int q_quiet,
+                 int q_all, MQUE *tmp, int *tot, int *self, int *del)
+{
+  (*tot)++;
+  if (!GoodObject(tmp->executor))
+    (*del)++;
+  else if (q_all || (Owner(tmp->executor) == victim)) {
+    if ((LookQueue(player) || Owns(tmp->executor, player))) {
+      (*self)++;
+      if (!q_quiet)
+        show_queue_single(player, tmp, q_type);
+    }
+  }
+}
+
 static void
 show_queue(dbref player, dbref victim, int q_type, int q_quiet, int q_all,
            MQUE *q_ptr, int *tot, int *self, int *del)
 {
   MQUE *tmp;
-  for (tmp = q_ptr; tmp; tmp = tmp->next) {
-    (*tot)++;
-    if (!GoodObject(tmp->executor))
-      (*del)++;
-    else if (q_all || (Owner(tmp->executor) == victim)) {
-      if ((LookQueue(player) || Owns(tmp->executor, player))) {
-        (*self)++;
-        if (!q_quiet)
-          show_queue_single(player, tmp, q_type);
-      }
-    }
-  }
+  for (tmp = q_ptr; tmp; tmp = tmp->next)
+    show_queue_entry(player, victim, q_type, q_quiet, q_all, tmp, tot, self,
+                     del);
 }
 
 /* Show a single queue entry */
@@ -2062,6 +2866,8 @@ do_queue(dbref player, const char *what, enum queue_type flag)
   int dpq = 0, dwq = 0, dsq = 0;
   int pq = 0, wq = 0, sq = 0;
   int tpq = 0, twq = 0, tsq = 0;
+  MQUE **waits;
+  int i, nwaits;
   if (flag == QUEUE_SUMMARY || flag == QUEUE_QUICK)
     quick = 1;
   if (flag == QUEUE_ALL || flag == QUEUE_SUMMARY) {
@@ -2099,7 +2905,12 @@ do_queue(dbref player, const char *what, enum queue_type flag)
     show_queue(player, victim, 0, quick, all, qfirst, &tpq, &pq, &dpq);
     if (!quick)
       notify(player, T("Wait Queue:"));
-    show_queue(player, victim, 1, quick, all, qwait, &twq, &wq, &dwq);
+    waits = wait_queue_list(&nwaits);
+    for (i = 0; i < nwaits; i++)
+      show_queue_entry(player, victim, 1, quick, all, waits[i], &twq, &wq,
+                       &dwq);
+    if (waits)
+      mush_free(waits, "mque.wait_list");
     if (!quick)
       notify(player, T("Semaphore Queue:"));
     show_queue(player, victim, 2, quick, all, qsemfirst, &tsq, &sq, &dsq);
@@ -2113,6 +2924,11 @@ do_queue(dbref player, const char *what, enum queue_type flag)
                   average32(queue_load_record, 60),
                   average32(queue_load_record, 300),
                   average32(queue_load_record, 900));
+    notify_format(player,
+                  T("Queue delay (50th/95th/99th percentile): Player...%s  "
+                    "Object...%s"),
+                  queue_delay_summary(RUN_PLAYER),
+                  queue_delay_summary(RUN_OBJECT));
   }
 }
 
@@ -2168,8 +2984,8 @@ do_queue_single(dbref player, char *pidstr, bool debug)
 void
 do_halt(dbref owner, const char *ncom, dbref victim)
 {
-  MQUE *tmp, *trail = NULL, *point, *next;
-  int num = 0;
+  MQUE *tmp, *point, *next;
+  int num = 0, i;
   dbref player;
   if (victim == NOTHING)
     player = owner;
@@ -2187,36 +3003,29 @@ do_halt(dbref owner, const char *ncom, dbref victim)
     }
   }
   /* remove wait q stuff */
-  for (point = qwait; point; point = next) {
-    if (((point->executor == player) || (Owner(point->executor) == player))) {
-      num--;
-      giveto(player, QUEUE_COST);
-      if (trail)
-        trail->next = next = point->next;
-      else
-        qwait = next = point->next;
-      free_qentry(point);
-    } else {
-      next = (trail = point)->next;
+  for (i = 0; i < WAIT_SLOT_COUNT; i++) {
+    for (point = wait_slots[i].head; point; point = next) {
+      next = point->next;
+      if (((point->executor == player) || (Owner(point->executor) == player))) {
+        num--;
+        giveto(player, QUEUE_COST);
+        wait_remove(point);
+        free_qentry(point);
+      }
     }
   }
 
   /* clear semaphore queue */
 
-  for (point = qsemfirst, trail = NULL; point; point = next) {
+  for (point = qsemfirst; point; point = next) {
+    next = point->next;
     if (((point->executor == player) || (Owner(point->executor) == player))) {
       num--;
       giveto(player, QUEUE_COST);
-      if (trail)
-        trail->next = next = point->next;
-      else
-        qsemfirst = next = point->next;
-      if (point == qsemlast)
-        qsemlast = trail;
       add_to_sem(point->semaphore_obj, -1, point->semaphore_attr);
+      sem_remove(point);
       free_qentry(point);
-    } else
-      next = (trail = point)->next;
+    }
   }
 
   add_to(player, num);
@@ -2315,22 +3124,10 @@ do_haltpid(dbref player, const char *arg1)
      turn comes up (Or show it in @ps, etc.).  Exception is for
      semaphores, which otherwise might wait forever. */
   q->executor = NOTHING;
-  if (q->semaphore_attr) {
-    MQUE *last = NULL, *tmp;
-    for (tmp = qsemfirst; tmp; last = tmp, tmp = tmp->next) {
-      if (tmp == q) {
-        if (last)
-          last->next = tmp->next;
-        else
-          qsemfirst = tmp->next;
-        if (qsemlast == tmp)
-          qsemlast = last;
-        break;
-      }
-    }
-
+  if (q->semaphore_obj != NOTHING) {
     giveto(victim, QUEUE_COST);
     add_to_sem(q->semaphore_obj, -1, q->semaphore_attr);
+    sem_remove(q);
     free_qentry(q);
   }
 
@@ -2458,9 +3255,23 @@ do_restart_com(dbref player, const char *arg1)
 void
 shutdown_queues(void)
 {
-  shutdown_a_queue(&qfirst, &qlast);
-  shutdown_a_queue(&qsemfirst, &qsemlast);
-  shutdown_a_queue(&qwait, NULL);
+  int i;
+
+  while (qfirst) {
+    MQUE *entry = qfirst;
+
+    run_queue_remove(entry);
+    shutdown_a_queue(&entry, NULL);
+  }
+  while (qsemfirst) {
+    MQUE *entry = qsemfirst;
+
+    sem_remove(entry);
+    shutdown_a_queue(&entry, NULL);
+  }
+  for (i = 0; i < WAIT_SLOT_COUNT; i++)
+    shutdown_a_queue(&wait_slots[i].head, &wait_slots[i].tail);
+  wait_count = 0;
 }
 
 static void
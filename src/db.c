@@ -30,6 +30,13 @@
 #ifdef HAVE_INTTYPES_H
 #include <inttypes.h>
 #endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#include <signal.h>
+#endif
 
 #include "ansi.h"
 #include "attrib.h"
@@ -41,9 +48,11 @@
 #include "extmail.h"
 #include "flags.h"
 #include "game.h"
+#include "hash_function.h"
 #include "htab.h"
 #include "lock.h"
 #include "log.h"
+#include "map_file.h"
 #include "memcheck.h"
 #include "mushdb.h"
 #include "mymalloc.h"
@@ -53,6 +62,7 @@
 #include "strutil.h"
 #include "mushsql.h"
 #include "charclass.h"
+#include "tests.h"
 
 #ifdef WIN32
 #pragma warning(disable : 4761) /* disable warning re conversion */
@@ -62,6 +72,11 @@
 void shutdown_checkpoint(void);
 #endif
 
+/** Read the objects of a database with help from other threads. */
+#if defined(HAVE_PTHREAD_H) && !defined(WIN32)
+#define DB_PARALLEL_LOAD
+#endif
+
 /** Get a ref out of the database if a given db flag is set */
 #define MAYBE_GET(f, x) (globals.indb_flags & (x)) ? getref(f) : 0
 
@@ -84,12 +99,14 @@ const char EOD[] = "***END OF DUMP***\n";
 #endif                       /* DB_INITIAL_SIZE */
 
 dbref db_size = DB_INITIAL_SIZE; /**< Current size of db array */
+int *db_queue_counts = NULL;     /**< Queued command counts, by dbref */
 
 static void db_grow(dbref newtop);
 
 static void db_write_obj_basic(PENNFILE *f, dbref i, struct object *o);
 int db_paranoid_write_object(PENNFILE *f, dbref i, int flag);
 int db_write_object(PENNFILE *f, dbref i);
+int db_write_object_as(PENNFILE *f, dbref i, struct object *o);
 void putlocks(PENNFILE *f, lock_list *l);
 void getlocks(dbref i, PENNFILE *f);
 void get_new_locks(dbref i, PENNFILE *f, int c);
@@ -101,6 +118,29 @@ static void db_write_flags(PENNFILE *f);
 static void db_write_attrs(PENNFILE *f);
 static dbref db_read_oldstyle(PENNFILE *f);
 static void add_object_table(dbref);
+static void penn_fspan(PENNFILE *f, const char stops[256], char *buff,
+                       char **bp);
+static void parallel_load_start(PENNFILE *f);
+static void parallel_load_end(PENNFILE *f);
+#ifdef DB_PARALLEL_LOAD
+static bool parallel_load_reading(PENNFILE *f);
+static bool parallel_load_next(PENNFILE *f);
+static bool parallel_load_attrs(PENNFILE *f, dbref i, int count);
+static void bindb_free(struct bindb *b);
+static void db_write_binary_header(PENNFILE *f, int dbflag);
+static void db_write_binary_object(PENNFILE *f, dbref i, struct object *o);
+static void db_write_binary_footer(PENNFILE *f);
+static bool db_read_binary_header(PENNFILE *f);
+static bool db_read_binary_objects(PENNFILE *f, sqlite3_stmt *adder);
+static void db_read_count_type(dbref i);
+static void db_read_object_done(dbref i, sqlite3_stmt *adder);
+#endif
+
+/** Characters that end a run of plain text in a quoted string */
+static const char span_quoted[256] = {['"'] = 1, ['\\'] = 1, ['\0'] = 1,
+                                      ['\n'] = 1};
+/** Characters that end a run of plain text in an unquoted string */
+static const char span_line[256] = {['\0'] = 1, ['\n'] = 1};
 
 StrTree object_names; /**< String tree of object names */
 extern StrTree atr_names;
@@ -147,6 +187,7 @@ static void
 db_grow(dbref newtop)
 {
   struct object *newdb;
+  int *newcounts;
   dbref initialized;
   struct object *o;
 
@@ -165,6 +206,10 @@ db_grow(dbref newtop)
         do_rawlog(LT_ERR, "ERROR: out of memory while creating database!");
         abort();
       }
+      if ((db_queue_counts = malloc(db_size * sizeof(int))) == NULL) {
+        do_rawlog(LT_ERR, "ERROR: out of memory while creating database!");
+        abort();
+      }
     }
     /* maybe grow it */
     if (db_top > db_size) {
@@ -177,6 +222,12 @@ db_grow(dbref newtop)
         abort();
       }
       db = newdb;
+      if ((newcounts = realloc(db_queue_counts, db_size * sizeof(int))) ==
+          NULL) {
+        do_rawlog(LT_ERR, "ERROR: out of memory while extending database!");
+        abort();
+      }
+      db_queue_counts = newcounts;
     }
     while (initialized < db_top) {
       o = db + initialized;
@@ -198,6 +249,7 @@ db_grow(dbref newtop)
       o->attrcount = 0;
       o->attrcap = 0;
       o->list = NULL;
+      db_queue_counts[initialized] = 0;
       initialized++;
     }
   }
@@ -237,6 +289,7 @@ new_object(void)
   o->warnings = 0;
   o->modification_time = o->creation_time = mudtime;
   o->attrcount = 0;
+  QueueCount(newobj) = 0;
   /* Flags are set by the functions that call this */
   o->powers = new_flag_bitmask("POWER");
   if (current_state.garbage) {
@@ -391,6 +444,7 @@ db_read_labeled_string(PENNFILE *f, char **label, char **value)
     int sline;
     sline = dbline;
     for (;;) {
+      penn_fspan(f, span_quoted, vbuf, &p);
       c = penn_fgetc(f);
       if (c == '"')
         break;
@@ -658,7 +712,7 @@ db_write_obj_basic(PENNFILE *f, dbref i, struct object *o)
   db_write_labeled_dbref(f, "owner", o->owner);
   db_write_labeled_dbref(f, "zone", o->zone);
   db_write_labeled_int(f, "pennies", Pennies(i));
-  db_write_labeled_int(f, "type", Typeof(i));
+  db_write_labeled_int(f, "type", o->type & ~TYPE_MARKED);
   db_write_labeled_string(f, "flags",
                           bits_to_string("FLAG", o->flags, GOD, NOTHING));
   db_write_labeled_string(f, "powers",
@@ -676,11 +730,29 @@ db_write_obj_basic(PENNFILE *f, dbref i, struct object *o)
 int
 db_write_object(PENNFILE *f, dbref i)
 {
-  struct object *o;
+  return db_write_object_as(f, i, db + i);
+}
+
+/** Write out an object, taking its basic fields from a copy.
+ * The incremental dumper uses this to write an object's links as they
+ * were when the dump began. Locks, pennies and attributes always come
+ * from the object itself.
+ * \param f file pointer to write to.
+ * \param i dbref of object to write.
+ * \param o the fields to write for it.
+ */
+int
+db_write_object_as(PENNFILE *f, dbref i, struct object *o)
+{
   ALIST *list;
   int count = 0;
 
-  o = db + i;
+  if (f->bin) {
+    db_write_binary_object(f, i, o);
+    return 0;
+  }
+
+  penn_fprintf(f, "!%d\n", i);
   db_write_obj_basic(f, i, o);
 
   /* write the attribute list */
@@ -705,27 +777,16 @@ db_write_object(PENNFILE *f, dbref i)
   return 0;
 }
 
-/** Write out the object database to disk.
- * \verbatim
- * This function writes the databsae out to disk. The database
- * structure currently looks something like this:
- * +V<header line>
- * savedtime <timestamp>
- * +FLAGS LIST
- * <flag data>
- * +POWERS LIST
- * <flag data>
- * ~<number of objects>
- * <object data>
- * \endverbatim
+/** Write out the start of the object database.
+ * This is everything in the file before the first object: the header
+ * line, flag, power and attribute tables, and the object count.
+ * If binary_dump is on, the rest of a normal dump is binary.
  * \param f file pointer to write to.
  * \param flag 0 for normal dump, DBF_PANIC for panic dumps.
- * \return the number of objects in the database (db_top)
  */
-dbref
-db_write(PENNFILE *f, int flag)
+void
+db_write_header(PENNFILE *f, int flag)
 {
-  dbref i;
   int dbflag;
 
   /* print a header line to make a later conversion to 2.0 easier to do.
@@ -757,11 +818,15 @@ db_write(PENNFILE *f, int flag)
   dbflag += DBF_HEAR_CONNECT;
   dbflag += DBF_NEW_VERSIONS;
 
-  penn_fprintf(f, "+V%d\n", dbflag * 256 + 2);
+  if (BINARY_DUMP && !(flag & DBF_PANIC)) {
+    db_write_binary_header(f, dbflag - 5);
+  } else {
+    penn_fprintf(f, "+V%d\n", dbflag * 256 + 2);
 
-  db_write_labeled_int(f, "dbversion", NDBF_VERSION);
+    db_write_labeled_int(f, "dbversion", NDBF_VERSION);
 
-  db_write_labeled_string(f, "savedtime", show_time(mudtime, 1));
+    db_write_labeled_string(f, "savedtime", show_time(mudtime, 1));
+  }
 
   db_write_flags(f);
 
@@ -769,6 +834,45 @@ db_write(PENNFILE *f, int flag)
 
   penn_fprintf(f, "~%d\n", db_top);
 
+  if (f->bin)
+    penn_fputs("!\n", f);
+}
+
+/** Write out the end of dump marker.
+ * \param f file pointer to write to.
+ */
+void
+db_write_footer(PENNFILE *f)
+{
+  if (f->bin)
+    db_write_binary_footer(f);
+  penn_fputs(EOD, f);
+}
+
+/** Write out the object database to disk.
+ * \verbatim
+ * This function writes the databsae out to disk. The database
+ * structure currently looks something like this:
+ * +V<header line>
+ * savedtime <timestamp>
+ * +FLAGS LIST
+ * <flag data>
+ * +POWERS LIST
+ * <flag data>
+ * ~<number of objects>
+ * <object data>
+ * \endverbatim
+ * \param f file pointer to write to.
+ * \param flag 0 for normal dump, DBF_PANIC for panic dumps.
+ * \return the number of objects in the database (db_top)
+ */
+dbref
+db_write(PENNFILE *f, int flag)
+{
+  dbref i;
+
+  db_write_header(f, flag);
+
   for (i = 0; i < db_top; i++) {
 #ifdef WIN32SERVICES
     /* Keep the service manager happy */
@@ -777,10 +881,9 @@ db_write(PENNFILE *f, int flag)
 #endif
     if (IsGarbage(i))
       continue;
-    penn_fprintf(f, "!%d\n", i);
     db_write_object(f, i);
   }
-  penn_fputs(EOD, f);
+  db_write_footer(f);
   return db_top;
 }
 
@@ -1085,10 +1188,12 @@ getstring_noalloc(PENNFILE *f)
         return buf;
       }
       safe_chr(c, buf, &p);
+      penn_fspan(f, span_line, buf, &p);
       c = penn_fgetc(f);
     }
   } else {
     for (;;) {
+      penn_fspan(f, span_quoted, buf, &p);
       c = penn_fgetc(f);
       if (c == '"') {
         /* It's a closing quote if it's followed by \r or \n */
@@ -1215,6 +1320,8 @@ db_free(void)
 
     free((char *) db);
     db = NULL;
+    free(db_queue_counts);
+    db_queue_counts = NULL;
     db_init = db_top = 0;
   }
 }
@@ -1340,6 +1447,11 @@ db_read_attrs(PENNFILE *f, dbref i, int count)
   int found = 0;
   ansi_string *as;
 
+#ifdef DB_PARALLEL_LOAD
+  if (parallel_load_attrs(f, i, count))
+    return;
+#endif
+
   attr_reserve(i, count);
 
   for (;;) {
@@ -1603,6 +1715,79 @@ db_read_oldstyle(PENNFILE *f)
   }
 }
 
+/* Count a newly read object in current_state by its type. */
+static void
+db_read_count_type(dbref i)
+{
+  switch (Typeof(i)) {
+  case TYPE_PLAYER:
+    current_state.players++;
+    current_state.garbage--;
+    break;
+  case TYPE_THING:
+    current_state.things++;
+    current_state.garbage--;
+    break;
+  case TYPE_EXIT:
+    current_state.exits++;
+    current_state.garbage--;
+    break;
+  case TYPE_ROOM:
+    current_state.rooms++;
+    current_state.garbage--;
+    break;
+  }
+}
+
+/* Finish off an object once all its fields have been read. */
+static void
+db_read_object_done(dbref i, sqlite3_stmt *adder)
+{
+  struct object *o = db + i;
+  int status;
+
+  sqlite3_bind_int(adder, 1, i);
+  do {
+    status = sqlite3_step(adder);
+  } while (is_busy_status(status));
+  if (status != SQLITE_DONE) {
+    do_rawlog(LT_ERR, "Unable to add #%d to objects table: %s", i,
+              sqlite3_errstr(status));
+  }
+  sqlite3_reset(adder);
+
+  if (IsPlayer(i) && (strlen(o->name) > (size_t) PLAYER_NAME_LIMIT)) {
+    char buff[BUFFER_LEN]; /* The name plus a NUL */
+    mush_strncpy(buff, o->name, PLAYER_NAME_LIMIT);
+    set_name(i, buff);
+    do_rawlog(LT_CHECK,
+              " * Name of #%d is longer than the maximum, truncating.\n", i);
+  } else if (!IsPlayer(i) && (strlen(o->name) > OBJECT_NAME_LIMIT)) {
+    char buff[OBJECT_NAME_LIMIT + 1]; /* The name plus a NUL */
+    mush_strncpy(buff, o->name, OBJECT_NAME_LIMIT);
+    set_name(i, buff);
+    do_rawlog(LT_CHECK,
+              " * Name of #%d is longer than the maximum, truncating.\n", i);
+  }
+  if (IsPlayer(i)) {
+    add_player(i);
+    clear_flag_internal(i, "CONNECTED");
+    /* If it has the MONITOR flag and the db predates HEAR_CONNECT, swap
+     * them over */
+    if (!(globals.indb_flags & DBF_HEAR_CONNECT) &&
+        has_flag_by_name(i, "MONITOR", NOTYPE)) {
+      clear_flag_internal(i, "MONITOR");
+      set_flag_internal(i, "HEAR_CONNECT");
+    }
+  }
+
+  if (globals.new_indb_version < 4 && IsRoom(i) &&
+      has_flag_by_name(i, "HAVEN", TYPE_ROOM)) {
+    /* HAVEN flag is no longer settable on rooms. */
+    clear_flag_internal(i, "HAVEN");
+  }
+}
+
 /** Read the object database from a file.
  * This function reads the entire database from a file. See db_write()
  * for some notes about the expected format.
@@ -1614,7 +1799,6 @@ db_read(PENNFILE *f)
 {
   sqlite3 *sqldb;
   sqlite3_stmt *adder;
-  int status;
   int c;
   dbref i = 0;
   char *tmp;
@@ -1638,11 +1822,15 @@ db_read(PENNFILE *f)
     return -1;
   }
   c = penn_fgetc(f);
-  if (c != 'V') {
+  if (c == 'B') {
+    /* Binary database. The version and timestamp are in its header. */
+    if (!db_read_binary_header(f))
+      return -1;
+  } else if (c != 'V') {
     do_rawlog(LT_ERR, "Database does not start with a version string");
     return -1;
-  }
-  globals.indb_flags = ((getref(f) - 2) / 256) - 5;
+  } else
+    globals.indb_flags = ((getref(f) - 2) / 256) - 5;
   /* if you want to read in an old-style database, use an earlier
    * patchlevel to upgrade.
    */
@@ -1652,19 +1840,25 @@ db_read(PENNFILE *f)
     return -1;
   }
 
-  if (!(globals.indb_flags & DBF_LABELS))
-    return db_read_oldstyle(f);
+  if (!f->bin) {
+    if (!(globals.indb_flags & DBF_LABELS))
+      return db_read_oldstyle(f);
 
-  if ((globals.indb_flags & DBF_NEW_VERSIONS)) {
-    db_read_this_labeled_int(f, "dbversion", &i);
-    globals.new_indb_version = i;
-  }
+    if ((globals.indb_flags & DBF_NEW_VERSIONS)) {
+      db_read_this_labeled_int(f, "dbversion", &i);
+      globals.new_indb_version = i;
+    }
 
-  db_read_this_labeled_string(f, "savedtime", &tmp);
-  strcpy(db_timestamp, tmp);
+    db_read_this_labeled_string(f, "savedtime", &tmp);
+    strcpy(db_timestamp, tmp);
+  }
 
   do_rawlog(LT_ERR, "Loading database saved on %s UTC", db_timestamp);
 
+  /* Old databases need their attributes' ANSI converted as they're read */
+  if ((globals.indb_flags & DBF_SPIFFY_AF_ANSI) && !f->bin)
+    parallel_load_start(f);
+
   sqlite3_exec(sqldb, "BEGIN TRANSACTION", NULL, NULL, NULL);
   adder = prepare_statement(sqldb, "INSERT INTO objects(dbref) VALUES (?)",
                             "objects.add");
@@ -1701,6 +1895,13 @@ db_read(PENNFILE *f)
       db_init = (getref(f) * 3) / 2;
       break;
     case '!':
+      if (f->bin) {
+        if (!db_read_binary_objects(f, adder)) {
+          sqlite3_exec(sqldb, "ROLLBACK TRANSACTION", NULL, NULL, NULL);
+          return -1;
+        }
+        break;
+      }
       /* Read an object */
       {
         char *label, *value;
@@ -1806,24 +2007,7 @@ db_read(PENNFILE *f)
             break;
           case LBL_TYPE:
             o->type = parse_integer(value);
-            switch (Typeof(i)) {
-            case TYPE_PLAYER:
-              current_state.players++;
-              current_state.garbage--;
-              break;
-            case TYPE_THING:
-              current_state.things++;
-              current_state.garbage--;
-              break;
-            case TYPE_EXIT:
-              current_state.exits++;
-              current_state.garbage--;
-              break;
-            case TYPE_ROOM:
-              current_state.rooms++;
-              current_state.garbage--;
-              break;
-            }
+            db_read_count_type(i);
             break;
           case LBL_FLAGS:
             o->flags = string_to_bits("FLAG", value);
@@ -1857,48 +2041,7 @@ db_read(PENNFILE *f)
             return -1;
           }
         }
-        sqlite3_bind_int(adder, 1, i);
-        do {
-          status = sqlite3_step(adder);
-        } while (is_busy_status(status));
-        if (status != SQLITE_DONE) {
-          do_rawlog(LT_ERR, "Unable to add #%d to objects table: %s", i,
-                    sqlite3_errstr(status));
-        }
-        sqlite3_reset(adder);
-
-        if (IsPlayer(i) && (strlen(o->name) > (size_t) PLAYER_NAME_LIMIT)) {
-          char buff[BUFFER_LEN]; /* The name plus a NUL */
-          mush_strncpy(buff, o->name, PLAYER_NAME_LIMIT);
-          set_name(i, buff);
-          do_rawlog(LT_CHECK,
-                    " * Name of #%d is longer than the maximum, truncating.\n",
-                    i);
-        } else if (!IsPlayer(i) && (strlen(o->name) > OBJECT_NAME_LIMIT)) {
-          char buff[OBJECT_NAME_LIMIT + 1]; /* The name plus a NUL */
-          mush_strncpy(buff, o->name, OBJECT_NAME_LIMIT);
-          set_name(i, buff);
-          do_rawlog(LT_CHECK,
-                    " * Name of #%d is longer than the maximum, truncating.\n",
-                    i);
-        }
-        if (IsPlayer(i)) {
-          add_player(i);
-          clear_flag_internal(i, "CONNECTED");
-          /* If it has the MONITOR flag and the db predates HEAR_CONNECT, swap
-           * them over */
-          if (!(globals.indb_flags & DBF_HEAR_CONNECT) &&
-              has_flag_by_name(i, "MONITOR", NOTYPE)) {
-            clear_flag_internal(i, "MONITOR");
-            set_flag_internal(i, "HEAR_CONNECT");
-          }
-        }
-
-        if (globals.new_indb_version < 4 && IsRoom(i) &&
-            has_flag_by_name(i, "HAVEN", TYPE_ROOM)) {
-          /* HAVEN flag is no longer settable on rooms. */
-          clear_flag_internal(i, "HAVEN");
-        }
+        db_read_object_done(i, adder);
       }
       break;
     case '*': {
@@ -1915,6 +2058,7 @@ db_read(PENNFILE *f)
            * ROOM. */
           set_flag_type_by_name("FLAG", "HAVEN", TYPE_PLAYER);
         }
+        parallel_load_end(f);
         do_rawlog(LT_ERR, "READING: done");
         sqlite3_exec(sqldb, "COMMIT TRANSACTION", NULL, NULL, NULL);
         loading_db = 0;
@@ -1934,191 +2078,733 @@ db_read(PENNFILE *f)
   return -1;
 }
 
-static sqlite3 *penn_sqldb = NULL;
-static sqlite3 *statement_cache = NULL;
-static sqlite3_stmt *find_stmt = NULL;
-static sqlite3_stmt *insert_stmt = NULL;
-static sqlite3_stmt *delete_stmt = NULL;
-static sqlite3_stmt *delete_all_stmts = NULL;
-static sqlite3_stmt *find_all_stmts = NULL;
+/* Binary databases
+ *
+ * With binary_dump on, the main database is saved in a compact binary
+ * format instead of the labeled text one. It starts with a +B<version>
+ * line and a binary header: the dbflags, the dbversion, the saved time,
+ * and how attribute values are compressed, with the character counts
+ * of the huffman tree if they are. The flag, power and attribute tables
+ * and the ~<db_top> line follow as text, then a ! line and the objects.
+ *
+ * Numbers are LEB128 varints, zigzag encoded if they can be negative,
+ * and strings are a length followed by their bytes. Attribute names,
+ * lock types and flag lists go through a string table: a reference
+ * of 0 is followed by a new string, which gets the next index in the
+ * table, and n refers to the (n-1)th string. Huffman compressed
+ * attribute values are saved as they are stored in the chunk manager.
+ *
+ * Each object is its dbref + 1 and then the same fields, in the same
+ * order, as a text dump. A dbref of 0 ends the objects. After it come
+ * the whole string table and an index of where each object starts,
+ * their offsets from the byte after the ! line as two 64-bit little
+ * endian numbers, and the usual end of dump line. Tools can use those
+ * to look up objects without reading the whole file.
+ */
 
-static int
-comp_helper(const char *a, int lena, const char *b, int lenb)
+/** Version of the binary database format, from its +B line */
+#define BINDB_VERSION 1
+
+/** The most bytes of a string in a binary database */
+#define BINDB_STRING_LIMIT (BUFFER_LEN * 2)
+
+/** State of a binary database being read or written. */
+struct bindb {
+  HASHTAB strings;      /**< Writing: string table index + 1 of strings */
+  char **strtab;        /**< The string table */
+  uint32_t nstrings;    /**< Number of strings in strtab */
+  uint32_t strcap;      /**< Allocated size of strtab */
+  dbref *index_refs;    /**< Writing: the objects written, in order */
+  uint64_t *index_offs; /**< Writing: where each object starts */
+  size_t nindex;        /**< Number of objects in the index */
+  size_t indexcap;      /**< Allocated size of the index arrays */
+  uint64_t offset;      /**< Bytes since the start of the objects */
+  bool huffman;         /**< Are attribute values huffman compressed? */
+  long freq[256];       /**< Character counts of the huffman tree */
+};
+
+static struct bindb *
+bindb_new(void)
 {
-  int i = 0;
-  while (lena && lenb) {
-    int d;
-    lena -= 1;
-    lenb -= 1;
-    d = (int) a[i] - (int) b[i];
-    if (d) {
-      return d;
-    }
-    i += 1;
-  }
-  return lena - lenb;
+  struct bindb *b;
+
+  b = mush_calloc(1, sizeof *b, "bindb");
+  hashinit(&b->strings, 256);
+  return b;
 }
 
-/* sqlite3 collator function that sorts strings like foo100, foo1 in the order
- * foo1, foo100 */
-static int
-comp_trailing_numbers(void *data __attribute__((__unused__)), int lena,
-                      const void *va, int lenb, const void *vb)
+static void
+bindb_free(struct bindb *b)
 {
-  const char *a = va;
-  const char *b = vb;
-
-  if (lena == 0 && lenb == 0) {
-    return 0;
-  } else if (lena == 0) {
-    return -1;
-  } else if (lenb == 0) {
-    return 1;
-  } else if (isdigit(a[lena - 1]) && isdigit(b[lenb - 1])) {
-    int traila = lena - 1;
-    int trailb = lenb - 1;
-    int d;
-    int na = 0, nb = 0;
-    int place;
+  uint32_t n;
+
+  hashfree(&b->strings);
+  for (n = 0; n < b->nstrings; n++)
+    mush_free(b->strtab[n], "bindb.string");
+  if (b->strtab)
+    mush_free(b->strtab, "bindb.strtab");
+  if (b->index_refs) {
+    mush_free(b->index_refs, "bindb.index");
+    mush_free(b->index_offs, "bindb.index");
+  }
+  mush_free(b, "bindb");
+}
 
-    place = 1;
-    while (traila > 0 && isdigit(a[traila])) {
-      na += place * (a[traila] - '0');
-      place *= 10;
-      traila -= 1;
-    }
-    traila += 1;
+/* Add a string to the end of the string table. */
+static void
+bindb_add_string(struct bindb *b, const char *s, size_t len)
+{
+  if (b->nstrings == b->strcap) {
+    b->strcap = b->strcap ? b->strcap * 2 : 256;
+    b->strtab = mush_realloc(b->strtab, b->strcap * sizeof(char *),
+                             "bindb.strtab");
+  }
+  b->strtab[b->nstrings] = mush_malloc(len + 1, "bindb.string");
+  memcpy(b->strtab[b->nstrings], s, len);
+  b->strtab[b->nstrings][len] = '\0';
+  b->nstrings++;
+}
 
-    place = 1;
-    while (trailb > 0 && isdigit(b[trailb])) {
-      nb += place * (b[trailb] - '0');
-      place *= 10;
-      trailb -= 1;
-    }
-    trailb += 1;
+static void
+bin_put(PENNFILE *f, const void *data, size_t len)
+{
+  penn_fwrite(data, len, f);
+  f->bin->offset += len;
+}
 
-    d = comp_helper(a, traila, b, trailb);
-    if (d) {
-      return d;
-    } else {
-      return na - nb;
-    }
+static void
+bin_put_uint(PENNFILE *f, uint64_t n)
+{
+  unsigned char buff[10];
+  size_t len = 0;
 
-  } else {
-    return comp_helper(a, lena, b, lenb);
+  while (n >= 0x80) {
+    buff[len++] = (n & 0x7F) | 0x80;
+    n >>= 7;
   }
+  buff[len++] = n;
+  bin_put(f, buff, len);
 }
 
-/** Callback function for sqlite3_bind_text to free a
-    mush_malloc-allocated "string" */
-void
-free_string(void *s)
+static void
+bin_put_int(PENNFILE *f, int64_t n)
 {
-  mush_free(s, "string");
+  bin_put_uint(f, ((uint64_t) n << 1) ^ (uint64_t)(n >> 63));
 }
 
-static bool
-optimize_shared_db(void *data __attribute__((__unused__)))
+static void
+bin_put_u64le(PENNFILE *f, uint64_t n)
 {
-  if (penn_sqldb) {
-    return optimize_db(penn_sqldb);
-  } else {
-    return false;
-  }
+  unsigned char buff[8];
+  int b;
+
+  for (b = 0; b < 8; b++)
+    buff[b] = (n >> (b * 8)) & 0xFF;
+  bin_put(f, buff, sizeof buff);
 }
 
 static void
-sqlite_logger(void *arg __attribute__((__unused__)), int errcode,
-              const char *errmsg)
+bin_put_string(PENNFILE *f, const char *s)
 {
-  /* Ignore messages we don't really care about. */
-  if (errcode == SQLITE_SCHEMA) {
-    return;
-  }
-  if (!errmsg) {
-    errmsg = "UNKNOWN ERROR";
-  }
-  if (strstr(errmsg, "UNIQUE constraint failed: players.name") ||
-      strstr(errmsg, "malformed JSON")) {
+  size_t len = strlen(s);
+
+  bin_put_uint(f, len);
+  bin_put(f, s, len);
+}
+
+/* Write a reference to s in the string table, adding it if it's new. */
+static void
+bin_put_sref(PENNFILE *f, const char *s)
+{
+  struct bindb *b = f->bin;
+  intptr_t n;
+
+  n = (intptr_t) hashfind(s, &b->strings);
+  if (n) {
+    bin_put_uint(f, n);
     return;
   }
-
-  /* Log the rest */
-  do_rawlog(LT_ERR, "SQLite error %d: %s", errcode, errmsg);
+  bindb_add_string(b, s, strlen(s));
+  hashadd(s, (void *) (intptr_t) b->nstrings, &b->strings);
+  bin_put_uint(f, 0);
+  bin_put_string(f, s);
 }
 
-/** Set up error logging and other one-off sqlite stuff. Should only
-    be called once. */
-void
-initialize_sqlite(void)
+/* Write the binary header of a database, after its +B line. */
+static void
+db_write_binary_header(PENNFILE *f, int dbflag)
 {
-  sqlite3_config(SQLITE_CONFIG_LOG, sqlite_logger, NULL);
-  sqlite3_initialize();
+  int n;
+
+  penn_fprintf(f, "+B%d\n", BINDB_VERSION);
+  f->bin = bindb_new();
+  bin_put_uint(f, dbflag);
+  bin_put_uint(f, NDBF_VERSION);
+  bin_put_string(f, show_time(mudtime, 1));
+  f->bin->huffman = compress_get_table(f->bin->freq);
+  if (f->bin->huffman) {
+    bin_put_string(f, "huffman");
+    for (n = 0; n < 256; n++)
+      bin_put_uint(f, f->bin->freq[n]);
+  } else
+    bin_put_string(f, "none");
+  /* Only binary data is counted, so this is where the objects start. */
+  f->bin->offset = 0;
 }
 
-extern sqlite3 *help_db;
-extern sqlite3 *connlog_db;
+/* Write an object to a binary database. */
+static void
+db_write_binary_object(PENNFILE *f, dbref i, struct object *o)
+{
+  struct bindb *b = f->bin;
+  lock_list *ll;
+  ALIST *list;
+  int count;
+
+  if (b->nindex == b->indexcap) {
+    b->indexcap = b->indexcap ? b->indexcap * 2 : 1024;
+    b->index_refs = mush_realloc(b->index_refs, b->indexcap * sizeof(dbref),
+                                 "bindb.index");
+    b->index_offs = mush_realloc(b->index_offs, b->indexcap * sizeof(uint64_t),
+                                 "bindb.index");
+  }
+  b->index_refs[b->nindex] = i;
+  b->index_offs[b->nindex] = b->offset;
+  b->nindex++;
+
+  bin_put_uint(f, (uint64_t) i + 1);
+  bin_put_string(f, o->name);
+  bin_put_int(f, o->location);
+  bin_put_int(f, o->contents);
+  bin_put_int(f, o->exits);
+  bin_put_int(f, o->next);
+  bin_put_int(f, o->parent);
+
+  count = 0;
+  for (ll = Locks(i); ll; ll = ll->next)
+    count++;
+  bin_put_uint(f, count);
+  for (ll = Locks(i); ll; ll = ll->next) {
+    bin_put_sref(f, ll->type);
+    bin_put_int(f, L_CREATOR(ll));
+    bin_put_sref(f, lock_flags_long(ll));
+    bin_put_uint(f, chunk_derefs(L_KEY(ll)));
+    bin_put_string(f, unparse_boolexp(GOD, ll->key, UB_DBREF));
+  }
 
-/** Clean up sqlite stuff right before mush shutdown. */
-void
-shutdown_sqlite(void)
+  bin_put_int(f, o->owner);
+  bin_put_int(f, o->zone);
+  bin_put_int(f, Pennies(i));
+  bin_put_uint(f, o->type & ~TYPE_MARKED);
+  bin_put_sref(f, bits_to_string("FLAG", o->flags, GOD, NOTHING));
+  bin_put_sref(f, bits_to_string("POWER", o->powers, GOD, NOTHING));
+  bin_put_sref(f, unparse_warnings(o->warnings));
+  bin_put_int(f, o->creation_time);
+  bin_put_int(f, o->modification_time);
+
+  count = 0;
+  ATTR_FOR_EACH (i, list) {
+    if (AF_Nodump(list))
+      continue;
+    count++;
+  }
+  bin_put_uint(f, count);
+  ATTR_FOR_EACH (i, list) {
+    if (AF_Nodump(list))
+      continue;
+    bin_put_sref(f, AL_NAME(list));
+    bin_put_int(f, Owner(AL_CREATOR(list)));
+    bin_put_sref(f, atrflag_to_string(AL_FLAGS(list)));
+    bin_put_uint(f, AL_DEREFS(list));
+    if (b->huffman)
+      bin_put_string(f, atr_get_compressed_data(list));
+    else
+      bin_put_string(f, atr_value(list));
+  }
+}
+
+/* Write the end of the objects, the string table and the index. */
+static void
+db_write_binary_footer(PENNFILE *f)
 {
-  sqlite3_stmt *all_cached;
-  int rc;
+  struct bindb *b = f->bin;
+  uint64_t strtab_start, index_start, last_offset = 0;
+  dbref last_ref = 0;
+  size_t n;
+
+  bin_put_uint(f, 0);
+
+  strtab_start = b->offset;
+  bin_put_uint(f, b->nstrings);
+  for (n = 0; n < b->nstrings; n++)
+    bin_put_string(f, b->strtab[n]);
+
+  index_start = b->offset;
+  bin_put_uint(f, b->nindex);
+  for (n = 0; n < b->nindex; n++) {
+    bin_put_int(f, b->index_refs[n] - last_ref);
+    bin_put_uint(f, b->index_offs[n] - last_offset);
+    last_ref = b->index_refs[n];
+    last_offset = b->index_offs[n];
+  }
 
-  /* Cleanly shut down any open databases */
-  close_shared_db();
+  bin_put_u64le(f, strtab_start);
+  bin_put_u64le(f, index_start);
+}
 
-  if (help_db) {
-    close_sql_db(help_db);
-    help_db = NULL;
+/* Give up on reading a corrupt binary database. */
+static void __attribute__((__noreturn__))
+bin_corrupt(const char *what)
+{
+  do_rawlog(LT_ERR, "ERROR: Binary database is corrupt: %s", what);
+  longjmp(db_err, 1);
+}
+
+static uint64_t
+bin_get_uint(PENNFILE *f)
+{
+  uint64_t n = 0;
+  int shift, c;
+
+  for (shift = 0; shift < 64; shift += 7) {
+    if ((c = penn_fgetc(f)) == EOF)
+      bin_corrupt("unexpected end of file");
+    n |= (uint64_t) (c & 0x7F) << shift;
+    if (!(c & 0x80))
+      return n;
   }
+  bin_corrupt("number too long");
+}
 
-  if (connlog_db) {
-    close_sql_db(connlog_db);
-    connlog_db = NULL;
+static int64_t
+bin_get_int(PENNFILE *f)
+{
+  uint64_t n = bin_get_uint(f);
+
+  return (int64_t) (n >> 1) ^ -(int64_t) (n & 1);
+}
+
+/* Read a string into buff, which holds BINDB_STRING_LIMIT + 1 bytes. */
+static size_t
+bin_get_string(PENNFILE *f, char *buff)
+{
+  uint64_t len = bin_get_uint(f);
+
+  if (len > BINDB_STRING_LIMIT)
+    bin_corrupt("string too long");
+  if (penn_fread(buff, len, f) != len)
+    bin_corrupt("unexpected end of file");
+  buff[len] = '\0';
+  return len;
+}
+
+/* Read a string table reference, adding a new string to the table. */
+static const char *
+bin_get_sref(PENNFILE *f)
+{
+  struct bindb *b = f->bin;
+  char buff[BINDB_STRING_LIMIT + 1];
+  uint64_t n;
+  size_t len;
+
+  n = bin_get_uint(f);
+  if (n > b->nstrings)
+    bin_corrupt("bad string table reference");
+  if (n)
+    return b->strtab[n - 1];
+  len = bin_get_string(f, buff);
+  bindb_add_string(b, buff, len);
+  return b->strtab[b->nstrings - 1];
+}
+
+/* Read the binary header of a database, after its +B. */
+static bool
+db_read_binary_header(PENNFILE *f)
+{
+  char buff[BINDB_STRING_LIMIT + 1];
+  long version;
+  int n;
+
+  version = getref(f);
+  if (version != BINDB_VERSION) {
+    do_rawlog(LT_ERR, "ERROR: Unknown binary database version %ld.", version);
+    return false;
+  }
+  if (!f->bin)
+    f->bin = bindb_new();
+  globals.indb_flags = bin_get_uint(f);
+  globals.new_indb_version = bin_get_uint(f);
+  bin_get_string(f, buff);
+  mush_strncpy(db_timestamp, buff, sizeof db_timestamp);
+  bin_get_string(f, buff);
+  if (strcmp(buff, "huffman") == 0) {
+    f->bin->huffman = true;
+    for (n = 0; n < 256; n++)
+      f->bin->freq[n] = bin_get_uint(f);
+  } else if (strcmp(buff, "none") != 0) {
+    do_rawlog(LT_ERR, "ERROR: Unknown binary database compression '%s'.",
+              buff);
+    return false;
   }
+  return true;
+}
 
-  /* Free any remaining cached prepared statements */
-  if (!statement_cache) {
+/* Read all the objects of a binary database, and the rest of the binary
+ * data after them. */
+static bool
+db_read_binary_objects(PENNFILE *f, sqlite3_stmt *adder)
+{
+  struct bindb *b = f->bin;
+  char buff[BINDB_STRING_LIMIT + 1];
+  char name[ATTRIBUTE_NAME_LIMIT + 1];
+  char type[BUFFER_LEN];
+  struct object *o;
+  dbref i, owner;
+  privbits flags;
+  boolexp key;
+  uint64_t n, count;
+  int derefs;
+  size_t len, objects = 0;
+
+  if (penn_fgetc(f) != '\n')
+    bin_corrupt("missing start of objects");
+  b->offset = 0;
+
+  while ((n = bin_get_uint(f))) {
+    if (n > INT_MAX)
+      bin_corrupt("bad dbref");
+    i = n - 1;
+    db_grow(i + 1);
+    o = db + i;
+    objects++;
+
+    bin_get_string(f, buff);
+    set_name(i, buff);
+    o->location = bin_get_int(f);
+    o->contents = bin_get_int(f);
+    o->exits = bin_get_int(f);
+    o->next = bin_get_int(f);
+    o->parent = bin_get_int(f);
+
+    count = bin_get_uint(f);
+    while (count--) {
+      mush_strncpy(type, bin_get_sref(f), sizeof type);
+      owner = bin_get_int(f);
+      flags = string_to_privs(lock_privs, bin_get_sref(f), 0);
+      derefs = bin_get_uint(f);
+      bin_get_string(f, buff);
+      key = parse_boolexp_d(GOD, buff, type, derefs);
+      if (key == TRUE_BOOLEXP)
+        /* Malformed lock key in the db! Oops. */
+        do_rawlog(LT_ERR, "WARNING: Invalid lock key '%s' for lock #%d/%s!",
+                  buff, i, type);
+      else
+        add_lock_raw(owner, i, type, key, flags);
+    }
+
+    o->owner = bin_get_int(f);
+    o->zone = bin_get_int(f);
+    s_Pennies(i, bin_get_int(f));
+    o->type = bin_get_uint(f);
+    db_read_count_type(i);
+    o->flags = string_to_bits("FLAG", bin_get_sref(f));
+    /* Clear the GOING flags. If it was scheduled for destruction
+     * when the db was saved, it gets a reprieve.
+     */
+    clear_flag_internal(i, "GOING");
+    clear_flag_internal(i, "GOING_TWICE");
+    o->powers = string_to_bits("POWER", bin_get_sref(f));
+    o->warnings = parse_warnings(NOTHING, bin_get_sref(f));
+    o->creation_time = (time_t) bin_get_int(f);
+    o->modification_time = (time_t) bin_get_int(f);
+
+    count = bin_get_uint(f);
+    attr_reserve(i, count);
+    while (count--) {
+      mush_strncpy(name, bin_get_sref(f), sizeof name);
+      owner = bin_get_int(f);
+      flags = string_to_privs(attr_privs_view, bin_get_sref(f), 0);
+      derefs = bin_get_uint(f);
+      len = bin_get_string(f, buff);
+      if (b->huffman && len) {
+        char *t = malloc(len + 1);
+        memcpy(t, buff, len + 1);
+        atr_new_add_compressed(i, name, NULL, t, owner, flags, derefs, 1);
+      } else
+        atr_new_add(i, name, buff, owner, flags, derefs, 1);
+    }
+
+    db_read_object_done(i, adder);
+  }
+
+  /* The string table and index are only there for other programs, but
+   * make sure they agree with what was read. */
+  count = bin_get_uint(f);
+  if (count != b->nstrings)
+    bin_corrupt("wrong size of string table");
+  while (count--)
+    bin_get_string(f, buff);
+  count = bin_get_uint(f);
+  if (count != objects)
+    bin_corrupt("wrong size of object index");
+  while (count--) {
+    (void) bin_get_int(f);
+    (void) bin_get_uint(f);
+  }
+  if (penn_fread(buff, 16, f) != 16)
+    bin_corrupt("unexpected end of file");
+  return true;
+}
+
+/** Set up attribute compression before loading a database.
+ * Text databases are read through to tune the compression. Binary ones
+ * with huffman compressed attribute values have to use the huffman
+ * tree they were saved with, which they come with the counts for.
+ * \param f the database file, which is left partly read.
+ * \return true on success.
+ */
+bool
+db_init_compress(PENNFILE *f)
+{
+  int c;
+
+  c = penn_fgetc(f);
+  if (c == EOF)
+    return init_compress(f);
+  penn_ungetc(c, f);
+  if (c == '+' && f->pos + 1 < f->len && f->buf[f->pos + 1] == 'B') {
+    penn_fgetc(f);
+    penn_fgetc(f);
+    if (!db_read_binary_header(f))
+      return false;
+    if (f->bin->huffman)
+      return init_compress_table(f->bin->freq);
+  }
+  return init_compress(f);
+}
+
+TEST_GROUP(bindb)
+{
+  PENNFILE *volatile f = NULL;
+  const char *fname = "bindbtestdata.bin";
+  char buff[BINDB_STRING_LIMIT + 1];
+  int64_t ints[] = {0, 1, -1, 63, -64, 64, NOTHING, AMBIGUOUS, INT32_MAX,
+                    INT32_MIN, INT64_MAX, INT64_MIN};
+  size_t n;
+  volatile int bad = 0;
+
+  if (setjmp(db_err)) {
+    TEST("bindb.error", 0);
+    if (f)
+      penn_fclose(f);
+    remove(fname);
+    return;
+  }
+
+  f = penn_fopen(fname, "w");
+  TEST("bindb.create", f != NULL);
+  if (!f)
     return;
+  f->bin = bindb_new();
+  for (n = 0; n < sizeof ints / sizeof ints[0]; n++) {
+    bin_put_int(f, ints[n]);
+    bin_put_uint(f, (uint64_t) ints[n]);
   }
-  rc =
-    sqlite3_prepare_v2(statement_cache, "SELECT statement FROM prepared_cache",
-                       -1, &all_cached, NULL);
-  if (rc != SQLITE_OK) {
+  bin_put_string(f, "");
+  bin_put_sref(f, "WIZARD");
+  bin_put_sref(f, "DARK");
+  bin_put_sref(f, "WIZARD");
+  bin_put_u64le(f, UINT64_C(0x0102030405060708));
+  TEST("bindb.strtab", f->bin->nstrings == 2);
+  penn_fclose(f);
+
+  f = penn_fopen(fname, "r");
+  TEST("bindb.open", f != NULL);
+  if (!f)
     return;
+  f->bin = bindb_new();
+  for (n = 0; n < sizeof ints / sizeof ints[0] && !bad; n++) {
+    if (bin_get_int(f) != ints[n])
+      bad = 1;
+    else if (bin_get_uint(f) != (uint64_t) ints[n])
+      bad = 2;
+  }
+  TEST("bindb.numbers", !bad);
+  TEST("bindb.empty", bin_get_string(f, buff) == 0 && !*buff);
+  TEST("bindb.sref.1", strcmp(bin_get_sref(f), "WIZARD") == 0);
+  TEST("bindb.sref.2", strcmp(bin_get_sref(f), "DARK") == 0);
+  TEST("bindb.sref.3", strcmp(bin_get_sref(f), "WIZARD") == 0 &&
+                         f->bin->nstrings == 2);
+  TEST("bindb.u64le", penn_fread(buff, 8, f) == 8 && buff[0] == 8 &&
+                        buff[7] == 1);
+  TEST("bindb.eof", penn_fgetc(f) == EOF);
+  penn_fclose(f);
+  f = NULL;
+  remove(fname);
+}
+
+static sqlite3 *penn_sqldb = NULL;
+
+/* Cached prepared statements are kept in an IHASHTAB keyed by a hash of
+ * (connection, name). A second table over the same entries is keyed by
+ * the statement itself, for close_statement() and the timing trace
+ * callback.
+ */
+
+/** A cached prepared statement. */
+struct stmt_entry {
+  sqlite3 *db;          /**< Connection the statement belongs to */
+  const char *name;     /**< Name it was cached under */
+  uint32_t hash;        /**< Hash of (db, name) */
+  sqlite3_stmt *stmt;   /**< The statement */
+  int64_t lookups;      /**< Times it was fetched from the cache */
+  int64_t usecs;        /**< Total time spent running it */
+  struct timeval start; /**< When the current run started, if running */
+};
+
+static IHASHTAB stmt_by_name; /**< Cached statements, by name hash */
+static IHASHTAB stmt_by_ptr;  /**< Cached statements, by statement */
+
+static int stmt_trace(unsigned, void *, void *, void *);
+static bool stmt_forget_if(uint64_t, void *, void *);
+
+static int
+comp_helper(const char *a, int lena, const char *b, int lenb)
+{
+  int i = 0;
+  while (lena && lenb) {
+    int d;
+    lena -= 1;
+    lenb -= 1;
+    d = (int) a[i] - (int) b[i];
+    if (d) {
+      return d;
+    }
+    i += 1;
+  }
+  return lena - lenb;
+}
+
+/* sqlite3 collator function that sorts strings like foo100, foo1 in the order
+ * foo1, foo100 */
+static int
+comp_trailing_numbers(void *data __attribute__((__unused__)), int lena,
+                      const void *va, int lenb, const void *vb)
+{
+  const char *a = va;
+  const char *b = vb;
+
+  if (lena == 0 && lenb == 0) {
+    return 0;
+  } else if (lena == 0) {
+    return -1;
+  } else if (lenb == 0) {
+    return 1;
+  } else if (isdigit(a[lena - 1]) && isdigit(b[lenb - 1])) {
+    int traila = lena - 1;
+    int trailb = lenb - 1;
+    int d;
+    int na = 0, nb = 0;
+    int place;
+
+    place = 1;
+    while (traila > 0 && isdigit(a[traila])) {
+      na += place * (a[traila] - '0');
+      place *= 10;
+      traila -= 1;
+    }
+    traila += 1;
+
+    place = 1;
+    while (trailb > 0 && isdigit(b[trailb])) {
+      nb += place * (b[trailb] - '0');
+      place *= 10;
+      trailb -= 1;
+    }
+    trailb += 1;
+
+    d = comp_helper(a, traila, b, trailb);
+    if (d) {
+      return d;
+    } else {
+      return na - nb;
+    }
+
+  } else {
+    return comp_helper(a, lena, b, lenb);
   }
+}
+
+/** Callback function for sqlite3_bind_text to free a
+    mush_malloc-allocated "string" */
+void
+free_string(void *s)
+{
+  mush_free(s, "string");
+}
 
-  while (sqlite3_step(all_cached) == SQLITE_ROW) {
-    sqlite3_stmt *cached =
-      (sqlite3_stmt *) ((intptr_t) sqlite3_column_int64(all_cached, 0));
-    sqlite3_finalize(cached);
+static bool
+optimize_shared_db(void *data __attribute__((__unused__)))
+{
+  if (penn_sqldb) {
+    return optimize_db(penn_sqldb);
+  } else {
+    return false;
   }
-  sqlite3_finalize(all_cached);
-  if (find_stmt) {
-    sqlite3_finalize(find_stmt);
-    find_stmt = NULL;
+}
+
+static void
+sqlite_logger(void *arg __attribute__((__unused__)), int errcode,
+              const char *errmsg)
+{
+  /* Ignore messages we don't really care about. */
+  if (errcode == SQLITE_SCHEMA) {
+    return;
   }
-  if (insert_stmt) {
-    sqlite3_finalize(insert_stmt);
-    insert_stmt = NULL;
+  if (!errmsg) {
+    errmsg = "UNKNOWN ERROR";
   }
-  if (delete_stmt) {
-    sqlite3_finalize(delete_stmt);
-    delete_stmt = NULL;
+  if (strstr(errmsg, "malformed JSON")) {
+    return;
   }
-  if (delete_all_stmts) {
-    sqlite3_finalize(delete_all_stmts);
-    delete_all_stmts = NULL;
+
+  /* Log the rest */
+  do_rawlog(LT_ERR, "SQLite error %d: %s", errcode, errmsg);
+}
+
+/** Set up error logging and other one-off sqlite stuff. Should only
+    be called once. */
+void
+initialize_sqlite(void)
+{
+  sqlite3_config(SQLITE_CONFIG_LOG, sqlite_logger, NULL);
+  sqlite3_initialize();
+}
+
+extern sqlite3 *help_db;
+extern sqlite3 *connlog_db;
+
+/** Clean up sqlite stuff right before mush shutdown. */
+void
+shutdown_sqlite(void)
+{
+  /* Cleanly shut down any open databases */
+  close_shared_db();
+
+  if (help_db) {
+    close_sql_db(help_db);
+    help_db = NULL;
   }
-  if (find_all_stmts) {
-    sqlite3_finalize(find_all_stmts);
-    find_all_stmts = NULL;
+
+  if (connlog_db) {
+    close_sql_db(connlog_db);
+    connlog_db = NULL;
   }
 
-  sqlite3_close_v2(statement_cache);
-  statement_cache = NULL;
+  /* Free any remaining cached prepared statements */
+  ihash_delete_if(&stmt_by_name, stmt_forget_if, NULL);
+  ihash_flush(&stmt_by_name);
+  ihash_flush(&stmt_by_ptr);
 }
 
 /** Return a pointer to a global in-memory sql database. */
@@ -2302,6 +2988,9 @@ open_sql_db(const char *name, bool nocreate)
   sqlite3_spellfix_init(db, NULL, NULL);
   sqlite3_remember_init(db, NULL, NULL);
   sqlite3_busy_timeout(db, 250);
+  /* Time runs of cached prepared statements for @list/memstats */
+  sqlite3_trace_v2(db, SQLITE_TRACE_STMT | SQLITE_TRACE_PROFILE, stmt_trace,
+                   NULL);
 
   sqlite3_db_config(db, SQLITE_DBCONFIG_ENABLE_FKEY, 1, (int *) NULL);
   sqlite3_db_config(db, SQLITE_DBCONFIG_DEFENSIVE, 1, (int *) NULL);
@@ -2445,158 +3134,191 @@ is_busy_status(int s)
   return s == SQLITE_BUSY || s == SQLITE_LOCKED;
 }
 
-/** Close a currently-opened sqlite3 handle, cleaning up
-   any cached prepared statements first. */
-void
-close_sql_db(sqlite3 *db)
+static inline uint32_t
+stmt_name_hash(sqlite3 *db, const char *name)
 {
-  int status;
-
-  /* Finalize any cached prepared statements associated with this
-     connection. */
-  if (statement_cache) {
-    if (!delete_all_stmts) {
-      const char query[] = "DELETE FROM prepared_cache WHERE handle = ?";
-      if ((status = sqlite3_prepare_v3(statement_cache, query, sizeof query,
-                                       SQLITE_PREPARE_PERSISTENT,
-                                       &delete_all_stmts, NULL)) != SQLITE_OK) {
-        do_rawlog(LT_ERR,
-                  "Unable to prepare query statement_cache.delete_all: %s",
-                  sqlite3_errmsg(db));
-        delete_all_stmts = NULL;
-      }
-    }
-    if (!find_all_stmts) {
-      const char query[] =
-        "SELECT statement FROM prepared_cache WHERE handle = ?";
-      if ((status = sqlite3_prepare_v3(statement_cache, query, sizeof query,
-                                       SQLITE_PREPARE_PERSISTENT,
-                                       &find_all_stmts, NULL)) != SQLITE_OK) {
-        do_rawlog(LT_ERR,
-                  "Unable to prepare query statement_cache.find_all: %s",
-                  sqlite3_errmsg(db));
-        find_all_stmts = NULL;
-      }
-    }
+  return city_hash(name, strlen(name), (uintptr_t) db);
+}
 
-    if (find_all_stmts) {
-      sqlite3_bind_int64(find_all_stmts, 1, (intptr_t) db);
-      do {
-        status = sqlite3_step(find_all_stmts);
-        if (status == SQLITE_ROW) {
-          sqlite3_stmt *stmt = (sqlite3_stmt *) ((
-            intptr_t) sqlite3_column_int64(find_all_stmts, 0));
-          sqlite3_finalize(stmt);
-        }
-      } while (status == SQLITE_ROW || is_busy_status(status));
-      sqlite3_reset(find_all_stmts);
-    }
+/** Find a cached statement.
+ * \param db the connection.
+ * \param name the statement name.
+ * \param hash stmt_name_hash(db, name).
+ * \return the statement's entry, or NULL.
+ */
+static struct stmt_entry *
+stmt_find(sqlite3 *db, const char *name, uint32_t hash)
+{
+  struct stmt_entry *e;
+  uint32_t pos = 0;
 
-    if (delete_all_stmts) {
-      sqlite3_bind_int64(delete_all_stmts, 1, (intptr_t) db);
-      do {
-        status = sqlite3_step(delete_all_stmts);
-      } while (status != SQLITE_DONE && is_busy_status(status));
-      sqlite3_reset(delete_all_stmts);
+  while ((e = ihash_match(&stmt_by_name, hash, &pos))) {
+    if (e->db == db && (e->name == name || strcmp(e->name, name) == 0)) {
+      break;
     }
   }
-  sqlite3_exec(db, "PRAGMA optimize", NULL, NULL, NULL);
-  sqlite3_close_v2(db);
+  return e;
 }
 
-/** Return a cached prepared statement, or create and cache it if not
- * already present.
- *
- * \param db the sqlite3 database connection to use.
- * \param query the SQL query to prepare, in UTF-8.
- * \param name the name of the query. (db,name) is the cache key, not the actual
- * text of the query, in UTF-8.
- * \param cache if true, cache the query, if false not and it needs to be
- * cleaned up with sqlite3_finalize(). \return the prepared statement, NULL on
- * errors.
+/** Finalize a statement that has been removed from stmt_by_name.
+ * \param e the statement's entry.
  */
-sqlite3_stmt *
-prepare_statement_cache(sqlite3 *db, const char *query, const char *name,
-                        bool cache)
+static void
+stmt_free(struct stmt_entry *e)
 {
-  sqlite3_stmt *stmt = NULL;
-  int status;
-  int flags = cache ? SQLITE_PREPARE_PERSISTENT : 0;
+  ihash_delete(&stmt_by_ptr, (uintptr_t) e->stmt, e);
+  sqlite3_finalize(e->stmt);
+  mush_free((char *) e->name, "sql.stmt.name");
+  mush_free(e, "sql.stmt");
+}
 
-  /* When merging with the threaded branch this probably needs a
-   * mutex. Also think about if the cache can be tables in the general
-   * shared db. */
-
-  /* Set up prepared statement cache database */
-  if (!statement_cache) {
-    char *errmsg;
-    if ((status = sqlite3_open_v2(":memory:", &statement_cache,
-                                  SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE |
-                                    SQLITE_OPEN_FULLMUTEX,
-                                  NULL)) != SQLITE_OK) {
-      do_rawlog(LT_ERR, "Unable to create prepared statement cache: %s",
-                db ? sqlite3_errmsg(statement_cache) : sqlite3_errstr(status));
-      if (statement_cache) {
-        sqlite3_close(statement_cache);
-        statement_cache = NULL;
-      }
-      return NULL;
-    }
+/** ihash_delete_if() callback that frees the statements of a connection,
+ * or all of them if the connection is NULL.
+ */
+static bool
+stmt_forget_if(uint64_t key __attribute__((__unused__)), void *data,
+               void *db)
+{
+  struct stmt_entry *e = data;
 
-    if (sqlite3_exec(
-          statement_cache,
-          "CREATE TABLE prepared_cache(handle INTEGER NOT NULL, name TEXT NOT "
-          "NULL, statement INTEGER NOT NULL, PRIMARY KEY(handle, name)) "
-          "WITHOUT ROWID",
-          NULL, NULL, &errmsg) != SQLITE_OK) {
-      do_rawlog(LT_ERR, "Unable to build prepared statement cache table: %s",
-                errmsg);
-      sqlite3_free(errmsg);
-      sqlite3_close(statement_cache);
-      statement_cache = NULL;
-      return NULL;
-    }
+  if (db && e->db != db) {
+    return false;
   }
+  stmt_free(e);
+  return true;
+}
 
-  if (!find_stmt) {
-    const char fquery[] =
-      "SELECT statement FROM prepared_cache WHERE handle = ? AND name = ?";
-    if ((status = sqlite3_prepare_v3(statement_cache, fquery, sizeof fquery,
-                                     SQLITE_PREPARE_PERSISTENT, &find_stmt,
-                                     NULL)) != SQLITE_OK) {
-      do_rawlog(LT_ERR, "Unable to prepare query statement_cache.find: %s",
-                sqlite3_errmsg(statement_cache));
-      find_stmt = NULL;
-      return NULL;
+/** Remove a statement from the cache and finalize it.
+ * \param e the statement's entry.
+ */
+static void
+stmt_forget(struct stmt_entry *e)
+{
+  ihash_delete(&stmt_by_name, e->hash, e);
+  stmt_free(e);
+}
+
+/** sqlite3 trace callback that times each run of a cached statement. */
+static int
+stmt_trace(unsigned type, void *data __attribute__((__unused__)), void *p,
+           void *x __attribute__((__unused__)))
+{
+  struct stmt_entry *e;
+
+  e = ihash_find(&stmt_by_ptr, (uintptr_t) p);
+  if (!e) {
+    return 0;
+  }
+  if (type == SQLITE_TRACE_STMT) {
+    /* Also called for each trigger program; only the first call counts */
+    if (!e->start.tv_sec) {
+      penn_gettimeofday(&e->start);
     }
+  } else if (e->start.tv_sec) {
+    struct timeval now;
+
+    penn_gettimeofday(&now);
+    e->usecs += (now.tv_sec - e->start.tv_sec) * INT64_C(1000000) +
+                (now.tv_usec - e->start.tv_usec);
+    e->start.tv_sec = 0;
   }
+  return 0;
+}
 
-  if (!insert_stmt) {
-    const char iquery[] =
-      "INSERT INTO prepared_cache(handle, name, statement) VALUES (?,?,?)";
-    if ((status = sqlite3_prepare_v3(statement_cache, iquery, sizeof iquery,
-                                     SQLITE_PREPARE_PERSISTENT, &insert_stmt,
-                                     NULL)) != SQLITE_OK) {
-      do_rawlog(LT_ERR, "Unable to prepare query statement_cache.insert: %s",
-                sqlite3_errmsg(statement_cache));
-      insert_stmt = NULL;
-      return NULL;
+static int
+stmt_stats_cmp(const void *a, const void *b)
+{
+  const struct statement_stats *sa = a, *sb = b;
+
+  if (sa->usecs != sb->usecs) {
+    return sa->usecs < sb->usecs ? 1 : -1;
+  }
+  return strcmp(sa->name, sb->name);
+}
+
+/** Collect statistics on the cached prepared statements of a connection.
+ * \param db the connection.
+ * \param count set to the number of statements.
+ * \return a mush_malloc'ed array with an entry per statement, most time
+ * spent first, or NULL if there are none. Free with "sql.stmt.stats".
+ * The names are only valid until the next statement is closed.
+ */
+struct statement_stats *
+statement_cache_stats(sqlite3 *db, int *count)
+{
+  struct statement_stats *stats;
+  struct stmt_entry *e;
+  uint32_t pos = 0;
+  int n = 0;
+
+  *count = 0;
+  if (!db || !stmt_by_name.entries) {
+    return NULL;
+  }
+  stats = mush_calloc(stmt_by_name.entries, sizeof *stats, "sql.stmt.stats");
+  while ((e = ihash_next(&stmt_by_name, &pos, NULL))) {
+    if (e->db == db) {
+      stats[n].name = e->name;
+      stats[n].lookups = e->lookups;
+      stats[n].runs = sqlite3_stmt_status(e->stmt, SQLITE_STMTSTATUS_RUN, 0);
+      stats[n].steps =
+        sqlite3_stmt_status(e->stmt, SQLITE_STMTSTATUS_VM_STEP, 0);
+      stats[n].usecs = e->usecs;
+      n += 1;
     }
   }
+  if (!n) {
+    mush_free(stats, "sql.stmt.stats");
+    return NULL;
+  }
+  qsort(stats, n, sizeof *stats, stmt_stats_cmp);
+  *count = n;
+  return stats;
+}
+
+/** Close a currently-opened sqlite3 handle, cleaning up
+   any cached prepared statements first. */
+void
+close_sql_db(sqlite3 *db)
+{
+  /* Finalize any cached prepared statements associated with this
+     connection. */
+  ihash_delete_if(&stmt_by_name, stmt_forget_if, db);
+  sqlite3_exec(db, "PRAGMA optimize", NULL, NULL, NULL);
+  sqlite3_close_v2(db);
+}
+
+/** Return a cached prepared statement, or create and cache it if not
+ * already present.
+ *
+ * \param db the sqlite3 database connection to use.
+ * \param query the SQL query to prepare, in UTF-8.
+ * \param name the name of the query. (db,name) is the cache key, not the actual
+ * text of the query, in UTF-8.
+ * \param cache if true, cache the query, if false not and it needs to be
+ * cleaned up with sqlite3_finalize(). \return the prepared statement, NULL on
+ * errors.
+ */
+sqlite3_stmt *
+prepare_statement_cache(sqlite3 *db, const char *query, const char *name,
+                        bool cache)
+{
+  sqlite3_stmt *stmt = NULL;
+  struct stmt_entry *e;
+  uint32_t hash = 0;
+  int status;
+  int flags = cache ? SQLITE_PREPARE_PERSISTENT : 0;
+
+  /* When merging with the threaded branch this probably needs a
+   * mutex. */
 
   if (cache) {
     /* See if the statement is cached and return it if so */
-    sqlite3_bind_int64(find_stmt, 1, (intptr_t) db);
-    sqlite3_bind_text(find_stmt, 2, name, strlen(name), SQLITE_TRANSIENT);
-    do {
-      status = sqlite3_step(find_stmt);
-      if (status == SQLITE_ROW) {
-        stmt = (sqlite3_stmt *) ((intptr_t) sqlite3_column_int64(find_stmt, 0));
-        sqlite3_reset(find_stmt);
-        return stmt;
-      }
-    } while (is_busy_status(status));
-    sqlite3_reset(find_stmt);
+    hash = stmt_name_hash(db, name);
+    if ((e = stmt_find(db, name, hash))) {
+      e->lookups += 1;
+      return e->stmt;
+    }
   }
 
   /* Prepare a new statement and cache it. */
@@ -2608,13 +3330,14 @@ prepare_statement_cache(sqlite3 *db, const char *query, const char *name,
   }
 
   if (cache) {
-    sqlite3_bind_int64(insert_stmt, 1, (intptr_t) db);
-    sqlite3_bind_text(insert_stmt, 2, name, strlen(name), SQLITE_TRANSIENT);
-    sqlite3_bind_int64(insert_stmt, 3, (intptr_t) stmt);
-    do {
-      status = sqlite3_step(insert_stmt);
-    } while (is_busy_status(status));
-    sqlite3_reset(insert_stmt);
+    e = mush_calloc(1, sizeof *e, "sql.stmt");
+    e->db = db;
+    e->name = mush_strdup(name, "sql.stmt.name");
+    e->hash = hash;
+    e->stmt = stmt;
+    e->lookups = 1;
+    ihash_add(&stmt_by_name, hash, e);
+    ihash_add(&stmt_by_ptr, (uintptr_t) stmt, e);
   }
 
   return stmt;
@@ -2627,52 +3350,145 @@ prepare_statement_cache(sqlite3 *db, const char *query, const char *name,
 void
 close_statement(sqlite3_stmt *stmt)
 {
+  struct stmt_entry *e;
 
   /* When merging with the threaded branch this probably needs a mutex. */
 
-  if (statement_cache) {
-    int status;
-    if (!delete_stmt) {
-      const char query[] = "DELETE FROM prepared_cache WHERE statement = ?";
+  e = ihash_find(&stmt_by_ptr, (uintptr_t) stmt);
+  if (e) {
+    stmt_forget(e);
+    return;
+  }
 
-      if ((status = sqlite3_prepare_v3(statement_cache, query, sizeof query,
-                                       SQLITE_PREPARE_PERSISTENT, &delete_stmt,
-                                       NULL)) != SQLITE_OK) {
-        do_rawlog(LT_ERR,
-                  "Unable to prepare query statement_cache.delete_one: %s",
-                  sqlite3_errmsg(statement_cache));
-        delete_stmt = NULL;
-        return;
-      }
-    }
+  sqlite3_finalize(stmt);
+}
 
-    sqlite3_bind_int64(delete_stmt, 1, (intptr_t) stmt);
-    do {
-      status = sqlite3_step(delete_stmt);
-    } while (is_busy_status(status));
-    sqlite3_reset(delete_stmt);
+TEST_GROUP(statement_cache)
+{
+  sqlite3 *db1, *db2;
+  sqlite3_stmt *s1, *s2;
+  struct statement_stats *stats;
+  char name[32];
+  int i, n, count, nmany = 128;
+
+  db1 = open_sql_db(NULL, 0);
+  db2 = open_sql_db(NULL, 0);
+  TEST("statement_cache.open", db1 && db2);
+  if (!db1 || !db2) {
+    return;
+  }
+  s1 = prepare_statement(db1, "VALUES (1)", "test.one");
+  /* Names are compared by value, not by pointer */
+  strcpy(name, "test.one");
+  TEST("statement_cache.find.1",
+       s1 && prepare_statement(db1, "VALUES (1)", name) == s1);
+  s2 = prepare_statement(db2, "VALUES (1)", "test.one");
+  TEST("statement_cache.find.2", s2 && s2 != s1);
+
+  /* Enough statements to force a resize */
+  for (i = 0; i < nmany; i += 1) {
+    snprintf(name, sizeof name, "test.%d", i);
+    prepare_statement(db1, "VALUES (2)", name);
+  }
+  for (i = 0, n = 0; i < nmany; i += 1) {
+    snprintf(name, sizeof name, "test.%d", i);
+    s2 = prepare_statement(db1, "VALUES (2)", name);
+    n += s2 && sqlite3_stmt_status(s2, SQLITE_STMTSTATUS_RUN, 0) == 0;
+  }
+  TEST("statement_cache.many", n == nmany);
+
+  sqlite3_step(s1);
+  sqlite3_reset(s1);
+  stats = statement_cache_stats(db1, &count);
+  TEST("statement_cache.stats.1", stats && count == nmany + 1);
+  for (i = 0; i < count && strcmp(stats[i].name, "test.one"); i += 1)
+    ;
+  TEST("statement_cache.stats.2",
+       i < count && stats[i].lookups == 2 && stats[i].runs == 1);
+  if (stats) {
+    mush_free(stats, "sql.stmt.stats");
   }
 
-  sqlite3_finalize(stmt);
+  for (i = 0; i < nmany; i += 2) {
+    snprintf(name, sizeof name, "test.%d", i);
+    close_statement(prepare_statement(db1, "VALUES (2)", name));
+  }
+  stats = statement_cache_stats(db1, &count);
+  TEST("statement_cache.close.1", count == nmany / 2 + 1);
+  if (stats) {
+    mush_free(stats, "sql.stmt.stats");
+  }
+
+  close_sql_db(db1);
+  TEST("statement_cache.close.2", statement_cache_stats(db1, &count) == NULL);
+  stats = statement_cache_stats(db2, &count);
+  TEST("statement_cache.close.3", stats && count == 1);
+  if (stats) {
+    mush_free(stats, "sql.stmt.stats");
+  }
+  close_sql_db(db2);
+}
+
+/* Object data is kept in an IHASHTAB keyed by (key number, dbref).
+ * Each key is given a number the first time it's used, so entries are
+ * found without any string comparisons.
+ */
+
+/** A known object data key. */
+struct objdata_key {
+  uint32_t id; /**< Number of the key */
+};
+
+static IHASHTAB objdata_table;
+static HASHTAB objdata_keys; /**< struct objdata_key, by name */
+static uint32_t objdata_nkeys = 0; /**< Number of keys in objdata_keys */
+
+#define OBJDATA_INITIAL_SIZE 256
+
+/** Look up an object data key.
+ * \param keybase the key.
+ * \param create if true, add the key if it's not already known.
+ * \return the key's entry, or NULL.
+ */
+static struct objdata_key *
+objdata_intern(const char *keybase, bool create)
+{
+  struct objdata_key *key;
+
+  if (!objdata_keys.buckets) {
+    hashinit(&objdata_keys, 16);
+  }
+  key = hashfind(keybase, &objdata_keys);
+  if (key || !create) {
+    return key;
+  }
+  key = mush_malloc(sizeof *key, "objdata.key");
+  key->id = objdata_nkeys++;
+  hashadd(keybase, key, &objdata_keys);
+  return key;
+}
+
+static inline uint64_t
+objdata_hkey(dbref thing, const struct objdata_key *key)
+{
+  return ((uint64_t) key->id << 32) | (uint32_t) thing;
 }
 
 static void
 init_objdata()
 {
   const char *create_query =
-    "CREATE TABLE objects(dbref INTEGER NOT NULL PRIMARY KEY, queue INTEGER "
-    "NOT NULL DEFAULT 0);"
-    "CREATE TABLE objdata(dbref INTEGER NOT NULL, key TEXT NOT NULL, ptr "
-    "INTEGER, PRIMARY KEY (dbref, key), FOREIGN KEY(dbref) REFERENCES "
-    "objects(dbref) ON DELETE CASCADE) WITHOUT ROWID;";
+    "CREATE TABLE objects(dbref INTEGER NOT NULL PRIMARY KEY);";
   char *errmsg = NULL;
   sqlite3 *sqldb = get_shared_db();
 
   if (sqlite3_exec(sqldb, create_query, NULL, NULL, &errmsg) != SQLITE_OK) {
-    do_rawlog(LT_ERR, "Unable to create objdata table: %s", errmsg);
+    do_rawlog(LT_ERR, "Unable to create objects table: %s", errmsg);
     sqlite3_free(errmsg);
-    return;
   }
+
+  ihash_flush(&objdata_table);
+  ihash_init(&objdata_table, OBJDATA_INITIAL_SIZE);
 }
 
 /** Add data to the object data hashtable.
@@ -2691,38 +3507,13 @@ init_objdata()
 void *
 set_objdata(dbref thing, const char *keybase, void *data)
 {
-  sqlite3_stmt *setter;
-  int status;
-  sqlite3 *sqldb;
-
   if (data == NULL) {
     delete_objdata(thing, keybase);
     return NULL;
   }
 
-  sqldb = get_shared_db();
-  setter =
-    prepare_statement(sqldb,
-                      "INSERT INTO objdata(dbref, key, ptr) VALUES(?, ?, ?) ON "
-                      "CONFLICT (dbref, key) DO UPDATE SET ptr=excluded.ptr",
-                      "objdata.set");
-  if (!setter) {
-    return NULL;
-  }
-
-  sqlite3_bind_int(setter, 1, thing);
-  sqlite3_bind_text(setter, 2, keybase, strlen(keybase), SQLITE_STATIC);
-  sqlite3_bind_int64(setter, 3, (intptr_t) data);
-
-  do {
-    status = sqlite3_step(setter);
-  } while (is_busy_status(status));
-
-  if (status != SQLITE_DONE) {
-    do_rawlog(LT_ERR, "Unable to execute objdata set query for #%d/%s: %s",
-              thing, keybase, sqlite3_errmsg(sqldb));
-  }
-  sqlite3_reset(setter);
+  ihash_set(&objdata_table, objdata_hkey(thing, objdata_intern(keybase, 1)),
+            data);
 
   return data;
 }
@@ -2735,31 +3526,12 @@ set_objdata(dbref thing, const char *keybase, void *data)
 void *
 get_objdata(dbref thing, const char *keybase)
 {
-  sqlite3_stmt *getter;
-  int status;
-  void *data = NULL;
-  sqlite3 *sqldb = get_shared_db();
+  struct objdata_key *key;
 
-  getter = prepare_statement(
-    sqldb, "SELECT ptr FROM objdata WHERE dbref = ? AND key = ?",
-    "objdata.get");
-  if (!getter) {
+  if (!objdata_table.entries || !(key = objdata_intern(keybase, 0))) {
     return NULL;
   }
-
-  sqlite3_bind_int(getter, 1, thing);
-  sqlite3_bind_text(getter, 2, keybase, strlen(keybase), SQLITE_STATIC);
-  do {
-    status = sqlite3_step(getter);
-  } while (is_busy_status(status));
-  if (status == SQLITE_ROW) {
-    data = (void *) ((intptr_t) sqlite3_column_int64(getter, 0));
-  } else if (status != SQLITE_DONE) {
-    do_rawlog(LT_TRACE, "Unable to execute objdata get query for #%d/%s: %s",
-              thing, keybase, sqlite3_errmsg(sqldb));
-  }
-  sqlite3_reset(getter);
-  return data;
+  return ihash_find(&objdata_table, objdata_hkey(thing, key));
 }
 
 /** Clear an object's data for a specific key.
@@ -2769,27 +3541,133 @@ get_objdata(dbref thing, const char *keybase)
 void
 delete_objdata(dbref thing, const char *keybase)
 {
-  sqlite3_stmt *deleter;
-  int status;
-  sqlite3 *sqldb = get_shared_db();
+  struct objdata_key *key;
 
-  deleter = prepare_statement(
-    sqldb, "DELETE FROM objdata WHERE dbref = ? AND key = ?", "objdata.delete");
-  if (!deleter) {
+  if (!objdata_table.entries || !(key = objdata_intern(keybase, 0))) {
     return;
   }
+  ihash_delete(&objdata_table, objdata_hkey(thing, key), NULL);
+}
 
-  sqlite3_bind_int(deleter, 1, thing);
-  sqlite3_bind_text(deleter, 2, keybase, strlen(keybase), SQLITE_STATIC);
-  do {
-    status = sqlite3_step(deleter);
-  } while (is_busy_status(status));
+/** Clear all of an object's data. Used when the object is destroyed.
+ * It does not free any of the data pointers.
+ * \param thing dbref of object data is associated with.
+ */
+void
+clear_objdata(dbref thing)
+{
+  struct objdata_key *key;
 
-  if (status != SQLITE_DONE) {
-    do_rawlog(LT_ERR, "Unable to execute objdata delete query for #%d: %s",
-              thing, sqlite3_errmsg(sqldb));
+  if (!objdata_table.entries) {
+    return;
+  }
+  for (key = hash_firstentry(&objdata_keys); key;
+       key = hash_nextentry(&objdata_keys)) {
+    ihash_delete(&objdata_table, objdata_hkey(thing, key), NULL);
+  }
+}
+
+TEST_GROUP(objdata)
+{
+  int vals[3] = {1, 2, 3};
+  int i, n, status, nbench = 20000;
+  char key[] = "TEST.OBJDATA";
+  struct timeval start, end;
+  long native_us, sql_us;
+  sqlite3 *bdb;
+  sqlite3_stmt *getter;
+  void *data;
+  dbref thing;
+
+  /* clear_objdata() drops every key, so only use it on our own object */
+  thing = new_scratch_object();
+  TEST("objdata.get.1", get_objdata(thing, "TEST.OBJDATA") == NULL);
+  TEST("objdata.set.1", set_objdata(thing, "TEST.OBJDATA", vals) == vals);
+  /* Keys are compared by value, not by pointer */
+  TEST("objdata.get.2", get_objdata(thing, key) == vals);
+  TEST("objdata.get.3", get_objdata(0, "TEST.OBJDATA") == NULL);
+  set_objdata(thing, "TEST.OBJDATA", vals + 1);
+  TEST("objdata.set.2", get_objdata(thing, "TEST.OBJDATA") == vals + 1);
+  set_objdata(thing, "TEST.OBJDATA2", vals + 2);
+  TEST("objdata.set.3", get_objdata(thing, "TEST.OBJDATA2") == vals + 2);
+  set_objdata(thing, "TEST.OBJDATA", NULL);
+  TEST("objdata.delete.1", get_objdata(thing, "TEST.OBJDATA") == NULL);
+  TEST("objdata.delete.2", get_objdata(thing, "TEST.OBJDATA2") == vals + 2);
+  clear_objdata(thing);
+  TEST("objdata.clear.1", get_objdata(thing, "TEST.OBJDATA2") == NULL);
+  free_scratch_object(thing);
+
+  /* Enough entries to force a resize and lots of collisions */
+  for (i = 0; i < nbench; i += 1) {
+    set_objdata(i, "TEST.OBJDATA", vals + (i % 3));
+  }
+  for (i = 0, n = 0; i < nbench; i += 1) {
+    n += get_objdata(i, "TEST.OBJDATA") == vals + (i % 3);
+  }
+  TEST("objdata.many.1", n == nbench);
+  for (i = 0; i < nbench; i += 2) {
+    delete_objdata(i, "TEST.OBJDATA");
+  }
+  for (i = 0, n = 0; i < nbench; i += 1) {
+    data = get_objdata(i, "TEST.OBJDATA");
+    n += (i % 2) ? data == vals + (i % 3) : data == NULL;
+  }
+  TEST("objdata.many.2", n == nbench);
+
+  /* Compare lookup speed with the sqlite table objdata used to live in. */
+  penn_gettimeofday(&start);
+  for (i = 0; i < nbench; i += 1) {
+    (void) get_objdata(i, "TEST.OBJDATA");
+  }
+  penn_gettimeofday(&end);
+  native_us = (end.tv_sec - start.tv_sec) * 1000000L +
+              (end.tv_usec - start.tv_usec);
+
+  bdb = open_sql_db(NULL, 0);
+  TEST("objdata.bench.1", bdb != NULL);
+  if (!bdb) {
+    goto cleanup;
+  }
+  sqlite3_exec(bdb,
+               "CREATE TABLE objdata(dbref INTEGER NOT NULL, key TEXT NOT "
+               "NULL, ptr INTEGER, PRIMARY KEY (dbref, key)) WITHOUT ROWID;"
+               "WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x + 2 FROM c "
+               "WHERE x < 20000) INSERT INTO objdata SELECT x, "
+               "'TEST.OBJDATA', x FROM c",
+               NULL, NULL, NULL);
+  getter = prepare_statement(
+    bdb, "SELECT ptr FROM objdata WHERE dbref = ? AND key = ?",
+    "objdata.bench");
+  TEST("objdata.bench.2", getter != NULL);
+  if (!getter) {
+    close_sql_db(bdb);
+    goto cleanup;
+  }
+  penn_gettimeofday(&start);
+  for (i = 0, n = 0; i < nbench; i += 1) {
+    sqlite3_bind_int(getter, 1, i);
+    sqlite3_bind_text(getter, 2, key, strlen(key), SQLITE_STATIC);
+    do {
+      status = sqlite3_step(getter);
+    } while (is_busy_status(status));
+    n += status == SQLITE_ROW;
+    sqlite3_reset(getter);
+  }
+  penn_gettimeofday(&end);
+  sql_us =
+    (end.tv_sec - start.tv_sec) * 1000000L + (end.tv_usec - start.tv_usec);
+  TEST("objdata.bench.3", n == nbench / 2);
+  close_sql_db(bdb);
+
+  do_rawlog(LT_TRACE,
+            "objdata benchmark: %d lookups took %ldus in the hash table, "
+            "%ldus in sqlite.",
+            nbench, native_us, sql_us);
+
+cleanup:
+  for (i = 0; i < nbench; i += 1) {
+    delete_objdata(i, "TEST.OBJDATA");
   }
-  sqlite3_reset(deleter);
 }
 
 static void
@@ -2891,7 +3769,7 @@ penn_fopen(const char *filename, const char *mode)
 {
   PENNFILE *pf;
 
-  pf = mush_malloc(sizeof *pf, "pennfile");
+  pf = mush_calloc(1, sizeof *pf, "pennfile");
   pf->type = PFT_FILE;
   pf->handle.f = fopen(filename, mode);
   if (!pf->handle.f) {
@@ -2907,7 +3785,19 @@ penn_fopen(const char *filename, const char *mode)
 void
 penn_fclose(PENNFILE *pf)
 {
+  parallel_load_end(pf);
+  if (pf->bin)
+    bindb_free(pf->bin);
+  if (pf->type == PFT_MAPPED) {
+    unmap_file(pf->handle.m);
+    mush_free(pf, "pennfile");
+    return;
+  }
+  if (pf->buf)
+    mush_free(pf->buf, "pennfile.buffer");
   switch (pf->type) {
+  case PFT_MAPPED:
+    break;
   case PFT_PIPE:
 #ifndef WIN32
     pclose(pf->handle.f);
@@ -2925,45 +3815,110 @@ penn_fclose(PENNFILE *pf)
   mush_free(pf, "pennfile");
 }
 
-int
-penn_fgetc(PENNFILE *f)
+/** Size of the read buffer of a db file */
+#define PENNFILE_BLOCK (1024 * 128)
+
+/* Read the next block of a db file into its buffer.
+ * Returns false at the end of the file. */
+static bool
+penn_fill(PENNFILE *f)
 {
+  size_t n = 0;
+
+#ifdef DB_PARALLEL_LOAD
+  if (parallel_load_reading(f))
+    return parallel_load_next(f);
+#endif
+  if (f->eof)
+    return false;
+  if (!f->buf && f->type != PFT_MAPPED)
+    f->buf = mush_malloc(PENNFILE_BLOCK, "pennfile.buffer");
   switch (f->type) {
   case PFT_FILE:
   case PFT_PIPE:
-#ifdef HAVE_GETC_UNLOCKED
-    return getc_unlocked(f->handle.f);
-#else
-    return getc(f->handle.f);
-#endif
+    n = fread(f->buf, 1, PENNFILE_BLOCK, f->handle.f);
     break;
   case PFT_GZFILE:
 #ifdef HAVE_LIBZ
-    return gzgetc(f->handle.g);
+  {
+    int r = gzread(f->handle.g, f->buf, PENNFILE_BLOCK);
+    n = r > 0 ? r : 0;
+  }
 #endif
+  break;
+  case PFT_MAPPED:
     break;
   }
-  return 0;
+  if (n == 0) {
+    f->eof = true;
+    return false;
+  }
+  f->pos = 0;
+  f->len = n;
+  return true;
+}
+
+int
+penn_fgetc(PENNFILE *f)
+{
+  if (f->pos < f->len || penn_fill(f))
+    return (unsigned char) f->buf[f->pos++];
+  return EOF;
+}
+
+/** Copy characters from a db file until one in a set of stop characters.
+ * The stop character itself is left to be read next. Characters that
+ * don't fit in buff are discarded, as with safe_chr().
+ * \param f the file to read from.
+ * \param stops table of the stop characters, indexed by character.
+ * \param buff the buffer to copy into.
+ * \param bp pointer to the current end of buff.
+ */
+static void
+penn_fspan(PENNFILE *f, const char stops[256], char *buff, char **bp)
+{
+  const char *start, *end, *p;
+
+  while (f->pos < f->len || penn_fill(f)) {
+    start = f->buf + f->pos;
+    end = f->buf + f->len;
+    for (p = start; p < end && !stops[(unsigned char) *p]; p++)
+      ;
+    safe_strl(start, p - start, buff, bp);
+    f->pos = p - f->buf;
+    if (p < end)
+      return;
+  }
 }
 
 char *
 penn_fgets(char *buf, int len, PENNFILE *pf)
 {
-  switch (pf->type) {
-  case PFT_FILE:
-  case PFT_PIPE:
-#ifdef HAVE_FGETS_UNLOCKED
-    return fgets_unlocked(buf, len, pf->handle.f);
-#else
-    return fgets(buf, len, pf->handle.f);
-#endif
-  case PFT_GZFILE:
-#ifdef HAVE_LIBZ
-    return gzgets(pf->handle.g, buf, len);
-#endif
-    break;
+  char *bp = buf;
+  const char *nl;
+  size_t n;
+
+  if (len <= 0)
+    return NULL;
+  len--;
+  while (len > 0 && (pf->pos < pf->len || penn_fill(pf))) {
+    n = pf->len - pf->pos;
+    if (n > (size_t) len)
+      n = len;
+    nl = memchr(pf->buf + pf->pos, '\n', n);
+    if (nl)
+      n = nl - (pf->buf + pf->pos) + 1;
+    memcpy(bp, pf->buf + pf->pos, n);
+    bp += n;
+    len -= n;
+    pf->pos += n;
+    if (nl)
+      break;
   }
-  return NULL;
+  if (bp == buf)
+    return NULL;
+  *bp = '\0';
+  return buf;
 }
 
 /* c should not be a negative value or it'll screw up gzputc return value
@@ -2985,6 +3940,8 @@ penn_fputc(int c, PENNFILE *f)
     OUTPUT(gzputc(f->handle.g, c));
 #endif
     break;
+  case PFT_MAPPED:
+    longjmp(db_err, 1);
   }
   return 0;
 }
@@ -3006,6 +3963,8 @@ penn_fputs(const char *s, PENNFILE *f)
     OUTPUT(gzputs(f->handle.g, s));
 #endif
     break;
+  case PFT_MAPPED:
+    longjmp(db_err, 1);
   }
   return 0;
 }
@@ -3061,39 +4020,958 @@ penn_fprintf(PENNFILE *f, const char *fmt, ...)
 #endif
 #endif
     break;
+  case PFT_MAPPED:
+    longjmp(db_err, 1);
   }
   return r;
 }
 
+/** Read up to len bytes from a db file.
+ * \param data where to put them.
+ * \param len how many to read.
+ * \param f the file to read from.
+ * \return the number of bytes read, less than len at the end of the file.
+ */
+size_t
+penn_fread(void *data, size_t len, PENNFILE *f)
+{
+  char *d = data;
+  size_t n, done = 0;
+
+  while (done < len && (f->pos < f->len || penn_fill(f))) {
+    n = f->len - f->pos;
+    if (n > len - done)
+      n = len - done;
+    memcpy(d + done, f->buf + f->pos, n);
+    f->pos += n;
+    done += n;
+  }
+  return done;
+}
+
+/** Write bytes to a db file.
+ * \param data the bytes to write.
+ * \param len how many there are.
+ * \param f the file to write to.
+ */
 int
-penn_ungetc(int c, PENNFILE *f)
+penn_fwrite(const void *data, size_t len, PENNFILE *f)
 {
+  if (!len)
+    return 0;
   switch (f->type) {
   case PFT_FILE:
   case PFT_PIPE:
-    OUTPUT(ungetc(c, f->handle.f));
+    if (fwrite(data, 1, len, f->handle.f) != len)
+      longjmp(db_err, 1);
     break;
   case PFT_GZFILE:
 #ifdef HAVE_LIBZ
-    OUTPUT(gzungetc(c, f->handle.g));
+    if (gzwrite(f->handle.g, data, len) <= 0)
+      longjmp(db_err, 1);
 #endif
     break;
+  case PFT_MAPPED:
+    longjmp(db_err, 1);
   }
+  return 0;
+}
+
+/* Only the character that was just read can be pushed back. Like
+ * ungetc(), pushing back EOF does nothing. */
+int
+penn_ungetc(int c, PENNFILE *f)
+{
+  if (c == EOF)
+    return EOF;
+  if (f->pos == 0 || (unsigned char) f->buf[f->pos - 1] != c)
+    longjmp(db_err, 1);
+  f->pos--;
   return c;
 }
 
 int
 penn_feof(PENNFILE *pf)
 {
-  switch (pf->type) {
-  case PFT_FILE:
-  case PFT_PIPE:
-    return feof(pf->handle.f);
-  case PFT_GZFILE:
-#ifdef HAVE_LIBZ
-    return gzeof(pf->handle.g);
+  return pf->eof && pf->pos >= pf->len;
+}
+
+#ifdef DB_PARALLEL_LOAD
+/*
+ * Parallel database loading.
+ *
+ * Once the header of a database has been read, a reader thread takes
+ * over the file and cuts the rest of it into batches of whole objects,
+ * and a few worker threads parse (and, when the compression method
+ * allows it, compress) the attribute lists of each batch. The main
+ * thread goes on reading the same PENNFILE, which now returns the
+ * batches in file order, so everything but attribute lists is read by
+ * the usual code. When db_read_attrs() reaches a list a worker has
+ * already parsed it just adds the results, in the same order as
+ * reading them would have.
+ *
+ * Workers only take lists in the plain format db_write() produces;
+ * anything else (comments, odd spacing, over-long values) is left for
+ * the usual code to read, complain about, or reject, so a database
+ * loads the same way either way.
+ */
+
+/** Size at which the reader starts a new batch */
+#define LOAD_BATCH_SIZE (1024 * 256)
+/** Most batches that can be waiting on the workers or the main thread */
+#define LOAD_MAX_BATCHES 16
+/** Most worker threads */
+#define LOAD_MAX_WORKERS 4
+
+/** Size at which the reader starts a new batch; tests make it smaller */
+static size_t load_batch_size = LOAD_BATCH_SIZE;
+/** Number of attribute lists added from a worker's parse */
+static int load_parsed_lists = 0;
+
+/** An attribute parsed by a worker. Strings are offsets into the
+ * batch's arena. */
+struct load_attr {
+  size_t name;      /**< Attribute name */
+  size_t flags;     /**< Attribute flag names */
+  size_t value;     /**< Attribute value */
+  dbref owner;      /**< Attribute owner */
+  int derefs;       /**< Initial deref count */
+  char *compressed; /**< value, compressed, or NULL */
+};
+
+/** The attribute list of one object in a batch */
+struct load_record {
+  size_t attr_start; /**< Offset of the list in the batch, or 0 */
+  size_t attr_end;   /**< Offset just past the list */
+  int first;         /**< Index of the first parsed attribute */
+  int count;         /**< Number of parsed attributes */
+  int lines;         /**< Number of lines in the list */
+  bool parsed;       /**< Did a worker parse the whole list? */
+};
+
+/** Life cycle of a batch */
+enum load_batch_state {
+  LOAD_BATCH_READ,   /**< Waiting for a worker */
+  LOAD_BATCH_BUSY,   /**< Being parsed */
+  LOAD_BATCH_PARSED, /**< Waiting for the main thread */
+};
+
+/** A run of whole objects from the database file */
+struct load_batch {
+  enum load_batch_state state; /**< Where the batch is in its life */
+  char *data;                  /**< The text */
+  size_t len;                  /**< Length of data */
+  size_t size;                 /**< Allocated size of data */
+  bool owned;                  /**< Was data malloced, or is it mapped? */
+  bool cut;                    /**< Does the next batch start an object? */
+  struct load_record *recs;    /**< Attribute lists, in file order */
+  int nrecs;                   /**< Number of recs */
+  int maxrecs;                 /**< Allocated size of recs */
+  struct load_attr *attrs;     /**< Parsed attributes */
+  int nattrs;                  /**< Number of attrs */
+  int maxattrs;                /**< Allocated size of attrs */
+  char *arena;                 /**< Parsed strings */
+  size_t arenalen;             /**< Used length of arena */
+  size_t arenasize;            /**< Allocated size of arena */
+  struct load_batch *next;     /**< Next batch in file order */
+};
+
+/** State of a parallel load */
+struct db_loader {
+  PENNFILE *f;     /**< The file being loaded */
+  PENNFILE under;  /**< The real read state of f, used by the reader */
+  struct load_batch *head; /**< Oldest batch not done with */
+  struct load_batch *tail; /**< Newest batch */
+  int nbatches;            /**< Number of batches in the list */
+  int cur_rec;             /**< Next record of head to check */
+  bool reading;            /**< Is the main thread reading head? */
+  bool done;               /**< Has the reader finished? */
+  bool stop;               /**< Should all threads stop? */
+  bool reader_running;     /**< Was the reader thread started? */
+  bool compress;           /**< Should workers compress values? */
+  int nworkers;            /**< Number of worker threads */
+  pthread_t reader;                    /**< The reader thread */
+  pthread_t workers[LOAD_MAX_WORKERS]; /**< The worker threads */
+  pthread_mutex_t lock;                /**< Protects the batch list */
+  pthread_cond_t changed;              /**< Signalled on any change */
+};
+
+static struct db_loader *loader = NULL; /**< The current parallel load */
+
+/** Is a file being read through a parallel load? */
+static bool
+parallel_load_reading(PENNFILE *f)
+{
+  return loader && loader->f == f;
+}
+
+/* Loader threads use plain malloc(); the memory checker isn't thread-safe. */
+static struct load_batch *
+loader_new_batch(struct db_loader *l)
+{
+  struct load_batch *b = calloc(1, sizeof *b);
+
+  if (!b)
+    return NULL;
+  b->owned = l->under.type != PFT_MAPPED;
+  if (!b->owned)
+    b->data = l->under.buf + l->under.pos;
+  return b;
+}
+
+static void
+loader_free_batch(struct load_batch *b)
+{
+  int n;
+
+  for (n = 0; n < b->nattrs; n++)
+    free(b->attrs[n].compressed);
+  if (b->owned)
+    free(b->data);
+  free(b->recs);
+  free(b->attrs);
+  free(b->arena);
+  free(b);
+}
+
+/* Add the next block of the file to a batch. Returns false at the end of
+ * the file or when out of memory. */
+static bool
+loader_more(struct db_loader *l, struct load_batch *b)
+{
+  PENNFILE *u = &l->under;
+  size_t n;
+
+  if (u->pos >= u->len && !penn_fill(u))
+    return false;
+  n = u->len - u->pos;
+  if (n > PENNFILE_BLOCK)
+    n = PENNFILE_BLOCK;
+  if (b->owned) {
+    if (b->len + n > b->size) {
+      size_t size = b->size ? b->size * 2 : LOAD_BATCH_SIZE + PENNFILE_BLOCK;
+      char *data;
+
+      while (size < b->len + n)
+        size *= 2;
+      data = realloc(b->data, size);
+      if (!data)
+        return false;
+      b->data = data;
+      b->size = size;
+    }
+    memcpy(b->data + b->len, u->buf + u->pos, n);
+  }
+  b->len += n;
+  u->pos += n;
+  return true;
+}
+
+/* Move everything in a batch from offset at on to a new batch. */
+static struct load_batch *
+loader_split_batch(struct db_loader *l, struct load_batch *b, size_t at)
+{
+  struct load_batch *nb = loader_new_batch(l);
+
+  if (!nb)
+    return NULL;
+  if (b->owned) {
+    nb->size = b->len - at + LOAD_BATCH_SIZE + PENNFILE_BLOCK;
+    nb->data = malloc(nb->size);
+    if (!nb->data) {
+      free(nb);
+      return NULL;
+    }
+    memcpy(nb->data, b->data + at, b->len - at);
+  } else
+    nb->data = b->data + at;
+  nb->len = b->len - at;
+  b->len = at;
+  return nb;
+}
+
+/* Hand a batch to the workers, waiting for room. Returns false if the
+ * load is being stopped; the batch is freed. */
+static bool
+loader_queue_batch(struct db_loader *l, struct load_batch *b)
+{
+  pthread_mutex_lock(&l->lock);
+  while (l->nbatches >= LOAD_MAX_BATCHES && !l->stop)
+    pthread_cond_wait(&l->changed, &l->lock);
+  if (l->stop) {
+    pthread_mutex_unlock(&l->lock);
+    loader_free_batch(b);
+    return false;
+  }
+  if (l->tail)
+    l->tail->next = b;
+  else
+    l->head = b;
+  l->tail = b;
+  l->nbatches++;
+  pthread_cond_broadcast(&l->changed);
+  pthread_mutex_unlock(&l->lock);
+  return true;
+}
+
+/* Note the start of an object in a batch. */
+static struct load_record *
+loader_new_record(struct load_batch *b)
+{
+  if (b->nrecs == b->maxrecs) {
+    int max = b->maxrecs ? b->maxrecs * 2 : 256;
+    struct load_record *recs = realloc(b->recs, max * sizeof *recs);
+
+    if (!recs)
+      return NULL;
+    b->recs = recs;
+    b->maxrecs = max;
+  }
+  memset(b->recs + b->nrecs, 0, sizeof *b->recs);
+  return b->recs + b->nrecs++;
+}
+
+/** The reader thread.
+ * Cuts the file into batches at the start of objects, and notes where
+ * each object's attribute list starts. Quoted strings are tracked so
+ * that lines inside them aren't taken for the start of an object. The
+ * end of dump marker ends the last batch, and the file is left just
+ * past it for the main thread to go on reading.
+ */
+static void *
+loader_read_thread(void *arg)
+{
+  struct db_loader *l = arg;
+  struct load_batch *b;
+  struct load_record *rec = NULL;
+  size_t scan = 0;
+  const size_t eodlen = sizeof EOD - 1;
+  bool bol = true, quoted = false, escaped = false, eof = false;
+  bool attrs_next = false;
+
+  b = loader_new_batch(l);
+  while (b) {
+    if (scan == b->len || (bol && !eof && b->len - scan < eodlen)) {
+      if (eof)
+        break;
+      if (!loader_more(l, b))
+        eof = true;
+      continue;
+    }
+    if (bol && !quoted) {
+      const char *line = b->data + scan;
+
+      if (*line == '!') {
+        if (scan >= load_batch_size) {
+          struct load_batch *nb = loader_split_batch(l, b, scan);
+
+          if (!nb)
+            break;
+          b->cut = true;
+          if (!loader_queue_batch(l, b)) {
+            loader_free_batch(nb);
+            b = NULL;
+            break;
+          }
+          b = nb;
+          scan = 0;
+        }
+        rec = loader_new_record(b);
+        if (!rec)
+          break;
+      } else if (*line == '*' && b->len - scan >= eodlen &&
+                 memcmp(line, EOD, eodlen) == 0) {
+        /* Leave the rest of the file where the main thread can read it */
+        l->under.pos -= b->len - (scan + eodlen);
+        b->len = scan + eodlen;
+        break;
+      } else if (rec && *line == 'a' && b->len - scan > 10 &&
+                 memcmp(line, "attrcount ", 10) == 0)
+        attrs_next = true;
+      bol = false;
+    }
+    while (scan < b->len) {
+      char c = b->data[scan++];
+
+      if (escaped)
+        escaped = false;
+      else if (quoted) {
+        if (c == '\\')
+          escaped = true;
+        else if (c == '"')
+          quoted = false;
+      } else if (c == '"')
+        quoted = true;
+      else if (c == '\n') {
+        bol = true;
+        if (attrs_next) {
+          rec->attr_start = scan;
+          attrs_next = false;
+        }
+        break;
+      }
+    }
+  }
+  if (b)
+    loader_queue_batch(l, b);
+  pthread_mutex_lock(&l->lock);
+  l->done = true;
+  pthread_cond_broadcast(&l->changed);
+  pthread_mutex_unlock(&l->lock);
+  return NULL;
+}
+
+/* Copy a character to the end of a batch's arena. */
+static bool
+loader_arena_chr(struct load_batch *b, char c)
+{
+  if (b->arenalen == b->arenasize) {
+    size_t size = b->arenasize ? b->arenasize * 2 : LOAD_BATCH_SIZE;
+    char *arena = realloc(b->arena, size);
+
+    if (!arena)
+      return false;
+    b->arena = arena;
+    b->arenasize = size;
+  }
+  b->arena[b->arenalen++] = c;
+  return true;
+}
+
+/** Parse one labeled field of an attribute, as written by
+ * db_write_labeled_string() and friends.
+ * \param b the batch.
+ * \param p offset of the start of the field's line.
+ * \param label the label the field must have.
+ * \param value set to the arena offset of the value.
+ * \return the offset of the next line, or 0 if the field should be left
+ * for db_read_labeled_string().
+ */
+static size_t
+loader_parse_field(struct load_batch *b, size_t p, const char *label,
+                   size_t *value)
+{
+  const char *s = b->data;
+  size_t n = strlen(label), start;
+
+  while (p < b->len && (s[p] == ' ' || s[p] == '\t'))
+    p++;
+  if (b->len - p <= n || memcmp(s + p, label, n) != 0 ||
+      (s[p + n] != ' ' && s[p + n] != '\t'))
+    return 0;
+  for (p += n; p < b->len && (s[p] == ' ' || s[p] == '\t'); p++)
+    ;
+  if (p >= b->len || s[p] == '\n')
+    return 0;
+  start = *value = b->arenalen;
+  if (s[p] == '"') {
+    for (p++; p < b->len && s[p] != '"'; p++) {
+      if (s[p] == '\\' && ++p >= b->len)
+        return 0;
+      if (s[p] == '\0' || b->arenalen - start >= BUFFER_LEN - 2 ||
+          !loader_arena_chr(b, s[p]))
+        return 0;
+    }
+    p++;
+  } else {
+    for (; p < b->len && s[p] != '\n'; p++) {
+      if ((!isdigit((unsigned char) s[p]) && s[p] != '#' && s[p] != '-') ||
+          b->arenalen - start >= BUFFER_LEN - 2 || !loader_arena_chr(b, s[p]))
+        return 0;
+    }
+  }
+  if (p >= b->len || s[p] != '\n' || !loader_arena_chr(b, '\0'))
+    return 0;
+  return p + 1;
+}
+
+/* Parse the attribute list of one object. */
+static void
+loader_parse_record(struct db_loader *l, struct load_batch *b,
+                    struct load_record *rec)
+{
+  size_t p = rec->attr_start, owner, derefs;
+  const char *nl;
+  struct load_attr *a;
+
+  rec->first = b->nattrs;
+  while (p < b->len && b->data[p] == ' ') {
+    if (b->nattrs == b->maxattrs) {
+      int max = b->maxattrs ? b->maxattrs * 2 : 1024;
+      struct load_attr *attrs = realloc(b->attrs, max * sizeof *attrs);
+
+      if (!attrs)
+        goto fail;
+      b->attrs = attrs;
+      b->maxattrs = max;
+    }
+    a = b->attrs + b->nattrs;
+    a->compressed = NULL;
+    if (!(p = loader_parse_field(b, p, "name", &a->name)) ||
+        !(p = loader_parse_field(b, p, "owner", &owner)) ||
+        !(p = loader_parse_field(b, p, "flags", &a->flags)) ||
+        !(p = loader_parse_field(b, p, "derefs", &derefs)) ||
+        !(p = loader_parse_field(b, p, "value", &a->value)))
+      goto fail;
+    if (strlen(b->arena + a->name) > ATTRIBUTE_NAME_LIMIT)
+      goto fail;
+    a->owner = qparse_dbref(b->arena + owner);
+    a->derefs = parse_integer(b->arena + derefs);
+    if (l->compress && b->arena[a->value])
+      a->compressed = text_compress(b->arena + a->value);
+    b->nattrs++;
+  }
+  /* The list must visibly end inside the batch */
+  if (p >= b->len && !b->cut)
+    goto fail;
+  rec->attr_end = p;
+  rec->count = b->nattrs - rec->first;
+  for (nl = b->data + rec->attr_start;
+       (nl = memchr(nl, '\n', b->data + p - nl)); nl++)
+    rec->lines++;
+  rec->parsed = true;
+  return;
+
+fail:
+  while (b->nattrs > rec->first)
+    free(b->attrs[--b->nattrs].compressed);
+}
+
+/** A worker thread. Parses batches until the reader is done with the
+ * file and there are none left. */
+static void *
+loader_parse_thread(void *arg)
+{
+  struct db_loader *l = arg;
+  struct load_batch *b;
+  int n;
+
+  pthread_mutex_lock(&l->lock);
+  for (;;) {
+    for (b = l->head; b && b->state != LOAD_BATCH_READ; b = b->next)
+      ;
+    if (!b) {
+      if (l->stop || l->done)
+        break;
+      pthread_cond_wait(&l->changed, &l->lock);
+      continue;
+    }
+    b->state = LOAD_BATCH_BUSY;
+    pthread_mutex_unlock(&l->lock);
+    for (n = 0; n < b->nrecs; n++)
+      if (b->recs[n].attr_start && !l->stop)
+        loader_parse_record(l, b, b->recs + n);
+    pthread_mutex_lock(&l->lock);
+    b->state = LOAD_BATCH_PARSED;
+    pthread_cond_broadcast(&l->changed);
+  }
+  pthread_mutex_unlock(&l->lock);
+  return NULL;
+}
+
+/** Start loading the rest of a database file in parallel.
+ * Does nothing if threads can't be started or parallel_db_load is off.
+ * \param f the file being read by db_read().
+ */
+static void
+parallel_load_start(PENNFILE *f)
+{
+  struct db_loader *l;
+  sigset_t all, old;
+  long cpus = 2;
+  int n;
+
+#ifdef HAVE_SYSCONF
+  cpus = sysconf(_SC_NPROCESSORS_ONLN);
 #endif
+  if (loader || !PARALLEL_DB_LOAD)
+    return;
+  l = mush_calloc(1, sizeof *l, "db.loader");
+  l->f = f;
+  l->under = *f;
+  l->compress = text_compress_reentrant();
+  pthread_mutex_init(&l->lock, NULL);
+  pthread_cond_init(&l->changed, NULL);
+  loader = l;
+
+  /* Signals belong to the main thread. The workers go first, so that if
+   * they can't be started, nothing has been read yet. */
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  /* Even with one CPU, a worker parses faster than the main thread */
+  for (n = 0; n < LOAD_MAX_WORKERS && (n == 0 || n < cpus - 1); n++) {
+    if (pthread_create(&l->workers[n], NULL, loader_parse_thread, l) != 0)
+      break;
+  }
+  l->nworkers = n;
+  if (n && pthread_create(&l->reader, NULL, loader_read_thread, l) == 0)
+    l->reader_running = true;
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (!l->reader_running) {
+    do_rawlog(LT_ERR, "Unable to start database loading threads.");
+    parallel_load_end(f);
+    return;
+  }
+
+  /* The main thread now reads the batches through f. */
+  f->buf = NULL;
+  f->pos = f->len = 0;
+  f->eof = false;
+}
+
+/** Stop a parallel load, and give the file back to the usual code.
+ * At the end of the dump, the file is left just past it; if the load
+ * is being abandoned, where it's left doesn't matter.
+ * \param f the file being read.
+ */
+static void
+parallel_load_end(PENNFILE *f)
+{
+  struct db_loader *l = loader;
+  struct load_batch *b;
+  int n;
+
+  if (!l || l->f != f)
+    return;
+  pthread_mutex_lock(&l->lock);
+  l->stop = true;
+  pthread_cond_broadcast(&l->changed);
+  pthread_mutex_unlock(&l->lock);
+  if (l->reader_running)
+    pthread_join(l->reader, NULL);
+  for (n = 0; n < l->nworkers; n++)
+    pthread_join(l->workers[n], NULL);
+  while ((b = l->head)) {
+    l->head = b->next;
+    loader_free_batch(b);
+  }
+  f->buf = l->under.buf;
+  f->pos = l->under.pos;
+  f->len = l->under.len;
+  f->eof = l->under.eof;
+  pthread_cond_destroy(&l->changed);
+  pthread_mutex_destroy(&l->lock);
+  mush_free(l, "db.loader");
+  loader = NULL;
+}
+
+/** Give the main thread the next batch to read through f.
+ * \param f the file being read.
+ * \return true if there's more to read.
+ */
+static bool
+parallel_load_next(PENNFILE *f)
+{
+  struct db_loader *l = loader;
+  struct load_batch *b, *old = NULL;
+
+  pthread_mutex_lock(&l->lock);
+  if (l->reading) {
+    old = l->head;
+    l->head = old->next;
+    if (!l->head)
+      l->tail = NULL;
+    l->nbatches--;
+    l->reading = false;
+    pthread_cond_broadcast(&l->changed);
+  }
+  while (!((b = l->head) && b->state == LOAD_BATCH_PARSED) &&
+         !(!b && l->done))
+    pthread_cond_wait(&l->changed, &l->lock);
+  if (b) {
+    l->reading = true;
+    l->cur_rec = 0;
+  }
+  pthread_mutex_unlock(&l->lock);
+  if (old)
+    loader_free_batch(old);
+
+  if (!b) {
+    /* The reader stopped at the end of the dump, or of the file. */
+    parallel_load_end(f);
+    return f->pos < f->len || penn_fill(f);
+  }
+  f->buf = b->data;
+  f->pos = 0;
+  f->len = b->len;
+  return f->len > 0 || penn_fill(f);
+}
+
+/** Add an attribute list that a worker has already parsed.
+ * \param f the file being read, at the start of an attribute list.
+ * \param i dbref for the attribute list.
+ * \param count the number of attributes expected.
+ * \return true if the list was added, false if it has to be read.
+ */
+static bool
+parallel_load_attrs(PENNFILE *f, dbref i, int count)
+{
+  struct db_loader *l = loader;
+  struct load_batch *b;
+  struct load_record *rec;
+  struct load_attr *a;
+  int n;
+
+  if (!l || l->f != f || !l->reading)
+    return false;
+  b = l->head;
+  while (l->cur_rec < b->nrecs && b->recs[l->cur_rec].attr_start < f->pos)
+    l->cur_rec++;
+  if (l->cur_rec >= b->nrecs)
+    return false;
+  rec = b->recs + l->cur_rec;
+  if (rec->attr_start != f->pos || !rec->parsed)
+    return false;
+  l->cur_rec++;
+
+  attr_reserve(i, count);
+  for (n = 0, a = b->attrs + rec->first; n < rec->count; n++, a++) {
+    atr_new_add_compressed(
+      i, b->arena + a->name, b->arena + a->value, a->compressed, a->owner,
+      string_to_privs(attr_privs_view, b->arena + a->flags, 0), a->derefs, 1);
+    a->compressed = NULL;
+  }
+  if (rec->count != count)
+    do_rawlog(LT_ERR,
+              "WARNING: Actual attribute count (%d) different than "
+              "expected count (%d).",
+              rec->count, count);
+  dbline += rec->lines;
+  f->pos = rec->attr_end;
+  load_parsed_lists++;
+  return true;
+}
+#else /* DB_PARALLEL_LOAD */
+static void
+parallel_load_start(PENNFILE *f __attribute__((__unused__)))
+{
+}
+
+static void
+parallel_load_end(PENNFILE *f __attribute__((__unused__)))
+{
+}
+#endif /* DB_PARALLEL_LOAD */
+
+TEST_GROUP(penn_fgetc)
+{
+  PENNFILE *volatile f = NULL;
+  const char *fname = "pennfiletestdata.txt";
+  char buf[BUFFER_LEN];
+  char *label, *value;
+  int i;
+  volatile int bad = 0;
+
+  if (setjmp(db_err)) {
+    TEST("penn_fgetc.error", 0);
+    if (f)
+      penn_fclose(f);
+    remove(fname);
+    return;
+  }
+
+  f = penn_fopen(fname, "w");
+  TEST("penn_fgetc.create.1", f != NULL);
+  if (!f)
+    return;
+  /* Enough lines to cross several buffer refills */
+  for (i = 0; i < 5000; i++) {
+    putref(f, i);
+    putstring(f, "a \"quoted\" \\string\\ with\nnewline");
+    db_write_labeled_string(f, "value", "some text \"here\"");
+  }
+  penn_fputs("unquoted\r\nline\nlast", f);
+  penn_fclose(f);
+
+  f = penn_fopen(fname, "r");
+  TEST("penn_fgetc.open.1", f != NULL);
+  if (!f)
+    return;
+  for (i = 0; i < 5000 && !bad; i++) {
+    if (getref(f) != i)
+      bad = 1;
+    else if (strcmp(getstring_noalloc(f),
+                    "a \"quoted\" \\string\\ with\nnewline"))
+      bad = 2;
+    else {
+      db_read_labeled_string(f, &label, &value);
+      if (strcmp(label, "value") || strcmp(value, "some text \"here\""))
+        bad = 3;
+    }
+  }
+  TEST("penn_fgetc.read.1", bad == 0);
+  TEST("penn_fgetc.read.2", !strcmp(getstring_noalloc(f), "unquoted\r\nline"));
+  TEST("penn_fgetc.fgets.1", penn_fgets(buf, 3, f) && !strcmp(buf, "la"));
+  TEST("penn_fgetc.ungetc.1",
+       penn_ungetc(penn_fgetc(f), f) == 's' && penn_fgetc(f) == 's');
+  TEST("penn_fgetc.feof.1", !penn_feof(f));
+  TEST("penn_fgetc.fgets.2", penn_fgets(buf, sizeof buf, f) &&
+                               !strcmp(buf, "t"));
+  TEST("penn_fgetc.feof.2", penn_fgetc(f) == EOF && penn_feof(f));
+  TEST("penn_fgetc.ungetc.2", penn_ungetc(EOF, f) == EOF && penn_feof(f));
+  penn_fclose(f);
+
+  /* A quoted string with nothing after it, not even a newline */
+  f = penn_fopen(fname, "w");
+  TEST("penn_fgetc.create.2", f != NULL);
+  if (!f)
+    return;
+  penn_fputs("\"last\"", f);
+  penn_fclose(f);
+  f = penn_fopen(fname, "r");
+  TEST("penn_fgetc.open.2", f != NULL);
+  if (!f)
+    return;
+  TEST("penn_fgetc.read.3", !strcmp(getstring_noalloc(f), "last"));
+  TEST("penn_fgetc.feof.3", penn_feof(f));
+  penn_fclose(f);
+  f = NULL;
+  remove(fname);
+}
+
+#ifdef DB_PARALLEL_LOAD
+#define LOAD_TEST_OBJS 40 /**< Objects in the parallel_load test file */
+#define LOAD_TEST_BIG 7   /**< Object with a list bigger than a file block */
+
+/* Number of attributes on an object in the parallel_load test file. */
+static int
+load_test_count(int obj)
+{
+  return obj == LOAD_TEST_BIG ? 300 : obj % 5;
+}
+
+/* Make the name and value of an attribute in the test file. Values
+ * include quoted lines that look like the start of an object. */
+static void
+load_test_attr(int obj, int n, char *name, char *value)
+{
+  char *vp = value;
+
+  snprintf(name, ATTRIBUTE_NAME_LIMIT + 1, "LOADTEST_%d_%d", obj, n);
+  switch (n % 4) {
+  case 0:
+    snprintf(value, BUFFER_LEN, "!%d\nattrcount 1\n name \"fake\"\n", obj);
+    break;
+  case 1:
+    snprintf(value, BUFFER_LEN, "a \"quoted\" \\ value %d", n);
+    break;
+  case 2:
+    safe_fill('x', 2000, value, &vp);
+    safe_integer(n, value, &vp);
+    *vp = '\0';
+    break;
+  default:
+    snprintf(value, BUFFER_LEN, "plain %d", n);
     break;
   }
-  return 0;
+}
+
+/* Read the parallel_load test file, putting every attribute on thing.
+ * Returns the number of objects read, or -1 on errors. */
+static int
+load_test_read(const char *fname, dbref thing, bool parallel)
+{
+  PENNFILE *volatile f;
+  volatile int objs = 0;
+  char buf[BUFFER_LEN];
+  char *tmp;
+  int c, count;
+
+  f = penn_fopen(fname, "r");
+  if (!f)
+    return -1;
+  if (setjmp(db_err)) {
+    penn_fclose(f);
+    return -1;
+  }
+  if (parallel)
+    parallel_load_start(f);
+  while ((c = penn_fgetc(f)) == '!') {
+    (void) getref(f);
+    db_read_this_labeled_string(f, "name", &tmp);
+    db_read_this_labeled_int(f, "attrcount", &count);
+    db_read_attrs(f, thing, count);
+    objs++;
+  }
+  penn_ungetc(c, f);
+  if (!penn_fgets(buf, sizeof buf, f) || strcmp(buf, EOD) != 0)
+    objs = -1;
+  penn_fclose(f);
+  return objs;
+}
+#endif /* DB_PARALLEL_LOAD */
+
+TEST_GROUP(parallel_load)
+{
+#ifdef DB_PARALLEL_LOAD
+  const char *fname = "paralleltestdata.txt";
+  PENNFILE *f;
+  char name[ATTRIBUTE_NAME_LIMIT + 1], value[BUFFER_LEN];
+  dbref serial, parallel;
+  ATTR *a, *b;
+  int i, j, lists, bad = 0;
+  int save_option = options.parallel_db_load;
+  long save_flags = globals.indb_flags;
+  size_t save_size = load_batch_size;
+
+  f = penn_fopen(fname, "w");
+  TEST("parallel_load.create", f != NULL);
+  if (!f)
+    return;
+  for (i = 0; i < LOAD_TEST_OBJS; i++) {
+    penn_fprintf(f, "!%d\n", i);
+    db_write_labeled_string(f, "name", "Looks like\n!1\nattrcount 0\n");
+    db_write_labeled_int(f, "attrcount", load_test_count(i));
+    for (j = 0; j < load_test_count(i); j++) {
+      load_test_attr(i, j, name, value);
+      db_write_labeled_string(f, " name", name);
+      db_write_labeled_dbref(f, "  owner", GOD);
+      db_write_labeled_string(f, "  flags", (j % 2) ? "no_command" : "");
+      db_write_labeled_int(f, "  derefs", j % 3);
+      db_write_labeled_string(f, "  value", value);
+    }
+  }
+  penn_fputs(EOD, f);
+  penn_fclose(f);
+
+  /* Small batches, so objects and their lists are spread over many */
+  load_batch_size = 4096;
+  options.parallel_db_load = 1;
+  globals.indb_flags |= DBF_SPIFFY_AF_ANSI;
+  serial = new_scratch_object();
+  parallel = new_scratch_object();
+
+  TEST("parallel_load.serial",
+       load_test_read(fname, serial, 0) == LOAD_TEST_OBJS);
+  lists = load_parsed_lists;
+  TEST("parallel_load.parallel",
+       load_test_read(fname, parallel, 1) == LOAD_TEST_OBJS);
+  /* Every list is in the plain format, so none should be left over */
+  TEST("parallel_load.workers", load_parsed_lists - lists == LOAD_TEST_OBJS);
+  for (i = 0; i < LOAD_TEST_OBJS; i++) {
+    for (j = 0; j < load_test_count(i); j++) {
+      load_test_attr(i, j, name, value);
+      a = atr_get_noparent(serial, name);
+      b = atr_get_noparent(parallel, name);
+      if (!a || !b || strcmp(atr_value(a), value) != 0 ||
+          strcmp(atr_value(b), value) != 0 || AL_FLAGS(a) != AL_FLAGS(b) ||
+          AL_DEREFS(a) != AL_DEREFS(b) || AL_CREATOR(a) != AL_CREATOR(b))
+        bad++;
+    }
+  }
+  TEST("parallel_load.same", bad == 0);
+  TEST("parallel_load.count", AttrCount(serial) == AttrCount(parallel));
+
+  options.parallel_db_load = 0;
+  lists = load_parsed_lists;
+  i = load_test_read(fname, parallel, 1);
+  TEST("parallel_load.off", i == LOAD_TEST_OBJS && load_parsed_lists == lists);
+
+  free_scratch_object(serial);
+  free_scratch_object(parallel);
+  options.parallel_db_load = save_option;
+  globals.indb_flags = save_flags;
+  load_batch_size = save_size;
+  remove(fname);
+#endif /* DB_PARALLEL_LOAD */
 }
@@ -84,6 +84,7 @@ static void clear_thing(dbref thing);
 static void clear_player(dbref thing);
 static void clear_room(dbref thing);
 static void clear_exit(dbref thing);
+static void delete_object_row(dbref thing);
 
 static void check_fields(void);
 static void check_connected_rooms(void);
@@ -602,6 +603,8 @@ free_object(dbref thing)
   const char *type;
   if (!GoodObject(thing))
     return;
+  /* A dump in progress needs the object as it was */
+  incremental_dump_object(thing);
   local_data_free(thing);
   switch (Typeof(thing)) {
   case TYPE_THING:
@@ -729,8 +732,10 @@ free_object(dbref thing)
       Contents(loc) = remove_first(Contents(loc), thing);
     if (Typeof(thing) == TYPE_THING)
       current_state.things--;
-    else
+    else {
       current_state.players--;
+      delete_player(thing);
+    }
     break;
   case TYPE_EXIT: /* This probably won't be needed, but lets make sure */
     loc = Source(thing);
@@ -757,24 +762,8 @@ free_object(dbref thing)
   Home(thing) = NOTHING;
   CreTime(thing) = 0; /* Prevents it from matching objids */
 
-  {
-    sqlite3 *sqldb;
-    sqlite3_stmt *deleter;
-    int status;
-
-    sqldb = get_shared_db();
-    deleter = prepare_statement(sqldb, "DELETE FROM objects WHERE dbref = ?",
-                                "objects.delete");
-    sqlite3_bind_int(deleter, 1, thing);
-    do {
-      status = sqlite3_step(deleter);
-    } while (is_busy_status(status));
-    if (status != SQLITE_DONE) {
-      do_rawlog(LT_ERR, "Unable to delete #%d from objects table: %s", thing,
-                sqlite3_errmsg(sqldb));
-    }
-    sqlite3_reset(deleter);
-  }
+  delete_object_row(thing);
+  clear_objdata(thing);
 
   Next(thing) = first_free;
   first_free = thing;
@@ -782,6 +771,68 @@ free_object(dbref thing)
   current_state.garbage++;
 }
 
+/* Remove a freed object from the sqlite objects table. */
+static void
+delete_object_row(dbref thing)
+{
+  sqlite3 *sqldb;
+  sqlite3_stmt *deleter;
+  int status;
+
+  sqldb = get_shared_db();
+  deleter = prepare_statement(sqldb, "DELETE FROM objects WHERE dbref = ?",
+                              "objects.delete");
+  sqlite3_bind_int(deleter, 1, thing);
+  do {
+    status = sqlite3_step(deleter);
+  } while (is_busy_status(status));
+  if (status != SQLITE_DONE) {
+    do_rawlog(LT_ERR, "Unable to delete #%d from objects table: %s", thing,
+              sqlite3_errmsg(sqldb));
+  }
+  sqlite3_reset(deleter);
+}
+
+/** Make a bare thing for hardcode tests to work on instead of real objects.
+ * It isn't anywhere and nothing refers to it, so free_scratch_object() can
+ * throw it away again without any of the usual destruction.
+ * \return dbref of the new object.
+ */
+dbref
+new_scratch_object(void)
+{
+  dbref thing = new_object();
+
+  set_name(thing, "Scratch");
+  Type(thing) = TYPE_THING;
+  Flags(thing) = new_flag_bitmask("FLAG");
+  return thing;
+}
+
+/** Free an object made by new_scratch_object().
+ * \param thing the object.
+ */
+void
+free_scratch_object(dbref thing)
+{
+  incremental_dump_object(thing);
+  atr_free_all(thing);
+  free_locks(Locks(thing));
+  Locks(thing) = NULL;
+  Type(thing) = TYPE_GARBAGE;
+  destroy_flag_bitmask("FLAG", Flags(thing));
+  Flags(thing) = NULL;
+  destroy_flag_bitmask("POWER", Powers(thing));
+  Powers(thing) = NULL;
+  set_name(thing, "Garbage");
+  CreTime(thing) = 0;
+  delete_object_row(thing);
+  clear_objdata(thing);
+  Next(thing) = first_free;
+  first_free = thing;
+  current_state.garbage++;
+}
+
 static void
 empty_contents(dbref thing)
 {
@@ -36,24 +36,18 @@
  * THEORY OF OPERATION:
  *  Prior to pl11, mail was an unsorted linked list. When mail was sent,
  * it was added onto the end. To read mail, you scanned the whole list.
- * This is still how origmail.c works.
- *  As of pl11, extmail.c maintains mail as a sorted linked list, sorted
- * by recipient and order of receipt. This makes sending mail less
- * efficient (because you have to scan the list to figure out where to
- * insert), but reading/checking/deleting more efficient,
- * because once you've found where the player's mail starts, you just
- * read from there.
- *  That wouldn't be so exciting unless there was a fast way to find
- * where a player's mail chain started. Fortunately, there is. We
- * record that information for connected players when they connect,
- * on their descriptor. So, when connected players do reading/etc,
- * it's O(1). Sending to a connected player is O(1). Sending to an
- * unconnected player still requires scanning (O(n)), but you send once,
- * and read/list/delete etc, multiple times.
- *  And just to make the sending to disconnected players faster,
- * instead of scanning the whole maildb to find the insertion point,
- * we start the scan from the chain of the connected player with the
- * closest db# to the target player. This scales up very well.
+ *  Later, extmail.c kept all mail in one linked list sorted by
+ * recipient, with a hint to find where each player's messages started.
+ * That still meant walking the whole list to send to a player with no
+ * hint, and to find or count the messages a player had sent.
+ *  Now each player with mail has a mailbox, found through an intmap
+ * keyed by dbref. It holds the messages they've received, in order of
+ * receipt, and counts of their read, unread and cleared messages in
+ * each folder, so sending and counting are O(1). Every message is also
+ * on its sender's mailbox, in the order sent, so reviewing, retracting
+ * and counting sent mail only looks at what that player sent. Things
+ * that need every message walk the mailboxes in dbref order, which is
+ * the order mail has always been saved in.
  *--------------------------------------------------------------------
  * \endverbatim
  */
@@ -87,6 +81,7 @@
 #include "externs.h"
 #include "flags.h"
 #include "function.h"
+#include "intmap.h"
 #include "lock.h"
 #include "log.h"
 #include "malias.h"
@@ -119,7 +114,6 @@ static int send_mail_alias(dbref player, char *aname, char *subject,
                            int nosig);
 static void filter_mail(dbref from, dbref player, char *subject, char *message,
                         int mailnumber, mail_flag flags);
-static MAIL *find_insertion_point(dbref player);
 static int get_folder_number(dbref player, char *name);
 static char *get_folder_name(dbref player, int fld);
 static int player_folder(dbref player);
@@ -140,13 +134,31 @@ static int was_sender(dbref player, MAIL *mp);
 void do_mail_reviewread(dbref player, dbref target, const char *msglist);
 void do_mail_reviewlist(dbref player, dbref target);
 
-MAIL *maildb;   /**< The head of the mail list */
-MAIL *tail_ptr; /**< The end of the mail list */
+/** The ways a message is counted */
+enum mail_class { MC_READ, MC_UNREAD, MC_CLEARED, MC_COUNT };
 
-slab *mail_slab; /**< slab for 'struct mail' allocations */
+/** A player's mail.
+ * Every object that has received or sent mail has one.
+ */
+struct mailbox {
+  MAIL *first;                         /**< Oldest message received */
+  MAIL *last;                          /**< Newest message received */
+  MAIL *sent_first;                    /**< Oldest message sent */
+  MAIL *sent_last;                     /**< Newest message sent */
+  time_t sent_ctime;                   /**< Creation time of the sender */
+  int counts[MAX_FOLDERS + 1][MC_COUNT]; /**< Messages received by folder */
+  int sent_counts[MC_COUNT];             /**< Messages sent */
+};
+
+static intmap *mailboxes = NULL;  /**< Mailboxes by dbref */
+static int spool_counts[MC_COUNT]; /**< All messages */
+
+static struct mailbox *mailbox_find(dbref player);
+static void mail_link(MAIL *mp);
+static void mail_delete(MAIL *mp);
+static void mail_set_status(MAIL *mp, mail_flag read);
 
-#define HEAD maildb   /**< The head of the mail list */
-#define TAIL tail_ptr /**< The end of the mail list */
+slab *mail_slab; /**< slab for 'struct mail' allocations */
 
 /** A line of...dashes! */
 #define DASH_LINE                                                              \
@@ -496,9 +508,9 @@ do_mail_flags(dbref player, const char *msglist, mail_flag flag, bool negate)
         }
         twiddled++;
         if (negate) {
-          mp->read &= ~flag;
+          mail_set_status(mp, mp->read & ~flag);
         } else {
-          mp->read |= flag;
+          mail_set_status(mp, mp->read | flag);
         }
         switch (flag) {
         case M_TAG:
@@ -641,9 +653,9 @@ do_mail_file(dbref player, char *msglist, char *folder)
       i[Folder(mp)]++;
       if (mail_match(player, mp, ms, i[Folder(mp)])) {
         j++;
-        mp->read &= M_FMASK;    /* Clear the folder */
-        mp->read &= ~M_CLEARED; /* Unclear it if it was marked cleared */
-        mp->read |= FolderBit(foldernum);
+        /* Clear the folder, and unclear it if it was marked cleared */
+        mail_set_status(mp, (mp->read & M_FMASK & ~M_CLEARED) |
+                              FolderBit(foldernum));
         if (All(ms)) {
           if (!notified) {
             notify_format(player,
@@ -727,7 +739,7 @@ do_mail_read(dbref player, char *msglist)
         else
           notify(player, DASH_LINE);
         if (Unread(mp))
-          mp->read |= M_MSGREAD; /* mark message as read */
+          mail_set_status(mp, mp->read | M_MSGREAD); /* mark as read */
       }
     }
   }
@@ -854,6 +866,72 @@ FUNCTION(fun_maillist)
   }
 }
 
+/** A message in a list of sent mail */
+struct sent_entry {
+  MAIL *mp; /**< The message */
+  int n;    /**< Its place on the sender's list */
+};
+
+static int
+sent_entry_cmp(const void *a, const void *b)
+{
+  const struct sent_entry *sa = a, *sb = b;
+
+  if (sa->mp->to != sb->mp->to) {
+    return sa->mp->to < sb->mp->to ? -1 : 1;
+  }
+  return sa->n - sb->n;
+}
+
+/* The first message on a player's list of sent mail, or NULL */
+static MAIL *
+first_sent(dbref player)
+{
+  struct mailbox *box = mailbox_find(player);
+
+  if (!box || (box->sent_ctime && box->sent_ctime != CreTime(player))) {
+    return NULL;
+  }
+  return box->sent_first;
+}
+
+/** List the mail a player has sent.
+ * \param player the sender.
+ * \param target the recipient, or NOTHING for everyone.
+ * \param count set to the number of messages.
+ * \return the messages, by recipient and then in the order they were
+ * sent, which is also the order they were received. Free with
+ * "mail.sent_list". NULL if there are none.
+ */
+static struct sent_entry *
+sent_mail_list(dbref player, dbref target, int *count)
+{
+  struct mailbox *box = mailbox_find(player);
+  struct sent_entry *list;
+  MAIL *mp;
+  int n = 0;
+
+  *count = 0;
+  if (!first_sent(player)) {
+    return NULL;
+  }
+  list = mush_calloc(box->sent_counts[MC_READ] + box->sent_counts[MC_UNREAD] +
+                       box->sent_counts[MC_CLEARED],
+                     sizeof *list, "mail.sent_list");
+  for (mp = box->sent_first; mp; mp = mp->sent_next) {
+    if (target == NOTHING || mp->to == target) {
+      list[n].mp = mp;
+      list[n].n = n;
+      n++;
+    }
+  }
+  if (target == NOTHING) {
+    qsort(list, n, sizeof *list, sent_entry_cmp);
+  }
+  *count = n;
+  return list;
+}
+
 /** Review mail messages.
  * This displays the contents of a set of mail messages sent by one player to
  * another
@@ -886,9 +964,8 @@ do_mail_reviewread(dbref player, dbref target, const char *msglist)
   ms.flags = M_ALL;
   /* Initialize i (message index), j (messages read) */
   i = j = 0;
-  for (mp = find_exact_starting_point(target); mp && (mp->to == target);
-       mp = mp->next) {
-    if (mail_match(player, mp, ma, 0)) {
+  for (mp = first_sent(player); mp; mp = mp->sent_next) {
+    if (mp->to == target && mail_match(player, mp, ma, 0)) {
       /* This was a listed message */
       i++;
       if (mail_match(player, mp, ms, i)) {
@@ -940,9 +1017,10 @@ do_mail_reviewlist(dbref player, dbref target)
   char nbuff[BUFFER_LEN], *np;
   int nlen;
   struct mail_selector ms;
-  int i;
+  int i, n, nsent;
   bool isplayer;
   dbref last = NOTHING;
+  struct sent_entry *sent;
 
   /* Initialize mail selector */
   ms.low = 0;
@@ -964,16 +1042,16 @@ do_mail_reviewlist(dbref player, dbref target)
     if (nlen < 27)
       safe_fill(' ', 27 - nlen, nbuff, &np);
     *np = '\0';
-    mp = find_exact_starting_point(target);
   } else {
     np = nbuff;
     safe_format(nbuff, &np, "%-27s", T("All"));
     *np = '\0';
-    mp = HEAD;
   }
+  sent = sent_mail_list(player, target, &nsent);
   notify_format(
     player, T("--------------------   MAIL: %s   ------------------"), nbuff);
-  for (; mp && ((target == NOTHING) || (mp->to == target)); mp = mp->next) {
+  for (n = 0; n < nsent; n++) {
+    mp = sent[n].mp;
     if (last != mp->to) {
       i = 0;
       last = mp->to;
@@ -1017,6 +1095,9 @@ do_mail_reviewlist(dbref player, dbref target)
       }
     }
   }
+  if (sent) {
+    mush_free(sent, "mail.sent_list");
+  }
   notify(player, DASH_LINE);
   if (SUPPORT_PUEBLO) {
     notify(player, close_tag("SAMP"));
@@ -1095,10 +1176,9 @@ do_mail_retract(dbref player, const char *name, const char *msglist)
   ms.flags = M_ALL;
   /* Initialize i (messages listed), and j (messages retracted) */
   i = j = 0;
-  for (mp = find_exact_starting_point(target); mp && (mp->to == target);
-       mp = nextp) {
-    nextp = mp->next;
-    if (mail_match(player, mp, ma, 0)) {
+  for (mp = first_sent(player); mp; mp = nextp) {
+    nextp = mp->sent_next;
+    if (mp->to == target && mail_match(player, mp, ma, 0)) {
       /* was in message list */
       i++;
       if (mail_match(player, mp, ms, i)) {
@@ -1107,25 +1187,8 @@ do_mail_retract(dbref player, const char *name, const char *msglist)
         if (Read(mp)) {
           notify_format(player, T("MAIL: Message %d has been read."), i);
         } else {
-          /* Delete this one */
-          /* head and tail of the list are special */
-          if (mp == HEAD)
-            HEAD = mp->next;
-          else if (mp == TAIL)
-            TAIL = mp->prev;
-          /* relink the list */
-          if (mp->prev != NULL)
-            mp->prev->next = mp->next;
-          if (mp->next != NULL)
-            mp->next->prev = mp->prev;
-          /* save the pointer */
-          nextp = mp->next;
-          /* then wipe */
           notify_format(player, T("MAIL: Message %d has been retracted."), i);
-          mdb_top--;
-          free(mp->subject);
-          chunk_delete(mp->msgid);
-          slab_free(mail_slab, mp);
+          mail_delete(mp);
         }
       }
     }
@@ -1182,30 +1245,11 @@ do_mail_purge(dbref player)
   /* Go through player's mail, and remove anything marked cleared */
   for (mp = find_exact_starting_point(player); mp && (mp->to == player);
        mp = nextp) {
+    nextp = mp->next;
     if ((mp->to == player) && Cleared(mp)) {
-      /* Delete this one */
-      /* head and tail of the list are special */
-      if (mp == HEAD)
-        HEAD = mp->next;
-      else if (mp == TAIL)
-        TAIL = mp->prev;
-      /* relink the list */
-      if (mp->prev != NULL)
-        mp->prev->next = mp->next;
-      if (mp->next != NULL)
-        mp->next->prev = mp->prev;
-      /* save the pointer */
-      nextp = mp->next;
-      /* then wipe */
-      mdb_top--;
-      free(mp->subject);
-      chunk_delete(mp->msgid);
-      slab_free(mail_slab, mp);
-    } else {
-      nextp = mp->next;
+      mail_delete(mp);
     }
   }
-  delete_objdata(player, "MAIL");
   if (command_check_byname(player, "@MAIL", NULL))
     notify(player, T("MAIL: Mailbox purged."));
   return;
@@ -1248,13 +1292,12 @@ do_mail_fwd(dbref player, char *msglist, char *tolist)
    * the forwarding command happens to forward a message back
    * to the player itself
    */
-  last = mp = find_exact_starting_point(player);
-  if (!last) {
+  mp = find_exact_starting_point(player);
+  if (!mp) {
     notify(player, T("MAIL: You have no messages to forward."));
     return;
   }
-  while (last->next && (last->next->to == player))
-    last = last->next;
+  last = mailbox_find(player)->last;
 
   FA_Init(i);
   while (mp && (mp->to == player) && (mp != last->next)) {
@@ -1438,20 +1481,17 @@ count_mail(dbref player, int folder, int *rcount, int *ucount, int *ccount)
   /* returns count of read, unread, & cleared messages as rcount, ucount,
    * ccount. folder=-1 returns for all folders */
 
-  MAIL *mp;
-  int rc, uc, cc;
+  struct mailbox *box = mailbox_find(player);
+  int rc, uc, cc, f;
 
   cc = rc = uc = 0;
-  for (mp = find_exact_starting_point(player); mp && (mp->to == player);
-       mp = mp->next) {
-    if ((mp->to == player) &&
-        ((folder == -1) || (Folder(mp) == (mail_flag) folder))) {
-      if (Cleared(mp))
-        cc++;
-      else if (Read(mp))
-        rc++;
-      else
-        uc++;
+  if (box) {
+    for (f = 0; f <= MAX_FOLDERS; f++) {
+      if (folder == -1 || folder == f) {
+        rc += box->counts[f][MC_READ];
+        uc += box->counts[f][MC_UNREAD];
+        cc += box->counts[f][MC_CLEARED];
+      }
     }
   }
   *rcount = rc;
@@ -1563,7 +1603,8 @@ real_send_mail(dbref player, dbref target, char *subject, char *message,
 {
   /* deliver a mail message to a target, period */
 
-  MAIL *newp, *mp;
+  MAIL *newp;
+  struct mailbox *box;
   int rc, uc, cc;
   char sbuf[BUFFER_LEN];
   ATTR *a;
@@ -1601,14 +1642,9 @@ real_send_mail(dbref player, dbref target, char *subject, char *message,
     return 0;
   }
 
-  /* Where do we insert it? After mp, wherever that is.
-   * This can return NULL if there are no messages or
-   * if we insert at the head of the list
-   */
-  mp = find_insertion_point(target);
-
   /* initialize the appropriate fields */
-  newp = slab_malloc(mail_slab, mp);
+  box = mailbox_find(target);
+  newp = slab_malloc(mail_slab, box ? box->last : NULL);
   newp->to = target;
   newp->from = player;
   newp->from_ctime = CreTime(player);
@@ -1657,31 +1693,7 @@ real_send_mail(dbref player, dbref target, char *subject, char *message,
   newp->time = mudtime;
   newp->read = flags & M_FMASK; /* Send to folder 0 */
 
-  if (mp) {
-    newp->prev = mp;
-    newp->next = mp->next;
-    if (mp == TAIL)
-      TAIL = newp;
-    else
-      mp->next->prev = newp;
-    mp->next = newp;
-  } else {
-    if (HEAD) {
-      /* Insert at the front */
-      newp->next = HEAD;
-      newp->prev = NULL;
-      HEAD->prev = newp;
-      HEAD = newp;
-    } else {
-      /* This is the first message in the maildb */
-      HEAD = newp;
-      TAIL = newp;
-      newp->prev = NULL;
-      newp->next = NULL;
-    }
-  }
-
-  mdb_top++;
+  mail_link(newp);
 
   /* notify people */
   if (!silent) {
@@ -1715,23 +1727,20 @@ void
 do_mail_nuke(dbref player)
 {
   MAIL *mp, *nextp;
+  dbref i;
 
   if (!God(player)) {
     notify(player, T("The postal service issues a warrant for your arrest."));
     return;
   }
-  /* walk the list */
-  for (mp = HEAD; mp != NULL; mp = nextp) {
-    nextp = mp->next;
-    if (mp->subject)
-      free(mp->subject);
-    chunk_delete(mp->msgid);
-    slab_free(mail_slab, mp);
+  /* walk each mailbox */
+  for (i = 0; i < db_top; i++) {
+    for (mp = find_exact_starting_point(i); mp; mp = nextp) {
+      nextp = mp->next;
+      mail_delete(mp);
+    }
   }
 
-  HEAD = TAIL = NULL;
-  mdb_top = 0;
-
   do_log(LT_ERR, 0, 0, "** MAIL PURGE ** done by %s(#%d).", Name(player),
          player);
   notify(player, T("You annihilate the post office. All messages cleared."));
@@ -1748,7 +1757,7 @@ do_mail_debug(dbref player, const char *action, const char *victim)
 {
   dbref target;
   MAIL *mp, *nextp;
-  int i;
+  int i, n;
 
   if (!Wizard(player)) {
     notify(player, T("Go get some bugspray."));
@@ -1767,13 +1776,14 @@ do_mail_debug(dbref player, const char *action, const char *victim)
                   AName(target, AN_SYS, NULL), target);
     return;
   } else if (strcasecmp("sanity", action) == 0) {
-    for (i = 0, mp = HEAD; mp != NULL; i++, mp = mp->next) {
-      if (!GoodObject(mp->to))
-        notify_format(player, T("Bad object #%d has mail."), mp->to);
-      else if (!IsPlayer(mp->to))
-        notify_format(player, T("%s(#%d) has mail but is not a player."),
-                      Name(mp->to), mp->to);
+    for (n = 0, i = 0; i < db_top; i++) {
+      for (mp = find_exact_starting_point(i); mp; n++, mp = mp->next) {
+        if (!IsPlayer(mp->to))
+          notify_format(player, T("%s(#%d) has mail but is not a player."),
+                        Name(mp->to), mp->to);
+      }
     }
+    i = n;
     if (i != mdb_top) {
       notify_format(
         player,
@@ -1783,37 +1793,15 @@ do_mail_debug(dbref player, const char *action, const char *victim)
     }
     notify(player, T("Mail sanity check completed."));
   } else if (strcasecmp("fix", action) == 0) {
-    for (i = 0, mp = HEAD; mp != NULL; i++, mp = nextp) {
-      if (!GoodObject(mp->to) || !IsPlayer(mp->to)) {
-        notify_format(player, T("Fixing mail for #%d."), mp->to);
-        /* Delete this one */
-        /* head and tail of the list are special */
-        if (mp == HEAD)
-          HEAD = mp->next;
-        else if (mp == TAIL)
-          TAIL = mp->prev;
-        /* relink the list */
-        if (mp->prev != NULL)
-          mp->prev->next = mp->next;
-        if (mp->next != NULL)
-          mp->next->prev = mp->prev;
-        /* save the pointer */
-        nextp = mp->next;
-        /* then wipe */
-        mdb_top--;
-        if (mp->subject)
-          free(mp->subject);
-        chunk_delete(mp->msgid);
-        slab_free(mail_slab, mp);
-      } else if (!GoodObject(mp->from)) {
-        /* Oops, it's from a player whose dbref is out of range!
-         * We'll make it appear to be from #0 instead because there's
-         * no really good choice
-         */
-        mp->from = 0;
-        nextp = mp->next;
-      } else {
+    /* Mail can only be filed under a good recipient and sender, so
+     * bad dbrefs are caught as it's loaded. */
+    for (i = 0; i < db_top; i++) {
+      for (mp = find_exact_starting_point(i); mp; mp = nextp) {
         nextp = mp->next;
+        if (!IsPlayer(mp->to)) {
+          notify_format(player, T("Fixing mail for #%d."), mp->to);
+          mail_delete(mp);
+        }
       }
     }
     notify(player, T("Mail sanity fix completed."));
@@ -1823,6 +1811,27 @@ do_mail_debug(dbref player, const char *action, const char *victim)
   }
 }
 
+/* Tally the mail a player has sent by status, and how long it is
+ * if chars is not NULL. */
+static void
+sent_mail_stats(dbref player, int *fc, int *fr, int *fu, int *chars)
+{
+  struct mailbox *box = mailbox_find(player);
+  MAIL *mp;
+
+  if (!first_sent(player)) {
+    return;
+  }
+  *fc += box->sent_counts[MC_CLEARED];
+  *fr += box->sent_counts[MC_READ];
+  *fu += box->sent_counts[MC_UNREAD];
+  if (chars) {
+    for (mp = box->sent_first; mp; mp = mp->sent_next) {
+      *chars += strlen(get_message(mp));
+    }
+  }
+}
+
 /** Display mail database statistics.
  * \verbatim
  * This implements @mail/stat, @mail/dstat, @mail/fstat.
@@ -1836,7 +1845,7 @@ do_mail_debug(dbref player, const char *action, const char *victim)
 void
 do_mail_stats(dbref player, char *name, enum mail_stats_type full)
 {
-  dbref target;
+  dbref target, i;
   int fc, fr, fu, tc, tr, tu, fchars, tchars, cchars;
   char last[50];
   MAIL *mp;
@@ -1873,30 +1882,27 @@ do_mail_stats(dbref player, char *name, enum mail_stats_type full)
                     mdb_top);
       return;
     } else if (full == MSTATS_READ) {
-      for (mp = HEAD; mp != NULL; mp = mp->next) {
-        if (Cleared(mp))
-          fc++;
-        else if (Read(mp))
-          fr++;
-        else
-          fu++;
-      }
+      fc = spool_counts[MC_CLEARED];
+      fr = spool_counts[MC_READ];
+      fu = spool_counts[MC_UNREAD];
       notify_format(
         player,
         T("MAIL: There are %d msgs in the mail spool, %d unread, %d cleared."),
         fc + fr + fu, fu, fc);
       return;
     } else {
-      for (mp = HEAD; mp != NULL; mp = mp->next) {
-        if (Cleared(mp)) {
-          fc++;
-          cchars += strlen(get_message(mp));
-        } else if (Read(mp)) {
-          fr++;
-          fchars += strlen(get_message(mp));
-        } else {
-          fu++;
-          tchars += strlen(get_message(mp));
+      for (i = 0; i < db_top; i++) {
+        for (mp = find_exact_starting_point(i); mp; mp = mp->next) {
+          if (Cleared(mp)) {
+            fc++;
+            cchars += strlen(get_message(mp));
+          } else if (Read(mp)) {
+            fr++;
+            fchars += strlen(get_message(mp));
+          } else {
+            fu++;
+            tchars += strlen(get_message(mp));
+          }
         }
       }
       notify_format(player,
@@ -1918,12 +1924,9 @@ do_mail_stats(dbref player, char *name, enum mail_stats_type full)
 
   if (full == MSTATS_COUNT) {
     /* just count number of messages */
-    for (mp = HEAD; mp != NULL; mp = mp->next) {
-      if (was_sender(target, mp))
-        fr++;
-      if (mp->to == target)
-        tr++;
-    }
+    sent_mail_stats(target, &fr, &fr, &fr, NULL);
+    count_mail(target, -1, &tr, &tu, &tc);
+    tr += tu + tc;
     notify_format(player, T("%s sent %d messages."),
                   AName(target, AN_SYS, NULL), fr);
     notify_format(player, T("%s has %d messages."), AName(target, AN_SYS, NULL),
@@ -1931,29 +1934,19 @@ do_mail_stats(dbref player, char *name, enum mail_stats_type full)
     return;
   }
   /* more detailed message count */
-  for (mp = HEAD; mp != NULL; mp = mp->next) {
-    if (was_sender(target, mp)) {
-      if (Cleared(mp))
-        fc++;
-      else if (Read(mp))
-        fr++;
-      else
-        fu++;
-      if (full == MSTATS_SIZE)
-        fchars += strlen(get_message(mp));
-    }
-    if (mp->to == target) {
-      if (!tr && !tu)
-        mush_strncpy(last, show_time(mp->time, 0), 50);
-      if (Cleared(mp))
-        tc++;
-      else if (Read(mp))
-        tr++;
-      else
-        tu++;
-      if (full == MSTATS_SIZE)
-        tchars += strlen(get_message(mp));
-    }
+  sent_mail_stats(target, &fc, &fr, &fu,
+                  full == MSTATS_SIZE ? &fchars : NULL);
+  for (mp = find_exact_starting_point(target); mp; mp = mp->next) {
+    if (!tr && !tu)
+      mush_strncpy(last, show_time(mp->time, 0), 50);
+    if (Cleared(mp))
+      tc++;
+    else if (Read(mp))
+      tr++;
+    else
+      tu++;
+    if (full == MSTATS_SIZE)
+      tchars += strlen(get_message(mp));
   }
 
   notify_format(player, T("Mail statistics for %s:"),
@@ -2218,7 +2211,7 @@ FUNCTION(fun_mailstats)
 
   /* mail database statistics */
 
-  dbref target;
+  dbref target, i;
   int fc, fr, fu, tc, tr, tu, fchars, tchars, cchars;
   char last[50];
   MAIL *mp;
@@ -2268,29 +2261,26 @@ FUNCTION(fun_mailstats)
       safe_integer(mdb_top, buff, bp);
       return;
     } else if (full == 1) {
-      for (mp = HEAD; mp != NULL; mp = mp->next) {
-        if (Cleared(mp))
-          fc++;
-        else if (Read(mp))
-          fr++;
-        else
-          fu++;
-      }
+      fc = spool_counts[MC_CLEARED];
+      fr = spool_counts[MC_READ];
+      fu = spool_counts[MC_UNREAD];
       /* FORMAT
        * sent, sent_unread, sent_cleared
        */
       safe_format(buff, bp, "%d %d %d", fc + fr + fu, fu, fc);
     } else {
-      for (mp = HEAD; mp != NULL; mp = mp->next) {
-        if (Cleared(mp)) {
-          fc++;
-          cchars += strlen(get_message(mp));
-        } else if (Read(mp)) {
-          fr++;
-          fchars += strlen(get_message(mp));
-        } else {
-          fu++;
-          tchars += strlen(get_message(mp));
+      for (i = 0; i < db_top; i++) {
+        for (mp = find_exact_starting_point(i); mp; mp = mp->next) {
+          if (Cleared(mp)) {
+            fc++;
+            cchars += strlen(get_message(mp));
+          } else if (Read(mp)) {
+            fr++;
+            fchars += strlen(get_message(mp));
+          } else {
+            fu++;
+            tchars += strlen(get_message(mp));
+          }
         }
       }
       /* FORMAT
@@ -2308,12 +2298,9 @@ FUNCTION(fun_mailstats)
 
   if (full == 0) {
     /* just count number of messages */
-    for (mp = HEAD; mp != NULL; mp = mp->next) {
-      if (was_sender(target, mp))
-        fr++;
-      if (mp->to == target)
-        tr++;
-    }
+    sent_mail_stats(target, &fr, &fr, &fr, NULL);
+    count_mail(target, -1, &tr, &tu, &tc);
+    tr += tu + tc;
     /* FORMAT
      * sent, received
      */
@@ -2321,29 +2308,18 @@ FUNCTION(fun_mailstats)
     return;
   }
   /* more detailed message count */
-  for (mp = HEAD; mp != NULL; mp = mp->next) {
-    if (was_sender(target, mp)) {
-      if (Cleared(mp))
-        fc++;
-      else if (Read(mp))
-        fr++;
-      else
-        fu++;
-      if (full == 2)
-        fchars += strlen(get_message(mp));
-    }
-    if (mp->to == target) {
-      if (!tr && !tu)
-        mush_strncpy(last, show_time(mp->time, 0), 50);
-      if (Cleared(mp))
-        tc++;
-      else if (Read(mp))
-        tr++;
-      else
-        tu++;
-      if (full == 2)
-        tchars += strlen(get_message(mp));
-    }
+  sent_mail_stats(target, &fc, &fr, &fu, full == 2 ? &fchars : NULL);
+  for (mp = find_exact_starting_point(target); mp; mp = mp->next) {
+    if (!tr && !tu)
+      mush_strncpy(last, show_time(mp->time, 0), 50);
+    if (Cleared(mp))
+      tc++;
+    else if (Read(mp))
+      tr++;
+    else
+      tu++;
+    if (full == 2)
+      tchars += strlen(get_message(mp));
   }
 
   if (full == 1) {
@@ -2409,6 +2385,7 @@ int
 dump_mail(PENNFILE *fp)
 {
   MAIL *mp;
+  dbref i;
   int count = 0;
   int mail_flags = 0;
 
@@ -2424,18 +2401,20 @@ dump_mail(PENNFILE *fp)
 
   penn_fprintf(fp, "%d\n", mdb_top);
 
-  for (mp = HEAD; mp != NULL; mp = mp->next) {
-    putref(fp, mp->to);
-    putref(fp, mp->from);
-    putref(fp, mp->from_ctime);
-    putstring(fp, show_time(mp->time, 0));
-    if (mp->subject)
-      putstring(fp, uncompress(mp->subject));
-    else
-      putstring(fp, "");
-    putstring(fp, get_message(mp));
-    putref(fp, mp->read);
-    count++;
+  for (i = 0; i < db_top; i++) {
+    for (mp = find_exact_starting_point(i); mp; mp = mp->next) {
+      putref(fp, mp->to);
+      putref(fp, mp->from);
+      putref(fp, mp->from_ctime);
+      putstring(fp, show_time(mp->time, 0));
+      if (mp->subject)
+        putstring(fp, uncompress(mp->subject));
+      else
+        putstring(fp, "");
+      putstring(fp, get_message(mp));
+      putref(fp, mp->read);
+      count++;
+    }
   }
 
   penn_fputs(EOD, fp);
@@ -2448,70 +2427,216 @@ dump_mail(PENNFILE *fp)
   return count;
 }
 
-/** Find the first message in a player's mail chain, or NULL if none.
- * We first try to find a good place to start by looking for a connected
- * player with a dbref nearest to our target player. Then it's a linear
- * search.
- * \param player the player to search for.
- * \return pointer to first message in their mail chain, or NULL.
+/** Find a player's mailbox.
+ * \param player the player.
+ * \return their mailbox, or NULL if they have no mail.
  */
-MAIL *
-find_exact_starting_point(dbref player)
+static struct mailbox *
+mailbox_find(dbref player)
 {
-  static MAIL *mp;
+  return mailboxes ? im_find(mailboxes, player) : NULL;
+}
 
-  if (!HEAD)
-    return NULL;
+/* Find a player's mailbox, making an empty one if needed */
+static struct mailbox *
+mailbox_get(dbref player)
+{
+  struct mailbox *box;
 
-  mp = get_objdata(player, "MAIL");
-  if (!mp) {
-    /* Player hasn't already done something that looks up their mail. */
-    if (HEAD->to > player)
-      return NULL; /* No mail chain */
-    for (mp = HEAD; mp && (mp->to < player); mp = mp->next)
-      ;
+  if (!mailboxes) {
+    mailboxes = im_new();
+  }
+  box = im_find(mailboxes, player);
+  if (!box) {
+    box = mush_calloc(1, sizeof *box, "mail.box");
+    im_insert(mailboxes, player, box);
+  }
+  return box;
+}
+
+/* Free a mailbox once nothing is sent from or to it */
+static void
+mailbox_release(dbref player, struct mailbox *box)
+{
+  if (!box->first && !box->sent_first) {
+    im_delete(mailboxes, player);
+    mush_free(box, "mail.box");
+  }
+}
+
+/* How a message is counted */
+static inline enum mail_class
+mail_class(MAIL *mp)
+{
+  if (Cleared(mp)) {
+    return MC_CLEARED;
+  } else if (Read(mp)) {
+    return MC_READ;
   } else {
-    while (mp && (mp->to >= player))
-      mp = mp->prev;
-    if (!mp)
-      mp = HEAD;
-    while (mp && (mp->to < player))
-      mp = mp->next;
-  }
-  if (mp && (mp->to == player)) {
-    set_objdata(player, "MAIL", mp);
-    return mp;
-  } else
-    return NULL;
+    return MC_UNREAD;
+  }
 }
 
-/* Find the place where new mail to this player should go (after):
- *  1. The last message in the player's mail chain, or
- *  2. The last message before where the player's chain should start, or
- *  3. NULL (meaning TAIL)
+/* Is a message on its sender's list of sent mail? Messages left behind
+ * by an earlier object with the same dbref aren't. */
+static inline bool
+mail_on_sent(struct mailbox *box, MAIL *mp)
+{
+  return box && (box->sent_first == mp || mp->sent_prev);
+}
+
+/* Take a sender's messages off their sent list without deleting them,
+ * because the sender is a new object reusing the dbref. */
+static void
+mailbox_forget_sent(struct mailbox *box)
+{
+  MAIL *mp, *nextp;
+  int n;
+
+  for (mp = box->sent_first; mp; mp = nextp) {
+    nextp = mp->sent_next;
+    mp->sent_next = mp->sent_prev = NULL;
+  }
+  box->sent_first = box->sent_last = NULL;
+  for (n = 0; n < MC_COUNT; n += 1) {
+    box->sent_counts[n] = 0;
+  }
+}
+
+/** Add a new message to the end of its recipient's and sender's mail.
+ * \param mp the message, with to, from, from_ctime and read filled in.
  */
-static MAIL *
-find_insertion_point(dbref player)
+static void
+mail_link(MAIL *mp)
 {
-  static MAIL *mp;
+  struct mailbox *box;
+  enum mail_class mc = mail_class(mp);
 
-  if (!HEAD)
-    return NULL;
-  mp = get_objdata(player, "MAIL");
-  if (!mp) {
-    if (HEAD->to > player)
-      return NULL; /* No mail chain */
-    for (mp = TAIL; mp && (mp->to > player); mp = mp->prev)
-      ;
+  box = mailbox_get(mp->to);
+  mp->next = NULL;
+  mp->prev = box->last;
+  if (box->last) {
+    box->last->next = mp;
+  } else {
+    box->first = mp;
+  }
+  box->last = mp;
+  box->counts[Folder(mp)][mc] += 1;
+
+  /* A creation time of 0 is unknown, and matches any sender. Mail from
+   * an older object with the same dbref isn't on anyone's sent list. */
+  box = mailbox_get(mp->from);
+  mp->sent_next = mp->sent_prev = NULL;
+  if (!mp->from_ctime || !box->sent_ctime ||
+      mp->from_ctime >= box->sent_ctime) {
+    if (mp->from_ctime && box->sent_ctime &&
+        mp->from_ctime > box->sent_ctime) {
+      mailbox_forget_sent(box);
+    }
+    if (mp->from_ctime) {
+      box->sent_ctime = mp->from_ctime;
+    }
+    mp->sent_prev = box->sent_last;
+    if (box->sent_last) {
+      box->sent_last->sent_next = mp;
+    } else {
+      box->sent_first = mp;
+    }
+    box->sent_last = mp;
+    box->sent_counts[mc] += 1;
+  }
+
+  spool_counts[mc] += 1;
+  mdb_top++;
+}
+
+/** Remove a message from its recipient's and sender's mail, and free it.
+ * \param mp the message.
+ */
+static void
+mail_delete(MAIL *mp)
+{
+  struct mailbox *box;
+  enum mail_class mc = mail_class(mp);
+
+  box = mailbox_find(mp->to);
+  if (mp->prev) {
+    mp->prev->next = mp->next;
   } else {
-    while (mp && (mp->to <= player))
-      mp = mp->next;
-    if (!mp)
-      mp = TAIL;
-    while (mp && (mp->to > player))
-      mp = mp->prev;
+    box->first = mp->next;
   }
-  return mp;
+  if (mp->next) {
+    mp->next->prev = mp->prev;
+  } else {
+    box->last = mp->prev;
+  }
+  box->counts[Folder(mp)][mc] -= 1;
+  mailbox_release(mp->to, box);
+
+  box = mailbox_find(mp->from);
+  if (mail_on_sent(box, mp)) {
+    if (mp->sent_prev) {
+      mp->sent_prev->sent_next = mp->sent_next;
+    } else {
+      box->sent_first = mp->sent_next;
+    }
+    if (mp->sent_next) {
+      mp->sent_next->sent_prev = mp->sent_prev;
+    } else {
+      box->sent_last = mp->sent_prev;
+    }
+    box->sent_counts[mc] -= 1;
+    mailbox_release(mp->from, box);
+  }
+
+  spool_counts[mc] -= 1;
+  mdb_top--;
+  if (mp->subject) {
+    free(mp->subject);
+  }
+  chunk_delete(mp->msgid);
+  slab_free(mail_slab, mp);
+}
+
+/** Change the status bits of a message, keeping the counts right.
+ * \param mp the message.
+ * \param read the new status, including its folder.
+ */
+static void
+mail_set_status(MAIL *mp, mail_flag read)
+{
+  struct mailbox *box;
+  enum mail_class oldmc = mail_class(mp), newmc;
+  mail_flag oldfolder = Folder(mp);
+
+  mp->read = read;
+  newmc = mail_class(mp);
+  if (oldmc == newmc && oldfolder == Folder(mp)) {
+    return;
+  }
+  box = mailbox_find(mp->to);
+  box->counts[oldfolder][oldmc] -= 1;
+  box->counts[Folder(mp)][newmc] += 1;
+  box = mailbox_find(mp->from);
+  if (mail_on_sent(box, mp)) {
+    box->sent_counts[oldmc] -= 1;
+    box->sent_counts[newmc] += 1;
+  }
+  spool_counts[oldmc] -= 1;
+  spool_counts[newmc] += 1;
+}
+
+/** Find the first message in a player's mail chain, or NULL if none.
+ * \param player the player to search for.
+ * \return pointer to first message in their mail chain, or NULL. The
+ * chain is followed through the next pointers, and ends with NULL.
+ */
+MAIL *
+find_exact_starting_point(dbref player)
+{
+  struct mailbox *box = mailbox_find(player);
+
+  return box ? box->first : NULL;
 }
 
 /** Initialize the mail database pointers */
@@ -2524,8 +2649,6 @@ mail_init(void)
     mdb_top = 0;
     mail_slab = slab_create("mail messages", sizeof(struct mail));
     slab_set_opt(mail_slab, SLAB_HINTLESS_THRESHOLD, 5);
-    HEAD = NULL;
-    TAIL = NULL;
   }
 }
 
@@ -2542,8 +2665,7 @@ load_mail(PENNFILE *fp)
   int mail_top = 0;
   int mail_flags = 0;
   int i = 0;
-  MAIL *mp, *tmpmp;
-  int done = 0;
+  MAIL *mp;
   char sbuf[BUFFER_LEN];
   struct tm ttm;
 
@@ -2574,41 +2696,6 @@ load_mail(PENNFILE *fp)
     }
     return 0;
   }
-  /* first one is a special case */
-  mp = slab_malloc(mail_slab, NULL);
-  mp->to = getref(fp);
-  mp->from = getref(fp);
-  if (mail_flags & MDBF_SENDERCTIME)
-    mp->from_ctime = (time_t) getref(fp);
-  else
-    mp->from_ctime = 0; /* No one will have this creation time */
-
-  if (do_convtime(getstring_noalloc(fp), &ttm))
-    mp->time = mktime(&ttm);
-  else /* do_convtime failed. Odd. */
-    mp->time = mudtime;
-
-  if (mail_flags & MDBF_SUBJECT) {
-    tbuf = compress(getstring_noalloc(fp));
-  }
-  text = compress(getstring_noalloc(fp));
-  len = strlen(text) + 1;
-  mp->msgid = chunk_create(text, len, 1);
-  free(text);
-  if (mail_flags & MDBF_SUBJECT)
-    mp->subject = tbuf;
-  else {
-    mush_strncpy(sbuf, get_message(mp), BUFFER_LEN);
-    mp->subject = compress(chopstr(sbuf, SUBJECT_LEN));
-  }
-  mp->read = getref(fp);
-  mp->next = NULL;
-  mp->prev = NULL;
-  HEAD = mp;
-  TAIL = mp;
-  i++;
-
-  /* now loop through */
   for (; i < mail_top; i++) {
     mp = slab_malloc(mail_slab, NULL);
     mp->to = getref(fp);
@@ -2637,41 +2724,27 @@ load_mail(PENNFILE *fp)
     }
     mp->read = (uint32_t) getref(fp);
 
-    /* We now to a sorted insertion, sorted by recipient db# */
-    if (mp->to >= TAIL->to) {
-      /* Pop it onto the end */
-      mp->next = NULL;
-      mp->prev = TAIL;
-      TAIL->next = mp;
-      TAIL = mp;
-    } else {
-      /* Search for where to put it */
-      mp->prev = NULL;
-      for (done = 0, tmpmp = HEAD; tmpmp && !done; tmpmp = tmpmp->next) {
-        if (tmpmp->to > mp->to) {
-          /* Insert before tmpmp */
-          mp->next = tmpmp;
-          mp->prev = tmpmp->prev;
-          if (tmpmp->prev) {
-            /* tmpmp isn't HEAD */
-            tmpmp->prev->next = mp;
-          } else {
-            /* tmpmp is HEAD */
-            HEAD = mp;
-          }
-          tmpmp->prev = mp;
-          done = 1;
-        }
-      }
-      if (!done) {
-        /* This is bad */
-        do_rawlog(LT_ERR, "MAIL: bad code.");
-      }
+    if (!GoodObject(mp->to)) {
+      /* There's no mailbox to file it under */
+      do_rawlog(LT_ERR, "MAIL: Discarding message to bad object #%d.",
+                mp->to);
+      if (mp->subject)
+        free(mp->subject);
+      chunk_delete(mp->msgid);
+      slab_free(mail_slab, mp);
+      continue;
     }
+    if (!GoodObject(mp->from)) {
+      /* Oops, it's from a player whose dbref is out of range!
+       * We'll make it appear to be from #0 instead because there's
+       * no really good choice
+       */
+      mp->from = 0;
+    }
+    /* Messages are dumped in order for each recipient */
+    mail_link(mp);
   }
 
-  mdb_top = i;
-
   if (i != mail_top) {
     do_rawlog(LT_ERR, "MAIL: mail_top is %d, only read in %d messages.",
               mail_top, i);
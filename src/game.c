@@ -29,6 +29,9 @@ void Win32MUSH_setup(void);
 #ifdef HAVE_SYS_TYPES_H
 #include <sys/types.h>
 #endif
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
 #ifdef HAVE_SYS_RESOURCE_H
 #include <sys/resource.h>
 #endif
@@ -56,6 +59,7 @@ void Win32MUSH_setup(void);
 #include "intmap.h"
 #include "lock.h"
 #include "log.h"
+#include "map_file.h"
 #include "match.h"
 #include "mushdb.h"
 #include "mymalloc.h"
@@ -65,6 +69,7 @@ void Win32MUSH_setup(void);
 #include "sig.h"
 #include "strtree.h"
 #include "strutil.h"
+#include "tests.h"
 #include "version.h"
 #include "mushsql.h"
 
@@ -302,11 +307,10 @@ do_shutdown(dbref player, enum shutdown_type flag)
 
 jmp_buf db_err;
 
-static bool
-dump_database_internal(void)
+/** Stop the cpu limit timer from interrupting a database save. */
+static void
+dump_signals_off(void)
 {
-  PENNFILE *volatile f = NULL;
-
 #ifndef PROFILING
 #ifndef WIN32
 #ifdef __CYGWIN__
@@ -316,16 +320,38 @@ dump_database_internal(void)
 #endif /* __CYGWIN__ */
 #endif /* WIN32 */
 #endif /* PROFILING */
+}
 
-  if (setjmp(db_err)) {
-    /* The dump failed. Disk might be full or something went bad with the
-       compression slave. Boo! */
-    const char *errmsg = NULL;
+/** Restore the cpu limit timer after a database save. */
+static void
+dump_signals_on(void)
+{
+#ifndef PROFILING
+#ifdef HAVE_SETITIMER
+#ifdef __CYGWIN__
+  install_sig_handler(SIGALRM, signal_cpu_limit);
+#else
+  install_sig_handler(SIGPROF, signal_cpu_limit);
+#endif /* __CYGWIN__ */
+#endif /* HAVE_SETITIMER */
+#endif /* PROFILING */
+}
 
-    if (f) {
+/** Report a failed database save.
+ * \param f the file being written when it failed, or NULL. It is closed.
+ */
+static void
+dump_failed(PENNFILE *f)
+{
+  /* The dump failed. Disk might be full or something went bad with the
+     compression slave. Boo! */
+  const char *errmsg = NULL;
+
+  if (f) {
       switch (f->type) {
       case PFT_FILE:
       case PFT_PIPE:
+      case PFT_MAPPED:
         errmsg = strerror(errno);
         break;
       case PFT_GZFILE:
@@ -339,27 +365,76 @@ dump_database_internal(void)
 #endif
       break;
       }
+  } else {
+    errmsg = strerror(errno);
+  }
+
+  do_rawlog(LT_ERR, "ERROR! Database save failed: %s", errmsg);
+  queue_event(SYSEVENT, "DUMP`ERROR", "%s,%d,PERROR %s",
+              T("GAME: ERROR! Database save failed!"), 0, errmsg);
+  flag_broadcast("WIZARD ROYALTY", 0, T("GAME: ERROR! Database save failed!"));
+  if (f) {
+    penn_fclose(f);
+  }
+}
+
+/** Save the mail and chat databases.
+ * Errors longjmp() to db_err.
+ * \param fp where to keep the file being written, for the error handler.
+ */
+static void
+dump_mail_and_chat(PENNFILE *volatile *fp)
+{
+  char realdumpfile[2048];
+  char realtmpfl[2304];
+  char tmpfl[2048];
+
+  snprintf(realdumpfile, sizeof realdumpfile, "%s%s", options.mail_db,
+           options.compresssuff);
+  strcpy(tmpfl, make_new_epoch_file(options.mail_db, epoch));
+  snprintf(realtmpfl, sizeof realtmpfl, "%s%s", tmpfl, options.compresssuff);
+  if (mdb_top >= 0) {
+    if ((*fp = db_open_write(tmpfl)) != NULL) {
+      dump_mail(*fp);
+      penn_fclose(*fp);
+      *fp = NULL;
+      if (rename_file(realtmpfl, realdumpfile) < 0) {
+        penn_perror(realtmpfl);
+        longjmp(db_err, 1);
+      }
     } else {
-      errmsg = strerror(errno);
+      penn_perror(realtmpfl);
+      longjmp(db_err, 1);
     }
-
-    do_rawlog(LT_ERR, "ERROR! Database save failed: %s", errmsg);
-    queue_event(SYSEVENT, "DUMP`ERROR", "%s,%d,PERROR %s",
-                T("GAME: ERROR! Database save failed!"), 0, errmsg);
-    flag_broadcast("WIZARD ROYALTY", 0,
-                   T("GAME: ERROR! Database save failed!"));
-    if (f) {
-      penn_fclose(f);
+  }
+  snprintf(realdumpfile, sizeof realdumpfile, "%s%s", options.chatdb,
+           options.compresssuff);
+  strcpy(tmpfl, make_new_epoch_file(options.chatdb, epoch));
+  snprintf(realtmpfl, sizeof realtmpfl, "%s%s", tmpfl, options.compresssuff);
+  if ((*fp = db_open_write(tmpfl)) != NULL) {
+    save_chatdb(*fp);
+    penn_fclose(*fp);
+    *fp = NULL;
+    if (rename_file(realtmpfl, realdumpfile) < 0) {
+      penn_perror(realtmpfl);
+      longjmp(db_err, 1);
     }
-#ifndef PROFILING
-#ifdef HAVE_SETITIMER
-#ifdef __CYGWIN__
-    install_sig_handler(SIGALRM, signal_cpu_limit);
-#else
-    install_sig_handler(SIGPROF, signal_cpu_limit);
-#endif /* __CYGWIN__ */
-#endif /* HAVE_SETITIMER */
-#endif /* PROFILING */
+  } else {
+    penn_perror(realtmpfl);
+    longjmp(db_err, 1);
+  }
+}
+
+static bool
+dump_database_internal(void)
+{
+  PENNFILE *volatile f = NULL;
+
+  dump_signals_off();
+
+  if (setjmp(db_err)) {
+    dump_failed(f);
+    dump_signals_on();
     return false;
   } else {
     char realdumpfile[2048];
@@ -398,6 +473,7 @@ dump_database_internal(void)
         break;
       }
       penn_fclose(f);
+      f = NULL;
       if (rename_file(realtmpfl, realdumpfile) < 0) {
         penn_perror(realtmpfl);
         longjmp(db_err, 1);
@@ -406,52 +482,395 @@ dump_database_internal(void)
       penn_perror(realtmpfl);
       longjmp(db_err, 1);
     }
-    snprintf(realdumpfile, sizeof realdumpfile, "%s%s", options.mail_db,
-             options.compresssuff);
-    strcpy(tmpfl, make_new_epoch_file(options.mail_db, epoch));
-    snprintf(realtmpfl, sizeof realtmpfl, "%s%s", tmpfl, options.compresssuff);
-    if (mdb_top >= 0) {
-      if ((f = db_open_write(tmpfl)) != NULL) {
-        dump_mail(f);
-        penn_fclose(f);
-        if (rename_file(realtmpfl, realdumpfile) < 0) {
-          penn_perror(realtmpfl);
-          longjmp(db_err, 1);
-        }
-      } else {
-        penn_perror(realtmpfl);
-        longjmp(db_err, 1);
-      }
-    }
-    snprintf(realdumpfile, sizeof realdumpfile, "%s%s", options.chatdb,
-             options.compresssuff);
-    strcpy(tmpfl, make_new_epoch_file(options.chatdb, epoch));
-    snprintf(realtmpfl, sizeof realtmpfl, "%s%s", tmpfl, options.compresssuff);
-    if ((f = db_open_write(tmpfl)) != NULL) {
-      save_chatdb(f);
-      penn_fclose(f);
-      if (rename_file(realtmpfl, realdumpfile) < 0) {
-        penn_perror(realtmpfl);
-        longjmp(db_err, 1);
-      }
-    } else {
-      penn_perror(realtmpfl);
-      longjmp(db_err, 1);
-    }
+    dump_mail_and_chat(&f);
     time(&globals.last_dump_time);
   }
 
-#ifndef PROFILING
-#ifdef HAVE_SETITIMER
-#ifdef __CYGWIN__
-  install_sig_handler(SIGALRM, signal_cpu_limit);
-#else
-  install_sig_handler(SIGPROF, signal_cpu_limit);
+  dump_signals_on();
+
+  return true;
+}
+
+/* Incremental dumps.
+ *
+ * When the chunk swap file can't be cloned for a forking dump, the
+ * main database is instead written a slice at a time from the system
+ * queue so the game keeps running while it's saved. The links between
+ * objects are copied when the dump starts so the saved contents and
+ * exit lists stay consistent with each other; everything else about an
+ * object is saved as it is when that object's turn comes up. Objects
+ * that are about to be destroyed are written out first, via
+ * incremental_dump_object(). Mail and chat are small and are saved all
+ * at once at the end.
+ */
+
+#define INCR_DUMP_SLICE 20 /**< Milliseconds of writing per slice */
+#define INCR_DUMP_PAUSE 30 /**< Milliseconds between slices */
+
+/** The links of an object when an incremental dump started. */
+struct dump_links {
+  dbref location; /**< Location, destination or drop-to */
+  dbref contents; /**< First item in the contents list */
+  dbref exits;    /**< Home or first exit */
+  dbref next;     /**< Next in the contents or exits list */
+  dbref parent;   /**< Parent */
+  dbref owner;    /**< Owner */
+  dbref zone;     /**< Zone */
+  int type;       /**< Type, or TYPE_GARBAGE */
+  bool written;   /**< Has it been saved yet? */
+};
+
+/** State of the incremental dump in progress. */
+static struct {
+  bool active;              /**< Is a dump in progress? */
+  PENNFILE *f;              /**< The temporary database file */
+  char tmpfl[2048];         /**< Name of the temporary database file */
+  dbref top;                /**< db_top when the dump started */
+  dbref next;               /**< Next object to consider */
+  struct dump_links *links; /**< Links of each object */
+  struct squeue *slice;     /**< Pending slice event */
+} incr_dump = {false, NULL, "", 0, 0, NULL, NULL};
+
+static bool incremental_dump_start(void);
+static bool incremental_dump_slice(void *);
+static void incremental_dump_finish(void);
+static void incremental_dump_abort(void);
+
+static void
+incremental_dump_clear(void)
+{
+  if (incr_dump.slice) {
+    sq_cancel(incr_dump.slice);
+    incr_dump.slice = NULL;
+  }
+  if (incr_dump.links) {
+    mush_free(incr_dump.links, "incremental dump links");
+    incr_dump.links = NULL;
+  }
+  incr_dump.f = NULL;
+  incr_dump.active = false;
+}
+
+/* Write one object from the snapshot, if it hasn't been already. */
+static void
+incremental_dump_write(dbref i)
+{
+  struct dump_links *l = incr_dump.links + i;
+  struct object o;
+
+  if (l->written || l->type == TYPE_GARBAGE)
+    return;
+  l->written = true;
+  if (IsGarbage(i))
+    return;
+  o = db[i];
+  o.location = l->location;
+  o.contents = l->contents;
+  o.exits = l->exits;
+  o.next = l->next;
+  o.parent = l->parent;
+  o.owner = l->owner;
+  o.zone = l->zone;
+  o.type = l->type;
+  db_write_object_as(incr_dump.f, i, &o);
+}
+
+/* Remove the partly written database of an incremental dump. */
+static void
+incremental_dump_unlink(void)
+{
+  char realtmpfl[2304];
+
+  snprintf(realtmpfl, sizeof realtmpfl, "%s%s", incr_dump.tmpfl,
+           options.compresssuff);
+  unlink(realtmpfl);
+}
+
+/* Report a failed incremental dump and forget about it. */
+static void
+incremental_dump_failed(void)
+{
+  dump_failed(incr_dump.f);
+  incr_dump.f = NULL;
+  incremental_dump_unlink();
+  incremental_dump_clear();
+}
+
+/** Begin an incremental dump of the main database.
+ * \return true if the dump was started.
+ */
+static bool
+incremental_dump_start(void)
+{
+  PENNFILE *volatile f = NULL;
+  dbref i;
+
+  if (setjmp(db_err)) {
+    dump_failed(f);
+    incremental_dump_clear();
+    return false;
+  }
+
+  local_dump_database();
+
+  mush_strncpy(incr_dump.tmpfl, make_new_epoch_file(globals.dumpfile, epoch),
+               sizeof incr_dump.tmpfl);
+  if ((f = db_open_write(incr_dump.tmpfl)) == NULL) {
+    penn_perror(incr_dump.tmpfl);
+    longjmp(db_err, 1);
+  }
+
+  incr_dump.links = mush_calloc(db_top ? db_top : 1, sizeof(struct dump_links),
+                                "incremental dump links");
+  for (i = 0; i < db_top; i++) {
+    struct dump_links *l = incr_dump.links + i;
+    l->location = Location(i);
+    l->contents = Contents(i);
+    l->exits = Exits(i);
+    l->next = Next(i);
+    l->parent = Parent(i);
+    l->owner = Owner(i);
+    l->zone = Zone(i);
+    l->type = IsGarbage(i) ? TYPE_GARBAGE : (db[i].type & ~TYPE_MARKED);
+  }
+  incr_dump.top = db_top;
+  incr_dump.next = 0;
+  incr_dump.f = f;
+  incr_dump.active = true;
+
+  db_write_header(f, 0);
+
+  do_rawlog_lvl(LT_CHECK, MLOG_INFO,
+                "CHECKPOINTING: %s.#%d# incrementally, %d objects",
+                globals.dumpfile, epoch, incr_dump.top);
+  incr_dump.slice =
+    sq_register_in_msec(0, incremental_dump_slice, NULL, NULL);
+  return true;
+}
+
+/* Write objects until this slice's time is up. */
+static bool
+incremental_dump_slice(void *data __attribute__((__unused__)))
+{
+  uint64_t deadline = now_msecs() + INCR_DUMP_SLICE;
+
+  incr_dump.slice = NULL;
+  if (!incr_dump.active)
+    return false;
+
+  if (setjmp(db_err)) {
+    incremental_dump_failed();
+    return false;
+  }
+
+  while (incr_dump.next < incr_dump.top) {
+    incremental_dump_write(incr_dump.next++);
+    if ((incr_dump.next & 7) == 0 && now_msecs() >= deadline)
+      break;
+  }
+
+  if (incr_dump.next < incr_dump.top)
+    incr_dump.slice =
+      sq_register_in_msec(INCR_DUMP_PAUSE, incremental_dump_slice, NULL, NULL);
+  else
+    incremental_dump_finish();
+  return false;
+}
+
+/* All objects are written; put the new database in place. */
+static void
+incremental_dump_finish(void)
+{
+  char realdumpfile[2048];
+  char realtmpfl[2304];
+  PENNFILE *volatile f = incr_dump.f;
+
+  if (setjmp(db_err)) {
+    dump_failed(f);
+    incremental_dump_clear();
+    return;
+  }
+
+  db_write_footer(f);
+  penn_fclose(f);
+  f = incr_dump.f = NULL;
+
+  snprintf(realdumpfile, sizeof realdumpfile, "%s%s", globals.dumpfile,
+           options.compresssuff);
+  snprintf(realtmpfl, sizeof realtmpfl, "%s%s", incr_dump.tmpfl,
+           options.compresssuff);
+  if (rename_file(realtmpfl, realdumpfile) < 0) {
+    penn_perror(realtmpfl);
+    longjmp(db_err, 1);
+  }
+  dump_mail_and_chat(&f);
+  incremental_dump_clear();
+
+  time(&globals.last_dump_time);
+  do_rawlog_lvl(LT_CHECK, MLOG_INFO, "CHECKPOINTING: %s.#%d# (done)",
+                globals.dumpfile, epoch);
+  queue_event(SYSEVENT, "DUMP`COMPLETE", "%s,%d", DUMP_NOFORK_COMPLETE, 0);
+}
+
+/* Give up on an incremental dump in progress, removing its file. */
+static void
+incremental_dump_abort(void)
+{
+  if (!incr_dump.active)
+    return;
+  if (incr_dump.f)
+    penn_fclose(incr_dump.f);
+  incremental_dump_unlink();
+  do_rawlog_lvl(LT_CHECK, MLOG_INFO, "CHECKPOINTING: %s.#%d# (abandoned)",
+                globals.dumpfile, epoch);
+  incremental_dump_clear();
+}
+
+/** Save an object to an incremental dump in progress before it changes
+ * in a way the dump can't cope with, like being destroyed.
+ * \param thing the object.
+ */
+void
+incremental_dump_object(dbref thing)
+{
+  if (!incr_dump.active || thing < 0 || thing >= incr_dump.top)
+    return;
+  if (incr_dump.links[thing].written)
+    return;
+  if (setjmp(db_err)) {
+    incremental_dump_failed();
+    return;
+  }
+  incremental_dump_write(thing);
+}
+
+#if !defined(WIN32) && defined(HAVE_FORK)
+/* Load a saved database in place of the running one and check the
+ * objects the incremental_dump test changed while it was being written.
+ * Only called in a child process.
+ * Returns a bitmask of failed checks, or 0x40 if it didn't load.
+ */
+static int
+incremental_dump_check(const char *fname, dbref thing, dbref doomed)
+{
+  PENNFILE *volatile f = NULL;
+  ATTR *a;
+  volatile int bad = 0;
+
+  if (setjmp(db_err))
+    return 0x40;
+  /* db_read() creates the objects table afresh */
+  sqlite3_exec(get_shared_db(), "DROP TABLE objects", NULL, NULL, NULL);
+  f = db_open(fname);
+  if (db_read(f) <= (thing > doomed ? thing : doomed))
+    return 0x40;
+  penn_fclose(f);
+
+  /* Links are saved as they were when the dump started */
+  if (Parent(thing) != NOTHING)
+    bad |= 1;
+  /* Attributes as they were when the object was written */
+  a = atr_get_noparent(thing, "INCR_DUMP_TEST");
+  if (!a || strcmp(atr_value(a), "after") != 0)
+    bad |= 2;
+  /* Destroyed objects as they were just before */
+  if (!IsThing(doomed) || strcmp(Name(doomed), "Incr_Dump_Doomed") != 0)
+    bad |= 4;
+  return bad;
+}
 #endif
+
+TEST_GROUP(incremental_dump)
+{
+  char dumpfile[sizeof globals.dumpfile], maildb[sizeof options.mail_db];
+  char chatdb[sizeof options.chatdb], fname[2304];
+  int forking = options.forking_dump, incremental = options.incremental_dump;
+  int paranoid = globals.paranoid_dump, saved_epoch = epoch;
+  dbref thing, doomed;
+  bool ok;
+
+#ifdef ALWAYS_PARANOID
+  return;
 #endif
+  mush_strncpy(dumpfile, globals.dumpfile, sizeof dumpfile);
+  mush_strncpy(maildb, options.mail_db, sizeof maildb);
+  mush_strncpy(chatdb, options.chatdb, sizeof chatdb);
+  mush_strncpy(globals.dumpfile, "incrdumptest.db", sizeof globals.dumpfile);
+  mush_strncpy(options.mail_db, "incrdumptest.mail", sizeof options.mail_db);
+  mush_strncpy(options.chatdb, "incrdumptest.chat", sizeof options.chatdb);
+  snprintf(fname, sizeof fname, "%s%s", globals.dumpfile,
+           options.compresssuff);
+  options.forking_dump = 0;
+  options.incremental_dump = 1;
+  globals.paranoid_dump = 0;
+
+  thing = new_scratch_object();
+  doomed = new_scratch_object();
+  set_name(doomed, "Incr_Dump_Doomed");
+  atr_add(thing, "INCR_DUMP_TEST", "before", GOD, 0);
+
+  ok = fork_and_dump(1) && incr_dump.active && incr_dump.slice;
+  TEST("incremental_dump.start", ok);
+  if (ok) {
+    /* Change things before their turn comes */
+    Parent(thing) = 0;
+    atr_add(thing, "INCR_DUMP_TEST", "after", GOD, 0);
+    free_scratch_object(doomed);
+    TEST("incremental_dump.early", incr_dump.links[doomed].written);
+    while (incr_dump.active) {
+      sq_cancel(incr_dump.slice);
+      incremental_dump_slice(NULL);
+    }
+    TEST("incremental_dump.finish",
+         !incr_dump.active && access(fname, R_OK) == 0);
+  } else
+    free_scratch_object(doomed);
+  Parent(thing) = NOTHING;
+  free_scratch_object(thing);
+
+#if !defined(WIN32) && defined(HAVE_FORK)
+  if (ok) {
+    WAIT_TYPE status = 0;
+    bool split = chunk_num_swapped() && chunk_fork_file();
+    pid_t child;
+
+    /* Load it in a child, like a forking dump, so this game's database
+     * isn't replaced. */
+    block_a_signal(SIGCHLD);
+    child = fork();
+    if (child == 0) {
+      if (split)
+        chunk_fork_child();
+      status = incremental_dump_check(globals.dumpfile, thing, doomed);
+      if (split)
+        chunk_fork_done();
+      _exit(status);
+    }
+    if (split)
+      chunk_fork_parent();
+    if (child < 0 || mush_wait(child, &status, 0) != child)
+      status = 0xFF << 8;
+    unblock_a_signal(SIGCHLD);
+    status = WIFEXITED(status) ? WEXITSTATUS(status) : 0xFF;
+    TEST("incremental_dump.reload", !(status & 0x40));
+    TEST("incremental_dump.links", !(status & 1));
+    TEST("incremental_dump.attribs", !(status & 2));
+    TEST("incremental_dump.destroyed", !(status & 4));
+  }
 #endif
 
-  return true;
+  unlink(fname);
+  snprintf(fname, sizeof fname, "%s%s", options.mail_db, options.compresssuff);
+  unlink(fname);
+  snprintf(fname, sizeof fname, "%s%s", options.chatdb, options.compresssuff);
+  unlink(fname);
+  mush_strncpy(globals.dumpfile, dumpfile, sizeof globals.dumpfile);
+  mush_strncpy(options.mail_db, maildb, sizeof options.mail_db);
+  mush_strncpy(options.chatdb, chatdb, sizeof options.chatdb);
+  options.forking_dump = forking;
+  options.incremental_dump = incremental;
+  globals.paranoid_dump = paranoid;
+  epoch = saved_epoch;
 }
 
 /** Crash gracefully.
@@ -539,6 +958,7 @@ mush_panicf(const char *msg, ...)
 void
 dump_database(void)
 {
+  incremental_dump_abort();
   epoch++;
 
   do_rawlog_lvl(LT_ERR, MLOG_INFO, "DUMPING: %s.#%d#", globals.dumpfile, epoch);
@@ -565,6 +985,17 @@ fork_and_dump(int forking)
 #ifndef WIN32
   bool split = false;
 #endif
+  bool incremental;
+
+  if (incr_dump.active) {
+    if (forking) {
+      do_rawlog_lvl(LT_CHECK, MLOG_INFO,
+                    "CHECKPOINTING: %s.#%d# still in progress",
+                    globals.dumpfile, epoch);
+      return true;
+    }
+    incremental_dump_abort();
+  }
 
   epoch++;
 
@@ -582,6 +1013,11 @@ fork_and_dump(int forking)
 #if defined(WIN32) || !defined(HAVE_FORK)
   nofork = 1;
 #endif
+#ifdef ALWAYS_PARANOID
+  incremental = false;
+#else
+  incremental = forking && INCREMENTAL_DUMP && !globals.paranoid_dump;
+#endif
 
   if (!nofork && chunk_num_swapped()) {
 #ifndef WIN32
@@ -590,16 +1026,24 @@ fork_and_dump(int forking)
       split = 1;
     } else {
       /* Ack, can't fork, 'cause we have stuff on disk... */
-      do_rawlog_lvl(LT_ERR, MLOG_INFO,
-                    "fork_and_dump: Data are swapped to disk, so "
-                    "nonforking dumps will be used.");
-      flag_broadcast(
-        "WIZARD", 0,
-        T("DUMP: Data are swapped to disk, so nonforking dumps will be used."));
+      if (incremental) {
+        do_rawlog_lvl(LT_ERR, MLOG_INFO,
+                      "fork_and_dump: Data are swapped to disk, so "
+                      "an incremental dump will be used.");
+      } else {
+        do_rawlog_lvl(LT_ERR, MLOG_INFO,
+                      "fork_and_dump: Data are swapped to disk, so "
+                      "nonforking dumps will be used.");
+        flag_broadcast("WIZARD", 0,
+                       T("DUMP: Data are swapped to disk, so nonforking "
+                         "dumps will be used."));
+      }
       nofork = 1;
     }
 #endif
   }
+  if (nofork && incremental && incremental_dump_start())
+    return true;
   if (!nofork) {
 #ifndef WIN32
 #ifdef HAVE_FORK
@@ -674,24 +1118,21 @@ do_restart(void)
   ATTR *s;
   char buf[BUFFER_LEN];
   char *bp;
-  sqlite3 *sqldb = get_shared_db();
 
   /* Do stuff that needs to be done for players only: add stuff to the
    * alias table, and refund money from queued commands at shutdown.
    */
 
-  sqlite3_exec(sqldb, "BEGIN TRANSACTION", NULL, NULL, NULL);
   for (thing = 0; thing < db_top; thing++) {
     if (IsPlayer(thing)) {
       if ((s = atr_get_noparent(thing, "ALIAS")) != NULL) {
         bp = buf;
         safe_str(atr_value(s), buf, &bp);
         *bp = '\0';
-        add_player_alias(thing, buf, 1);
+        add_player_alias(thing, buf);
       }
     }
   }
-  sqlite3_exec(sqldb, "COMMIT TRANSACTION", NULL, NULL, NULL);
 
   /* Once we load all that, then we can trigger the startups and
    * begin queueing commands. Also, let's make sure that we get
@@ -837,6 +1278,7 @@ init_game_dbs(void)
   const char *outfile;
   const char *mailfile;
   volatile int panicdb;
+  uint64_t load_start;
 
 #ifdef WIN32
   Win32MUSH_setup(); /* create index files, copy databases etc. */
@@ -884,7 +1326,7 @@ init_game_dbs(void)
   } else {
     /* ok, read it in */
     do_rawlog(LT_ERR, "ANALYZING: %s", infile);
-    if (init_compress(f) != 1) {
+    if (!db_init_compress(f)) {
       do_rawlog(LT_ERR, "ERROR LOADING %s", infile);
       return -1;
     }
@@ -901,12 +1343,14 @@ init_game_dbs(void)
     /* ok, read it in */
     do_rawlog(LT_ERR, "LOADING: %s", infile);
     dbline = 0;
+    load_start = now_msecs();
     if (db_read(f) < 0) {
       do_rawlog(LT_ERR, "ERROR LOADING %s", infile);
       penn_fclose(f);
       return -1;
     }
-    do_rawlog(LT_ERR, "LOADING: %s (done)", infile);
+    do_rawlog(LT_ERR, "LOADING: %s (done in %.2f seconds)", infile,
+              (now_msecs() - load_start) / 1000.0);
 
     if (globals.new_indb_version < 6) {
       do_flag_delete("POWER", GOD, "Cemit");
@@ -2443,7 +2887,7 @@ db_open(const char *fname)
   sqlite3_str_appendall(fstr, options.compresssuff);
   filename = sqlite3_str_finish(fstr);
 
-  pf = mush_malloc(sizeof *pf, "pennfile");
+  pf = mush_calloc(1, sizeof *pf, "pennfile");
 
 #ifdef HAVE_LIBZ
   if (*options.uncompressprog &&
@@ -2496,16 +2940,30 @@ db_open(const char *fname)
   } else
 #endif /* WIN32 */
   {
-    pf->type = PFT_FILE;
-    pf->handle.f = fopen(filename, FOPEN_READ);
-    if (!pf->handle.f) {
+    FILE *fp;
+    MAPPED_FILE *m;
+    struct stat st;
+
+    fp = fopen(filename, FOPEN_READ);
+    if (!fp) {
       do_rawlog(LT_ERR, "Unable to open %s: %s\n", filename, strerror(errno));
+    } else if (fstat(fileno(fp), &st) == 0 && st.st_size > 0 &&
+               (m = map_file(filename, 0)) != NULL) {
+      /* Uncompressed databases are read straight out of memory. */
+      fclose(fp);
+      sqlite3_free(filename);
+      pf->type = PFT_MAPPED;
+      pf->handle.m = m;
+      pf->buf = m->data;
+      pf->len = m->len;
+      return pf;
     } else {
-      setvbuf(pf->handle.f, NULL, _IOFBF, 1024 * 32);
 #ifdef HAVE_POSIX_FADVISE
-      posix_fadvise(fileno(pf->handle.f), 0, 0, POSIX_FADV_SEQUENTIAL);
+      posix_fadvise(fileno(fp), 0, 0, POSIX_FADV_SEQUENTIAL);
 #endif
     }
+    pf->type = PFT_FILE;
+    pf->handle.f = fp;
     sqlite3_free(filename);
   }
   if (!pf->handle.f) {
@@ -2546,7 +3004,7 @@ db_open_write(const char *fname)
             errno, strerror(errno));
   }
 
-  pf = mush_malloc(sizeof *pf, "pennfile");
+  pf = mush_calloc(1, sizeof *pf, "pennfile");
 
 #ifdef HAVE_LIBZ
   if (*options.compressprog && strcmp(options.compressprog, "gzip") == 0) {
@@ -2615,7 +3073,7 @@ extern StrTree object_names;
 extern PTAB ptab_command;
 extern PTAB ptab_attrib;
 extern PTAB ptab_flag;
-extern intmap *queue_map, *descs_by_fd;
+extern intmap *queue_map, *sem_map, *descs_by_fd;
 #ifdef HAVE_INOTIFY_INIT1
 extern intmap *watchtable;
 #endif
@@ -2623,6 +3081,24 @@ extern intmap *watchtable;
 static void
 list_sqlite3_stats(dbref player, const char *name, sqlite3 *db)
 {
+  struct statement_stats *stats;
+  int count, n;
+
+  stats = statement_cache_stats(db, &count);
+  if (stats) {
+    notify_format(player, "Cached statements for %s database", name);
+    notify_format(player, "%-30s %9s %9s %11s %9s %7s", "Name", "Lookups",
+                  "Runs", "Steps", "Time(ms)", "Avg(us)");
+    for (n = 0; n < count; n += 1) {
+      notify_format(player, "%-30.30s %9ld %9d %11d %9.1f %7.1f",
+                    stats[n].name, (long) stats[n].lookups, stats[n].runs,
+                    stats[n].steps, stats[n].usecs / 1000.0,
+                    stats[n].runs ? (double) stats[n].usecs / stats[n].runs
+                                  : 0.0);
+    }
+    mush_free(stats, "sql.stmt.stats");
+  }
+
 #ifdef SQLITE_ENABLE_STMTVTAB
   sqlite3_stmt *statter;
   statter = prepare_statement(
@@ -2711,10 +3187,21 @@ do_list_memstats(dbref player)
   notify(player, "Integer Maps:");
   im_stats_header(player);
   im_stats(player, queue_map, "Queue IDs");
+  im_stats(player, sem_map, "Semaphores");
   im_stats(player, descs_by_fd, "Connections");
 #ifdef HAVE_INOTIFY_INIT1
   im_stats(player, watchtable, "Inotify");
 #endif
+  notify(player, "$-Command Index:");
+  cmd_index_stats(player);
+  notify(player, "Compiled Attributes:");
+  pe_program_stats(player);
+  notify(player, "Compiled Regexps:");
+  re_cache_stats(player);
+  notify(player, "Output Queues:");
+  output_stats(player);
+  notify(player, "Notifications:");
+  notify_stats(player);
 
   notify(player, "Sqlite3 Databases:");
   sqlmem = sqlite3_memory_used();
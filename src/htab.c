@@ -56,6 +56,7 @@
 #include "htab.h"
 #include "mymalloc.h"
 #include "log.h"
+#include "tests.h"
 
 /* Temporary prototypes to make the compiler happy. */
 char *mush_strdup(const char *s, const char *check) __attribute_malloc__;
@@ -469,3 +470,346 @@ hash_stats(const HASHTAB *htab, struct hashstats *stats)
     stats->key_length /= stats->entries;
   }
 }
+
+/*
+ * Integer-keyed tables
+ *
+ * These use open addressing with linear probing, which keeps lookups to
+ * a hash and a short scan of adjacent slots. Deleting an entry moves
+ * later entries in its probe sequence back, so no tombstones are needed
+ * and the table never has to be rebuilt to get rid of them.
+ */
+
+/** A slot in an IHASHTAB. */
+struct ihash_slot {
+  uint64_t key; /**< The key */
+  void *data;   /**< The data, or NULL if the slot is empty */
+};
+
+#define IHASH_MIN_SIZE 16
+
+/** Home slot of a key. */
+static inline uint32_t
+ihash_home(const IHASHTAB *tab, uint64_t key)
+{
+  /* Final mixing step of MurmurHash3 */
+  key ^= key >> 33;
+  key *= UINT64_C(0xff51afd7ed558ccd);
+  key ^= key >> 33;
+  key *= UINT64_C(0xc4ceb9fe1a85ec53);
+  key ^= key >> 33;
+  return (uint32_t) key & (tab->size - 1);
+}
+
+static void
+ihash_resize(IHASHTAB *tab, uint32_t newsize)
+{
+  struct ihash_slot *old = tab->slots;
+  uint32_t oldsize = tab->size;
+  uint32_t i, j;
+
+  tab->slots = mush_calloc(newsize, sizeof *tab->slots, "ihash.slots");
+  tab->size = newsize;
+  for (i = 0; i < oldsize; i += 1) {
+    if (old[i].data) {
+      for (j = ihash_home(tab, old[i].key); tab->slots[j].data;
+           j = (j + 1) & (newsize - 1))
+        ;
+      tab->slots[j] = old[i];
+    }
+  }
+  if (old) {
+    mush_free(old, "ihash.slots");
+  }
+}
+
+/** Initialize an integer-keyed hash table.
+ * \param tab pointer to the table to initialize.
+ * \param size number of entries to make room for up front, or 0 to wait
+ * for the first add.
+ */
+void
+ihash_init(IHASHTAB *tab, uint32_t size)
+{
+  uint32_t slots = IHASH_MIN_SIZE;
+
+  tab->slots = NULL;
+  tab->size = 0;
+  tab->entries = 0;
+  if (size) {
+    while (slots / 4 * 3 < size) {
+      slots *= 2;
+    }
+    ihash_resize(tab, slots);
+  }
+}
+
+/** Look up the entries with a given key, one at a time.
+ * \param tab pointer to the table.
+ * \param key the key.
+ * \param pos set to 0 before the first call, and left alone between calls.
+ * \return the data of the next entry with the key, or NULL if there are
+ * no more.
+ */
+void *
+ihash_match(const IHASHTAB *tab, uint64_t key, uint32_t *pos)
+{
+  uint32_t mask = tab->size - 1;
+  uint32_t i;
+
+  if (!tab->entries) {
+    return NULL;
+  }
+  for (i = (ihash_home(tab, key) + *pos) & mask; tab->slots[i].data;
+       i = (i + 1) & mask) {
+    *pos += 1;
+    if (tab->slots[i].key == key) {
+      return tab->slots[i].data;
+    }
+  }
+  return NULL;
+}
+
+/** Look up an entry.
+ * \param tab pointer to the table.
+ * \param key the key.
+ * \return the data of the first entry with the key, or NULL.
+ */
+void *
+ihash_find(const IHASHTAB *tab, uint64_t key)
+{
+  uint32_t pos = 0;
+
+  return ihash_match(tab, key, &pos);
+}
+
+/** Add an entry, even if there are already entries with its key.
+ * \param tab pointer to the table.
+ * \param key the key.
+ * \param data the data, which must not be NULL.
+ */
+void
+ihash_add(IHASHTAB *tab, uint64_t key, void *data)
+{
+  uint32_t i;
+
+  /* Keep the load factor under 3/4 */
+  if ((tab->entries + 1) * 4 > tab->size * 3) {
+    ihash_resize(tab, tab->size ? tab->size * 2 : IHASH_MIN_SIZE);
+  }
+  for (i = ihash_home(tab, key); tab->slots[i].data;
+       i = (i + 1) & (tab->size - 1))
+    ;
+  tab->slots[i].key = key;
+  tab->slots[i].data = data;
+  tab->entries += 1;
+}
+
+/** Add an entry, or replace the data of the first one with its key.
+ * \param tab pointer to the table.
+ * \param key the key.
+ * \param data the data, which must not be NULL.
+ */
+void
+ihash_set(IHASHTAB *tab, uint64_t key, void *data)
+{
+  uint32_t mask = tab->size - 1;
+  uint32_t i;
+
+  if (tab->entries) {
+    for (i = ihash_home(tab, key); tab->slots[i].data; i = (i + 1) & mask) {
+      if (tab->slots[i].key == key) {
+        tab->slots[i].data = data;
+        return;
+      }
+    }
+  }
+  ihash_add(tab, key, data);
+}
+
+/** Empty a slot, moving later entries in the same probe sequence back.
+ * \param tab pointer to the table.
+ * \param i the slot.
+ */
+static void
+ihash_unslot(IHASHTAB *tab, uint32_t i)
+{
+  uint32_t mask = tab->size - 1;
+  uint32_t j, home;
+
+  tab->slots[i].data = NULL;
+  tab->entries -= 1;
+  for (j = (i + 1) & mask; tab->slots[j].data; j = (j + 1) & mask) {
+    home = ihash_home(tab, tab->slots[j].key);
+    /* Leave the entry alone if its home slot is cyclically in (i, j] */
+    if (i <= j ? (i < home && home <= j) : (i < home || home <= j)) {
+      continue;
+    }
+    tab->slots[i] = tab->slots[j];
+    tab->slots[j].data = NULL;
+    i = j;
+  }
+}
+
+/** Delete an entry.
+ * \param tab pointer to the table.
+ * \param key the key.
+ * \param data the data of the entry to delete, or NULL for the first
+ * entry with the key.
+ * \retval true an entry was deleted.
+ * \retval false there was no such entry.
+ */
+bool
+ihash_delete(IHASHTAB *tab, uint64_t key, const void *data)
+{
+  uint32_t mask = tab->size - 1;
+  uint32_t i;
+
+  if (!tab->entries) {
+    return false;
+  }
+  for (i = ihash_home(tab, key); tab->slots[i].data; i = (i + 1) & mask) {
+    if (tab->slots[i].key == key && (!data || tab->slots[i].data == data)) {
+      ihash_unslot(tab, i);
+      return true;
+    }
+  }
+  return false;
+}
+
+/** Delete every entry a function picks.
+ * \param tab pointer to the table.
+ * \param pred called with each entry's key and data and arg; returns
+ * true to delete the entry.
+ * \param arg passed to pred.
+ * \return the number of entries deleted.
+ */
+uint32_t
+ihash_delete_if(IHASHTAB *tab,
+                bool (*pred)(uint64_t key, void *data, void *arg), void *arg)
+{
+  uint32_t i = 0, n = 0;
+
+  /* Deleting can move a later entry into the emptied slot, so only
+   * advance past slots that are kept. Entries that wrap around to the
+   * start get looked at twice, which is harmless since they were kept
+   * the first time. */
+  while (tab->entries && i < tab->size) {
+    if (tab->slots[i].data &&
+        pred(tab->slots[i].key, tab->slots[i].data, arg)) {
+      ihash_unslot(tab, i);
+      n += 1;
+    } else {
+      i += 1;
+    }
+  }
+  return n;
+}
+
+/** Walk through the entries of a table.
+ * The table must not be changed during the walk; use ihash_delete_if()
+ * to delete entries.
+ * \param tab pointer to the table.
+ * \param pos set to 0 before the first call, and left alone between calls.
+ * \param key if not NULL, set to the key of the entry returned.
+ * \return the data of the next entry, or NULL if there are no more.
+ */
+void *
+ihash_next(const IHASHTAB *tab, uint32_t *pos, uint64_t *key)
+{
+  while (*pos < tab->size) {
+    struct ihash_slot *slot = tab->slots + (*pos)++;
+    if (slot->data) {
+      if (key) {
+        *key = slot->key;
+      }
+      return slot->data;
+    }
+  }
+  return NULL;
+}
+
+/** Delete all entries of a table and free its slots.
+ * The data of the entries isn't freed.
+ * \param tab pointer to the table.
+ */
+void
+ihash_flush(IHASHTAB *tab)
+{
+  if (tab->slots) {
+    mush_free(tab->slots, "ihash.slots");
+  }
+  ihash_init(tab, 0);
+}
+
+/** Bytes used by a table's slots. */
+size_t
+ihash_bytes(const IHASHTAB *tab)
+{
+  return tab->size * sizeof *tab->slots;
+}
+
+static bool
+ihash_test_pred(uint64_t key __attribute__((__unused__)), void *data,
+                void *arg)
+{
+  return data == arg;
+}
+
+TEST_GROUP(ihash)
+{
+  int vals[4] = {0, 1, 2, 3};
+  IHASHTAB tab;
+  uint32_t i, n, pos;
+  uint64_t key;
+  void *data;
+
+  ihash_init(&tab, 0);
+  TEST("ihash.find.1", ihash_find(&tab, 1) == NULL);
+  ihash_set(&tab, 1, vals + 1);
+  ihash_set(&tab, 2, vals + 2);
+  TEST("ihash.find.2",
+       ihash_find(&tab, 1) == vals + 1 && ihash_find(&tab, 2) == vals + 2);
+  ihash_set(&tab, 1, vals + 3);
+  TEST("ihash.set.1", ihash_find(&tab, 1) == vals + 3 && tab.entries == 2);
+
+  /* Entries sharing a key */
+  ihash_add(&tab, 2, vals);
+  pos = 0;
+  n = 0;
+  while ((data = ihash_match(&tab, 2, &pos))) {
+    n += data == vals || data == vals + 2;
+  }
+  TEST("ihash.match.1", n == 2);
+  TEST("ihash.delete.1", ihash_delete(&tab, 2, vals + 2));
+  TEST("ihash.delete.2", ihash_find(&tab, 2) == vals);
+  TEST("ihash.delete.3", !ihash_delete(&tab, 2, vals + 2));
+  ihash_flush(&tab);
+  TEST("ihash.flush.1", ihash_find(&tab, 1) == NULL && !tab.entries);
+
+  /* Enough entries to resize, with deletes in the middle of probe
+   * sequences */
+  for (i = 0; i < 5000; i += 1) {
+    ihash_add(&tab, i % 1000, vals + (i / 1000) % 4);
+  }
+  for (i = 0; i < 1000; i += 2) {
+    while (ihash_delete(&tab, i, NULL))
+      ;
+  }
+  for (i = 0, n = 0; i < 1000; i += 1) {
+    pos = 0;
+    while (ihash_match(&tab, i, &pos)) {
+      n += i % 2 ? 1 : 100;
+    }
+  }
+  TEST("ihash.many.1", n == 2500 && tab.entries == 2500);
+  n = ihash_delete_if(&tab, ihash_test_pred, vals);
+  TEST("ihash.delete_if.1", n == 1000 && tab.entries == 1500);
+  pos = 0;
+  n = 0;
+  while ((data = ihash_next(&tab, &pos, &key))) {
+    n += data != vals && key % 2;
+  }
+  TEST("ihash.next.1", n == 1500);
+  ihash_flush(&tab);
+}
@@ -50,6 +50,7 @@
 #endif
 #include <limits.h>
 #include <errno.h>
+#include <inttypes.h>
 
 #include "notify.h"
 #include "access.h"
@@ -75,6 +76,7 @@
 #include "strutil.h"
 #include "charconv.h"
 #include "websock.h"
+#include "tests.h"
 
 extern CHAN *channels;
 
@@ -113,18 +115,25 @@ static const char flushed_message[] = "\r\n<Output Flushed>\x1B[0m\r\n";
 
 extern DESC *descriptor_list;
 
-static struct text_block *make_text_block(const char *s, int n);
+static struct text_block *make_text_block(const char *s, int n, bool pooled);
 void free_text_block(struct text_block *t);
 void add_to_queue(struct text_queue *q, const char *b, int n);
+static void link_text_block(struct text_queue *q, struct text_block *p);
+static void append_to_queue(struct text_queue *q, const char *b, int n,
+                            bool use_head);
 static int flush_queue(struct text_queue *q, int n);
 int queue_write(DESC *d, const char *b, int n);
 int queue_newwrite(DESC *d, const char *b, int n);
+static int queue_converted_channel(DESC *d, const char *b, int n, char ch);
+static int queue_notify(DESC *d, const char *b, int n, bool converted,
+                        char ch);
 int queue_string(DESC *d, const char *s);
 int WIN32_CDECL queue_string_eol(DESC *d, const char *s, ...)
   __attribute__((__format__(__printf__, 2, 3)));
 int queue_eol(DESC *d);
 void freeqs(DESC *d);
 int process_output(DESC *d);
+void desc_output_pending(DESC *d);
 void init_text_queue(struct text_queue *q);
 
 static int str_type(const char *str);
@@ -275,6 +284,8 @@ struct notify_strings {
   char const *message; /**< The message text. */
   size_t len;          /**< Length of message. */
   int made;            /**< True if message has been rendered. */
+  char const *utf8;    /**< The message converted to UTF-8, or NULL */
+  int utf8len;         /**< Length of utf8 */
 };
 
 /** A message, in every possible rendering */
@@ -311,10 +322,22 @@ static void make_prefix_str(dbref thing, dbref enactor, const char *msg,
                             char *tbuf1);
 
 static const char *notify_makestring_real(struct notify_message *message,
-                                          int output_type);
+                                          int output_type, bool utf8,
+                                          int *len);
 static char *notify_makestring_nocache(const char *message, int output_type);
+static void free_notify_message(struct notify_message *message, int first);
 
-#define notify_makestring(msg, ot) notify_makestring_real(msg, ot)
+#define notify_makestring(msg, ot) notify_makestring_real(msg, ot, 0, NULL)
+
+/** Counts of how well message renderings are shared between recipients,
+ * for @stats/tables */
+static struct {
+  uint64_t messages;    /**< Messages sent with notify_anything() */
+  uint64_t lookups;     /**< Renderings of them wanted */
+  uint64_t renders;     /**< Renderings that weren't cached */
+  uint64_t utf8s;       /**< UTF-8 versions wanted */
+  uint64_t conversions; /**< UTF-8 versions that weren't cached */
+} notify_counts;
 
 /** Check which kinds of markup or special characters a string may contain.
  * This is used to avoid generating message types we don't need. For
@@ -583,14 +606,17 @@ init_notify_message_group(struct notify_message_group *real_message)
     real_message->messages.strs[i].message = NULL;
     real_message->messages.strs[i].made = 0;
     real_message->messages.strs[i].len = 0;
+    real_message->messages.strs[i].utf8 = NULL;
 
     real_message->nospoofs.strs[i].message = NULL;
     real_message->nospoofs.strs[i].made = 0;
     real_message->nospoofs.strs[i].len = 0;
+    real_message->nospoofs.strs[i].utf8 = NULL;
 
     real_message->paranoids.strs[i].message = NULL;
     real_message->paranoids.strs[i].made = 0;
     real_message->paranoids.strs[i].len = 0;
+    real_message->paranoids.strs[i].utf8 = NULL;
   }
   real_message->messages.type = 0;
   real_message->nospoofs.type = 0;
@@ -940,29 +966,110 @@ render_string(const char *message, int output_type)
  * \return pointer to the cached, rendered string
  */
 static const char *
-notify_makestring_real(struct notify_message *message, int output_type)
+notify_makestring_real(struct notify_message *message, int output_type,
+                       bool utf8, int *len)
 {
-  enum na_type msgtype;
+  struct notify_strings *str;
   const char *newstr;
 
   if (output_type & MSG_PLAYER)
     output_type = (output_type & (message->type | MSG_PLAYER));
 
-  msgtype = msg_to_na(output_type);
+  str = &message->strs[msg_to_na(output_type)];
+  notify_counts.lookups += 1;
+
+  if (!str->made) {
+    /* Render the message */
+    newstr = render_string(message->strs[0].message, output_type);
+    notify_counts.renders += 1;
+
+    /* Save the new message */
+    str->made = 1;
+    str->message = mush_strdup(newstr, "notify_str");
+    str->len = strlen(newstr);
+  }
+
+  if (!utf8) {
+    if (len)
+      *len = str->len;
+    return str->message;
+  }
 
-  if (message->strs[msgtype].made) {
-    return message->strs[msgtype].message;
+  /* A telnet client only gets the MSG_TELNET rendering if the message has
+   * IAC characters in it, which is the only time it affects conversion. */
+  notify_counts.utf8s += 1;
+  if (!str->utf8) {
+    str->utf8 = latin1_to_utf8_tn(str->message, str->len, &str->utf8len,
+                                  output_type & MSG_TELNET, "notify_str");
+    notify_counts.conversions += 1;
   }
+  if (len)
+    *len = str->utf8len;
+  return str->utf8;
+}
+
+/** Free the renderings of a message.
+ * \param message the message.
+ * \param first the first rendering to free; 0 if the original message was
+ * allocated too, 1 if it wasn't.
+ */
+static void
+free_notify_message(struct notify_message *message, int first)
+{
+  int i;
 
-  /* Render the message */
-  newstr = render_string(message->strs[0].message, output_type);
+  for (i = 0; i < MESSAGE_TYPES; i++) {
+    if (i >= first && message->strs[i].made)
+      mush_free((void *) message->strs[i].message, "notify_str");
+    if (message->strs[i].utf8)
+      mush_free((void *) message->strs[i].utf8, "notify_str");
+  }
+}
 
-  /* Save the new message */
-  message->strs[msgtype].made = 1;
-  message->strs[msgtype].message = mush_strdup(newstr, "notify_str");
-  message->strs[msgtype].len = strlen(newstr);
+/** Show how often message renderings were shared, for @stats/tables.
+ * \param player the enactor.
+ */
+void
+notify_stats(dbref player)
+{
+  notify_format(player,
+                " %" PRIu64 " messages, %" PRIu64 " renderings wanted, %" PRIu64
+                " made (%.1f%% reused).",
+                notify_counts.messages, notify_counts.lookups,
+                notify_counts.renders,
+                notify_counts.lookups
+                  ? 100.0 * (notify_counts.lookups - notify_counts.renders) /
+                      notify_counts.lookups
+                  : 0.0);
+  notify_format(player,
+                " %" PRIu64 " UTF-8 renderings wanted, %" PRIu64
+                " converted (%.1f%% reused).",
+                notify_counts.utf8s, notify_counts.conversions,
+                notify_counts.utf8s
+                  ? 100.0 * (notify_counts.utf8s - notify_counts.conversions) /
+                      notify_counts.utf8s
+                  : 0.0);
+}
 
-  return message->strs[msgtype].message;
+TEST_GROUP(notify_makestring) {
+  struct notify_message_group group;
+  const char *s, *u;
+  int len = 0;
+
+  init_notify_message_group(&group);
+  group.messages.strs[0].message = "caf\xE9";
+  group.messages.strs[0].made = 1;
+  group.messages.strs[0].len = 4;
+  group.messages.type = str_type("caf\xE9");
+  s = notify_makestring_real(&group.messages, MSG_PLAYER, 0, &len);
+  TEST("notify_makestring.1", strcmp(s, "caf\xE9") == 0 && len == 4);
+  u = notify_makestring_real(&group.messages, MSG_PLAYER, 1, &len);
+  TEST("notify_makestring.2", strcmp(u, "caf\xC3\xA9") == 0 && len == 5);
+  /* No color codes, so ANSI players share the plain rendering */
+  TEST("notify_makestring.3",
+       notify_makestring_real(&group.messages, MSG_PLAYER | MSG_ANSI16, 1,
+                              NULL) == u);
+  free_notify_message(&group.messages, 1);
 }
 
 /** Render a message in a given format and return the new message.
@@ -976,6 +1083,8 @@ notify_makestring_real(struct notify_message *message, int output_type)
 static char *
 notify_makestring_nocache(const char *message, int output_type)
 {
+  notify_counts.lookups += 1;
+  notify_counts.renders += 1;
   return mush_strdup(render_string(message, output_type), "notify_str");
 }
 
@@ -1031,7 +1140,6 @@ notify_anything(dbref executor, dbref speaker, na_lookup func, void *fdata,
 {
   struct notify_message_group real_message;
   struct notify_message_group *real_message_pointer = NULL;
-  int i;
 
   /* If we have no message, or noone to notify, do nothing */
   if (!func || ((!message || !*message) && !(flags & NA_PROMPT)))
@@ -1049,6 +1157,7 @@ notify_anything(dbref executor, dbref speaker, na_lookup func, void *fdata,
     real_message.messages.strs[0].len = strlen(message);
     real_message.messages.type = str_type(message);
     real_message_pointer = &real_message;
+    notify_counts.messages += 1;
   }
 
   if (loc == AMBIGUOUS)
@@ -1060,14 +1169,9 @@ notify_anything(dbref executor, dbref speaker, na_lookup func, void *fdata,
   if (!message || !*message)
     return;
   /* Cleanup */
-  for (i = 0; i < MESSAGE_TYPES; i++) {
-    if (i && real_message.messages.strs[i].made)
-      mush_free((void *) real_message.messages.strs[i].message, "notify_str");
-    if (real_message.nospoofs.strs[i].made)
-      mush_free((void *) real_message.nospoofs.strs[i].message, "notify_str");
-    if (real_message.paranoids.strs[i].made)
-      mush_free((void *) real_message.paranoids.strs[i].message, "notify_str");
-  }
+  free_notify_message(&real_message.messages, 1);
+  free_notify_message(&real_message.nospoofs, 0);
+  free_notify_message(&real_message.paranoids, 0);
 }
 
 /** Notify one or more objects with a message.
@@ -1112,11 +1216,13 @@ notify_anything_sub(dbref executor, dbref speaker, na_lookup func, void *fdata,
     real_prefix->strs[0].message = prefix;
     real_prefix->strs[0].made = 1;
     real_prefix->strs[0].len = strlen(prefix);
+    real_prefix->strs[0].utf8 = NULL;
     real_prefix->type = str_type(prefix);
     for (i = 1; i < MESSAGE_TYPES; i++) {
       real_prefix->strs[i].message = NULL;
       real_prefix->strs[i].made = 0;
       real_prefix->strs[i].len = 0;
+      real_prefix->strs[i].utf8 = NULL;
     }
   }
   /* Tell everyone */
@@ -1136,12 +1242,7 @@ notify_anything_sub(dbref executor, dbref speaker, na_lookup func, void *fdata,
   }
 
   if (real_prefix != NULL) {
-    int i;
-
-    for (i = 1; i < MESSAGE_TYPES; i++) {
-      if (real_prefix->strs[i].made)
-        mush_free((void *) real_prefix->strs[i].message, "notify_str");
-    }
+    free_notify_message(real_prefix, 1);
     mush_free(real_prefix, "notify_message");
   }
 
@@ -1192,6 +1293,8 @@ notify_internal(dbref target, dbref executor, dbref speaker, dbref *skips,
   int msglen = 0;            /**< Length of the rendered message */
   const char *prefixstr = NULL;
   int prefixlen = 0;
+  bool utf8 = 0;     /**< Send cached UTF-8 versions to this descriptor? */
+  bool msg_utf8 = 0; /**< Is msgstr in UTF-8? */
   static char buff[BUFFER_LEN],
     *bp; /**< Buffer used for processing the format attr */
   char *formatmsg =
@@ -1308,13 +1411,11 @@ notify_internal(dbref target, dbref executor, dbref speaker, dbref *skips,
         if (!d->connected || d->player != target)
           continue;
         output_type = notify_type(d);
+        utf8 = (d->conn_flags & (CONN_UTF8 | CONN_HTTP_BUFFER)) == CONN_UTF8;
 
         if (heard && prefix != NULL) {
-          /* Figure out */
-          if (!prefixstr || output_type != last_output_type) {
-            prefixstr = notify_makestring(prefix, output_type);
-            prefixlen = strlen(prefixstr);
-          }
+          prefixstr =
+            notify_makestring_real(prefix, output_type, utf8, &prefixlen);
         } else {
           prefixlen = 0;
         }
@@ -1332,8 +1433,8 @@ notify_internal(dbref target, dbref executor, dbref speaker, dbref *skips,
               message->paranoids.type =
                 str_type((const char *) message->paranoids.strs[0].message);
             }
-            spoofstr = notify_makestring(&message->paranoids, output_type);
-            spooflen = strlen(spoofstr);
+            spoofstr = notify_makestring_real(&message->paranoids, output_type,
+                                              utf8, &spooflen);
           } else {
             if (!message->nospoofs.strs[0].made) {
               message->nospoofs.strs[0].message = make_nospoof(speaker, 0);
@@ -1343,8 +1444,8 @@ notify_internal(dbref target, dbref executor, dbref speaker, dbref *skips,
               message->nospoofs.type =
                 str_type((const char *) message->nospoofs.strs[0].message);
             }
-            spoofstr = notify_makestring(&message->nospoofs, output_type);
-            spooflen = strlen(spoofstr);
+            spoofstr = notify_makestring_real(&message->nospoofs, output_type,
+                                              utf8, &spooflen);
           }
         } else {
           spooflen = 0;
@@ -1356,34 +1457,38 @@ notify_internal(dbref target, dbref executor, dbref speaker, dbref *skips,
         /* No point re-rendering this string if we're outputting to an identical
          * client */
         if (heard) {
-          if (!msgstr || output_type != last_output_type) {
-            if (cache) {
-              msgstr = notify_makestring(&message->messages, output_type);
-            } else {
-              if (formatmsg)
-                mush_free(formatmsg, "notify_str");
-              msgstr = formatmsg = notify_makestring_nocache(buff, output_type);
-            }
+          if (cache) {
+            msgstr = notify_makestring_real(&message->messages, output_type,
+                                            utf8, &msglen);
+            msg_utf8 = utf8;
+          } else if (!msgstr || output_type != last_output_type) {
+            if (formatmsg)
+              mush_free(formatmsg, "notify_str");
+            msgstr = formatmsg = notify_makestring_nocache(buff, output_type);
             msglen = strlen(msgstr);
           }
           last_output_type = output_type;
 
           if (msglen) {
             if (prefixlen) /* send prefix */
-              queue_newwrite(d, prefixstr, prefixlen);
+              queue_notify(d, prefixstr, prefixlen, utf8,
+                           WEBSOCKET_CHANNEL_AUTO);
             if (spooflen) /* send nospoof prefix */
-              queue_newwrite(d, spoofstr, spooflen);
+              queue_notify(d, spoofstr, spooflen, utf8,
+                           WEBSOCKET_CHANNEL_AUTO);
 
             if (prompt) { /* send prompt */
               if (d->conn_flags & CONN_WEBSOCKETS) {
-                queue_newwrite_channel(d, msgstr, msglen,
-                                       WEBSOCKET_CHANNEL_PROMPT);
+                queue_notify(d, msgstr, msglen, msg_utf8,
+                             WEBSOCKET_CHANNEL_PROMPT);
               } else {
-                queue_newwrite(d, msgstr, msglen); /* send message */
+                queue_notify(d, msgstr, msglen, msg_utf8,
+                             WEBSOCKET_CHANNEL_AUTO); /* send message */
                 queue_newwrite(d, "\xFF\xF9", 2);
               }
             } else {
-              queue_newwrite(d, msgstr, msglen); /* send message */
+              queue_notify(d, msgstr, msglen, msg_utf8,
+                           WEBSOCKET_CHANNEL_AUTO); /* send message */
             }
           }
         }
@@ -1733,27 +1838,49 @@ flag_broadcast(const char *flag1, const char *flag2, const char *fmt, ...)
 
 slab *text_block_slab = NULL; /**< Slab for 'struct text_block' allocations */
 
+/* Output blocks have room for TEXT_BLOCK_SIZE bytes. Output is packed
+ * into the last block of a queue while it fits, and freed blocks are kept
+ * on a free list for reuse, so a burst of output doesn't allocate a buffer
+ * per line. Text too big for a block gets a block of its own size, and so
+ * does queued input, which is one short command per block.
+ */
+#define TEXT_BLOCK_SIZE 4096
+#define TEXT_BLOCK_POOL 512 /**< Most free blocks to keep */
+
+static struct text_block *text_block_pool = NULL;
+int text_blocks_pooled = 0; /**< Blocks on the free list */
+int text_blocks_used = 0;   /**< Blocks holding queued text */
+
 static struct text_block *
-make_text_block(const char *s, int n)
+make_text_block(const char *s, int n, bool pooled)
 {
   struct text_block *p;
-  if (text_block_slab == NULL) {
-    text_block_slab = slab_create("output lines", sizeof(struct text_block));
-    /* See what stats are like on M*U*S*H, maybe change */
-    slab_set_opt(text_block_slab, SLAB_ALLOC_FIRST_FIT, 1);
-    slab_set_opt(text_block_slab, SLAB_ALWAYS_KEEP_A_PAGE, 1);
+
+  if (pooled && n <= TEXT_BLOCK_SIZE && text_block_pool) {
+    p = text_block_pool;
+    text_block_pool = p->nxt;
+    text_blocks_pooled -= 1;
+  } else {
+    if (text_block_slab == NULL) {
+      text_block_slab = slab_create("output lines", sizeof(struct text_block));
+      /* See what stats are like on M*U*S*H, maybe change */
+      slab_set_opt(text_block_slab, SLAB_ALLOC_FIRST_FIT, 1);
+      slab_set_opt(text_block_slab, SLAB_ALWAYS_KEEP_A_PAGE, 1);
+    }
+    p = slab_malloc(text_block_slab, NULL);
+    if (!p)
+      mush_panic("Out of memory");
+    p->size = (pooled && n < TEXT_BLOCK_SIZE) ? TEXT_BLOCK_SIZE : n;
+    p->buf = mush_malloc(p->size, "text_block_buff");
+    if (!p->buf)
+      mush_panic("Out of memory");
   }
-  p = slab_malloc(text_block_slab, NULL);
-  if (!p)
-    mush_panic("Out of memory");
-  p->buf = mush_malloc(n, "text_block_buff");
-  if (!p->buf)
-    mush_panic("Out of memory");
 
   memcpy(p->buf, s, n);
   p->nchars = n;
   p->start = p->buf;
   p->nxt = NULL;
+  text_blocks_used += 1;
   return p;
 }
 
@@ -1764,6 +1891,13 @@ void
 free_text_block(struct text_block *t)
 {
   if (t) {
+    text_blocks_used -= 1;
+    if (t->size == TEXT_BLOCK_SIZE && text_blocks_pooled < TEXT_BLOCK_POOL) {
+      t->nxt = text_block_pool;
+      text_block_pool = t;
+      text_blocks_pooled += 1;
+      return;
+    }
     if (t->buf)
       mush_free(t->buf, "text_block_buff");
     slab_free(text_block_slab, t);
@@ -1781,7 +1915,7 @@ init_text_queue(struct text_queue *q)
   return;
 }
 
-/** Add a new chunk of text to a player's output queue.
+/** Add a new chunk of text to a text queue, in a block of its own size.
  * \param q pointer to text_queue to add the chunk to.
  * \param b text to add to the queue.
  * \param n length of text to add.
@@ -1789,13 +1923,15 @@ init_text_queue(struct text_queue *q)
 void
 add_to_queue(struct text_queue *q, const char *b, int n)
 {
-  struct text_block *p;
-
   if (n == 0 || !q)
     return;
+  link_text_block(q, make_text_block(b, n, 0));
+}
 
-  p = make_text_block(b, n);
-
+/* Put a block at the end of a queue. */
+static void
+link_text_block(struct text_queue *q, struct text_block *p)
+{
   if (!q->head) {
     q->head = q->tail = p;
   } else {
@@ -1804,6 +1940,28 @@ add_to_queue(struct text_queue *q, const char *b, int n)
   }
 }
 
+/** Add text to the end of a queue, packing it into the last block if
+ * there's room.
+ * \param q pointer to text_queue to add the text to.
+ * \param b text to add to the queue.
+ * \param n length of text to add.
+ * \param use_head if false, don't add to the first block; SSL might be
+ * partway through writing it.
+ */
+static void
+append_to_queue(struct text_queue *q, const char *b, int n, bool use_head)
+{
+  struct text_block *p = q->tail;
+
+  if (p && p->size == TEXT_BLOCK_SIZE && (use_head || p != q->head) &&
+      p->buf + p->size - (p->start + p->nchars) >= n) {
+    memcpy(p->start + p->nchars, b, n);
+    p->nchars += n;
+  } else if (n > 0) {
+    link_text_block(q, make_text_block(b, n, 1));
+  }
+}
+
 static int
 flush_queue(struct text_queue *q, int n)
 {
@@ -1824,7 +1982,7 @@ flush_queue(struct text_queue *q, int n)
 #endif /* DEBUG */
     free_text_block(p);
   }
-  p = make_text_block(flushed_message, flen);
+  p = make_text_block(flushed_message, flen, 0);
   p->nxt = q->head;
   q->head = p;
   if (!q->tail)
@@ -1916,9 +2074,6 @@ queue_newwrite(DESC *d, const char *b, int n)
 int
 queue_newwrite_channel(DESC *d, const char *b, int n, char ch)
 {
-
-  int space;
-
   char *utf8 = NULL;
 
   if (d->conn_flags & CONN_NOWRITE)
@@ -1938,59 +2093,70 @@ queue_newwrite_channel(DESC *d, const char *b, int n, char ch)
     n = utf8bytes;
   }
 
+  n = queue_converted_channel(d, b, n, ch);
+  if (utf8)
+    mush_free(utf8, "string");
+  return n;
+}
+
+/** Queue a rendering of a notify message.
+ * \param d pointer to descriptor.
+ * \param b text to queue.
+ * \param n length of text.
+ * \param converted true if the text has already been converted to UTF-8
+ * for d.
+ * \param ch websocket channel to send the text on.
+ * \return number of characters queued.
+ */
+static int
+queue_notify(DESC *d, const char *b, int n, bool converted, char ch)
+{
+  if (converted)
+    return queue_converted_channel(d, b, n, ch);
+  else
+    return queue_newwrite_channel(d, b, n, ch);
+}
+
+/** Add text that's already in the descriptor's character set to its
+ * output queue. Used directly for text that's been converted once and
+ * is being sent to many descriptors.
+ * \param d pointer to descriptor.
+ * \param b text to queue.
+ * \param n length of text.
+ * \param ch websocket channel to send the text on.
+ * \return number of characters queued.
+ */
+static int
+queue_converted_channel(DESC *d, const char *b, int n, char ch)
+{
+  int space;
+
+  if (d->conn_flags & CONN_NOWRITE)
+    return 0;
+
   /*
    * Not ideal, but other than rewriting a lot of Penn code, the best we can do
    * is rewrite the buffer right before send().
    */
   if ((d->conn_flags & CONN_WEBSOCKETS)) {
     /* TODO: Uses a static buffer; probably safe in this case. */
-    to_websocket_frame(&b, &n, ch);
-  }
-
-  if (d->source != CS_OPENSSL_SOCKET && !d->output.head) {
-    /* If there's no data already buffered to write out, try writing
-       directly to the socket. Add whatever's left to the buffer to
-       queue for later. */
-    int written;
-
-    if ((written = send(d->descriptor, b, n, 0)) > 0) {
-      /* do_rawlog(LT_TRACE, "Wrote %d bytes directly.", written); */
-      d->output_chars += written;
-      if (written == n) {
-        if (utf8)
-          mush_free(utf8, "string");
-        return written;
-      }
-      n -= written;
-      b += written;
-    } else if (written < 0) {
-      if (!is_blocking_err(errno)) {
-        /* Ignore cases where the socket can't handle any bytes before blocking,
-         * report
-         * and fail on other errors.
-         */
-        do_rawlog(
-          LT_TRACE,
-          "send() returned %d (error %s) trying to write %d bytes to %d",
-          written, strerror(errno), n, d->descriptor);
-        d->conn_flags |= CONN_SHUTDOWN | CONN_NOWRITE;
-        d->closer = GOD;
-        d->close_reason = "socket error";
-        if (utf8)
-          mush_free(utf8, "string");
-        return 0;
-      }
-    } else { /* written == 0 */
-      do_rawlog(LT_TRACE, "send() wrote no bytes to %d", d->descriptor);
-    }
+    to_websocket_frame(d, &b, &n, ch);
   }
 
-  /* do_rawlog(LT_TRACE, "Queuing %d bytes.", n); */
+  /* Output isn't sent right away. It's collected and written with as
+   * few calls as possible by process_output() once the socket is ready,
+   * normally on the next pass through the main loop. */
 
   space = MAX_OUTPUT - d->output_size - n;
   if (space < SPILLOVER_THRESHOLD) {
     process_output(d);
     space = MAX_OUTPUT - d->output_size - n;
+    if (space < 0 && websocket_deflate_takeover(d)) {
+      /* Its frames are compressed against earlier ones, so throwing any
+       * away would leave the client unable to inflate the rest. */
+      boot_desc(d, "output overflow", NOTHING);
+      return 0;
+    }
     if (space < 0) {
 #ifdef HAVE_SSL
       if (d->ssl) {
@@ -2003,10 +2169,9 @@ queue_newwrite_channel(DESC *d, const char *b, int n, char ch)
         d->output_size -= flush_queue(&d->output, -space);
     }
   }
-  add_to_queue(&d->output, b, n);
+  append_to_queue(&d->output, b, n, !d->ssl);
   d->output_size += n;
-  if (utf8)
-    mush_free(utf8, "string");
+  desc_output_pending(d);
   return n;
 }
 
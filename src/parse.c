@@ -37,6 +37,7 @@
 #include "mymalloc.h"
 #include "mypcre.h"
 #include "notify.h"
+#include "profile.h"
 #include "strtree.h"
 #include "strutil.h"
 #include "tests.h"
@@ -2661,7 +2662,7 @@ process_expression(char *buff, char **bp, char const **str, dbref executor,
           temp[2] = '\0';
           attrib = atr_get(executor, temp);
           if (attrib)
-            safe_str(atr_value(attrib), buff, bp);
+            safe_str(atr_value_const(attrib), buff, bp);
           break;
         default: /* just copy */
           safe_chr(savec, buff, bp);
@@ -2998,6 +2999,7 @@ process_expression(char *buff, char **bp, char const **str, dbref executor,
             safe_integer(nfargs, buff, bp);
           } else {
             char *fbuff, *fbp;
+            bool profiled;
 
             global_fun_recursions++;
             pe_info->fun_recursions++;
@@ -3016,6 +3018,10 @@ process_expression(char *buff, char **bp, char const **str, dbref executor,
               fbp = *bp;
             }
 
+            profiled = PROFILE_SOFTCODE;
+            if (profiled) {
+              profile_push_function(fp->name);
+            }
             if (fp->flags & FN_BUILTIN) {
               global_fun_invocations++;
               pe_info->fun_invocations++;
@@ -3062,6 +3068,9 @@ process_expression(char *buff, char **bp, char const **str, dbref executor,
                           caller, enactor, pe_info, PE_USERFN);
               }
             }
+            if (profiled) {
+              profile_pop();
+            }
             if (realbuff)
               realbp = fbp;
             else
@@ -3194,6 +3203,523 @@ exit_sequence:
   return retval;
 }
 
+/* Compiled attributes.
+ *
+ * Attributes called through call_ufun() are evaluated over and over,
+ * and a lot of them are just text with %-substitutions in it. Those
+ * are turned into a list of instructions (copy text, insert %0, insert
+ * %qa, ...) the first time they're evaluated, and kept in a small
+ * cache keyed by object and the attribute's chunk reference, so
+ * changing the attribute gives it a new key. Anything the compiler
+ * doesn't understand - functions, [], {}, \, most %-subs - and any
+ * evaluation that could look different from the interpreter's (debug
+ * output, halted objects, hitting a limit) goes to process_expression()
+ * as before. With compile_ufuns_check on, both are run and any
+ * difference logged, with the interpreter's result used.
+ *
+ * Most attributes call functions, so a quick scan for the characters
+ * that rule compiling out is done before anything is looked up or
+ * allocated. Text that gets past it but still can't be compiled is
+ * cached too, without any instructions, so it isn't tried again.
+ */
+
+/** Compiled instruction types */
+enum pe_op_type {
+  PEOP_TEXT,     /**< Copy literal text */
+  PEOP_ARG,      /**< %0-%9 */
+  PEOP_QREG,     /**< %q<single character> */
+  PEOP_EXECUTOR, /**< %! */
+  PEOP_CALLER,   /**< %@ */
+  PEOP_ENACTOR,  /**< %# */
+  PEOP_NAME      /**< %n */
+};
+
+/** One compiled instruction. */
+struct pe_op {
+  enum pe_op_type type; /**< What to do */
+  char arg;             /**< Argument number or register name */
+  bool upper;           /**< Capitalize the result, for %N, %Q, etc. */
+  uint16_t start;       /**< Start of literal text in the program */
+  uint16_t len;         /**< Length of literal text */
+};
+
+/** A compiled attribute. */
+struct pe_program {
+  dbref thing;            /**< Object evaluating the attribute */
+  chunk_reference_t data; /**< Chunk reference of the attribute */
+  char *source;           /**< Attribute text, to verify cache hits */
+  char *text;             /**< Literal text used by PEOP_TEXT */
+  int nops;               /**< Number of instructions, -1 if not compiled */
+  struct pe_op *ops;      /**< Instructions */
+};
+
+#define PE_PROGRAM_CACHE_SIZE 1024
+static struct pe_program *pe_programs[PE_PROGRAM_CACHE_SIZE];
+static struct {
+  uint64_t runs;       /**< Compiled evaluations */
+  uint64_t fallbacks;  /**< Evaluations done by the interpreter */
+  uint64_t compiles;   /**< Attributes compiled (or found uncompilable) */
+  uint64_t mismatches; /**< compile_ufuns_check differences */
+} pe_program_counts;
+
+static void
+free_pe_program(struct pe_program *prog)
+{
+  mush_free(prog->source, "pe_program.source");
+  if (prog->text) {
+    mush_free(prog->text, "pe_program.text");
+  }
+  if (prog->ops) {
+    mush_free(prog->ops, "pe_program.ops");
+  }
+  mush_free(prog, "pe_program");
+}
+
+/** Characters compile_pe_program() always gives up on */
+static const char pe_uncompilable[] = {'[',      '(',       '{', '\\', '$',
+                                       ESC_CHAR, TAG_START, '\0'};
+
+/** Could compile_pe_program() possibly compile some text?
+ * \param src the text.
+ * \retval false it certainly can't.
+ * \retval true it might.
+ */
+static inline bool
+pe_maybe_compilable(const char *src)
+{
+  size_t len = strcspn(src, pe_uncompilable);
+
+  return !src[len] && len && src[len - 1] != ' ';
+}
+
+/** Compile attribute text evaluated with PE_UDEFAULT and PT_DEFAULT.
+ * \param src the text.
+ * \param text buffer as long as src to store literal text in.
+ * \param ops array of as many instructions as src has characters.
+ * \param textlen set to the length of the literal text.
+ * \return number of instructions, or -1 if src can't be compiled.
+ */
+static int
+compile_pe_program(const char *src, char *text, struct pe_op *ops,
+                   size_t *textlen)
+{
+  int nops = 0;
+  size_t tlen = 0;
+
+#define PE_OP(t, a, u)                                                         \
+  do {                                                                         \
+    ops[nops].type = (t);                                                      \
+    ops[nops].arg = (a);                                                       \
+    ops[nops].upper = (u);                                                     \
+    nops++;                                                                    \
+  } while (0)
+#define PE_TEXT(c)                                                             \
+  do {                                                                         \
+    if (!nops || ops[nops - 1].type != PEOP_TEXT) {                            \
+      PE_OP(PEOP_TEXT, 0, 0);                                                  \
+      ops[nops - 1].start = tlen;                                              \
+      ops[nops - 1].len = 0;                                                   \
+    }                                                                          \
+    text[tlen++] = (c);                                                        \
+    ops[nops - 1].len++;                                                       \
+  } while (0)
+
+  /* process_expression() strips leading spaces, and trailing ones in
+   * ways that depend on what comes before them. */
+  while (*src == ' ') {
+    src++;
+  }
+  if (*src && src[strlen(src) - 1] == ' ') {
+    return -1;
+  }
+
+  while (*src) {
+    switch (*src) {
+    case ' ':
+      PE_TEXT(' ');
+      while (*src == ' ') {
+        src++;
+      }
+      continue;
+    case '%':
+      src++;
+      switch (*src) {
+      case '%':
+        PE_TEXT('%');
+        break;
+      case ' ':
+        PE_TEXT('%');
+        PE_TEXT(' ');
+        break;
+      case '0':
+      case '1':
+      case '2':
+      case '3':
+      case '4':
+      case '5':
+      case '6':
+      case '7':
+      case '8':
+      case '9':
+        PE_OP(PEOP_ARG, *src - '0', 0);
+        break;
+      case '!':
+        PE_OP(PEOP_EXECUTOR, 0, 0);
+        break;
+      case '@':
+        PE_OP(PEOP_CALLER, 0, 0);
+        break;
+      case '#':
+        PE_OP(PEOP_ENACTOR, 0, 0);
+        break;
+      case 'B':
+      case 'b':
+        PE_TEXT(' ');
+        break;
+      case 'R':
+      case 'r':
+        PE_TEXT('\n');
+        break;
+      case 'T':
+      case 't':
+        PE_TEXT('\t');
+        break;
+      case 'N':
+      case 'n':
+        PE_OP(PEOP_NAME, 0, *src == 'N');
+        break;
+      case 'Q':
+      case 'q':
+        if (!src[1] || src[1] == '<') {
+          return -1;
+        }
+        PE_OP(PEOP_QREG, UPCASE(src[1]), *src == 'Q');
+        src++;
+        break;
+      default:
+        return -1;
+      }
+      src++;
+      continue;
+    case '[':
+    case '(':
+    case '{':
+    case '\\':
+    case '$':
+    case ESC_CHAR:
+    case TAG_START:
+      return -1;
+    default:
+      PE_TEXT(*src);
+      src++;
+      continue;
+    }
+  }
+#undef PE_TEXT
+#undef PE_OP
+  *textlen = tlen;
+  return nops;
+}
+
+/** Find or make the compiled version of an attribute.
+ * \param thing the object evaluating the attribute.
+ * \param data the attribute's chunk reference.
+ * \param src the attribute's text.
+ * \return the compiled attribute, which may have nops < 0.
+ */
+static struct pe_program *
+get_pe_program(dbref thing, chunk_reference_t data, const char *src)
+{
+  static char text[BUFFER_LEN];
+  static struct pe_op ops[BUFFER_LEN];
+  struct pe_program *prog;
+  uint64_t h;
+  int slot;
+  size_t tlen = 0;
+
+  h = ((uint64_t) data * 0x9E3779B97F4A7C15ULL) ^ (uint64_t) thing;
+  slot = (int) ((h >> 32) % PE_PROGRAM_CACHE_SIZE);
+
+  prog = pe_programs[slot];
+  if (prog && prog->thing == thing && prog->data == data &&
+      strcmp(prog->source, src) == 0) {
+    return prog;
+  }
+  if (prog) {
+    free_pe_program(prog);
+  }
+
+  pe_program_counts.compiles++;
+  prog = mush_malloc(sizeof *prog, "pe_program");
+  prog->thing = thing;
+  prog->data = data;
+  prog->source = mush_strdup(src, "pe_program.source");
+  prog->text = NULL;
+  prog->ops = NULL;
+  if (strlen(src) < BUFFER_LEN) {
+    prog->nops = compile_pe_program(src, text, ops, &tlen);
+  } else {
+    prog->nops = -1;
+  }
+  /* Only what compiled is kept; the rest stays cached as uncompilable */
+  if (prog->nops > 0) {
+    prog->ops = mush_calloc(prog->nops, sizeof *ops, "pe_program.ops");
+    memcpy(prog->ops, ops, prog->nops * sizeof *ops);
+    if (tlen) {
+      prog->text = mush_malloc(tlen, "pe_program.text");
+      memcpy(prog->text, text, tlen);
+    }
+  }
+  pe_programs[slot] = prog;
+  return prog;
+}
+
+/** Run a compiled attribute.
+ * Arguments are as for process_expression().
+ * \retval 0 success.
+ * \retval -1 the program can't be used here; use process_expression().
+ */
+static int
+run_pe_program(struct pe_program *prog, char *buff, char **bp, dbref executor,
+               dbref caller, dbref enactor, int eflags, NEW_PE_INFO *pe_info)
+{
+  int debugging, n;
+  const char *src;
+
+  if (prog->nops < 0 || !pe_info ||
+      (eflags & ~(PE_DEBUG | PE_NODEBUG)) != PE_UDEFAULT ||
+      (eflags & PE_DEBUG) || cpu_time_limit_hit || Halted(executor) ||
+      (CALL_LIMIT && pe_info->call_depth >= CALL_LIMIT)) {
+    return -1;
+  }
+  /* Would process_expression() show debug output? */
+  debugging = (caller != executor) ? 0 : pe_info->debugging;
+  if (eflags & PE_NODEBUG) {
+    debugging = -1;
+  }
+  if ((Debug(executor) && debugging != -1) || debugging == 1) {
+    return -1;
+  }
+  if (!prog->nops) {
+    return 0;
+  }
+
+  for (src = prog->source; *src == ' '; src++)
+    ;
+  if ((last_activity_type() != LA_PE) || !strstr(last_activity(), src)) {
+    log_activity(LA_PE, executor, src);
+  }
+
+  for (n = 0; n < prog->nops; n++) {
+    struct pe_op *op = &prog->ops[n];
+    char *savepos = *bp;
+    const char *val;
+    char qv[2];
+
+    switch (op->type) {
+    case PEOP_TEXT:
+      safe_strl(prog->text + op->start, op->len, buff, bp);
+      break;
+    case PEOP_ARG:
+      val = PE_Get_Env(pe_info, op->arg);
+      if (val) {
+        safe_str(val, buff, bp);
+      }
+      break;
+    case PEOP_QREG:
+      qv[0] = op->arg;
+      qv[1] = '\0';
+      val = PE_Getq(pe_info, qv);
+      if (val) {
+        safe_str(val, buff, bp);
+      }
+      break;
+    case PEOP_EXECUTOR:
+      safe_dbref(executor, buff, bp);
+      break;
+    case PEOP_CALLER:
+      safe_dbref(caller, buff, bp);
+      break;
+    case PEOP_ENACTOR:
+      safe_dbref(enactor, buff, bp);
+      break;
+    case PEOP_NAME:
+      if (GoodObject(enactor)) {
+        safe_str(Name(enactor), buff, bp);
+      } else {
+        safe_str(T(e_notvis), buff, bp);
+      }
+      break;
+    }
+    if (op->upper) {
+      savepos = skip_leading_ansi(savepos, *bp);
+      if (savepos) {
+        *savepos = UPCASE(*savepos);
+      }
+    }
+  }
+  pe_program_counts.runs++;
+  return 0;
+}
+
+/** Evaluate the text of an attribute.
+ * This is process_expression() with PT_DEFAULT, for attributes
+ * called through call_ufun(), but simple attributes are compiled the
+ * first time they're used and run from the compiled form afterwards.
+ * \param buff buffer to store returns of parsing.
+ * \param bp pointer to pointer into buff marking insert position.
+ * \param text the attribute text to evaluate.
+ * \param data the attribute's chunk reference, or NULL_CHUNK_REFERENCE
+ *  if the text isn't from an attribute.
+ * \param executor dbref of the object invoking the function.
+ * \param caller dbref of  the last object to use u()
+ * \param enactor dbref of the enactor.
+ * \param eflags flags to control what is evaluated.
+ * \param pe_info pointer to parser context data.
+ * \retval 0 success.
+ * \retval 1 CPU time limit exceeded.
+ */
+int
+process_compiled(char *buff, char **bp, char const *text,
+                 chunk_reference_t data, dbref executor, dbref caller,
+                 dbref enactor, int eflags, NEW_PE_INFO *pe_info)
+{
+  struct pe_program *prog = NULL;
+  char check[BUFFER_LEN];
+  char *cp = NULL;
+  char *start = *bp;
+  int r;
+
+  if (COMPILE_UFUNS && data != NULL_CHUNK_REFERENCE &&
+      pe_maybe_compilable(text)) {
+    prog = get_pe_program(executor, data, text);
+  }
+
+  if (prog && prog->nops >= 0) {
+    if (!COMPILE_UFUNS_CHECK) {
+      if (run_pe_program(prog, buff, bp, executor, caller, enactor, eflags,
+                         pe_info) == 0) {
+        return 0;
+      }
+    } else {
+      memcpy(check, buff, start - buff);
+      cp = check + (start - buff);
+      if (run_pe_program(prog, check, &cp, executor, caller, enactor, eflags,
+                         pe_info) < 0) {
+        cp = NULL;
+      }
+    }
+  }
+
+  pe_program_counts.fallbacks++;
+  r = process_expression(buff, bp, &text, executor, caller, enactor, eflags,
+                         PT_DEFAULT, pe_info);
+  if (cp && (cp - check != *bp - buff ||
+             memcmp(check + (start - buff), start, *bp - start))) {
+    pe_program_counts.mismatches++;
+    *cp = '\0';
+    do_rawlog(LT_ERR,
+              "Compiled attribute mismatch for #%d: '%s' gave '%s', expected "
+              "'%.*s'",
+              executor, prog->source, check + (start - buff),
+              (int) (*bp - start), start);
+  }
+  return r;
+}
+
+/** Report compiled attribute statistics.
+ * \param player the enactor.
+ */
+void
+pe_program_stats(dbref player)
+{
+  int n, cached = 0, compiled = 0;
+
+  for (n = 0; n < PE_PROGRAM_CACHE_SIZE; n++) {
+    if (pe_programs[n]) {
+      cached++;
+      if (pe_programs[n]->nops >= 0) {
+        compiled++;
+      }
+    }
+  }
+  notify_format(player, " %d cached attributes, %d of them compiled.", cached,
+                compiled);
+  notify_format(player,
+                " %" PRIu64 " compiled runs, %" PRIu64 " interpreted, %" PRIu64
+                " compiles, %" PRIu64 " mismatches.",
+                pe_program_counts.runs, pe_program_counts.fallbacks,
+                pe_program_counts.compiles, pe_program_counts.mismatches);
+}
+
+/* Compile and run a string both ways, for tests */
+static bool
+pe_program_agrees(const char *src, NEW_PE_INFO *pe_info)
+{
+  char text[BUFFER_LEN], cbuff[BUFFER_LEN], ibuff[BUFFER_LEN];
+  char *cbp = cbuff, *ibp = ibuff;
+  struct pe_op ops[BUFFER_LEN];
+  struct pe_program prog;
+  size_t tlen;
+
+  prog.source = (char *) src;
+  prog.text = text;
+  prog.ops = ops;
+  prog.nops = compile_pe_program(src, text, ops, &tlen);
+  if (prog.nops < 0 ||
+      run_pe_program(&prog, cbuff, &cbp, GOD, GOD, GOD, PE_UDEFAULT, pe_info) <
+        0) {
+    return 0;
+  }
+  process_expression(ibuff, &ibp, &src, GOD, GOD, GOD, PE_UDEFAULT,
+                     PT_DEFAULT, pe_info);
+  *cbp = *ibp = '\0';
+  return strcmp(cbuff, ibuff) == 0;
+}
+
+TEST_GROUP(pe_program)
+{
+  char text[BUFFER_LEN];
+  struct pe_op ops[BUFFER_LEN];
+  struct pe_program *prog;
+  NEW_PE_INFO *pe_info;
+  uint64_t compiles;
+  size_t tlen;
+
+  TEST("pe_program.compile.1",
+       compile_pe_program("abc", text, ops, &tlen) == 1 && tlen == 3);
+  TEST("pe_program.compile.2",
+       compile_pe_program("a %0 b %qa", text, ops, &tlen) == 4);
+  TEST("pe_program.compile.3",
+       compile_pe_program("[add(1,2)]", text, ops, &tlen) < 0);
+  TEST("pe_program.compile.4",
+       compile_pe_program("abs(1)", text, ops, &tlen) < 0);
+  TEST("pe_program.compile.5",
+       compile_pe_program("foo ", text, ops, &tlen) < 0);
+  TEST("pe_program.compile.6", compile_pe_program("%vA", text, ops, &tlen) < 0);
+
+  TEST("pe_program.scan.1", pe_maybe_compilable("a %0 b"));
+  TEST("pe_program.scan.2", !pe_maybe_compilable("a [add(1,2)]") &&
+                              !pe_maybe_compilable("abs(1)") &&
+                              !pe_maybe_compilable("foo ") &&
+                              !pe_maybe_compilable(""));
+  /* Text that gets past the scan but doesn't compile is remembered */
+  prog = get_pe_program(GOD, 12345, "%vA");
+  compiles = pe_program_counts.compiles;
+  TEST("pe_program.negative.1", prog->nops < 0 && !prog->ops && !prog->text);
+  TEST("pe_program.negative.2", get_pe_program(GOD, 12345, "%vA") == prog &&
+                                  pe_program_counts.compiles == compiles);
+
+  pe_info = make_pe_info("pe_info-test");
+  pe_regs_setenv(pe_info->regvals, 0, "zero");
+  pi_regs_setq(pe_info, "A", "qval");
+  TEST("pe_program.run.1", pe_program_agrees("  plain   text", pe_info));
+  TEST("pe_program.run.2",
+       pe_program_agrees("%0 and %1, %Qa%r%t%b%%% ! %!%@%#", pe_info));
+  TEST("pe_program.run.3", pe_program_agrees("%N says ]}), hi;=>", pe_info));
+  free_pe_info(pe_info);
+}
+
 #ifdef WIN32
 #pragma warning(default : 4761) /* NJG: enable warning re conversion */
 #endif
@@ -3,7 +3,14 @@
  *
  * \brief Player list management for PennMUSH.
  *
+ * Player names and aliases are kept in an IHASHTAB keyed by a hash of
+ * the case-folded name. Each player's
+ * names are also chained together, with the head of the chain kept as
+ * object data, so they can all be removed at once.
  *
+ * The names of connected players are also kept in a prefix trie, so
+ * partial matches of connected players don't have to walk the
+ * descriptor list.
  */
 
 #include "copyrite.h"
@@ -12,90 +19,124 @@
 #include <stdlib.h>
 
 #include "attrib.h"
+#include "case.h"
 #include "conf.h"
 #include "dbdefs.h"
 #include "externs.h"
+#include "hash_function.h"
+#include "htab.h"
 #include "mushdb.h"
+#include "mymalloc.h"
 #include "parse.h"
 #include "strutil.h"
-#include "mushsql.h"
 #include "log.h"
-#include "charconv.h"
+#include "tests.h"
+
+/** A name or alias in the player list. */
+struct plyr_name {
+  char *name;             /**< Case-folded name */
+  uint32_t hash;          /**< Hash of the folded name */
+  dbref player;           /**< Player the name belongs to */
+  struct plyr_name *next; /**< The player's next name */
+};
+
+static IHASHTAB plyr_table; /**< struct plyr_names, by hash */
+
+#define PLYR_INITIAL_SIZE 1024
+#define PLYR_OBJDATA "PLAYER.NAMES"
+
+/** A node in the trie of connected player names. */
+struct plyr_trie {
+  struct plyr_trie *child;   /**< First child */
+  struct plyr_trie *sibling; /**< Next child of the same parent */
+  int count;                 /**< Connected players named through here */
+  dbref player;              /**< Player whose name ends here, or NOTHING */
+  unsigned char c;           /**< Character leading to this node */
+};
+
+static struct plyr_trie trie_root = {NULL, NULL, 0, NOTHING, '\0'};
+
+static void trie_free(struct plyr_trie *node);
+
+/** Case-fold a player name.
+ * \param name the name, in latin-1.
+ * \param buff buffer of at least BUFFER_LEN bytes to fold it into.
+ * \return the length of the folded name.
+ */
+static int
+fold_name(const char *name, char *buff)
+{
+  int n;
 
-static int hft_initialized = 0;
-static void init_hft(void);
+  for (n = 0; name[n] && n < BUFFER_LEN - 1; n += 1) {
+    buff[n] = DOWNCASE((unsigned char) name[n]);
+  }
+  buff[n] = '\0';
+  return n;
+}
 
-static void
-init_hft(void)
+/** Find a folded name.
+ * \param name the folded name.
+ * \param hash the hash of the name.
+ * \return the name's entry, or NULL.
+ */
+static struct plyr_name *
+plyr_find(const char *name, uint32_t hash)
 {
-  if (!hft_initialized) {
-    char *errmsg = NULL;
-    sqlite3 *sqldb = get_shared_db();
-
-    if (sqlite3_exec(sqldb,
-                     "CREATE TABLE players(name TEXT NOT NULL PRIMARY KEY, "
-                     "dbref INTEGER NOT NULL, FOREIGN KEY(dbref) REFERENCES "
-                     "objects(dbref) ON DELETE CASCADE) WITHOUT ROWID;"
-                     "CREATE INDEX plyr_dbref_idx ON players(dbref)",
-                     NULL, NULL, &errmsg) != SQLITE_OK) {
-      do_rawlog(LT_ERR, "Unable to create players table: %s", errmsg);
-      sqlite3_free(errmsg);
-    } else {
-      hft_initialized = 1;
+  struct plyr_name *entry;
+  uint32_t pos = 0;
+
+  while ((entry = ihash_match(&plyr_table, hash, &pos))) {
+    if (strcmp(entry->name, name) == 0) {
+      break;
     }
   }
+  return entry;
 }
 
 /** Clear the player list htab. */
 void
 clear_players(void)
 {
-  if (hft_initialized) {
-    char *errmsg = NULL;
-    sqlite3 *sqldb = get_shared_db();
-
-    if (sqlite3_exec(sqldb, "DELETE FROM players", NULL, NULL, &errmsg) !=
-        SQLITE_OK) {
-      do_rawlog(LT_ERR, "Unable to wipe players table: %s", errmsg);
-      sqlite3_free(errmsg);
-    }
-  } else {
-    init_hft();
+  struct plyr_name *entry;
+  uint32_t pos = 0;
+
+  while ((entry = ihash_next(&plyr_table, &pos, NULL))) {
+    delete_objdata(entry->player, PLYR_OBJDATA);
+    mush_free(entry->name, "plyrlist.name");
+    mush_free(entry, "plyrlist.entry");
   }
+  ihash_flush(&plyr_table);
+  ihash_init(&plyr_table, PLYR_INITIAL_SIZE);
+
+  trie_free(trie_root.child);
+  trie_root.child = NULL;
+  trie_root.count = 0;
 }
 
 /* name is assumed to be latin-1 */
 static void
-add_player_name(sqlite3 *sqldb, const char *name, dbref player)
+add_player_name(const char *name, dbref player)
 {
-  sqlite3_stmt *adder;
-  int ulen;
-  char *utf8;
-  int status;
-
-  init_hft();
-
-  adder = prepare_statement(
-    sqldb, "INSERT INTO players(name, dbref) VALUES(upper(?), ?)",
-    "plyrlist.add");
-  if (!adder) {
+  char folded[BUFFER_LEN];
+  struct plyr_name *entry;
+  uint32_t hash;
+  int len;
+
+  len = fold_name(name, folded);
+  hash = city_hash(folded, len, 0);
+  if (plyr_find(folded, hash)) {
+    /* Names are unique; the first player to claim one keeps it. */
     return;
   }
 
-  utf8 = latin1_to_utf8(name, strlen(name), &ulen, "string");
-  sqlite3_bind_text(adder, 1, utf8, ulen, free_string);
-  sqlite3_bind_int(adder, 2, player);
-
-  do {
-    status = sqlite3_step(adder);
-  } while (is_busy_status(status));
-
-  if (status != SQLITE_DONE && status != SQLITE_CONSTRAINT) {
-    do_rawlog(LT_ERR, "Unable to execute players add query for #%d/%s: %s (%d)",
-              player, name, sqlite3_errmsg(sqldb), status);
-  }
-
-  sqlite3_reset(adder);
+  entry = mush_malloc(sizeof *entry, "plyrlist.entry");
+  entry->name = mush_strdup(folded, "plyrlist.name");
+  entry->hash = hash;
+  entry->player = player;
+  entry->next = get_objdata(player, PLYR_OBJDATA);
+  set_objdata(player, PLYR_OBJDATA, entry);
+  ihash_add(&plyr_table, hash, entry);
 }
 
 /** Add a player to the player list htab.
@@ -104,7 +145,7 @@ add_player_name(sqlite3 *sqldb, const char *name, dbref player)
 void
 add_player(dbref player)
 {
-  add_player_name(get_shared_db(), Name(player), player);
+  add_player_name(Name(player), player);
 }
 
 /** Add a player's alias list to the player list htab.
@@ -113,24 +154,9 @@ add_player(dbref player)
  * semicolon-separated.
  */
 void
-add_player_alias(dbref player, const char *alias, bool intransaction)
+add_player_alias(dbref player, const char *alias)
 {
   char tbuf1[BUFFER_LEN], *s, *sp;
-  int status;
-  char *errmsg;
-  sqlite3 *sqldb = get_shared_db();
-
-  init_hft();
-
-  if (!intransaction) {
-    status = sqlite3_exec(sqldb, "BEGIN TRANSACTION", NULL, NULL, &errmsg);
-    if (status != SQLITE_OK) {
-      do_rawlog(LT_ERR, "Unable to start players add alias transaction: %s",
-                errmsg);
-      sqlite3_free(errmsg);
-      return;
-    }
-  }
 
   mush_strncpy(tbuf1, alias, BUFFER_LEN);
   s = trim_space_sep(tbuf1, ALIAS_DELIMITER);
@@ -139,18 +165,7 @@ add_player_alias(dbref player, const char *alias, bool intransaction)
     while (sp && *sp && *sp == ' ')
       sp++;
     if (sp && *sp) {
-      add_player_name(sqldb, sp, player);
-    }
-  }
-
-  if (!intransaction) {
-    status = sqlite3_exec(sqldb, "COMMIT TRANSACTION", NULL, NULL, &errmsg);
-    if (status != SQLITE_OK) {
-      do_rawlog(LT_ERR, "Unable to commit players add alias transaction: %s",
-                errmsg);
-      sqlite3_free(errmsg);
-      sqlite3_exec(sqldb, "ROLLBACK TRANSACTION", NULL, NULL, NULL);
-      return;
+      add_player_name(sp, player);
     }
   }
 }
@@ -185,68 +200,186 @@ lookup_player(const char *name)
 dbref
 lookup_player_name(const char *name)
 {
-  sqlite3_stmt *looker;
-  dbref d = NOTHING;
-  char *utf8;
-  int ulen;
-  int status;
-  sqlite3 *sqldb = get_shared_db();
-
-  if (!hft_initialized) {
-    return NOTHING;
-  }
+  char folded[BUFFER_LEN];
+  struct plyr_name *entry;
+  int len;
 
-  looker =
-    prepare_statement(sqldb, "SELECT dbref FROM players WHERE name = upper(?)",
-                      "plyrlist.lookup");
-  if (!looker) {
+  if (!plyr_table.entries) {
     return NOTHING;
   }
 
-  utf8 = latin1_to_utf8(name, strlen(name), &ulen, "string");
-  sqlite3_bind_text(looker, 1, utf8, ulen, free_string);
-
-  do {
-    status = sqlite3_step(looker);
-  } while (is_busy_status(status));
-
-  if (status == SQLITE_ROW) {
-    d = sqlite3_column_int(looker, 0);
-  } else if (status != SQLITE_DONE) {
-    do_rawlog(LT_ERR, "Unable to run players lookup query for %s: %s", name,
-              sqlite3_errmsg(sqldb));
-  }
-  sqlite3_reset(looker);
-  return d;
+  len = fold_name(name, folded);
+  entry = plyr_find(folded, city_hash(folded, len, 0));
+  return entry ? entry->player : NOTHING;
 }
 
 /** Remove a player from the player list htab.
  * \param player dbref of player to remove.
- * \param alias key to remove if given.
  */
 void
 delete_player(dbref player)
 {
-  sqlite3_stmt *deleter;
-  int status;
-  sqlite3 *sqldb = get_shared_db();
+  struct plyr_name *entry, *next;
+
+  for (entry = get_objdata(player, PLYR_OBJDATA); entry; entry = next) {
+    next = entry->next;
+    ihash_delete(&plyr_table, entry->hash, entry);
+    mush_free(entry->name, "plyrlist.name");
+    mush_free(entry, "plyrlist.entry");
+  }
+  delete_objdata(player, PLYR_OBJDATA);
+}
+
+static void
+trie_free(struct plyr_trie *node)
+{
+  while (node) {
+    struct plyr_trie *next = node->sibling;
+    trie_free(node->child);
+    mush_free(node, "plyrlist.trie");
+    node = next;
+  }
+}
 
-  init_hft();
+/** Add a name to the trie of connected players.
+ * \param name the player's name.
+ * \param player the player.
+ */
+static void
+trie_add(const char *name, dbref player)
+{
+  char folded[BUFFER_LEN];
+  struct plyr_trie *node, *child;
+  unsigned char *s;
 
-  deleter = prepare_statement(sqldb, "DELETE FROM players WHERE dbref = ?",
-                              "plyrlist.delete");
-  if (!deleter) {
+  if (!fold_name(name, folded)) {
     return;
   }
 
-  sqlite3_bind_int(deleter, 1, player);
-  status = sqlite3_step(deleter);
-  if (status != SQLITE_DONE) {
-    do_rawlog(LT_ERR,
-              "Unable to execute query to delete players names for #%d: %s",
-              player, sqlite3_errmsg(sqldb));
+  /* Find where the name ends first, so a player already in the trie
+   * isn't counted twice. */
+  node = &trie_root;
+  for (s = (unsigned char *) folded; *s && node; s++) {
+    for (node = node->child; node && node->c != *s; node = node->sibling)
+      ;
+  }
+  if (node && node->player != NOTHING) {
+    return;
+  }
+
+  node = &trie_root;
+  node->count += 1;
+  for (s = (unsigned char *) folded; *s; s++) {
+    for (child = node->child; child && child->c != *s; child = child->sibling)
+      ;
+    if (!child) {
+      child = mush_malloc(sizeof *child, "plyrlist.trie");
+      child->child = NULL;
+      child->sibling = node->child;
+      child->count = 0;
+      child->player = NOTHING;
+      child->c = *s;
+      node->child = child;
+    }
+    node = child;
+    node->count += 1;
   }
-  sqlite3_reset(deleter);
+  node->player = player;
+}
+
+/** Remove a name from the trie of connected players.
+ * \param node the trie node to start from.
+ * \param s the rest of the folded name.
+ * \param player the player.
+ * \return true if the name was removed.
+ */
+static bool
+trie_remove(struct plyr_trie *node, const unsigned char *s, dbref player)
+{
+  struct plyr_trie **link, *child;
+
+  if (!*s) {
+    if (node->player != player) {
+      return false;
+    }
+    node->player = NOTHING;
+    node->count -= 1;
+    return true;
+  }
+
+  for (link = &node->child; *link && (*link)->c != *s;
+       link = &(*link)->sibling)
+    ;
+  child = *link;
+  if (!child || !trie_remove(child, s + 1, player)) {
+    return false;
+  }
+  if (!child->count) {
+    *link = child->sibling;
+    trie_free(child->child);
+    mush_free(child, "plyrlist.trie");
+  }
+  node->count -= 1;
+  return true;
+}
+
+/** Add a player to the index of connected players.
+ * Adding a player who's already there does nothing.
+ * \param player the player.
+ */
+void
+add_connected_player(dbref player)
+{
+  trie_add(Name(player), player);
+}
+
+/** Remove a player from the index of connected players.
+ * \param player the player.
+ */
+void
+delete_connected_player(dbref player)
+{
+  char folded[BUFFER_LEN];
+
+  fold_name(Name(player), folded);
+  trie_remove(&trie_root, (unsigned char *) folded, player);
+}
+
+/** Match the partial name of a connected player.
+ * \param match string to match.
+ * \return dbref of a unique connected player whose name partial-matches,
+ * AMBIGUOUS, or NOTHING.
+ */
+dbref
+match_connected_player(const char *match)
+{
+  char folded[BUFFER_LEN];
+  struct plyr_trie *node = &trie_root;
+  unsigned char *s;
+
+  if (!fold_name(match, folded)) {
+    return NOTHING;
+  }
+  for (s = (unsigned char *) folded; *s && node; s++) {
+    for (node = node->child; node && node->c != *s; node = node->sibling)
+      ;
+  }
+  if (!node || !node->count) {
+    return NOTHING;
+  }
+  /* An exact match wins */
+  if (node->player != NOTHING) {
+    return node->player;
+  }
+  if (node->count > 1) {
+    return AMBIGUOUS;
+  }
+  /* Only one name goes through here, and empty nodes are pruned, so
+   * follow the first child to its end. */
+  while (node->player == NOTHING) {
+    node = node->child;
+  }
+  return node->player;
 }
 
 /** Reset all of a player's player list entries (names/aliases).
@@ -260,11 +393,6 @@ void
 reset_player_list(dbref player, const char *name, const char *alias)
 {
   char tbuf[BUFFER_LEN];
-  int status;
-  char *errmsg;
-  sqlite3 *sqldb = get_shared_db();
-
-  init_hft();
 
   if (!name) {
     name = Name(player);
@@ -285,25 +413,65 @@ reset_player_list(dbref player, const char *name, const char *alias)
     }
   }
 
-  status = sqlite3_exec(sqldb, "BEGIN TRANSACTION", NULL, NULL, &errmsg);
-  if (status != SQLITE_OK) {
-    do_rawlog(LT_ERR, "Unable to start players replace transaction: %s",
-              errmsg);
-    sqlite3_free(errmsg);
-    return;
-  }
-
   /* Delete all the old stuff */
   delete_player(player);
   /* Add in the new stuff */
-  add_player_name(sqldb, name, player);
-  add_player_alias(player, tbuf, 1);
-
-  status = sqlite3_exec(sqldb, "COMMIT TRANSACTION", NULL, NULL, &errmsg);
-  if (status != SQLITE_OK) {
-    do_rawlog(LT_ERR, "Unable to commit players replace transaction: %s",
-              errmsg);
-    sqlite3_free(errmsg);
-    sqlite3_exec(sqldb, "ROLLBACK TRANSACTION", NULL, NULL, NULL);
+  add_player_name(name, player);
+  add_player_alias(player, tbuf);
+
+  /* The player still has their old name here */
+  if (Connected(player)) {
+    delete_connected_player(player);
+    trie_add(name, player);
   }
 }
+
+TEST_GROUP(plyrlist)
+{
+  dbref p1 = 1000000, p2 = 1000001, p3 = 1000002;
+  IHASHTAB save_table = plyr_table;
+  struct plyr_trie save_trie = trie_root;
+
+  /* Work on empty tables of our own, not the game's */
+  ihash_init(&plyr_table, 0);
+  trie_root.child = NULL;
+  trie_root.count = 0;
+
+  add_player_name("TestPlayer", p1);
+  add_player_alias(p1, "TP;Tester");
+  add_player_name("testplayer2", p2);
+  TEST("plyrlist.lookup.1", lookup_player_name("testplayer") == p1);
+  TEST("plyrlist.lookup.2", lookup_player_name("tEsTeR") == p1);
+  TEST("plyrlist.lookup.3", lookup_player_name("TESTPLAYER2") == p2);
+  TEST("plyrlist.lookup.4", lookup_player_name("TestPlay") == NOTHING);
+  /* Names are unique */
+  add_player_name("TP", p2);
+  TEST("plyrlist.unique", lookup_player_name("tp") == p1);
+  delete_player(p1);
+  TEST("plyrlist.delete.1", lookup_player_name("TestPlayer") == NOTHING &&
+                              lookup_player_name("TP") == NOTHING);
+  TEST("plyrlist.delete.2", lookup_player_name("TestPlayer2") == p2);
+  delete_player(p2);
+
+  trie_add("TestPlayer", p1);
+  trie_add("TestPlayer", p1);
+  trie_add("TestPlayer2", p2);
+  trie_add("Other", p3);
+  TEST("plyrlist.partial.1", match_connected_player("test") == AMBIGUOUS);
+  TEST("plyrlist.partial.2", match_connected_player("testplayer") == p1);
+  TEST("plyrlist.partial.3", match_connected_player("TestPlayer2") == p2);
+  TEST("plyrlist.partial.4", match_connected_player("o") == p3);
+  TEST("plyrlist.partial.5", match_connected_player("x") == NOTHING);
+  TEST("plyrlist.partial.6", match_connected_player("TestPlayer23") == NOTHING);
+  TEST("plyrlist.partial.7",
+       trie_remove(&trie_root, (const unsigned char *) "testplayer", p1));
+  TEST("plyrlist.partial.8", match_connected_player("test") == p2);
+  trie_remove(&trie_root, (const unsigned char *) "testplayer2", p2);
+  trie_remove(&trie_root, (const unsigned char *) "other", p3);
+  TEST("plyrlist.partial.9", trie_root.count == 0 && !trie_root.child);
+
+  trie_free(trie_root.child);
+  ihash_flush(&plyr_table);
+  plyr_table = save_table;
+  trie_root = save_trie;
+}
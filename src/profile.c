@@ -0,0 +1,598 @@
+/**
+ * \file profile.c
+ *
+ * \brief Sampling profiler for softcode.
+ *
+ * While profile_softcode is on, the server keeps a calling-context tree
+ * of what softcode is running. Each queue entry, ufun-style attribute
+ * evaluation and function call pushes a node that is a child of the
+ * current one and counts a call there. A virtual interval timer fires
+ * about once per millisecond of CPU time; its signal handler only bumps
+ * a counter, and the pending ticks are credited to the current node the
+ * next time a frame is pushed or popped, so the cost on the hot path is
+ * a short walk of the current node's children.
+ *
+ * @profile lists the most expensive attributes and functions, and
+ * @profile/dump writes the tree as collapsed stacks, one "a;b;c count"
+ * line per context, which flame graph tools read directly.
+ */
+
+#include "copyrite.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <inttypes.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#include <time.h>
+
+#include "conf.h"
+#include "dbdefs.h"
+#include "externs.h"
+#include "htab.h"
+#include "log.h"
+#include "mushdb.h"
+#include "mymalloc.h"
+#include "notify.h"
+#include "parse.h"
+#include "profile.h"
+#include "sig.h"
+#include "strutil.h"
+#include "tests.h"
+
+/** Upper bound on the number of contexts kept. Calls that would need a
+ * new context past this are counted against their caller. */
+#define PROFILE_MAX_NODES 100000
+/** Deepest context tracked. Deeper frames are counted against the
+ * deepest tracked one. */
+#define PROFILE_MAX_DEPTH 256
+/** Microseconds of CPU time between samples */
+#define PROFILE_INTERVAL 1000
+/** Number of entries listed by a plain @profile */
+#define PROFILE_DEFAULT_LINES 20
+
+/** What a profile context stands for */
+enum prof_kind {
+  PROF_ROOT,     /**< Server time outside of any softcode */
+  PROF_ATTR,     /**< An attribute, or a queue entry with no attribute */
+  PROF_FUNCTION, /**< A built-in or @function */
+};
+
+/** A node in the calling-context tree. */
+struct prof_node {
+  const char *name;         /**< Function or attribute name */
+  const char *key;          /**< Name pointer a function was pushed with */
+  dbref thing;              /**< Object the attribute is on, or NOTHING */
+  enum prof_kind kind;      /**< What this context is */
+  struct prof_node *parent; /**< Caller's context */
+  struct prof_node *child;  /**< First callee, most recently used first */
+  struct prof_node *sibling; /**< Next callee of the same caller */
+  uint64_t calls;           /**< Times this context was entered */
+  uint64_t samples;         /**< Timer ticks while this was innermost */
+  uint64_t total;           /**< Ticks including callees, for reports */
+};
+
+static struct prof_node prof_root = {"(server)", NULL, NOTHING, PROF_ROOT,
+                                     NULL,       NULL, NULL,    0,
+                                     0,          0};
+static struct prof_node *prof_current = &prof_root;
+static struct prof_node *prof_stack[PROFILE_MAX_DEPTH];
+static int prof_depth = 0;    /**< Frames on prof_stack */
+static int prof_overflow = 0; /**< Frames pushed past PROFILE_MAX_DEPTH */
+static int prof_nodes = 0;    /**< Contexts in the tree */
+static uint64_t prof_dropped = 0; /**< Calls not given their own context */
+static bool prof_reset_pending = false;
+static bool prof_running = false;
+static time_t prof_since = 0;
+static slab *prof_slab = NULL;
+static volatile sig_atomic_t prof_ticks = 0;
+
+#ifdef HAVE_SETITIMER
+/** Handler for the profiling timer. Just count the tick.
+ * \param signo unused.
+ */
+static void
+profile_tick(int signo)
+{
+  prof_ticks += 1;
+  reload_sig_handler(signo, profile_tick);
+}
+#endif
+
+/** Start the sampling timer the first time anything is profiled. */
+static void
+profile_start(void)
+{
+#ifdef HAVE_SETITIMER
+  struct itimerval every;
+
+  install_sig_handler(SIGVTALRM, profile_tick);
+  every.it_interval.tv_sec = 0;
+  every.it_interval.tv_usec = PROFILE_INTERVAL;
+  every.it_value = every.it_interval;
+  if (setitimer(ITIMER_VIRTUAL, &every, NULL) < 0) {
+    penn_perror("setitimer");
+  }
+#endif
+  if (!prof_since) {
+    prof_since = mudtime;
+  }
+  prof_running = true;
+}
+
+/** Stop the sampling timer. Called before a reboot, since itimers
+ * survive exec().
+ */
+void
+profile_stop(void)
+{
+#ifdef HAVE_SETITIMER
+  struct itimerval never;
+
+  if (prof_running) {
+    memset(&never, 0, sizeof never);
+    setitimer(ITIMER_VIRTUAL, &never, NULL);
+  }
+  ignore_signal(SIGVTALRM);
+#endif
+  prof_running = false;
+}
+
+/** Give the ticks since the last push or pop to the current context. */
+static inline void
+profile_credit(void)
+{
+  if (prof_ticks > 0) {
+    prof_current->samples += prof_ticks;
+    prof_ticks = 0;
+  }
+}
+
+static void
+profile_free_children(struct prof_node *n)
+{
+  struct prof_node *c, *next;
+
+  for (c = n->child; c; c = next) {
+    next = c->sibling;
+    profile_free_children(c);
+    mush_free((char *) c->name, "profile.name");
+    slab_free(prof_slab, c);
+  }
+  n->child = NULL;
+}
+
+/** Throw away everything collected so far. Only safe when no frames
+ * are active. */
+static void
+profile_clear(void)
+{
+  profile_free_children(&prof_root);
+  prof_root.calls = prof_root.samples = 0;
+  prof_ticks = 0;
+  prof_nodes = 0;
+  prof_dropped = 0;
+  prof_reset_pending = false;
+  prof_since = mudtime;
+}
+
+/** Find or add a callee of the current context, moving it to the front
+ * of its siblings so loops calling the same few things find them fast.
+ * Functions are pushed with the name from their function table entry,
+ * which doesn't move, so they're told apart by pointer.
+ * \return the callee, or NULL if there's no room for a new one.
+ */
+static struct prof_node *
+profile_child(enum prof_kind kind, dbref thing, const char *name)
+{
+  struct prof_node *n, *prev = NULL;
+
+  for (n = prof_current->child; n; prev = n, n = n->sibling) {
+    if (n->kind == kind && n->thing == thing &&
+        (kind == PROF_FUNCTION ? n->key == name
+                               : strcmp(n->name, name) == 0)) {
+      if (prev) {
+        prev->sibling = n->sibling;
+        n->sibling = prof_current->child;
+        prof_current->child = n;
+      }
+      return n;
+    }
+  }
+
+  if (prof_nodes >= PROFILE_MAX_NODES) {
+    return NULL;
+  }
+  if (!prof_slab) {
+    prof_slab = slab_create("profile nodes", sizeof(struct prof_node));
+  }
+  n = slab_malloc(prof_slab, prof_current);
+  n->name = mush_strdup(name, "profile.name");
+  n->key = name;
+  n->thing = thing;
+  n->kind = kind;
+  n->parent = prof_current;
+  n->child = NULL;
+  n->sibling = prof_current->child;
+  n->calls = n->samples = n->total = 0;
+  prof_current->child = n;
+  prof_nodes += 1;
+  return n;
+}
+
+static void
+profile_push(enum prof_kind kind, dbref thing, const char *name)
+{
+  struct prof_node *n;
+
+  if (!prof_running) {
+    profile_start();
+  }
+  if (prof_depth >= PROFILE_MAX_DEPTH) {
+    prof_overflow += 1;
+    return;
+  }
+  profile_credit();
+  prof_stack[prof_depth++] = prof_current;
+  n = profile_child(kind, thing, name);
+  if (n) {
+    n->calls += 1;
+    prof_current = n;
+  } else {
+    prof_dropped += 1;
+  }
+}
+
+/** Enter a function call.
+ * \param name the function's name, as stored in its FUN.
+ */
+void
+profile_push_function(const char *name)
+{
+  profile_push(PROF_FUNCTION, NOTHING, name);
+}
+
+/** Enter an attribute evaluation.
+ * \param thing the object the attribute is on.
+ * \param attr the attribute name, or an empty string for a lambda.
+ */
+void
+profile_push_attr(dbref thing, const char *attr)
+{
+  if (*attr) {
+    profile_push(PROF_ATTR, thing, attr);
+  } else {
+    profile_push(PROF_ATTR, NOTHING, "#lambda");
+  }
+}
+
+/** Enter a queue entry.
+ * \param attrname the "#dbref/ATTR" the entry came from, or NULL for
+ * commands with no attribute behind them.
+ */
+void
+profile_push_attrname(const char *attrname)
+{
+  char *slash;
+  dbref thing;
+
+  if (attrname && *attrname == '#') {
+    thing = strtol(attrname + 1, &slash, 10);
+    if (slash != attrname + 1 && *slash == '/') {
+      profile_push(PROF_ATTR, thing, slash + 1);
+      return;
+    }
+  }
+  profile_push(PROF_ATTR, NOTHING, "(command)");
+}
+
+/** Leave the innermost function call, attribute or queue entry. */
+void
+profile_pop(void)
+{
+  if (prof_overflow) {
+    prof_overflow -= 1;
+    return;
+  }
+  if (!prof_depth) {
+    return;
+  }
+  profile_credit();
+  prof_current = prof_stack[--prof_depth];
+  if (!prof_depth && prof_reset_pending) {
+    profile_clear();
+  }
+}
+
+/** Write a context's label.
+ * \param n the context.
+ * \param buff buffer of at least BUFFER_LEN bytes.
+ * \param bp pointer into buff.
+ */
+static void
+profile_label(const struct prof_node *n, char *buff, char **bp)
+{
+  switch (n->kind) {
+  case PROF_ROOT:
+    safe_str(n->name, buff, bp);
+    break;
+  case PROF_ATTR:
+    if (GoodObject(n->thing)) {
+      safe_dbref(n->thing, buff, bp);
+      safe_chr('/', buff, bp);
+    }
+    safe_str(n->name, buff, bp);
+    break;
+  case PROF_FUNCTION:
+    safe_str(n->name, buff, bp);
+    safe_strl("()", 2, buff, bp);
+    break;
+  }
+}
+
+/** Fill in the total field of a context and everything under it. */
+static uint64_t
+profile_totals(struct prof_node *n)
+{
+  struct prof_node *c;
+
+  n->total = n->samples;
+  for (c = n->child; c; c = c->sibling) {
+    n->total += profile_totals(c);
+  }
+  return n->total;
+}
+
+/** One line of the @profile report. */
+struct prof_entry {
+  char *label;     /**< Attribute or function */
+  uint64_t calls;   /**< Calls in every context */
+  uint64_t samples; /**< Ticks spent in it, not counting callees */
+  uint64_t total;   /**< Ticks spent in it, counting callees */
+};
+
+static void
+profile_entry_free(void *data)
+{
+  struct prof_entry *e = data;
+
+  mush_free(e->label, "profile.label");
+  mush_free(e, "profile.entry");
+}
+
+/** Does a context have a caller with the same label? */
+static bool
+profile_recursive(const struct prof_node *n)
+{
+  const struct prof_node *p;
+
+  for (p = n->parent; p; p = p->parent) {
+    if (p->kind == n->kind && p->thing == n->thing &&
+        strcmp(p->name, n->name) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/** Merge a context and everything under it into the per-label totals. */
+static void
+profile_merge(struct prof_node *n, HASHTAB *tab)
+{
+  char label[BUFFER_LEN], *lp = label;
+  struct prof_entry *e;
+  struct prof_node *c;
+
+  profile_label(n, label, &lp);
+  *lp = '\0';
+  e = hash_value(tab, label);
+  if (!e) {
+    e = mush_malloc(sizeof *e, "profile.entry");
+    e->label = mush_strdup(label, "profile.label");
+    e->calls = e->samples = e->total = 0;
+    hash_add(tab, label, e);
+  }
+  e->calls += n->calls;
+  e->samples += n->samples;
+  /* Time in a recursive call is already in the outer call's total, and
+   * (server) is just the time spent outside of softcode. */
+  if (n->kind == PROF_ROOT) {
+    e->total += n->samples;
+  } else if (!profile_recursive(n)) {
+    e->total += n->total;
+  }
+  for (c = n->child; c; c = c->sibling) {
+    profile_merge(c, tab);
+  }
+}
+
+static int
+profile_entry_cmp(const void *a, const void *b)
+{
+  const struct prof_entry *ea = *(const struct prof_entry *const *) a;
+  const struct prof_entry *eb = *(const struct prof_entry *const *) b;
+
+  if (ea->total != eb->total) {
+    return ea->total < eb->total ? 1 : -1;
+  }
+  if (ea->samples != eb->samples) {
+    return ea->samples < eb->samples ? 1 : -1;
+  }
+  if (ea->calls != eb->calls) {
+    return ea->calls < eb->calls ? 1 : -1;
+  }
+  return strcmp(ea->label, eb->label);
+}
+
+/** Write one collapsed stack line per context that has samples.
+ * \return the number of lines written.
+ */
+static int
+profile_write(FILE *f, const struct prof_node *n)
+{
+  const struct prof_node *path[PROFILE_MAX_DEPTH + 1];
+  const struct prof_node *c;
+  int lines = 0;
+
+  if (n->samples) {
+    char label[BUFFER_LEN], *lp;
+    int depth = 0, i;
+
+    if (n == &prof_root) {
+      path[depth++] = n;
+    } else {
+      /* Everything is under the root, so it's left out of other stacks */
+      for (c = n; c->parent; c = c->parent) {
+        path[depth++] = c;
+      }
+    }
+    for (i = depth - 1; i >= 0; i -= 1) {
+      char *s;
+
+      lp = label;
+      profile_label(path[i], label, &lp);
+      *lp = '\0';
+      /* ';' separates frames, and the count follows the last space */
+      for (s = label; *s; s++) {
+        if (*s == ';') {
+          *s = ':';
+        } else if (*s == ' ') {
+          *s = '_';
+        }
+      }
+      fputs(label, f);
+      fputc(i ? ';' : ' ', f);
+    }
+    fprintf(f, "%" PRIu64 "\n", n->samples);
+    lines = 1;
+  }
+  for (c = n->child; c; c = c->sibling) {
+    lines += profile_write(f, c);
+  }
+  return lines;
+}
+
+/** The @profile command.
+ * \param player the enactor.
+ * \param arg how many entries to list.
+ * \param reset true to throw away the data collected so far.
+ * \param dump true to write the data to profile_file.
+ */
+void
+do_profile(dbref player, const char *arg, bool reset, bool dump)
+{
+  HASHTAB tab;
+  struct prof_entry **entries, *e;
+  uint64_t total;
+  int count = 0, lines, i;
+
+  if (!Wizard(player)) {
+    notify(player, T("Permission denied."));
+    return;
+  }
+
+  profile_credit();
+
+  if (reset) {
+    /* Frames for this very command are still on the stack */
+    if (prof_depth) {
+      prof_reset_pending = true;
+    } else {
+      profile_clear();
+    }
+    notify(player, T("Profile data cleared."));
+    return;
+  }
+
+  if (dump) {
+    FILE *f;
+
+    if (!*PROFILE_FILE) {
+      notify(player, T("No profile_file is configured."));
+      return;
+    }
+    f = fopen(PROFILE_FILE, FOPEN_WRITE);
+    if (!f) {
+      notify_format(player, T("Unable to open %s."), PROFILE_FILE);
+      return;
+    }
+    lines = profile_write(f, &prof_root);
+    fclose(f);
+    notify_format(player, T("Wrote %d stacks to %s."), lines, PROFILE_FILE);
+    return;
+  }
+
+  lines = PROFILE_DEFAULT_LINES;
+  if (arg && *arg) {
+    if (!is_strict_integer(arg) || (lines = parse_integer(arg)) < 1) {
+      notify(player, T("How many lines?"));
+      return;
+    }
+  }
+
+  total = profile_totals(&prof_root);
+  hash_init(&tab, 256, profile_entry_free);
+  profile_merge(&prof_root, &tab);
+  entries = mush_calloc(tab.entries, sizeof *entries, "profile.entries");
+  for (e = hash_firstentry(&tab); e; e = hash_nextentry(&tab)) {
+    entries[count++] = e;
+  }
+  qsort(entries, count, sizeof *entries, profile_entry_cmp);
+
+  if (!PROFILE_SOFTCODE) {
+    notify(player, T("The softcode profiler is turned off."));
+  }
+  notify_format(player,
+                T("%" PRIu64 " samples in %d contexts since %s."), total,
+                prof_nodes, prof_since ? show_time(prof_since, 0) : "startup");
+  if (prof_dropped) {
+    notify_format(player,
+                  T("%" PRIu64 " calls were past the context limit."),
+                  prof_dropped);
+  }
+  notify(player, T("Total%   Self%         Calls  Where"));
+  for (i = 0; i < count && i < lines; i += 1) {
+    e = entries[i];
+    notify_format(player, "%5.1f%%  %5.1f%%  %12" PRIu64 "  %s",
+                  total ? 100.0 * e->total / total : 0.0,
+                  total ? 100.0 * e->samples / total : 0.0, e->calls,
+                  e->label);
+  }
+  mush_free(entries, "profile.entries");
+  hash_flush(&tab, 0);
+}
+
+TEST_GROUP(profile)
+{
+  struct prof_node *a, *f;
+  int depth = prof_depth;
+  const char *add = "TEST_ADD";
+
+  profile_push_attrname("#1/TEST_PROFILE");
+  a = prof_current;
+  TEST("profile.attrname", a->kind == PROF_ATTR && a->thing == 1 &&
+                             strcmp(a->name, "TEST_PROFILE") == 0);
+  profile_push_function(add);
+  f = prof_current;
+  profile_pop();
+  profile_push_function("TEST_SUB");
+  profile_pop();
+  profile_push_function(add);
+  TEST("profile.reuse", prof_current == f && f->calls == 2);
+  profile_pop();
+  TEST("profile.mru", a->child == f && f->sibling &&
+                        strcmp(f->sibling->name, "TEST_SUB") == 0);
+  profile_pop();
+  TEST("profile.pop", prof_depth == depth && prof_current == a->parent);
+  profile_push_attrname(NULL);
+  TEST("profile.command", strcmp(prof_current->name, "(command)") == 0);
+  profile_pop();
+  profile_push_attr(5, "");
+  TEST("profile.lambda", prof_current->thing == NOTHING &&
+                           strcmp(prof_current->name, "#lambda") == 0);
+  profile_pop();
+  TEST("profile.balanced", prof_depth == depth);
+}
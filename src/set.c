@@ -518,6 +518,8 @@ af_helper(dbref player, dbref thing, dbref parent __attribute__((__unused__)),
     return 0;
   }
 
+  cmd_index_invalidate(thing);
+
   /* Clear flags first, then set flags */
   if (af->clrf) {
     AL_FLAGS(atr) &= ~af->clrf;
@@ -554,6 +556,7 @@ copy_attrib_flags(dbref player, dbref target, ATTR *atr, int flags)
   else
     flags &= ~AF_ROOT;
   AL_FLAGS(atr) = flags;
+  cmd_index_invalidate(target);
 }
 
 /** Set a flag on an attribute.
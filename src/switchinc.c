@@ -1,6 +1,6 @@
 /* AUTOGENERATED FILE. DO NOT EDIT! */
-static const int max_switch = 193;
-SWITCH_VALUE switch_list[194] = {
+static const int max_switch = 196;
+SWITCH_VALUE switch_list[197] = {
   {"ACCESS", SWITCH_ACCESS, 0},
   {"ADD", SWITCH_ADD, 0},
   {"AFTER", SWITCH_AFTER, 0},
@@ -24,6 +24,7 @@ SWITCH_VALUE switch_list[194] = {
   {"COLNAMES", SWITCH_COLNAMES, 0},
   {"COMBINE", SWITCH_COMBINE, 0},
   {"COMMANDS", SWITCH_COMMANDS, 0},
+  {"COMPRESSION", SWITCH_COMPRESSION, 0},
   {"CONN", SWITCH_CONN, 0},
   {"CONNECT", SWITCH_CONNECT, 0},
   {"CONNECTED", SWITCH_CONNECTED, 0},
@@ -41,6 +42,7 @@ SWITCH_VALUE switch_list[194] = {
   {"DISABLE", SWITCH_DISABLE, 0},
   {"DOWN", SWITCH_DOWN, 0},
   {"DSTATS", SWITCH_DSTATS, 0},
+  {"DUMP", SWITCH_DUMP, 0},
   {"EMIT", SWITCH_EMIT, 0},
   {"ENABLE", SWITCH_ENABLE, 0},
   {"ENUM", SWITCH_ENUM, 0},
@@ -140,6 +142,7 @@ SWITCH_VALUE switch_list[194] = {
   {"REMIT", SWITCH_REMIT, 0},
   {"REMOVE", SWITCH_REMOVE, 0},
   {"RENAME", SWITCH_RENAME, 0},
+  {"RESET", SWITCH_RESET, 0},
   {"RESTART", SWITCH_RESTART, 0},
   {"RESTORE", SWITCH_RESTORE, 0},
   {"RESTRICT", SWITCH_RESTRICT, 0},
@@ -211,7 +211,7 @@ dbsave_warn_event(void *data)
   struct dbsave_warn_data *when = data;
 
   queue_event(SYSEVENT, when->event, "%s,%d", when->msg, NO_FORK ? 0 : 1);
-  if (NO_FORK && *(when->msg))
+  if (NO_FORK && !INCREMENTAL_DUMP && *(when->msg))
     flag_broadcast(0, 0, "%s", when->msg);
   return false;
 }
@@ -385,9 +385,89 @@ reset_cpu_timer(void)
 }
 
 /** System queue stuff. Timed events like dbcks and purges are handled
- *  through this system. */
+ *  through this system. Pending events are kept in a binary min-heap
+ *  ordered by when they run, so adding and cancelling events doesn't
+ *  mean walking all the others. */
+
+static struct squeue **sq_heap = NULL; /**< The heap of pending events */
+static size_t sq_count = 0;            /**< Number of pending events */
+static size_t sq_size = 0;             /**< Space allocated in sq_heap */
+static uint64_t sq_seq = 0;            /**< Counter for squeue.seq */
+
+/** slot of an event that isn't in the heap */
+#define SQ_NOT_QUEUED SIZE_MAX
+
+/** Does a run before b? Events due at the same time run in the order
+ * they were added. */
+static inline bool
+sq_before(const struct squeue *a, const struct squeue *b)
+{
+  return a->when < b->when || (a->when == b->when && a->seq < b->seq);
+}
+
+static inline void
+sq_place(struct squeue *sq, size_t slot)
+{
+  sq_heap[slot] = sq;
+  sq->slot = slot;
+}
+
+/** Move an event towards the top of the heap until it's in order. */
+static void
+sq_sift_up(size_t slot)
+{
+  struct squeue *sq = sq_heap[slot];
+
+  while (slot > 0) {
+    size_t parent = (slot - 1) / 2;
+
+    if (!sq_before(sq, sq_heap[parent]))
+      break;
+    sq_place(sq_heap[parent], slot);
+    slot = parent;
+  }
+  sq_place(sq, slot);
+}
+
+/** Move an event towards the bottom of the heap until it's in order. */
+static void
+sq_sift_down(size_t slot)
+{
+  struct squeue *sq = sq_heap[slot];
+
+  while (1) {
+    size_t child = slot * 2 + 1;
+
+    if (child >= sq_count)
+      break;
+    if (child + 1 < sq_count && sq_before(sq_heap[child + 1], sq_heap[child]))
+      child += 1;
+    if (!sq_before(sq_heap[child], sq))
+      break;
+    sq_place(sq_heap[child], slot);
+    slot = child;
+  }
+  sq_place(sq, slot);
+}
 
-struct squeue *sq_head = NULL;
+/** Take an event out of the heap.
+ * \param sq the event.
+ */
+static void
+sq_unlink(struct squeue *sq)
+{
+  size_t slot = sq->slot;
+
+  sq->slot = SQ_NOT_QUEUED;
+  sq_count -= 1;
+  if (slot == sq_count)
+    return;
+  sq_place(sq_heap[sq_count], slot);
+  if (slot > 0 && sq_before(sq_heap[slot], sq_heap[(slot - 1) / 2]))
+    sq_sift_up(slot);
+  else
+    sq_sift_down(slot);
+}
 
 /** Register a callback function to be executed at a certain time.
  * \param w when to run the event
@@ -410,24 +490,14 @@ sq_register(uint64_t w, sq_func f, void *d, const char *ev)
     sq->event = strupper_a(ev, "squeue.event");
   else
     sq->event = NULL;
-  sq->next = NULL;
+  sq->seq = sq_seq++;
 
-  if (!sq_head)
-    sq_head = sq;
-  else if (sq_head->when > sq->when) {
-    sq->next = sq_head;
-    sq_head = sq;
-  } else {
-    struct squeue *c, *prev = NULL;
-    for (prev = sq_head, c = sq_head->next; c; prev = c, c = c->next) {
-      if (c->when > sq->when) {
-        sq->next = c;
-        prev->next = sq;
-        return sq;
-      }
-    }
-    prev->next = sq;
+  if (sq_count == sq_size) {
+    sq_size = sq_size ? sq_size * 2 : 64;
+    sq_heap = mush_realloc(sq_heap, sq_size * sizeof *sq_heap, "squeue.heap");
   }
+  sq_heap[sq_count] = sq;
+  sq_sift_up(sq_count++);
 
   return sq;
 }
@@ -438,25 +508,14 @@ sq_register(uint64_t w, sq_func f, void *d, const char *ev)
 void
 sq_cancel(struct squeue *sq)
 {
-  struct squeue *tmp, *prev = NULL;
-
-  if (!sq)
+  /* An event that's running is freed when it's done. */
+  if (!sq || sq->slot == SQ_NOT_QUEUED)
     return;
 
-  /* Remove from list */
-  for (tmp = sq_head; tmp; tmp = tmp->next) {
-    if (tmp == sq) {
-      if (prev)
-        prev->next = tmp->next;
-      else
-        sq_head = tmp->next;
-      if (sq->event)
-        mush_free(sq->event, "squeue.event");
-      mush_free(sq, "squeue.node");
-      return;
-    }
-    prev = tmp;
-  }
+  sq_unlink(sq);
+  if (sq->event)
+    mush_free(sq->event, "squeue.event");
+  mush_free(sq, "squeue.node");
 }
 
 /** Register a callback function to be executed in N miliseconds.
@@ -525,10 +584,10 @@ sq_run_one(void)
   struct squeue *torun;
   bool r;
 
-  if (sq_head) {
-    if (sq_head->when <= now) {
-      torun = sq_head;
-      sq_head = torun->next;
+  if (sq_count) {
+    if (sq_heap[0]->when <= now) {
+      torun = sq_heap[0];
+      sq_unlink(torun);
 
       r = torun->fun(torun->data);
       if (torun->event) {
@@ -563,8 +622,8 @@ uint64_t
 sq_msecs_till_next(void)
 {
   uint64_t now = now_msecs();
-  if (sq_head) {
-    return sq_head->when - now;
+  if (sq_count) {
+    return sq_heap[0]->when > now ? sq_heap[0]->when - now : 0;
   }
   return 500;
 }
@@ -51,6 +51,7 @@
 #include "mushdb.h"
 #include "mymalloc.h"
 #include "parse.h"
+#include "profile.h"
 #include "strutil.h"
 #include "pcg_basic.h"
 
@@ -160,6 +161,7 @@ fetch_ufun_attrib(const char *attrstring, dbref executor, ufun_attrib *ufun,
   ufun->thing = executor;
   ufun->pe_flags = PE_UDEFAULT;
   ufun->ufun_flags = flags;
+  ufun->data = NULL_CHUNK_REFERENCE;
 
   ufun->thing = executor;
   thingname = NULL;
@@ -266,8 +268,9 @@ fetch_ufun_attrib(const char *attrstring, dbref executor, ufun_attrib *ufun,
   }
 
   /* Populate the ufun object */
-  mush_strncpy(ufun->contents, atr_value(attrib), BUFFER_LEN);
+  mush_strncpy(ufun->contents, atr_value_const(attrib), BUFFER_LEN);
   mush_strncpy(ufun->attrname, AL_NAME(attrib), ATTRIBUTE_NAME_LIMIT + 1);
+  ufun->data = attrib->data;
 
   /* We're good */
   return 1;
@@ -297,12 +300,12 @@ call_ufun_int(ufun_attrib *ufun, char *ret, dbref caller, dbref enactor,
   char rbuff[BUFFER_LEN + 40];
   char *rp, *np = NULL;
   int pe_ret;
-  char const *ap;
   char *old_attr = NULL;
   int made_pe_info = 0;
   PE_REGS *pe_regs;
   PE_REGS *pe_regs_old;
   int pe_reg_flags = 0;
+  bool profiled;
 
   /* Make sure we have a ufun first */
   if (!ufun)
@@ -359,9 +362,15 @@ call_ufun_int(ufun_attrib *ufun, char *ret, dbref caller, dbref enactor,
   }
 
   /* And now, make the call! =) */
-  ap = ufun->contents;
-  pe_ret = process_expression(ret, &rp, &ap, ufun->thing, caller, enactor,
-                              ufun->pe_flags, PT_DEFAULT, pe_info);
+  profiled = PROFILE_SOFTCODE;
+  if (profiled) {
+    profile_push_attr(ufun->thing, ufun->attrname);
+  }
+  pe_ret = process_compiled(ret, &rp, ufun->contents, ufun->data, ufun->thing,
+                            caller, enactor, ufun->pe_flags, pe_info);
+  if (profiled) {
+    profile_pop();
+  }
   *rp = '\0';
 
   if ((ufun->ufun_flags & UFUN_NAME) && np == rp) {
@@ -10,7 +10,11 @@
 #include "config.h"
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
 #include <openssl/sha.h>
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
 #include "conf.h"
 #include "externs.h"
 #include "log.h"
@@ -22,6 +26,7 @@
 #include "mymalloc.h"
 #include "connlog.h"
 #include "websock.h"
+#include "tests.h"
 
 /* Length of 16 bytes, Base64 encoded (with padding). */
 #define WEBSOCKET_KEY_LEN 24
@@ -49,6 +54,38 @@ enum WebSocketOp {
   /* 0xB - 0xF reserved for control frames */
 };
 
+/* First frame of a compressed message (RFC 7692). */
+#define WS_RSV1 0x40
+
+#ifdef HAVE_LIBZ
+/* Window size for compressed messages. Also bounds the memory used by a
+ * connection's compressor when context takeover is on. */
+#define WS_DEFLATE_WINDOW_BITS 12
+#define WS_DEFLATE_MEM_LEVEL 5
+
+/* Messages shorter than this aren't worth compressing. */
+#define WS_DEFLATE_MIN 64
+
+/* permessage-deflate state for one connection. */
+struct ws_deflate {
+  z_stream out;   /* Compressor kept between messages */
+  bool takeover;  /* True if out is in use */
+  char *in;       /* Compressed message being received */
+  int inlen;      /* Bytes in in */
+  bool truncated; /* The message being received is too long */
+};
+
+/* Shared by connections without context takeover; reset after each
+ * message. */
+static z_stream shared_deflate, shared_inflate;
+static bool shared_deflate_ready = 0, shared_inflate_ready = 0;
+
+static struct {
+  uint64_t plain_out, zipped_out; /* Compressed messages sent */
+  uint64_t plain_in, zipped_in;   /* Compressed messages received */
+} ws_counts;
+#endif
+
 /* Base64 encoder. PennMUSH's version uses the heavyweight OpenSSL API. */
 static void
 encode64(char *dst, const char *src, size_t srclen)
@@ -109,6 +146,240 @@ compute_websocket_accept(char *dst, const char *key)
   encode64(dst, hash, sizeof(hash));
 }
 
+#ifdef HAVE_LIBZ
+/* RFC 7692, section 7.1: look through a Sec-WebSocket-Extensions header
+ * for a permessage-deflate offer we can accept. Sets *takeover to false if
+ * the client asked for server_no_context_takeover. */
+static bool
+accept_deflate_offer(const char *value, bool *takeover)
+{
+  char buf[BUFFER_LEN];
+  char *offers, *offer;
+
+  mush_strncpy(buf, value, sizeof buf);
+  offers = buf;
+  while ((offer = split_token(&offers, ','))) {
+    char *param;
+    bool ok = 1, no_takeover = 0;
+
+    param = trim_space_sep(split_token(&offer, ';'), ' ');
+    if (strcasecmp(param, "permessage-deflate"))
+      continue;
+    while (ok && (param = split_token(&offer, ';'))) {
+      char *val = strchr(param, '=');
+
+      if (val) {
+        *val++ = '\0';
+        val = trim_space_sep(val, ' ');
+        if (*val == '"')
+          val++;
+      }
+      param = trim_space_sep(param, ' ');
+      if (!strcasecmp(param, "server_no_context_takeover")) {
+        no_takeover = 1;
+      } else if (!strcasecmp(param, "server_max_window_bits")) {
+        /* Only accept limits our compressors already stay within */
+        ok = val && atoi(val) >= WS_DEFLATE_WINDOW_BITS;
+      } else if (strcasecmp(param, "client_no_context_takeover") &&
+                 strcasecmp(param, "client_max_window_bits")) {
+        ok = 0;
+      }
+    }
+    if (ok) {
+      *takeover = !no_takeover;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static struct ws_deflate *
+ws_deflate_state(DESC *d)
+{
+  if (!d->ws_deflate)
+    d->ws_deflate = mush_calloc(1, sizeof *d->ws_deflate, "ws_deflate");
+  return d->ws_deflate;
+}
+
+/* Get the compressor to use for a message to a connection, or NULL if it
+ * didn't negotiate permessage-deflate. */
+static z_stream *
+message_deflater(DESC *d)
+{
+  if (!(d->conn_flags & CONN_WS_DEFLATE))
+    return NULL;
+  if (d->ws_deflate && d->ws_deflate->takeover)
+    return &d->ws_deflate->out;
+  if (!shared_deflate_ready) {
+    if (deflateInit2(&shared_deflate, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                     -WS_DEFLATE_WINDOW_BITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+      return NULL;
+    shared_deflate_ready = 1;
+  }
+  return &shared_deflate;
+}
+
+/* Start receiving a compressed message. */
+static void
+inflate_start(DESC *d)
+{
+  struct ws_deflate *ws = ws_deflate_state(d);
+
+  if (!ws->in)
+    ws->in = mush_malloc(BUFFER_LEN + 4, "ws_deflate.in");
+  ws->inlen = 0;
+  ws->truncated = 0;
+}
+
+/* Decompress a complete message and add what was sent on the text channel
+ * to the input at wp. Returns the new end of input. */
+static char *
+inflate_message(DESC *d, char *wp, char *const outend)
+{
+  static const char tail[4] = {0, 0, '\xFF', '\xFF'};
+  struct ws_deflate *ws = d->ws_deflate;
+  char buf[BUFFER_LEN];
+  int r, len;
+
+  if (!ws || !ws->in)
+    return wp;
+  if (ws->truncated) {
+    do_rawlog(LT_CONN, "[%d/%s/%s] Compressed websocket message too long.",
+              d->descriptor, d->addr, d->ip);
+    goto done;
+  }
+  if (!shared_inflate_ready) {
+    if (inflateInit2(&shared_inflate, -MAX_WBITS) != Z_OK)
+      goto done;
+    shared_inflate_ready = 1;
+  }
+
+  /* Every message is compressed from scratch (client_no_context_takeover),
+   * ending with a sync flush whose last 4 bytes the client leaves off. */
+  memcpy(ws->in + ws->inlen, tail, sizeof tail);
+  shared_inflate.next_in = (Bytef *) ws->in;
+  shared_inflate.avail_in = ws->inlen + sizeof tail;
+  shared_inflate.next_out = (Bytef *) buf;
+  shared_inflate.avail_out = sizeof buf;
+  r = inflate(&shared_inflate, Z_SYNC_FLUSH);
+  len = sizeof buf - shared_inflate.avail_out;
+  inflateReset(&shared_inflate);
+  if (r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR) {
+    do_rawlog(LT_CONN, "[%d/%s/%s] Invalid compressed websocket message.",
+              d->descriptor, d->addr, d->ip);
+    goto done;
+  }
+  ws_counts.zipped_in += ws->inlen;
+  ws_counts.plain_in += len;
+
+  if (len > 1 && buf[0] == WEBSOCKET_CHANNEL_TEXT) {
+    len -= 1;
+    if (len > outend - wp)
+      len = outend - wp;
+    memcpy(wp, buf + 1, len);
+    wp += len;
+  }
+
+done:
+  mush_free(ws->in, "ws_deflate.in");
+  ws->in = NULL;
+  ws->inlen = 0;
+  return wp;
+}
+#else
+typedef struct z_stream_s z_stream; /* Only pointers, which are NULL */
+#endif /* HAVE_LIBZ */
+
+TEST_GROUP(accept_deflate_offer)
+{
+#ifdef HAVE_LIBZ
+  bool takeover = 0;
+
+  TEST("accept_deflate_offer.1",
+       accept_deflate_offer("permessage-deflate", &takeover) && takeover);
+  TEST("accept_deflate_offer.2",
+       accept_deflate_offer("permessage-deflate; client_max_window_bits",
+                            &takeover) &&
+         takeover);
+  TEST("accept_deflate_offer.3",
+       accept_deflate_offer(
+         "x-webkit-deflate-frame, permessage-deflate; "
+         "server_no_context_takeover; client_no_context_takeover",
+         &takeover) &&
+         !takeover);
+  TEST("accept_deflate_offer.4",
+       !accept_deflate_offer("permessage-deflate; server_max_window_bits=10",
+                             &takeover));
+  TEST("accept_deflate_offer.5",
+       accept_deflate_offer("permessage-deflate; server_max_window_bits=10, "
+                            "permessage-deflate",
+                            &takeover));
+  TEST("accept_deflate_offer.6",
+       accept_deflate_offer("permessage-deflate; server_max_window_bits=\"15\"",
+                            &takeover));
+  TEST("accept_deflate_offer.7",
+       !accept_deflate_offer("permessage-deflate; foo", &takeover));
+  TEST("accept_deflate_offer.8", !accept_deflate_offer("foo, bar", &takeover));
+#endif /* HAVE_LIBZ */
+}
+
+/** Free a connection's permessage-deflate state.
+ * \param d the descriptor.
+ */
+void
+free_websocket_deflate(DESC *d)
+{
+#ifdef HAVE_LIBZ
+  struct ws_deflate *ws = d->ws_deflate;
+
+  if (!ws)
+    return;
+  if (ws->takeover)
+    deflateEnd(&ws->out);
+  if (ws->in)
+    mush_free(ws->in, "ws_deflate.in");
+  mush_free(ws, "ws_deflate");
+  d->ws_deflate = NULL;
+#endif
+}
+
+/** Does a connection compress messages against the ones sent before them?
+ * If so, none of its queued output can be thrown away.
+ * \param d the descriptor.
+ * \return true if it uses permessage-deflate with context takeover.
+ */
+bool
+websocket_deflate_takeover(DESC *d)
+{
+#ifdef HAVE_LIBZ
+  return (d->conn_flags & CONN_WS_DEFLATE) && d->ws_deflate &&
+         d->ws_deflate->takeover;
+#else
+  return 0;
+#endif
+}
+
+/** Show permessage-deflate statistics, for @stats/tables.
+ * \param player the enactor.
+ */
+void
+websocket_stats(dbref player)
+{
+#ifdef HAVE_LIBZ
+  if (ws_counts.plain_out)
+    notify_format(player,
+                  " %" PRIu64 " bytes of websocket messages compressed to "
+                  "%" PRIu64 " (%.1f%%).",
+                  ws_counts.plain_out, ws_counts.zipped_out,
+                  100.0 * ws_counts.zipped_out / ws_counts.plain_out);
+  if (ws_counts.zipped_in)
+    notify_format(player,
+                  " %" PRIu64 " bytes of websocket messages decompressed "
+                  "from %" PRIu64 ".",
+                  ws_counts.plain_in, ws_counts.zipped_in);
+#endif
+}
+
 static void
 abort_handshake(DESC *d)
 {
@@ -122,6 +393,9 @@ abort_handshake(DESC *d)
     RESPONSE_LEN = strlen(RESPONSE);
   }
 
+  d->conn_flags &= ~CONN_WS_DEFLATE;
+  free_websocket_deflate(d);
+
   queue_newwrite(d, RESPONSE, RESPONSE_LEN);
 }
 
@@ -148,6 +422,25 @@ complete_handshake(DESC *d)
   compute_websocket_accept(bp, d->checksum);
   bp += WEBSOCKET_ACCEPT_LEN;
 
+  if (d->conn_flags & CONN_WS_DEFLATE) {
+    /* Client messages are always decompressed from scratch, so they can
+     * share one decompressor. */
+    static const char DEFLATE[] = "\r\nSec-WebSocket-Extensions: "
+                                  "permessage-deflate; "
+                                  "client_no_context_takeover";
+    static const char NO_TAKEOVER[] = "; server_no_context_takeover";
+
+    memcpy(bp, DEFLATE, sizeof DEFLATE - 1);
+    bp += sizeof DEFLATE - 1;
+#ifdef HAVE_LIBZ
+    if (!d->ws_deflate || !d->ws_deflate->takeover)
+#endif
+    {
+      memcpy(bp, NO_TAKEOVER, sizeof NO_TAKEOVER - 1);
+      bp += sizeof NO_TAKEOVER - 1;
+    }
+  }
+
   memcpy(bp, "\r\n\r\n", 4);
   bp += 4;
 
@@ -196,11 +489,14 @@ int
 process_websocket_request(DESC *d, const char *command)
 {
   static const char *const KEY_HEADER = "Sec-WebSocket-Key:";
+  static const char *const EXTENSIONS_HEADER = "Sec-WebSocket-Extensions:";
 
   static size_t KEY_HEADER_LEN = 0;
+  static size_t EXTENSIONS_HEADER_LEN = 0;
 
   if (!KEY_HEADER_LEN) {
     KEY_HEADER_LEN = strlen(KEY_HEADER);
+    EXTENSIONS_HEADER_LEN = strlen(EXTENSIONS_HEADER);
   }
 
   /* TODO: Full implementation should verify entire request. */
@@ -222,20 +518,40 @@ process_websocket_request(DESC *d, const char *command)
     }
   }
 
+#ifdef HAVE_LIBZ
+  if (options.ws_deflate && !(d->conn_flags & CONN_WS_DEFLATE) &&
+      strncasecmp(command, EXTENSIONS_HEADER, EXTENSIONS_HEADER_LEN) == 0) {
+    bool takeover;
+
+    if (accept_deflate_offer(command + EXTENSIONS_HEADER_LEN, &takeover)) {
+      d->conn_flags |= CONN_WS_DEFLATE;
+      if (takeover && options.ws_context_takeover) {
+        struct ws_deflate *ws = ws_deflate_state(d);
+
+        ws->takeover =
+          deflateInit2(&ws->out, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                       -WS_DEFLATE_WINDOW_BITS, WS_DEFLATE_MEM_LEVEL,
+                       Z_DEFAULT_STRATEGY) == Z_OK;
+      }
+    }
+  }
+#endif
+
   return 1;
 }
 
 int
-process_websocket_frame(DESC *d, char *tbuf1, int got)
+process_websocket_frame(DESC *d, char *tbuf1, int got, char *out, int outlen)
 {
   char mask[1 + 4 + 1 + 1];
   unsigned char state, type, first, channel;
   uint64_t len;
   char *wp;
+  char *const outend = out + outlen;
   const char *cp, *end;
   enum WebSocketOp op;
 
-  wp = tbuf1;
+  wp = out;
 
   /* Restore state. */
   memcpy(mask, d->checksum, sizeof(mask));
@@ -257,13 +573,22 @@ process_websocket_frame(DESC *d, char *tbuf1, int got)
       case WS_OP_CONTINUATION:
         /* Continue the previous opcode. */
         /* TODO: Error handling (only data frames can be continued). */
-        first = 0;
+        if (first != 3) {
+          first = 0;
+        }
         op = type & 0x0F;
         break;
 
       case WS_OP_TEXT:
         /* First frame of a new message. */
         first = 1;
+#ifdef HAVE_LIBZ
+        if ((ch & WS_RSV1) && (d->conn_flags & CONN_WS_DEFLATE)) {
+          /* Compressed; decompressed once the whole message is in. */
+          first = 3;
+          inflate_start(d);
+        }
+#endif
         break;
 
       default:
@@ -340,6 +665,11 @@ process_websocket_frame(DESC *d, char *tbuf1, int got)
         state = 4;
 
         /* TODO: Handle end of frame. */
+#ifdef HAVE_LIBZ
+        if (first == 3 && (type & 0x80)) {
+          wp = inflate_message(d, wp, outend);
+        }
+#endif
       }
       break;
 
@@ -348,7 +678,9 @@ process_websocket_frame(DESC *d, char *tbuf1, int got)
       switch (first) {
       case 0:
         /* Continue frame. */
-        *wp++ = ch ^ mask[state];
+        if (wp < outend) {
+          *wp++ = ch ^ mask[state];
+        }
         break;
 
       case 1:
@@ -365,6 +697,21 @@ process_websocket_frame(DESC *d, char *tbuf1, int got)
       case 2:
         /* Ignore channel. */
         break;
+
+#ifdef HAVE_LIBZ
+      case 3:
+        /* Compressed message. */
+        if (d->ws_deflate && d->ws_deflate->in) {
+          struct ws_deflate *ws = d->ws_deflate;
+
+          if (ws->inlen < BUFFER_LEN) {
+            ws->in[ws->inlen++] = ch ^ mask[state];
+          } else {
+            ws->truncated = 1;
+          }
+        }
+        break;
+#endif
       }
 
       if (--len) {
@@ -375,6 +722,11 @@ process_websocket_frame(DESC *d, char *tbuf1, int got)
         state = 4;
 
         /* TODO: Handle end of frame. */
+#ifdef HAVE_LIBZ
+        if (first == 3 && (type & 0x80)) {
+          wp = inflate_message(d, wp, outend);
+        }
+#endif
       }
       break;
     }
@@ -387,12 +739,38 @@ process_websocket_frame(DESC *d, char *tbuf1, int got)
   memcpy(d->checksum, mask, sizeof(mask));
   d->ws_frame_len = len;
 
-  return wp - tbuf1;
+  return wp - out;
+}
+
+static char *
+write_frame_header(char *dst, unsigned char head, size_t len)
+{
+  *dst++ = head;
+
+  if (len < 126) {
+    *dst++ = len;
+  } else if (len < 65536) {
+    *dst++ = 126;
+
+    *dst++ = (len >> 8) & 0xFF;
+    *dst++ = len & 0xFF;
+  } else {
+    /* Probably never going to need this code path for typical BUFFER_LEN. */
+    int ii;
+
+    *dst++ = 127;
+
+    for (ii = 56; ii >= 0; ii -= 8) {
+      *dst++ = (len >> ii) & 0xFF;
+    }
+  }
+
+  return dst;
 }
 
 static char *
 write_message(char *dst, char *const dstend, const char *src,
-              const char *const srcend, char channel)
+              const char *const srcend, char channel, z_stream *z)
 {
   size_t dstlen = dstend - dst;
   size_t srclen = srcend - src;
@@ -416,28 +794,45 @@ write_message(char *dst, char *const dstend, const char *src,
     srclen = dstlen;
   }
 
-  /* Write frame header. */
   op = WS_OP_TEXT;
-  dstlen = 1 + srclen;
-  *dst++ = 0x80 | op;
 
-  if (dstlen < 126) {
-    *dst++ = dstlen;
-  } else if (dstlen < 65536) {
-    *dst++ = 126;
-
-    *dst++ = (dstlen >> 8) & 0xFF;
-    *dst++ = dstlen & 0xFF;
-  } else {
-    /* Probably never going to need this code path for typical BUFFER_LEN. */
-    int ii;
+#ifdef HAVE_LIBZ
+  if (z && 1 + srclen >= WS_DEFLATE_MIN) {
+    /* Compress the channel byte and text into the space after the
+     * largest possible header, then move it into place. */
+    char *zdst = dst + 10;
+    uLong bound = deflateBound(z, 1 + srclen) + 16;
+
+    if (bound <= (uLong) (dstend - zdst)) {
+      unsigned char ch = channel;
+      size_t zlen;
+
+      z->next_in = &ch;
+      z->avail_in = 1;
+      z->next_out = (Bytef *) zdst;
+      z->avail_out = bound;
+      deflate(z, Z_NO_FLUSH);
+      z->next_in = (Bytef *) src;
+      z->avail_in = srclen;
+      deflate(z, Z_SYNC_FLUSH);
+      if (z == &shared_deflate) {
+        deflateReset(z);
+      }
 
-    *dst++ = 127;
+      /* Leave off the 00 00 FF FF that ends the flush. */
+      zlen = (char *) z->next_out - zdst - 4;
+      ws_counts.plain_out += 1 + srclen;
+      ws_counts.zipped_out += zlen;
 
-    for (ii = 56; ii >= 0; ii -= 8) {
-      *dst++ = (dstlen >> ii) & 0xFF;
+      dst = write_frame_header(dst, 0x80 | WS_RSV1 | op, zlen);
+      memmove(dst, zdst, zlen);
+      return dst + zlen;
     }
   }
+#endif
+
+  /* Write frame header. */
+  dst = write_frame_header(dst, 0x80 | op, 1 + srclen);
 
   /* Write frame payload. Note server doesn't mask. */
   if (op == WS_OP_TEXT) {
@@ -451,13 +846,18 @@ write_message(char *dst, char *const dstend, const char *src,
 }
 
 void
-to_websocket_frame(const char **bp, int *np, char channel)
+to_websocket_frame(DESC *d, const char **bp, int *np, char channel)
 {
   /* TODO: Not sure what the largest possible buffer is yet. */
   static char buf[4 * BUFFER_LEN];
 
   char *dst = buf;
   char *const dstend = dst + sizeof(buf);
+#ifdef HAVE_LIBZ
+  z_stream *z = message_deflater(d);
+#else
+  z_stream *z = NULL;
+#endif
 
   if (channel == WEBSOCKET_CHANNEL_AUTO) {
     /* Scan for markup boundaries. */
@@ -478,7 +878,8 @@ to_websocket_frame(const char **bp, int *np, char channel)
         }
 
         if (!suppress && start != end) {
-          dst = write_message(dst, dstend, start, end, WEBSOCKET_CHANNEL_TEXT);
+          dst = write_message(dst, dstend, start, end, WEBSOCKET_CHANNEL_TEXT,
+                              z);
         }
 
         tag = end + 1;
@@ -516,7 +917,7 @@ to_websocket_frame(const char **bp, int *np, char channel)
 
           default:
             /* Unencoded tag. */
-            dst = write_message(dst, dstend, tag, end, channel);
+            dst = write_message(dst, dstend, tag, end, channel, z);
             break;
           }
 
@@ -530,11 +931,12 @@ to_websocket_frame(const char **bp, int *np, char channel)
 
     /* Send tail. */
     if (!suppress && start != end && !tag) {
-      dst = write_message(dst, dstend, start, end, WEBSOCKET_CHANNEL_TEXT);
+      dst = write_message(dst, dstend, start, end, WEBSOCKET_CHANNEL_TEXT,
+                          z);
     }
   } else {
     /* Send entire buffer on specified channel. */
-    dst = write_message(dst, dstend, *bp, *bp + *np, channel);
+    dst = write_message(dst, dstend, *bp, *bp + *np, channel, z);
   }
 
   /* Replace old arguments. */
@@ -26,6 +26,8 @@
 #include "copyrite.h"
 
 #include <ctype.h>
+#include <inttypes.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 
@@ -33,11 +35,14 @@
 #include "case.h"
 #include "conf.h"
 #include "externs.h"
+#include "htab.h"
 #include "memcheck.h"
 #include "mymalloc.h"
 #include "mypcre.h"
+#include "notify.h"
 #include "parse.h"
 #include "strutil.h"
+#include "tests.h"
 
 /** Force a char to be lowercase */
 #define FIXCASE(a) (DOWNCASE(a))
@@ -49,9 +54,279 @@
 pcre2_compile_context *re_compile_ctx = NULL;
 pcre2_match_context *re_match_ctx = NULL;
 pcre2_convert_context *glob_convert_ctx = NULL;
+pcre2_jit_stack *re_jit_stack = NULL;
 uint32_t re_compile_flags = 0;
 uint32_t re_match_flags = 0;
 
+/** Number of compiled regexps kept in the cache */
+#define RE_CACHE_SIZE 256
+
+/** A compiled regular expression in the cache.
+ * Entries are kept in a hash table keyed by compile flags and pattern,
+ * and on a list from most to least recently used. The match data is
+ * lent out with the pattern and taken back when it's returned; if a
+ * pattern is in use more than once at a time, as when regedit()'s
+ * replacement calls regmatch() with the same pattern, the others get
+ * match data of their own. An entry evicted while in use is freed when
+ * the last user puts it back.
+ */
+struct re_cache_entry {
+  char *key;                   /**< Hash key */
+  pcre2_code *re;              /**< The compiled pattern */
+  pcre2_match_data *md;        /**< Match data to lend out, or NULL */
+  size_t size;                 /**< Bytes used by the pattern and JIT code */
+  int users;                   /**< How many callers have it */
+  int uses;                    /**< Times it's been looked up */
+  bool cached;                 /**< Is it still in the cache? */
+  struct re_cache_entry *prev; /**< More recently used entry */
+  struct re_cache_entry *next; /**< Less recently used entry */
+};
+
+static HASHTAB re_cache;
+static struct re_cache_entry *re_cache_mru = NULL, *re_cache_lru = NULL;
+static size_t re_cache_bytes = 0;
+static int re_jit = -1; /**< Is JIT compilation available? -1 if unknown */
+
+/** Regexp cache statistics */
+static struct {
+  uint64_t hits;      /**< Lookups that found a compiled pattern */
+  uint64_t misses;    /**< Lookups that compiled the pattern */
+  uint64_t evictions; /**< Patterns pushed out to make room */
+  uint64_t jits;      /**< Patterns JIT-compiled */
+  uint64_t jit_fails; /**< Patterns that couldn't be JIT-compiled */
+} re_cache_counts;
+
+static void
+re_cache_unlink(struct re_cache_entry *e)
+{
+  if (e->prev) {
+    e->prev->next = e->next;
+  } else {
+    re_cache_mru = e->next;
+  }
+  if (e->next) {
+    e->next->prev = e->prev;
+  } else {
+    re_cache_lru = e->prev;
+  }
+  e->prev = e->next = NULL;
+}
+
+static void
+re_cache_push(struct re_cache_entry *e)
+{
+  e->prev = NULL;
+  e->next = re_cache_mru;
+  if (re_cache_mru) {
+    re_cache_mru->prev = e;
+  } else {
+    re_cache_lru = e;
+  }
+  re_cache_mru = e;
+}
+
+static void
+re_cache_free(struct re_cache_entry *e)
+{
+  if (e->md) {
+    pcre2_match_data_free(e->md);
+  }
+  pcre2_code_free(e->re);
+  DEL_CHECK("pcre");
+  mush_free(e->key, "regexp.cache.key");
+  mush_free(e, "regexp.cache");
+}
+
+/* Take an entry out of the cache, freeing it unless it's in use */
+static void
+re_cache_evict(struct re_cache_entry *e)
+{
+  re_cache_unlink(e);
+  hashdelete(e->key, &re_cache);
+  re_cache_bytes -= e->size;
+  e->cached = 0;
+  if (!e->users) {
+    re_cache_free(e);
+  }
+}
+
+/* JIT-compile a cached pattern, and update its size */
+static void
+re_cache_jit(struct re_cache_entry *e)
+{
+  size_t jitsize = 0;
+
+  if (re_jit < 0) {
+    uint32_t have_jit = 0;
+    pcre2_config(PCRE2_CONFIG_JIT, &have_jit);
+    re_jit = have_jit ? 1 : 0;
+  }
+  if (!re_jit) {
+    return;
+  }
+  if (pcre2_jit_compile(e->re, PCRE2_JIT_COMPLETE) != 0) {
+    /* Not fatal: pcre2_match() falls back on the interpreter */
+    re_cache_counts.jit_fails++;
+    return;
+  }
+  re_cache_counts.jits++;
+  if (pcre2_pattern_info(e->re, PCRE2_INFO_JITSIZE, &jitsize) == 0) {
+    e->size += jitsize;
+    re_cache_bytes += jitsize;
+  }
+}
+
+/** Get a compiled regular expression, compiling and caching it if it
+ * isn't already cached. Patterns are JIT-compiled the second time
+ * they're looked up, so ones used only once don't pay for it.
+ *
+ * \param pattern the pattern.
+ * \param flags the flags to compile it with, including re_compile_flags.
+ * \param cre filled in with the compiled pattern and match data.
+ * \param errcode set to the pcre2 error code if compiling fails.
+ * \retval true the pattern is ready. Give it back with re_cache_put().
+ * \retval false the pattern didn't compile.
+ */
+bool
+re_cache_get(const char *pattern, uint32_t flags, struct cached_regexp *cre,
+             int *errcode)
+{
+  char key[BUFFER_LEN + 16];
+  struct re_cache_entry *e;
+  pcre2_code *re;
+  PCRE2_SIZE erroffset;
+
+  cre->re = NULL;
+  cre->md = NULL;
+  cre->entry = NULL;
+
+  if (!re_cache.buckets) {
+    hashinit(&re_cache, RE_CACHE_SIZE);
+  }
+  snprintf(key, sizeof key, "%x:%s", (unsigned int) flags, pattern);
+
+  e = hashfind(key, &re_cache);
+  if (e) {
+    re_cache_counts.hits++;
+    if (e->uses++ == 1) {
+      re_cache_jit(e);
+    }
+    if (e != re_cache_mru) {
+      re_cache_unlink(e);
+      re_cache_push(e);
+    }
+  } else {
+    re = pcre2_compile((const PCRE2_UCHAR *) pattern, PCRE2_ZERO_TERMINATED,
+                       flags, errcode, &erroffset, re_compile_ctx);
+    if (!re) {
+      return false;
+    }
+    ADD_CHECK("pcre");
+    re_cache_counts.misses++;
+    if (re_cache.entries >= RE_CACHE_SIZE && re_cache_lru) {
+      re_cache_counts.evictions++;
+      re_cache_evict(re_cache_lru);
+    }
+    e = mush_malloc(sizeof *e, "regexp.cache");
+    e->key = mush_strdup(key, "regexp.cache.key");
+    e->re = re;
+    e->md = NULL;
+    e->size = 0;
+    pcre2_pattern_info(re, PCRE2_INFO_SIZE, &e->size);
+    e->users = 0;
+    e->uses = 1;
+    e->cached = 1;
+    hashadd(e->key, e, &re_cache);
+    re_cache_push(e);
+    re_cache_bytes += e->size;
+  }
+
+  e->users++;
+  cre->entry = e;
+  cre->re = e->re;
+  if (e->md) {
+    cre->md = e->md;
+    e->md = NULL;
+  } else {
+    cre->md = pcre2_match_data_create_from_pattern(e->re, NULL);
+  }
+  return true;
+}
+
+/** Give back a regular expression from re_cache_get().
+ * \param cre the compiled regular expression.
+ */
+void
+re_cache_put(struct cached_regexp *cre)
+{
+  struct re_cache_entry *e = cre->entry;
+
+  if (!e) {
+    return;
+  }
+  if (!e->md && e->cached) {
+    e->md = cre->md;
+  } else {
+    pcre2_match_data_free(cre->md);
+  }
+  e->users--;
+  if (!e->cached && !e->users) {
+    re_cache_free(e);
+  }
+  cre->re = NULL;
+  cre->md = NULL;
+  cre->entry = NULL;
+}
+
+/** Match a regular expression, with the usual match flags and context.
+ * A JIT-compiled pattern that runs out of JIT stack is tried again with
+ * the interpreter, which can backtrack further within the heap limit, so
+ * a pattern doesn't stop matching once the cache JIT-compiles it.
+ *
+ * \param re the pattern.
+ * \param subj the string to match against.
+ * \param len the length of subj.
+ * \param start the offset in subj to start matching at.
+ * \param md match data for the pattern.
+ * \return the return value of pcre2_match().
+ */
+int
+re_match(const pcre2_code *re, PCRE2_SPTR subj, PCRE2_SIZE len,
+         PCRE2_SIZE start, pcre2_match_data *md)
+{
+  int r;
+
+  r = pcre2_match(re, subj, len, start, re_match_flags, md, re_match_ctx);
+  if (r == PCRE2_ERROR_JIT_STACKLIMIT) {
+    r = pcre2_match(re, subj, len, start, re_match_flags | PCRE2_NO_JIT, md,
+                    re_match_ctx);
+  }
+  return r;
+}
+
+/** Report on the compiled regexp cache, for \@stats/tables.
+ * \param player the enactor.
+ */
+void
+re_cache_stats(dbref player)
+{
+  uint64_t lookups = re_cache_counts.hits + re_cache_counts.misses;
+
+  notify_format(player,
+                " %d of %d cached patterns, ~%lu bytes compiled. JIT is %s.",
+                re_cache.entries, RE_CACHE_SIZE,
+                (unsigned long) re_cache_bytes,
+                re_jit < 0 ? "unused" : (re_jit ? "on" : "unavailable"));
+  notify_format(player,
+                " %" PRIu64 " hits (%.1f%%), %" PRIu64 " misses, %" PRIu64
+                " evictions, %" PRIu64 " JIT compiles, %" PRIu64
+                " JIT failures.",
+                re_cache_counts.hits,
+                lookups ? 100.0 * re_cache_counts.hits / lookups : 0.0,
+                re_cache_counts.misses, re_cache_counts.evictions,
+                re_cache_counts.jits, re_cache_counts.jit_fails);
+}
+
 /** Do a wildcard match, without remembering the wild data.
  *
  * This routine will cause crashes if fed NULLs instead of strings.
@@ -446,13 +721,13 @@ regexp_match_case_r(const char *restrict s, const char *restrict val, bool cs,
                     char **matches, size_t nmatches, char *data, ssize_t len,
                     PE_REGS *pe_regs, int pe_reg_flags)
 {
+  struct cached_regexp cre;
   pcre2_code *re;
   size_t i;
   int errcode;
   ansi_string *as = NULL;
   const char *d;
   size_t delenn;
-  PCRE2_SIZE erroffset;
   pcre2_match_data *md;
   int subpatterns;
   int totallen = 0;
@@ -461,9 +736,8 @@ regexp_match_case_r(const char *restrict s, const char *restrict val, bool cs,
     matches[i] = NULL;
   }
 
-  if ((re = pcre2_compile((const PCRE2_UCHAR *) s, PCRE2_ZERO_TERMINATED,
-                          (cs ? 0 : PCRE2_CASELESS) | re_compile_flags,
-                          &errcode, &erroffset, re_compile_ctx)) == NULL) {
+  if (!re_cache_get(s, (cs ? 0 : PCRE2_CASELESS) | re_compile_flags, &cre,
+                    &errcode)) {
     /*
      * This is a matching error. We have an error message in
      * errptr that we can ignore, since we're doing
@@ -471,7 +745,8 @@ regexp_match_case_r(const char *restrict s, const char *restrict val, bool cs,
      */
     return 0;
   }
-  ADD_CHECK("pcre");
+  re = cre.re;
+  md = cre.md;
 
   /* The ansi string */
   if (has_markup(val)) {
@@ -487,15 +762,12 @@ regexp_match_case_r(const char *restrict s, const char *restrict val, bool cs,
    * Now we try to match the pattern. The relevant fields will
    * automatically be filled in by this.
    */
-  md = pcre2_match_data_create_from_pattern(re, NULL);
-  if ((subpatterns = pcre2_match(re, (const PCRE2_UCHAR *) d, delenn, 0,
-                                 re_match_flags, md, re_match_ctx)) < 0) {
+  if ((subpatterns = re_match(re, (const PCRE2_UCHAR *) d, delenn, 0, md)) <
+      0) {
     if (as) {
       free_ansi_string(as);
     }
-    pcre2_code_free(re);
-    pcre2_match_data_free(md);
-    DEL_CHECK("pcre");
+    re_cache_put(&cre);
     return 0;
   }
 
@@ -543,9 +815,7 @@ regexp_match_case_r(const char *restrict s, const char *restrict val, bool cs,
   if (as) {
     free_ansi_string(as);
   }
-  pcre2_code_free(re);
-  pcre2_match_data_free(md);
-  DEL_CHECK("pcre");
+  re_cache_put(&cre);
   return 1;
 }
 
@@ -564,12 +834,10 @@ bool
 quick_regexp_match(const char *restrict s, const char *restrict d, bool cs,
                    const char **report_err)
 {
-  pcre2_code *re;
+  struct cached_regexp cre;
   const char *sptr;
   size_t slen;
   int errcode;
-  PCRE2_SIZE erroffset;
-  pcre2_match_data *md;
   int r;
   int flags =
     re_compile_flags; /* There's a PCRE_NO_AUTO_CAPTURE flag to turn all raw
@@ -585,8 +853,7 @@ quick_regexp_match(const char *restrict s, const char *restrict d, bool cs,
     *report_err = NULL;
   }
 
-  if ((re = pcre2_compile((const PCRE2_UCHAR *) s, PCRE2_ZERO_TERMINATED, flags,
-                          &errcode, &erroffset, re_compile_ctx)) == NULL) {
+  if (!re_cache_get(s, flags, &cre, &errcode)) {
     /*
      * This is a matching error. We have an error message in
      * errptr that we can ignore, since we're doing
@@ -599,19 +866,14 @@ quick_regexp_match(const char *restrict s, const char *restrict d, bool cs,
     }
     return 0;
   }
-  ADD_CHECK("pcre");
   sptr = remove_markup(d, &slen);
 
   /*
    * Now we try to match the pattern. The relevant fields will
    * automatically be filled in by this.
    */
-  md = pcre2_match_data_create_from_pattern(re, NULL);
-  r = pcre2_match(re, (const PCRE2_UCHAR *) sptr, slen - 1, 0, re_match_flags,
-                  md, re_match_ctx);
-  pcre2_code_free(re);
-  pcre2_match_data_free(md);
-  DEL_CHECK("pcre");
+  r = re_match(cre.re, (const PCRE2_UCHAR *) sptr, slen - 1, 0, cre.md);
+  re_cache_put(&cre);
 
   return r >= 0;
 }
@@ -740,3 +1002,36 @@ wildcard_count(char *s, bool unescape)
     return 0;
   }
 }
+
+TEST_GROUP(re_cache)
+{
+  struct cached_regexp a, b;
+  int errcode;
+  const char *err = NULL;
+  char subj[BUFFER_LEN];
+
+  TEST("re_cache.compile", re_cache_get("^te(st)$", 0, &a, &errcode) &&
+                             a.re && a.md && a.entry->users == 1);
+  TEST("re_cache.shared",
+       re_cache_get("^te(st)$", 0, &b, &errcode) && b.re == a.re &&
+         b.md != a.md && a.entry->users == 2);
+  re_cache_put(&b);
+  TEST("re_cache.keep_md", a.entry->md && a.entry->users == 1);
+  TEST("re_cache.flags", re_cache_get("^te(st)$", PCRE2_CASELESS, &b,
+                                      &errcode) && b.re != a.re);
+  re_cache_put(&b);
+  re_cache_put(&a);
+  TEST("re_cache.error", !re_cache_get("te(st", 0, &a, &errcode) && !a.re);
+  TEST("re_cache.match", quick_regexp_match("^te(st)$", "TEST", 0, &err) &&
+                           !quick_regexp_match("^te(st)$", "TEST", 1, &err));
+
+  /* Backtracks deeper than PCRE2's default JIT stack allows. The second
+   * lookup JIT-compiles the pattern, and it has to keep matching. */
+  memset(subj, 'a', 2000);
+  subj[2000] = '\0';
+  TEST("re_cache.jit_stack.1", quick_regexp_match("^(a|b)*$", subj, 1, &err));
+  TEST("re_cache.jit_stack.2", quick_regexp_match("^(a|b)*$", subj, 1, &err));
+  memset(subj, 'a', BUFFER_LEN - 1);
+  subj[BUFFER_LEN - 1] = '\0';
+  TEST("re_cache.jit_stack.3", quick_regexp_match("^(a|b)*$", subj, 1, &err));
+}